@@ -0,0 +1,1299 @@
+
+
+#include <dif.h>
+
+#include <Field3D/InitIO.h>
+
+#include <sys/time.h>
+
+#include <cstdio>
+#include <iostream>
+
+using namespace Field3D;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/*
+ * Same setup as highrestest() in test.cpp, but every depth slice receives some
+ * data before the next one is added so updateDepth() has to keep the existing
+ * blocks around.
+ */
+void highresbench() {
+	DifImage<float> dif(V2i(4096, 4096));
+
+	unsigned int r,g,b,a,z;
+
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+	dif.addChannel("b", b);
+	dif.addChannel("a", a);
+	dif.addChannel("z", z);
+
+	float data[5];
+	double start = now();
+
+	for(int i = 0; i < 10; i++) {
+		double slice = now();
+
+		dif.addDepth((float)i);
+
+		for(int j = 0; j < 5; j++) {
+			data[j] = float(i + j);
+		}
+
+		for(int p = 0; p < 4096; p += 16) {
+			dif.writeData(V2i(p, p), (float)i, data);
+		}
+
+		printf("highres: depth %d took %.3f ms\n", i, (now() - slice) * 1000.0);
+	}
+
+	printf("highres: total %.3f ms\n", (now() - start) * 1000.0);
+}
+
+/*
+ * Setup of highresbench() with 64 depths, once adding every depth just before
+ * it is written, once with addDepths() and once after reserveDepths().
+ */
+void depthbench() {
+	const int depths = 64;
+	const char *modes[3] = {"addDepth", "addDepths", "reserveDepths"};
+
+	for(int mode = 0; mode < 3; mode++) {
+		DifImage<float> dif(V2i(4096, 4096));
+		unsigned int id;
+		const char *names[5] = {"r", "g", "b", "a", "z"};
+
+		for(int c = 0; c < 5; c++) {
+			dif.addChannel(names[c], id);
+		}
+
+		float data[5] = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f};
+		double start = now();
+
+		if(mode == 1) {
+			std::vector<float> list;
+
+			for(int i = 0; i < depths; i++) {
+				list.push_back(float(i));
+			}
+
+			dif.addDepths(list);
+		} else if(mode == 2) {
+			dif.reserveDepths(depths);
+		}
+
+		for(int i = 0; i < depths; i++) {
+			if(mode != 1) {
+				dif.addDepth(float(i));
+			}
+
+			for(int p = 0; p < 4096; p += 16) {
+				dif.writeData(V2i(p, p), float(i), data);
+			}
+		}
+
+		printf("depths: %s %.3f ms\n", modes[mode], (now() - start) * 1000.0);
+	}
+}
+
+/*
+ * Per-pixel cost of writeData()/readData() depending on the number of channels.
+ */
+void channelbench(unsigned int channels) {
+	const int res = 256;
+
+	DifImage<float> dif(V2i(res, res));
+
+	for(unsigned int c = 0; c < channels; c++) {
+		char name[16];
+		unsigned int id;
+
+		snprintf(name, sizeof(name), "c%u", c);
+		dif.addChannel(name, id);
+	}
+
+	std::vector<float> data(channels, 1.0f);
+	double start = now();
+
+	for(int d = 0; d < 2; d++) {
+		for(int i = 0; i < res; i++) {
+			for(int j = 0; j < res; j++) {
+				dif.writeData(V2i(i, j), float(d), &data[0]);
+			}
+		}
+	}
+
+	double write = (now() - start) / (2.0 * res * res);
+
+	start = now();
+
+	for(int i = 0; i < res; i++) {
+		for(int j = 0; j < res; j++) {
+			dif.readData(V2i(i, j), 0.5f, &data[0], DifImage<float>::eLinear);
+		}
+	}
+
+	double read = (now() - start) / (double(res) * res);
+
+	printf("channels: %2u channels write %.1f ns/pixel, linear read %.1f ns/pixel\n",
+		channels, write * 1e9, read * 1e9);
+}
+
+/*
+ * Per-pixel writeData() (as in hardtest()) against writeTile() for 32x32 buckets.
+ */
+void tilebench() {
+	const int res    = 512;
+	const int bucket = 32;
+
+	DifImage<float> pixel(V2i(res, res));
+	DifImage<float> tiled(V2i(res, res));
+
+	unsigned int id;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	for(int c = 0; c < 4; c++) {
+		pixel.addChannel(names[c], id);
+		tiled.addChannel(names[c], id);
+	}
+
+	std::vector<float> data(bucket * bucket * 4);
+
+	for(size_t i = 0; i < data.size(); i++) {
+		data[i] = float(i % 7 + 1);
+	}
+
+	// The first depth allocates the blocks in both images, the others reuse them
+	double perpixel[2] = {0.0, 0.0};
+	double tile[2]     = {0.0, 0.0};
+
+	for(int d = 0; d < 4; d++) {
+		double start = now();
+
+		for(int i = 0; i < res; i++) {
+			for(int j = 0; j < res; j++) {
+				pixel.writeData(V2i(i, j), float(d), &data[((j % bucket) * bucket + (i % bucket)) * 4]);
+			}
+		}
+
+		perpixel[d > 0] += now() - start;
+		start = now();
+
+		for(int i = 0; i < res; i += bucket) {
+			for(int j = 0; j < res; j += bucket) {
+				tiled.writeTile(V2i(i, j), V2i(bucket, bucket), float(d), &data[0]);
+			}
+		}
+
+		tile[d > 0] += now() - start;
+	}
+
+	printf("tiles: first depth  writeData %.3f ms, writeTile %.3f ms (%.1fx)\n",
+		perpixel[0] * 1000.0, tile[0] * 1000.0, perpixel[0] / tile[0]);
+	printf("tiles: other depths writeData %.3f ms, writeTile %.3f ms (%.1fx)\n",
+		perpixel[1] * 1000.0, tile[1] * 1000.0, perpixel[1] / tile[1]);
+}
+
+/*
+ * Per-pixel readData() against readTile() for an interpolated depth.
+ */
+void regionbench() {
+	const int res = 512;
+
+	DifImage<float> dif(V2i(res, res));
+
+	unsigned int id;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	std::vector<float> data(res * res * 4, 1.0f);
+
+	dif.writeTile(V2i(0, 0), V2i(res, res), 0.0f, &data[0]);
+	dif.writeTile(V2i(0, 0), V2i(res, res), 1.0f, &data[0]);
+
+	double start = now();
+
+	for(int j = 0; j < res; j++) {
+		for(int i = 0; i < res; i++) {
+			dif.readData(V2i(i, j), 0.5f, &data[(j * res + i) * 4]);
+		}
+	}
+
+	double perpixel = now() - start;
+
+	start = now();
+	dif.readTile(V2i(0, 0), V2i(res, res), 0.5f, &data[0]);
+
+	double tile = now() - start;
+
+	printf("region: readData %.3f ms, readTile %.3f ms (%.1fx)\n",
+		perpixel * 1000.0, tile * 1000.0, perpixel / tile);
+}
+
+/*
+ * Whole-channel interpolation (planar readTile()) with every instruction set
+ * the CPU supports.
+ */
+template<typename T> void lerpbench(const char *type) {
+	const int res = 1024;
+
+	DifImage<T> dif(V2i(res, res));
+
+	unsigned int id;
+	dif.addChannel("r", id);
+	dif.addChannel("a", id);
+
+	std::vector<T> data(res * res * 2);
+
+	for(size_t i = 0; i < data.size(); i++) {
+		data[i] = T(float(i % 251) * 0.01f);
+	}
+
+	dif.writeTile(V2i(0, 0), V2i(res, res), 0.0f, &data[0]);
+	dif.writeTile(V2i(0, 0), V2i(res, res), 1.0f, &data[0]);
+
+	const char *names[3] = {"scalar", "sse2", "avx2"};
+	DifSimd level = difSimd();
+	double scalar = 0.0;
+
+	for(int l = eDifSimdNone; l <= level; l++) {
+		difSetSimd(DifSimd(l));
+
+		double start = now();
+
+		for(int i = 0; i < 10; i++) {
+			dif.readTile(V2i(0, 0), V2i(res, res), 0.3f, &data[0], DifImage<T>::eLinear, DifImage<T>::ePlanar);
+		}
+
+		double elapsed = (now() - start) / 10.0;
+
+		if(l == eDifSimdNone) {
+			scalar = elapsed;
+		}
+
+		printf("lerp: %-6s %-6s %.3f ms (%.1fx)\n", type, names[l], elapsed * 1000.0, scalar / elapsed);
+	}
+
+	difSetSimd(level);
+}
+
+/*
+ * Resampling 8 depths to 32 uniform ones with readData() per pixel against
+ * resampleDepths().
+ */
+void resamplebench() {
+	const int res = 256;
+
+	DifImage<float> dif(V2i(res, res));
+
+	unsigned int id;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	std::vector<float> data(res * res * 4);
+
+	for(int d = 0; d < 8; d++) {
+		for(size_t i = 0; i < data.size(); i++) {
+			data[i] = float((i + d) % 17);
+		}
+
+		dif.writeTile(V2i(0, 0), V2i(res, res), float(d * d), &data[0]);
+	}
+
+	std::vector<float> depths(32);
+
+	for(int k = 0; k < 32; k++) {
+		depths[k] = float(k) * 49.0f / 31.0f;
+	}
+
+	double start = now();
+
+	DifImage<float> perpixel(V2i(res, res));
+
+	for(int c = 0; c < 4; c++) {
+		perpixel.addChannel(names[c], id);
+	}
+
+	for(int k = 0; k < 32; k++) {
+		for(int j = 0; j < res; j++) {
+			for(int i = 0; i < res; i++) {
+				float pixel[4];
+
+				dif.readData(V2i(i, j), depths[k], pixel);
+				perpixel.writeData(V2i(i, j), depths[k], pixel);
+			}
+		}
+	}
+
+	double loop = now() - start;
+
+	start = now();
+
+	DifImage<float> resampled(V2i(res, res));
+	dif.resampleDepths(depths, resampled);
+
+	double bulk = now() - start;
+
+	printf("resample: readData loop %.3f ms, resampleDepths %.3f ms (%.1fx)\n",
+		loop * 1000.0, bulk * 1000.0, loop / bulk);
+}
+
+/*
+ * Front to back compositing through readData() per pixel and depth against
+ * flatten().
+ */
+void flattenbench() {
+	const int res    = 512;
+	const int depths = 16;
+
+	DifImage<float> dif(V2i(res, res));
+
+	unsigned int id;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	std::vector<float> data(res * res * 4);
+
+	for(int d = 0; d < depths; d++) {
+		for(size_t i = 0; i < data.size(); i += 4) {
+			float alpha = float((i / 4 + d) % 7) * 0.05f;
+
+			data[i + 0] = data[i + 1] = data[i + 2] = alpha * 0.5f;
+			data[i + 3] = alpha;
+		}
+
+		dif.writeTile(V2i(0, 0), V2i(res, res), float(d), &data[0]);
+	}
+
+	double start = now();
+
+	for(int j = 0; j < res; j++) {
+		for(int i = 0; i < res; i++) {
+			float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+			for(int d = 0; d < depths && acc[3] < 1.0f; d++) {
+				float pixel[4];
+
+				dif.readData(V2i(i, j), float(d), pixel, DifImage<float>::eNone);
+
+				for(int c = 0; c < 4; c++) {
+					acc[c] += (1.0f - acc[3]) * pixel[c];
+				}
+			}
+
+			for(int c = 0; c < 4; c++) {
+				data[(j * res + i) * 4 + c] = acc[c];
+			}
+		}
+	}
+
+	double loop = now() - start;
+
+	start = now();
+	dif.flatten(&data[0]);
+
+	double flat = now() - start;
+
+	printf("flatten: readData loop %.3f ms, flatten %.3f ms (%.1fx)\n",
+		loop * 1000.0, flat * 1000.0, loop / flat);
+}
+
+/*
+ * First depth above a threshold for a sparse image, through readChannelData()
+ * per pixel and depth against firstHit().
+ */
+void summarybench() {
+	const int res    = 1024;
+	const int depths = 64;
+
+	DifImage<float> dif(V2i(res, res));
+
+	unsigned int id;
+	dif.addChannel("a", id);
+
+	for(int d = 0; d < depths; d++) {
+		dif.addDepth(float(d));
+	}
+
+	// A few small objects, most blocks stay empty
+	std::vector<float> data(32 * 32, 0.8f);
+
+	for(int o = 0; o < 16; o++) {
+		dif.writeTile(V2i((o * 197) % (res - 32), (o * 331) % (res - 32)), V2i(32, 32), float((o * 13) % depths), &data[0]);
+	}
+
+	std::vector<float> hits(res * res);
+	double start = now();
+
+	for(int j = 0; j < res; j++) {
+		for(int i = 0; i < res; i++) {
+			float hit = std::numeric_limits<float>::infinity();
+
+			for(int d = 0; d < depths; d++) {
+				float v = 0.0f;
+				dif.readChannelData(id, V2i(i, j), float(d), v, DifImage<float>::eNone);
+
+				if(v > 0.5f) {
+					hit = float(d);
+					break;
+				}
+			}
+
+			hits[j * res + i] = hit;
+		}
+	}
+
+	double loop = now() - start;
+
+	start = now();
+	dif.firstHit(id, &hits[0], 0.5f);
+
+	double query = now() - start;
+
+	printf("summary: readChannelData loop %.3f ms, firstHit %.3f ms (%.1fx)\n",
+		loop * 1000.0, query * 1000.0, loop / query);
+}
+
+/*
+ * "Is anything in front of depth Z in this rectangle" through readChannelData()
+ * per pixel and depth against DifDepthPyramid::inFront().
+ */
+void pyramidbench() {
+	const int res    = 1024;
+	const int depths = 64;
+	const int tests  = 200;
+
+	DifImage<float> dif(V2i(res, res));
+
+	unsigned int id;
+	dif.addChannel("a", id);
+
+	for(int d = 0; d < depths; d++) {
+		dif.addDepth(float(d));
+	}
+
+	std::vector<float> data(32 * 32, 0.8f);
+
+	for(int o = 0; o < 64; o++) {
+		dif.writeTile(V2i((o * 197) % (res - 32), (o * 331) % (res - 32)), V2i(32, 32), float((o * 13) % depths), &data[0]);
+	}
+
+	std::vector<V2i> origins;
+
+	for(int i = 0; i < tests; i++) {
+		origins.push_back(V2i((i * 389) % (res - 64), (i * 541) % (res - 64)));
+	}
+
+	const float z = 32.0f;
+	int loopHits = 0;
+	double start = now();
+
+	for(int i = 0; i < tests; i++) {
+		bool hit = false;
+
+		for(int j = origins[i].y; j < origins[i].y + 64 && !hit; j++) {
+			for(int k = origins[i].x; k < origins[i].x + 64 && !hit; k++) {
+				for(int d = 0; d < depths && float(d) < z; d++) {
+					float v = 0.0f;
+					dif.readChannelData(id, V2i(k, j), float(d), v, DifImage<float>::eNone);
+
+					if(v > 0.0f) {
+						hit = true;
+						break;
+					}
+				}
+			}
+		}
+
+		loopHits += hit;
+	}
+
+	double loop = now() - start;
+
+	start = now();
+
+	DifDepthPyramid<float> pyramid;
+	pyramid.build(dif, "a");
+
+	double build = now() - start;
+
+	int pyramidHits = 0;
+	start = now();
+
+	for(int i = 0; i < tests; i++) {
+		pyramidHits += pyramid.inFront(origins[i], V2i(64, 64), z);
+	}
+
+	double query = now() - start;
+
+	printf("pyramid: readChannelData loop %.3f us/test (%d hits), build %.3f ms, inFront %.3f us/test (%d hits)\n",
+		loop * 1e6 / tests, loopHits, build * 1000.0, query * 1e6 / tests, pyramidHits);
+}
+
+/*
+ * Merging three images with 8 depths each through readData()/writeData()
+ * against merge().
+ */
+void mergebench() {
+	const int res = 256;
+
+	std::vector<DifImage<float>*> images;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	for(int k = 0; k < 3; k++) {
+		DifImage<float>* image = new DifImage<float>(V2i(res, res));
+		unsigned int id;
+
+		for(int c = 0; c < 4; c++) {
+			image->addChannel(names[c], id);
+		}
+
+		std::vector<float> data(res * res * 4);
+
+		for(int d = 0; d < 8; d++) {
+			for(size_t i = 0; i < data.size(); i++) {
+				data[i] = float((i + d + k) % 11);
+			}
+
+			image->writeTile(V2i(0, 0), V2i(res, res), float(d * 3 + k), &data[0]);
+		}
+
+		images.push_back(image);
+	}
+
+	double start = now();
+
+	DifImage<float> perpixel(V2i(res, res));
+	unsigned int id;
+
+	for(int c = 0; c < 4; c++) {
+		perpixel.addChannel(names[c], id);
+	}
+
+	for(size_t k = 0; k < images.size(); k++) {
+		for(unsigned int s = 0; s < images[k]->depthLevels(); s++) {
+			float depth = images[k]->depthAtIndex(s);
+
+			for(int j = 0; j < res; j++) {
+				for(int i = 0; i < res; i++) {
+					float pixel[4];
+
+					images[k]->readData(V2i(i, j), depth, pixel, DifImage<float>::eNone);
+					perpixel.writeData(V2i(i, j), depth, pixel);
+				}
+			}
+		}
+	}
+
+	double loop = now() - start;
+
+	start = now();
+
+	DifImage<float> merged(V2i(res, res));
+	merged.merge(std::vector<const DifImage<float>*>(images.begin(), images.end()));
+
+	double bulk = now() - start;
+
+	printf("merge: readData/writeData loop %.3f ms, merge %.3f ms (%.1fx)\n",
+		loop * 1000.0, bulk * 1000.0, loop / bulk);
+
+	for(size_t k = 0; k < images.size(); k++) {
+		delete images[k];
+	}
+}
+
+// Writes the 32x32 buckets b, b + step, ... of a bench image, optionally behind a lock
+struct BucketBench {
+	DifImage<float>* dif;
+	boost::mutex* lock;
+	int res;
+	int first;
+	int step;
+
+	void operator()() {
+		const int buckets = (res / 32) * (res / 32);
+		std::vector<float> tile(32 * 32 * 4);
+
+		for(int b = first; b < buckets; b += step) {
+			V2i origin((b % (res / 32)) * 32, (b / (res / 32)) * 32);
+
+			for(int d = 0; d < 8; d++) {
+				for(size_t i = 0; i < tile.size(); i++) {
+					tile[i] = float((i + b + d) % 7);
+				}
+
+				if(lock) {
+					boost::mutex::scoped_lock guard(*lock);
+					dif->writeTile(origin, V2i(32, 32), float(d), &tile[0]);
+				} else {
+					dif->writeTile(origin, V2i(32, 32), float(d), &tile[0]);
+				}
+			}
+		}
+	}
+};
+
+/*
+ * Holding out a 4 channel image with a matte through readData()/writeData()
+ * against holdout().
+ */
+void holdoutbench() {
+	const int res    = 512;
+	const int depths = 16;
+
+	DifImage<float> dif(V2i(res, res));
+	DifImage<float> matte(V2i(res, res));
+
+	unsigned int id;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	matte.addChannel("a", id);
+
+	std::vector<float> data(res * res * 4);
+
+	for(int d = 0; d < depths; d++) {
+		for(size_t i = 0; i < data.size(); i += 4) {
+			float alpha = float((i / 4 + d) % 7) * 0.05f;
+
+			data[i + 0] = data[i + 1] = data[i + 2] = alpha * 0.5f;
+			data[i + 3] = alpha;
+		}
+
+		dif.writeTile(V2i(0, 0), V2i(res, res), float(2 * d), &data[0]);
+
+		for(int i = 0; i < res * res; i++) {
+			data[i] = float((i + d) % 5) * 0.04f;
+		}
+
+		matte.writeTile(V2i(0, 0), V2i(res, res), float(2 * d + 1), &data[0]);
+	}
+
+	DifImage<float> loopDst(V2i(res, res));
+
+	for(int c = 0; c < 4; c++) {
+		loopDst.addChannel(names[c], id);
+	}
+
+	for(int d = 0; d < depths; d++) {
+		loopDst.addDepth(float(2 * d));
+	}
+
+	double start = now();
+
+	for(int j = 0; j < res; j++) {
+		for(int i = 0; i < res; i++) {
+			float acc = 0.0f;
+
+			for(int d = 0; d < depths; d++) {
+				float pixel[4];
+
+				if(d > 0) {
+					float a = 0.0f;
+					matte.readChannelData(0, V2i(i, j), float(2 * d - 1), a, DifImage<float>::eNone);
+					acc += (1.0f - acc) * a;
+				}
+
+				dif.readData(V2i(i, j), float(2 * d), pixel, DifImage<float>::eNone);
+
+				for(int c = 0; c < 4; c++) {
+					pixel[c] *= 1.0f - acc;
+				}
+
+				loopDst.writeData(V2i(i, j), float(2 * d), pixel);
+			}
+		}
+	}
+
+	double loop = now() - start;
+
+	DifImage<float> dst(V2i(res, res));
+
+	start = now();
+	dif.holdout(matte, dst);
+
+	double bulk = now() - start;
+
+	printf("holdout: readData/writeData loop %.3f ms, holdout %.3f ms (%.1fx)\n",
+		loop * 1000.0, bulk * 1000.0, loop / bulk);
+}
+
+/*
+ * Render threads writing 32x32 buckets, serialised behind one mutex against
+ * beginConcurrentWrites().
+ */
+void concurrentwritebench() {
+	const int res = 512;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	unsigned int maxThreads = difDefaultThreads();
+
+	for(unsigned int t = 1; t <= maxThreads; t *= 2) {
+		double times[2];
+
+		for(int mode = 0; mode < 2; mode++) {
+			DifImage<float> dif(V2i(res, res));
+			boost::mutex lock;
+			unsigned int id;
+
+			for(int c = 0; c < 4; c++) {
+				dif.addChannel(names[c], id);
+			}
+
+			if(mode) {
+				dif.beginConcurrentWrites(8);
+			}
+
+			double start = now();
+
+			boost::thread_group group;
+
+			for(unsigned int i = 0; i < t; i++) {
+				BucketBench writer;
+				writer.dif   = &dif;
+				writer.lock  = mode ? NULL : &lock;
+				writer.res   = res;
+				writer.first = i;
+				writer.step  = t;
+
+				group.create_thread(writer);
+			}
+
+			group.join_all();
+
+			if(mode) {
+				dif.endConcurrentWrites();
+			}
+
+			times[mode] = now() - start;
+		}
+
+		printf("concurrent write: %2u threads mutex %.3f ms, concurrent %.3f ms (%.1fx)\n",
+			t, times[0] * 1000.0, times[1] * 1000.0, times[0] / times[1]);
+	}
+}
+
+// Reads rows first, first + step, ... of a bench image pixel by pixel at every depth
+struct ReadBench {
+	const DifImage<float>* dif;
+	int res;
+	int first;
+	int step;
+
+	void operator()() {
+		float data[4];
+
+		for(int y = first; y < res; y += step) {
+			for(int d = 0; d < 8; d++) {
+				for(int x = 0; x < res; x++) {
+					dif->readData(V2i(x, y), float(d) + 0.5f, data);
+				}
+			}
+		}
+	}
+};
+
+/*
+ * readData() from 1..N threads sharing one const image, reported as reads per
+ * second and the speedup over a single thread.
+ */
+void concurrentreadbench() {
+	const int res = 512;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	DifImage<float> dif(V2i(res, res));
+	unsigned int id;
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	std::vector<float> data(res * res * 4);
+
+	for(int d = 0; d < 9; d++) {
+		for(size_t i = 0; i < data.size(); i++) {
+			data[i] = float((i + d) % 13);
+		}
+
+		dif.writeTile(V2i(0, 0), V2i(res, res), float(d), &data[0]);
+	}
+
+	unsigned int maxThreads = difDefaultThreads();
+	double single = 0.0;
+
+	for(unsigned int t = 1; t <= maxThreads; t *= 2) {
+		double start = now();
+
+		boost::thread_group group;
+
+		for(unsigned int i = 0; i < t; i++) {
+			ReadBench reader;
+			reader.dif   = &dif;
+			reader.res   = res;
+			reader.first = i;
+			reader.step  = t;
+
+			group.create_thread(reader);
+		}
+
+		group.join_all();
+
+		double elapsed = now() - start;
+
+		if(t == 1) {
+			single = elapsed;
+		}
+
+		printf("concurrent read: %2u threads %.1f Mreads/s (%.1fx)\n",
+			t, res * res * 8 / elapsed * 1e-6, single / elapsed);
+	}
+}
+
+/*
+ * Opening a frame through load() against DifMappedImage::open(), then reading
+ * one depth of every pixel.
+ */
+void mappedbench() {
+	const int res = 512;
+	const char *names[4] = {"r", "g", "b", "a"};
+
+	DifImage<float> dif(V2i(res, res));
+	unsigned int id;
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	std::vector<float> data(res * res * 4);
+
+	for(int d = 0; d < 16; d++) {
+		for(size_t i = 0; i < data.size(); i++) {
+			data[i] = float((i + d) % 13);
+		}
+
+		dif.writeTile(V2i(0, 0), V2i(res, res), float(d), &data[0]);
+	}
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("bench_mapped.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return;
+		}
+
+		dif.save(ofp);
+		ofp.close();
+	}
+
+	dif.saveMapped("bench_mapped.difm");
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("bench_mapped.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return;
+	}
+
+	double start = now();
+
+	DifImage<float> difi(V2i(0, 0));
+	difi.load(ifp);
+
+	double load = now() - start;
+
+	start = now();
+
+	DifMappedImage<float> map;
+	map.open("bench_mapped.difm");
+
+	double open = now() - start;
+
+	float pixel[4];
+
+	start = now();
+
+	for(int y = 0; y < res; y++) {
+		for(int x = 0; x < res; x++) {
+			difi.readData(V2i(x, y), 7.0f, pixel, DifImage<float>::eNone);
+		}
+	}
+
+	double readLoaded = now() - start;
+
+	start = now();
+
+	for(int y = 0; y < res; y++) {
+		for(int x = 0; x < res; x++) {
+			map.readData(V2i(x, y), 7.0f, pixel, DifImage<float>::eNone);
+		}
+	}
+
+	double readMapped = now() - start;
+
+	printf("mapped: load %.3f ms, open %.3f ms (%.0fx), readData loaded %.1f ns/pixel, mapped %.1f ns/pixel\n",
+		load * 1000.0, open * 1000.0, load / open, readLoaded * 1e9 / (res * res), readMapped * 1e9 / (res * res));
+}
+
+/*
+ * save() and load() throughput of every codec and the size of the encoded
+ * channels, on an image that changes smoothly along depth (like the one of
+ * codectest()) and on a repeating pattern (like the one of mappedbench()).
+ */
+void codecbench() {
+	const int res    = 512;
+	const int depths = 16;
+	const char *names[4] = {"r", "g", "b", "a"};
+	const char *codecs[4] = {"none", "lz", "shuffle", "predict"};
+	const char *images[2] = {"smooth", "pattern"};
+
+	const double megabytes = double(res) * res * depths * 4 * sizeof(float) / (1024.0 * 1024.0);
+
+	for(int image = 0; image < 2; image++) {
+		DifImage<float> dif(V2i(res, res));
+		unsigned int id;
+
+		for(int c = 0; c < 4; c++) {
+			dif.addChannel(names[c], id);
+		}
+
+		std::vector<float> data(res * res * 4);
+
+		for(int d = 0; d < depths; d++) {
+			for(size_t i = 0; i < data.size(); i++) {
+				data[i] = (image == 0) ? float((i / 4) % res) * 0.25f + float(d) * 0.125f + float(i % 4) : float((i + d) % 13);
+			}
+
+			dif.writeTile(V2i(0, 0), V2i(res, res), float(d), &data[0]);
+		}
+
+		for(int codec = eDifCodecNone; codec <= eDifCodecPredict; codec++) {
+			for(unsigned int c = 0; c < 4; c++) {
+				dif.setChannelCodec(c, (enum DifCodec)codec);
+			}
+
+			double start = now();
+
+			{
+				Field3DOutputFile ofp;
+
+				if(!ofp.create("bench_codec.dif")) {
+					std::cout << "Error opening output file" << std::endl;
+					return;
+				}
+
+				dif.save(ofp);
+				ofp.close();
+			}
+
+			double save = now() - start;
+
+			Field3DInputFile ifp;
+
+			if(!ifp.open("bench_codec.dif")) {
+				std::cout << "Error opening input file" << std::endl;
+				return;
+			}
+
+			start = now();
+
+			DifImage<float> difi(V2i(0, 0));
+			difi.load(ifp);
+
+			double load = now() - start;
+
+			// Encoded size from the layers, Field3D compresses plain ones itself
+			double bytes = 0.0;
+
+			for(int c = 0; c < 4; c++) {
+				Field<float>::Vec layers = ifp.readScalarLayers<float>(names[c]);
+
+				for(size_t i = 0; i < layers.size(); i++) {
+					bytes += layers[i]->metadata().intMetadata("codecBytes", 0);
+				}
+			}
+
+			if(codec == eDifCodecNone) {
+				printf("codec %s %s: save %.0f MB/s, load %.0f MB/s\n", images[image], codecs[codec], megabytes / save, megabytes / load);
+			} else {
+				printf("codec %s %s: save %.0f MB/s, load %.0f MB/s, ratio %.2f\n", images[image], codecs[codec], megabytes / save, megabytes / load,
+					megabytes * 1024.0 * 1024.0 / bytes);
+			}
+		}
+	}
+}
+
+/*
+ * save() and load() throughput and file size of every storage type, stored
+ * plainly and with eDifCodecLZ, for a matte changing smoothly along depth.
+ */
+void storagebench() {
+	const int res    = 512;
+	const int depths = 16;
+	const char *storages[5] = {"native", "half", "uint8", "uint16", "uint32"};
+
+	const double megabytes = double(res) * res * depths * sizeof(float) / (1024.0 * 1024.0);
+
+	DifImage<float> dif(V2i(res, res));
+	unsigned int id;
+	dif.addChannel("a", id);
+
+	std::vector<float> data(res * res);
+
+	for(int d = 0; d < depths; d++) {
+		for(size_t i = 0; i < data.size(); i++) {
+			data[i] = std::min(1.0f, float(i % res) / res + float(d) / depths);
+		}
+
+		dif.writeTile(V2i(0, 0), V2i(res, res), float(d), &data[0]);
+	}
+
+	for(int codec = eDifCodecNone; codec <= eDifCodecLZ; codec++) {
+		for(int storage = eDifStorageNative; storage <= eDifStorageUInt32; storage++) {
+			// Native storage without a codec is a plain Field3D layer
+			if(codec == eDifCodecNone && storage == eDifStorageNative) {
+				continue;
+			}
+
+			dif.setChannelCodec(id, (enum DifCodec)codec);
+			dif.setChannelStorage(id, (enum DifStorage)storage);
+
+			double start = now();
+
+			{
+				Field3DOutputFile ofp;
+
+				if(!ofp.create("bench_storage.dif")) {
+					std::cout << "Error opening output file" << std::endl;
+					return;
+				}
+
+				dif.save(ofp);
+				ofp.close();
+			}
+
+			double save = now() - start;
+
+			Field3DInputFile ifp;
+
+			if(!ifp.open("bench_storage.dif")) {
+				std::cout << "Error opening input file" << std::endl;
+				return;
+			}
+
+			start = now();
+
+			DifImage<float> difi(V2i(0, 0));
+			difi.load(ifp);
+
+			double load = now() - start;
+
+			// Packed channels stay in their storage type, reads convert every value
+			difi.packChannels();
+
+			start = now();
+
+			float sum = 0.0f;
+
+			for(int d = 0; d < depths; d++) {
+				for(int y = 0; y < res; y++) {
+					for(int x = 0; x < res; x++) {
+						float v = 0.0f;
+						difi.readChannelData(0, V2i(x, y), float(d), v, DifImage<float>::eNone);
+						sum += v;
+					}
+				}
+			}
+
+			double read = now() - start;
+
+			Field<float>::Vec layers = ifp.readScalarLayers<float>("a");
+			double bytes = layers.empty() ? 0.0 : layers[0]->metadata().intMetadata("codecBytes", 0);
+
+			printf("storage %s%s: save %.0f MB/s, load %.0f MB/s, read %.0f MB/s, ratio %.2f, packed %s (%g)\n", storages[storage], codec == eDifCodecLZ ? " lz" : "",
+				megabytes / save, megabytes / load, megabytes / read, megabytes * 1024.0 * 1024.0 / bytes, difi.isPacked(0) ? "yes" : "no", sum);
+		}
+	}
+}
+
+/*
+ * Adding a dense channel as a copy of a DifField against adopting the blocks
+ * of a SparseField.
+ */
+void adoptbench() {
+	const int res    = 1024;
+	const int depths = 16;
+
+	DifImage<float> dif(V2i(res, res));
+
+	for(int d = 0; d < depths; d++) {
+		dif.addDepth(float(d));
+	}
+
+	DifField<float> field(V2i(res, res));
+	field.updateDepth(depths - 1);
+
+	SparseField<float>::Ptr sparse(new SparseField<float>);
+	sparse->setSize(V3i(res, res, depths));
+	sparse->clear(0.0f);
+
+	std::vector<float> row(res);
+
+	for(int d = 0; d < depths; d++) {
+		for(int y = 0; y < res; y++) {
+			for(int x = 0; x < res; x++) {
+				row[x] = float((x + y + d) % 17 + 1);
+				sparse->lvalue(x, y, d) = row[x];
+			}
+
+			field.writeSpan(V2i(0, y), d, res, &row[0]);
+		}
+	}
+
+	unsigned int id;
+	double start = now();
+
+	dif.addChannel("copy", field, id);
+
+	double copy = now() - start;
+
+	start = now();
+	dif.addChannel("adopt", sparse, id);
+
+	double adopt = now() - start;
+
+	printf("adopt: copy %.3f ms, adopt %.3f ms (%.1fx)\n",
+		copy * 1000.0, adopt * 1000.0, copy / adopt);
+}
+
+/*
+ * Wall clock time of save() and load() for 24 channels with 1..N threads.
+ */
+void iobench() {
+	const int res      = 512;
+	const int channels = 24;
+
+	DifImage<float> dif(V2i(res, res));
+
+	for(int c = 0; c < channels; c++) {
+		char name[16];
+		unsigned int id;
+
+		snprintf(name, sizeof(name), "c%d", c);
+		dif.addChannel(name, id);
+	}
+
+	std::vector<float> data(res * channels);
+
+	for(int d = 0; d < 4; d++) {
+		for(int y = 0; y < res; y++) {
+			for(size_t i = 0; i < data.size(); i++) {
+				data[i] = float((i + y * d) % 13);
+			}
+
+			dif.writeScanline(V2i(0, y), res, float(d), &data[0]);
+		}
+	}
+
+	unsigned int maxThreads = difDefaultThreads();
+
+	for(unsigned int t = 1; t <= maxThreads; t *= 2) {
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("bench_io.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return;
+		}
+
+		dif.setThreads(t);
+
+		double start = now();
+		dif.save(ofp);
+		ofp.close();
+
+		double save = now() - start;
+
+		Field3DInputFile ifp;
+
+		if(!ifp.open("bench_io.dif")) {
+			std::cout << "Error opening input file" << std::endl;
+			return;
+		}
+
+		DifImage<float> difi(V2i(0, 0));
+		difi.setThreads(t);
+
+		start = now();
+		difi.load(ifp);
+
+		double load = now() - start;
+
+		printf("io: %2u threads save %.3f ms, load %.3f ms\n", t, save * 1000.0, load * 1000.0);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	initIO();
+
+	highresbench();
+
+	depthbench();
+
+	channelbench(4);
+	channelbench(16);
+	channelbench(64);
+
+	tilebench();
+
+	regionbench();
+
+	lerpbench<float>("float");
+	lerpbench<double>("double");
+	lerpbench<half>("half");
+
+	resamplebench();
+
+	flattenbench();
+
+	summarybench();
+
+	pyramidbench();
+
+	mergebench();
+
+	holdoutbench();
+
+	concurrentwritebench();
+
+	concurrentreadbench();
+
+	mappedbench();
+
+	codecbench();
+
+	storagebench();
+
+	adoptbench();
+
+	iobench();
+
+	return 0;
+}
@@ -35,891 +35,7936 @@
 
 #include <Field3D/Field3DFile.h>
 #include <Field3D/SparseField.h>
+#include <Field3D/SparseFileManager.h>
 #include <Field3D/FieldInterp.h>
 
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
 #include <map>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define _DIF_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(DIF_NO_SIMD)
+#define _DIF_SIMD
+#include <immintrin.h>
+#endif
+
 FIELD3D_NAMESPACE_OPEN
 
 #define _DIF_TYPE SparseField<T>
 
-template<typename T> class DifField : public SparseField<T> {
+/*!
+ * @brief Sets the memory budget for out-of-core images
+ *
+ * Blocks of images loaded with DifImage::eOutOfCore are paged in by Field3D's
+ * SparseFileManager, which evicts the least recently used blocks once the
+ * budget is exceeded. The budget is shared by the whole process.
+ *
+ * @param[in] megabytes Budget in MB
+ */
+inline void difSetMemoryBudget(float megabytes) {
+	SparseFileManager::singleton().setMaxMemUse(megabytes);
+}
+
+/// Returns the lock around block lookups of paged fields, see difSetMemoryBudget()
+inline boost::mutex& difPageMutex() {
+	static boost::mutex mutex;
+
+	return mutex;
+}
+
+/*!
+ * @brief Returns the lock DifImage reads files under
+ *
+ * Whether Field3D pages the layers it reads is a flag of the process wide
+ * SparseFileManager. Out of core loads turn it on while they read and hold
+ * this lock exclusively, all other loads share it. Field3D files read outside
+ * of DifImage at the same time aren't covered.
+ */
+inline boost::shared_mutex& difLoadMutex() {
+	static boost::shared_mutex mutex;
+
+	return mutex;
+}
+
+/// Returns the number of threads used if none are requested explicitly
+inline unsigned int difDefaultThreads() {
+	unsigned int n = boost::thread::hardware_concurrency();
+
+	return (n > 0) ? n : 1;
+}
+
+/*!
+ * @brief Calls @a func(i) for every i in [begin, end) on up to @a threads threads
+ *
+ * Indices are handed out one at a time, so uneven work items balance out. With
+ * a single thread (or a single item) everything runs on the calling thread.
+ * @a func has to be safe to call concurrently for distinct indices.
+ */
+template<typename F> class DifParallelFor {
 	public:
-		typedef boost::intrusive_ptr<DifField> Ptr;
+		DifParallelFor(unsigned int begin, unsigned int end, unsigned int threads, F& func)
+			: m_ulNext(begin), m_ulEnd(end), m_rFunc(func) {
+			unsigned int count = std::min(threads, end > begin ? end - begin : 0);
 
-		DifField(const V2i& size);
-		DifField(const DifField<T>& o);
-		DifField(const _DIF_TYPE& o);
-		~DifField();
+			if(count <= 1) {
+				run();
+				return;
+			}
 
-		DifField& operator=(const DifField<T>& o);
+			boost::thread_group group;
 
-		bool writePixel(const V2i& pos, unsigned int dpt, const T data);
-		T readPixel(const V2i& pos, unsigned int dpt = 0, bool *retval = NULL);
+			for(unsigned int i = 1; i < count; i++) {
+				group.create_thread(boost::bind(&DifParallelFor::run, this));
+			}
 
-		int depth() const;
+			run();
+			group.join_all();
+		}
 
-		const V3i& getSize() const;
-		void setContainsData();
-		
-		void updateDepth(unsigned int dpt);
-		
-	protected:
-		virtual void sizeChanged();
-		
 	private:
-		V3i   m_vSize; // So we dont need recopmputation through dataResolution()
-		bool  m_bHasData;
+		void run() {
+			for(;;) {
+				unsigned int i;
+
+				{
+					boost::mutex::scoped_lock lock(m_mMutex);
+
+					if(m_ulNext >= m_ulEnd) {
+						return;
+					}
+
+					i = m_ulNext++;
+				}
+
+				m_rFunc(i);
+			}
+		}
+
+		boost::mutex m_mMutex;
+		unsigned int m_ulNext;
+		unsigned int m_ulEnd;
+		F& m_rFunc;
 };
 
-template<typename T> DifField<T>::DifField(const V2i& size) : _DIF_TYPE() {
-	m_vSize.x = size.x;
-	m_vSize.y = size.y;
+/// Instruction sets the interpolation kernels can use
+enum DifSimd {
+	eDifSimdNone = 0,
+	eDifSimdSSE2,
+	eDifSimdAVX2  ///< AVX2 and F16C
+};
 
-	m_vSize.z = 1;
+/// Returns the best instruction set supported by the CPU
+inline DifSimd difDetectSimd() {
+#ifdef _DIF_SIMD
+	__builtin_cpu_init();
 
-	m_bHasData = false;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+		return eDifSimdAVX2;
+	}
 
-	_DIF_TYPE::setSize(m_vSize);
-	_DIF_TYPE::clear(T(0));
+	if(__builtin_cpu_supports("sse2")) {
+		return eDifSimdSSE2;
+	}
+#endif
+	return eDifSimdNone;
 }
 
-template<typename T> DifField<T>::DifField(const DifField<T>& o) 
-	: _DIF_TYPE(o), m_vSize(o.m_vSize), m_bHasData(o.m_bHasData) {
-	// Nothing
+/* Internal */ inline DifSimd& difSimdState() {
+	static DifSimd level = difDetectSimd();
+
+	return level;
 }
 
-template<typename T> DifField<T>::DifField(const _DIF_TYPE& o) 
-	: _DIF_TYPE(o), m_vSize(0), m_bHasData(true) {
-	m_vSize = _DIF_TYPE::dataResolution();
+/// Returns the instruction set the interpolation kernels currently dispatch to
+inline DifSimd difSimd() {
+	return difSimdState();
 }
 
-template<typename T> DifField<T>::~DifField() {
+/*!
+ * @brief Limits the instruction set used by the interpolation kernels
+ *
+ * Mostly useful to compare against the scalar code. Levels the CPU does not
+ * support are clamped to the detected one.
+ */
+inline void difSetSimd(DifSimd level) {
+	difSimdState() = std::min(level, difDetectSimd());
+}
+
+#ifdef _DIF_SIMD
+__attribute__((target("sse2"))) inline void difLerpSSE2(const float* a, const float* b, float t, float* out, unsigned int n) {
+	const __m128 wa = _mm_set1_ps(1.0f - t);
+	const __m128 wb = _mm_set1_ps(t);
+	unsigned int i = 0;
 
+	for(; i + 4 <= n; i += 4) {
+		__m128 va = _mm_mul_ps(_mm_loadu_ps(a + i), wa);
+		__m128 vb = _mm_mul_ps(_mm_loadu_ps(b + i), wb);
+
+		_mm_storeu_ps(out + i, _mm_add_ps(va, vb));
+	}
+
+	for(; i < n; i++) {
+		out[i] = a[i] * (1.0f - t) + b[i] * t;
+	}
 }
 
-template<typename T> DifField<T>& DifField<T>::operator=(const DifField<T>& o) {
-	_DIF_TYPE::operator=(o);
+__attribute__((target("sse2"))) inline void difScaleAddSSE2(const float* a, float w, float c, float* out, unsigned int n) {
+	const __m128 vw = _mm_set1_ps(w);
+	const __m128 vc = _mm_set1_ps(c);
+	unsigned int i = 0;
 
-	m_vSize = o.m_vSize;
-	m_bHasData = o.m_bHasData;
+	for(; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), vw), vc));
+	}
 
-	return *this;
+	for(; i < n; i++) {
+		out[i] = a[i] * w + c;
+	}
 }
 
-template<typename T> T DifField<T>::readPixel(const V2i& pos, unsigned int dpt, bool *retval) {
-	if(m_vSize.x <= pos.x || m_vSize.y <= pos.y || m_vSize.z <= dpt) {
-		if(retval) {
-			(*retval) = false;
-		}
-		
-		return T(0);
+__attribute__((target("sse2"))) inline void difLerpSSE2(const double* a, const double* b, float t, double* out, unsigned int n) {
+	const __m128d wa = _mm_set1_pd(1.0f - t);
+	const __m128d wb = _mm_set1_pd(t);
+	unsigned int i = 0;
+
+	for(; i + 2 <= n; i += 2) {
+		__m128d va = _mm_mul_pd(_mm_loadu_pd(a + i), wa);
+		__m128d vb = _mm_mul_pd(_mm_loadu_pd(b + i), wb);
+
+		_mm_storeu_pd(out + i, _mm_add_pd(va, vb));
 	}
 
-	if(retval) {
-		(*retval) = true;
+	for(; i < n; i++) {
+		out[i] = a[i] * (1.0f - t) + b[i] * t;
 	}
+}
 
-	return _DIF_TYPE::value(pos.x, pos.y, dpt);
+__attribute__((target("sse2"))) inline void difScaleAddSSE2(const double* a, float w, double c, double* out, unsigned int n) {
+	const __m128d vw = _mm_set1_pd(w);
+	const __m128d vc = _mm_set1_pd(c);
+	unsigned int i = 0;
+
+	for(; i + 2 <= n; i += 2) {
+		_mm_storeu_pd(out + i, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a + i), vw), vc));
+	}
+
+	for(; i < n; i++) {
+		out[i] = a[i] * w + c;
+	}
 }
 
-template<typename T> int DifField<T>::depth() const {
-	return m_vSize.z;
+__attribute__((target("avx2"))) inline void difLerpAVX2(const float* a, const float* b, float t, float* out, unsigned int n) {
+	const __m256 wa = _mm256_set1_ps(1.0f - t);
+	const __m256 wb = _mm256_set1_ps(t);
+	unsigned int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		__m256 va = _mm256_mul_ps(_mm256_loadu_ps(a + i), wa);
+		__m256 vb = _mm256_mul_ps(_mm256_loadu_ps(b + i), wb);
+
+		_mm256_storeu_ps(out + i, _mm256_add_ps(va, vb));
+	}
+
+	difLerpSSE2(a + i, b + i, t, out + i, n - i);
 }
 
-template<typename T> bool DifField<T>::writePixel(const V2i& pos, unsigned int dpt, const T data) {
-	if(pos.x >= m_vSize.x || pos.y >= m_vSize.y) {
-		return false;
+__attribute__((target("avx2"))) inline void difScaleAddAVX2(const float* a, float w, float c, float* out, unsigned int n) {
+	const __m256 vw = _mm256_set1_ps(w);
+	const __m256 vc = _mm256_set1_ps(c);
+	unsigned int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), vw), vc));
 	}
 
-	//std::cout << "Write: " << data << " dpt=" << dpt << std::endl;
+	difScaleAddSSE2(a + i, w, c, out + i, n - i);
+}
 
-	updateDepth(dpt);
+__attribute__((target("avx2"))) inline void difLerpAVX2(const double* a, const double* b, float t, double* out, unsigned int n) {
+	const __m256d wa = _mm256_set1_pd(1.0f - t);
+	const __m256d wb = _mm256_set1_pd(t);
+	unsigned int i = 0;
 
-	m_bHasData = true;
-	_DIF_TYPE::lvalue(pos.x, pos.y, dpt) = data;
+	for(; i + 4 <= n; i += 4) {
+		__m256d va = _mm256_mul_pd(_mm256_loadu_pd(a + i), wa);
+		__m256d vb = _mm256_mul_pd(_mm256_loadu_pd(b + i), wb);
+
+		_mm256_storeu_pd(out + i, _mm256_add_pd(va, vb));
+	}
+
+	difLerpSSE2(a + i, b + i, t, out + i, n - i);
 }
 
-template<typename T> void DifField<T>::setContainsData() {
-	m_bHasData = true;
+__attribute__((target("avx2"))) inline void difScaleAddAVX2(const double* a, float w, double c, double* out, unsigned int n) {
+	const __m256d vw = _mm256_set1_pd(w);
+	const __m256d vc = _mm256_set1_pd(c);
+	unsigned int i = 0;
+
+	for(; i + 4 <= n; i += 4) {
+		_mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(a + i), vw), vc));
+	}
+
+	difScaleAddSSE2(a + i, w, c, out + i, n - i);
 }
 
+// half has the layout of an IEEE binary16, so F16C converts it in registers
+__attribute__((target("avx2,f16c"))) inline void difLerpAVX2(const half* a, const half* b, float t, half* out, unsigned int n) {
+	const __m256 wa = _mm256_set1_ps(1.0f - t);
+	const __m256 wb = _mm256_set1_ps(t);
+	unsigned int i = 0;
 
-template<typename T> const V3i& DifField<T>::getSize() const {
-	return m_vSize;
+	for(; i + 8 <= n; i += 8) {
+		__m256 va = _mm256_mul_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(a + i))), wa);
+		__m256 vb = _mm256_mul_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))), wb);
+
+		_mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_add_ps(va, vb), _MM_FROUND_TO_NEAREST_INT));
+	}
+
+	for(; i < n; i++) {
+		out[i] = a[i] * (1.0f - t) + b[i] * t;
+	}
 }
 
-template<typename T> void DifField<T>::updateDepth(unsigned int dpt) {
-	if(depth() <= dpt) {
-		m_vSize.z = dpt+1;
-
-		if(m_bHasData) { 
-			
-			// If we have data copy it to a tmp SparseField
-			SparseField<T> tmp(*this);
-
-			_DIF_TYPE::setSize(m_vSize);
-			
-			V3i dims = tmp.dataResolution();
-
-			// And Copy it back onto the resized field.
-			for(int i = 0; i < dims.x; i++) {
-				for(int j = 0; j < dims.y; j++) {
-					for(int k = 0; k < dims.z; k++) {
-						T handle = tmp.value(i, j, k);
-
-						// So we don't waste much RAM
-						if(handle != T(0)) {
-							writePixel(V2i(i, j), k, handle);
-						}
-					}
-				}
-			}
-		} else {
-			// The Field is empty, hence simply resize
-			_DIF_TYPE::setSize(m_vSize);
-		}
+__attribute__((target("avx2,f16c"))) inline void difScaleAddAVX2(const half* a, float w, float c, half* out, unsigned int n) {
+	const __m256 vw = _mm256_set1_ps(w);
+	const __m256 vc = _mm256_set1_ps(c);
+	unsigned int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		__m256 va = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(a + i)));
+
+		_mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_add_ps(_mm256_mul_ps(va, vw), vc), _MM_FROUND_TO_NEAREST_INT));
+	}
+
+	for(; i < n; i++) {
+		out[i] = a[i] * w + c;
 	}
 }
+#endif //_DIF_SIMD
 
-/* Protected */ template<typename T> void DifField<T>::sizeChanged() {
-	m_vSize = _DIF_TYPE::dataResolution();
+/*!
+ * @brief Interpolation kernels working on contiguous runs of voxels
+ *
+ * lerp() computes out = a*(1-t) + b*t, scaleAdd() computes out = a*w + c*wc,
+ * which is the same interpolation against a constant (an unallocated block).
+ * Both round like Imath::lerp(). float, double and half are specialised with
+ * SSE2/AVX2 code chosen at runtime (see difSimd()), anything else is scalar.
+ */
+template<typename T> struct DifKernel {
+	static void lerp(const T* a, const T* b, float t, T* out, unsigned int n) {
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = Imath::lerp(a[i], b[i], t);
+		}
+	}
 
-	_DIF_TYPE::sizeChanged();
+	static void scaleAdd(const T* a, float w, const T& c, float wc, T* out, unsigned int n) {
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = T(a[i] * w + c * wc);
+		}
+	}
+};
+
+template<> struct DifKernel<float> {
+	static void lerp(const float* a, const float* b, float t, float* out, unsigned int n) {
+#ifdef _DIF_SIMD
+		switch(difSimd()) {
+			case eDifSimdAVX2: difLerpAVX2(a, b, t, out, n); return;
+			case eDifSimdSSE2: difLerpSSE2(a, b, t, out, n); return;
+			default: break;
+		}
+#endif
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = a[i] * (1.0f - t) + b[i] * t;
+		}
+	}
+
+	static void scaleAdd(const float* a, float w, const float& c, float wc, float* out, unsigned int n) {
+#ifdef _DIF_SIMD
+		switch(difSimd()) {
+			case eDifSimdAVX2: difScaleAddAVX2(a, w, c * wc, out, n); return;
+			case eDifSimdSSE2: difScaleAddSSE2(a, w, c * wc, out, n); return;
+			default: break;
+		}
+#endif
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = a[i] * w + c * wc;
+		}
+	}
+};
+
+template<> struct DifKernel<double> {
+	static void lerp(const double* a, const double* b, float t, double* out, unsigned int n) {
+#ifdef _DIF_SIMD
+		switch(difSimd()) {
+			case eDifSimdAVX2: difLerpAVX2(a, b, t, out, n); return;
+			case eDifSimdSSE2: difLerpSSE2(a, b, t, out, n); return;
+			default: break;
+		}
+#endif
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = a[i] * (1.0f - t) + b[i] * t;
+		}
+	}
+
+	static void scaleAdd(const double* a, float w, const double& c, float wc, double* out, unsigned int n) {
+#ifdef _DIF_SIMD
+		switch(difSimd()) {
+			case eDifSimdAVX2: difScaleAddAVX2(a, w, c * wc, out, n); return;
+			case eDifSimdSSE2: difScaleAddSSE2(a, w, c * wc, out, n); return;
+			default: break;
+		}
+#endif
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = a[i] * w + c * wc;
+		}
+	}
+};
+
+// SSE2 has no half conversion, so only AVX2 (with F16C) is vectorised
+template<> struct DifKernel<half> {
+	static void lerp(const half* a, const half* b, float t, half* out, unsigned int n) {
+#ifdef _DIF_SIMD
+		if(difSimd() == eDifSimdAVX2) {
+			difLerpAVX2(a, b, t, out, n);
+			return;
+		}
+#endif
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = a[i] * (1.0f - t) + b[i] * t;
+		}
+	}
+
+	static void scaleAdd(const half* a, float w, const half& c, float wc, half* out, unsigned int n) {
+#ifdef _DIF_SIMD
+		if(difSimd() == eDifSimdAVX2) {
+			difScaleAddAVX2(a, w, c * wc, out, n);
+			return;
+		}
+#endif
+		for(unsigned int i = 0; i < n; i++) {
+			out[i] = a[i] * w + c * wc;
+		}
+	}
+};
+
+/*!
+ * @brief Block codecs for DifImage::save(), see DifImage::setChannelCodec()
+ *
+ * Blocks are encoded one by one from their raw bytes in native byte order.
+ * eDifCodecLZ is a byte oriented LZ77 in the spirit of LZ4. eDifCodecShuffle
+ * first replaces every value by its difference to the value one depth slice
+ * before and groups the bytes by significance, which turns slowly changing
+ * depths into long runs for the LZ stage. eDifCodecPredict xors every value
+ * with the one a slice before and only keeps the bytes that differ; it does
+ * not search for matches and decodes fastest.
+ */
+enum DifCodec {
+	eDifCodecNone    = 0,
+	eDifCodecLZ      = 1,
+	eDifCodecShuffle = 2,
+	eDifCodecPredict = 3
+};
+
+/// Appends the LZ length continuation bytes of @a value
+inline void difLZLength(std::vector<unsigned char>& out, size_t value) {
+	for(; value >= 255; value -= 255) {
+		out.push_back(255);
+	}
+
+	out.push_back((unsigned char)value);
 }
 
+/*!
+ * @brief Compresses @a size bytes and appends them to @a out
+ *
+ * A sequence is a token (literal count in the high, match length - 4 in the
+ * low nibble, 15 meaning more bytes follow), the literals, a 16 bit offset and
+ * the match length continuation. Matches are found greedily through a hash of
+ * the next four bytes. The last sequence only holds literals.
+ */
+inline void difLZCompress(const unsigned char* src, size_t size, std::vector<unsigned char>& out) {
+	const int hashBits = 12;
 
+	// Last position + 1 of every hash, 0 if none
+	std::vector<size_t> table(1 << hashBits, 0);
+	size_t anchor = 0;
+	size_t pos    = 0;
 
+	while(pos + 4 <= size) {
+		boost::uint32_t word;
+		memcpy(&word, src + pos, 4);
 
-template<typename T> class DifImage {
-	public:
-		typedef boost::intrusive_ptr<DifImage> Ptr;
+		size_t h         = (word * 2654435761u) >> (32 - hashBits);
+		size_t candidate = table[h];
 
-		DifImage(const V2i& size);
-		~DifImage();
+		table[h] = pos + 1;
 
-		bool addChannel(const std::string& name, const DifField<T>& i, unsigned int& retid);
-		bool addChannel(const std::string& name, unsigned int& retid);
+		if(candidate == 0 || pos + 1 - candidate > 65535 || memcmp(src + candidate - 1, src + pos, 4) != 0) {
+			// Step faster through data that doesn't match
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
 
-		unsigned int numberOfChannels() const;
+		const size_t match  = candidate - 1;
+		const size_t offset = pos - match;
+		size_t length = 4;
 
-		void save(Field3DOutputFile& ofp);
-		bool load(Field3DInputFile& ifp);
+		while(pos + length < size && src[match + length] == src[pos + length]) {
+			++length;
+		}
 
-		const std::string& channelName(unsigned int idx) const;
-		unsigned int channelIndex(const std::string& name, bool *retval=0);
+		const size_t literals = pos - anchor;
 
-		float depthAtIndex(unsigned int idx, bool* retval = 0) const;
-		unsigned int indexAtDepth(float dpt, bool* retval = 0) const;
-		
-		void addDepth(float dpt, bool sync=true);
+		out.push_back((unsigned char)((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(length - 4, 15)));
 
-		bool validChannelId(unsigned int id) const;
+		if(literals >= 15) {
+			difLZLength(out, literals - 15);
+		}
 
-		bool hasChannel(const std::string& name);
+		out.insert(out.end(), src + anchor, src + pos);
+		out.push_back((unsigned char)(offset & 255));
+		out.push_back((unsigned char)(offset >> 8));
 
-		unsigned int depthLevels() const;
+		if(length - 4 >= 15) {
+			difLZLength(out, length - 4 - 15);
+		}
 
-		enum DifImageInterpolation {
-			eNone     = 0,
-			eLinear   = 1,
-		};
+		pos   += length;
+		anchor = pos;
+	}
 
-		// data must be at least sizeof(T)*numberOfChannels()
-		void writeData(const V2i& pos, float depth, T* data);
-		bool readData(const V2i& pos, float depth, T *buffer, enum DifImageInterpolation type = eLinear);
+	const size_t literals = size - anchor;
 
-		bool readChannelData(unsigned int channelid, const V2i& pos, float depth, T& retval, enum DifImageInterpolation type = eLinear);
-		bool readChannelData(const std::string& channelname, const V2i& pos, float depth, T& retval, enum DifImageInterpolation type = eLinear);
+	out.push_back((unsigned char)(std::min<size_t>(literals, 15) << 4));
 
-		enum DifImageGetType {
-			eBefore,
-			eAfter
-		};
+	if(literals >= 15) {
+		difLZLength(out, literals - 15);
+	}
 
-		void getNearestDepthIndex(float dpt, enum DifImageGetType type, unsigned int& retid);
+	out.insert(out.end(), src + anchor, src + size);
+}
 
-#ifndef _NEXCEPTIONS
-		bool exceptionsEnabled() const;
-		void setExceptionsEnabled(bool yorn);
+/// Reads LZ length continuation bytes onto @a value, false if @a in runs past @a end
+inline bool difLZReadLength(const unsigned char*& in, const unsigned char* end, size_t& value) {
+	unsigned char b;
 
-		
-		class DifException : public std::exception {
-			public:
-				DifException(const std::string& what) throw() : m_sWhat(what) {}
-				~DifException() throw() {}
-				virtual const char* what() const throw() {return m_sWhat.c_str();}
-			private:
-				std::string m_sWhat;
-		};
+	do {
+		if(in >= end) {
+			return false;
+		}
 
-		#define _THROW(what) \
-			if(m_bExceptionsEnabled) {\
-				throw DifException(#what);\
-			}
-#else
-		#define _THROW(what)
-#endif //_NEXCEPTIONS
+		b = *in++;
+		value += b;
+	} while(b == 255);
 
-	protected:
-		void loadDepthMapping(const SparseField<float>::Ptr field);
-	
-		DifField<T>* getField(unsigned int channelid);
-		DifField<T>* addChannelIntern(const std::string& name, const DifField<T>& i, unsigned int& retid);
+	return true;
+}
+
+/*!
+ * @brief Decompresses the output of difLZCompress()
+ * @return false if the data is corrupt or doesn't decode to exactly @a capacity bytes
+ */
+inline bool difLZDecompress(const unsigned char* in, size_t size, unsigned char* dst, size_t capacity) {
+	const unsigned char* end = in + size;
+	size_t pos = 0;
+
+	// The last sequence has literals only, a stream ending after a match is cut off
+	for(;;) {
+		if(in >= end) {
+			return false;
+		}
+
+		const unsigned int token = *in++;
+		size_t literals = token >> 4;
+
+		if(literals == 15 && !difLZReadLength(in, end, literals)) {
+			return false;
+		}
+
+		if(literals > (size_t)(end - in) || literals > capacity - pos) {
+			return false;
+		}
+
+		memcpy(dst + pos, in, literals);
+		in  += literals;
+		pos += literals;
+
+		if(in == end) {
+			return pos == capacity;
+		}
+
+		if(end - in < 2) {
+			return false;
+		}
+
+		const size_t offset = in[0] | (in[1] << 8);
+		size_t length = token & 15;
+
+		in += 2;
+
+		if(length == 15 && !difLZReadLength(in, end, length)) {
+			return false;
+		}
+
+		length += 4;
+
+		if(offset == 0 || offset > pos || length > capacity - pos) {
+			return false;
+		}
+
+		// Matches may overlap their own output
+		for(size_t i = 0; i < length; i++) {
+			dst[pos + i] = dst[pos - offset + i];
+		}
+
+		pos += length;
+	}
+}
+
+/*!
+ * @brief Delta along depth and byte shuffle of @a count values of type @a U
+ *
+ * @a plane is the number of values per depth slice. Byte b of value i ends up
+ * at b*count + i of @a out.
+ */
+template<typename U> void difShuffle(const unsigned char* data, size_t count, size_t plane, unsigned char* out) {
+	const size_t width = sizeof(U);
+
+	for(size_t i = 0; i < count; i++) {
+		U v;
+		memcpy(&v, data + i * width, width);
+
+		if(i >= plane) {
+			U p;
+			memcpy(&p, data + (i - plane) * width, width);
+			v = U(v - p);
+		}
+
+		for(size_t b = 0; b < width; b++) {
+			out[b * count + i] = (unsigned char)(v >> (b * 8));
+		}
+	}
+}
+
+/// Reverses difShuffle()
+template<typename U> void difUnshuffle(const unsigned char* in, size_t count, size_t plane, unsigned char* data) {
+	const size_t width = sizeof(U);
+
+	for(size_t i = 0; i < count; i++) {
+		U v = 0;
+
+		for(size_t b = 0; b < width; b++) {
+			v = U(v | (U(in[b * count + i]) << (b * 8)));
+		}
+
+		if(i >= plane) {
+			U p;
+			memcpy(&p, data + (i - plane) * width, width);
+			v = U(v + p);
+		}
+
+		memcpy(data + i * width, &v, width);
+	}
+}
+
+/*!
+ * @brief Xor prediction of @a count values of type @a U, appended to @a out
+ *
+ * Every value is predicted by the one a depth slice before (the previous
+ * value within the first slice). A nibble per value gives the number of low
+ * bytes of the xor with the prediction that are stored, the nibbles come
+ * first, two per byte, then the stored bytes.
+ */
+template<typename U> void difPredict(const unsigned char* data, size_t count, size_t plane, std::vector<unsigned char>& out) {
+	const size_t width = sizeof(U);
+	const size_t head  = out.size();
+
+	// Room for the worst case, cut back at the end
+	out.resize(head + (count + 1) / 2 + count * width, 0);
+
+	unsigned char* bytes = count > 0 ? &out[head + (count + 1) / 2] : NULL;
+
+	for(size_t i = 0; i < count; i++) {
+		U v, p = 0;
+		memcpy(&v, data + i * width, width);
+
+		if(i >= plane) {
+			memcpy(&p, data + (i - plane) * width, width);
+		} else if(i > 0) {
+			memcpy(&p, data + (i - 1) * width, width);
+		}
+
+		const U x = U(v ^ p);
+		unsigned int n = width;
+
+		while(n > 0 && ((x >> ((n - 1) * 8)) & 0xff) == 0) {
+			--n;
+		}
+
+		out[head + i / 2] |= (unsigned char)(n << ((i & 1) * 4));
+
+		for(unsigned int b = 0; b < n; b++) {
+			*bytes++ = (unsigned char)(x >> (b * 8));
+		}
+	}
+
+	if(count > 0) {
+		out.resize(bytes - &out[0]);
+	}
+}
+
+/// Reverses difPredict(), false if the data is corrupt
+template<typename U> bool difUnpredict(const unsigned char* in, size_t size, size_t count, size_t plane, unsigned char* data) {
+	const size_t width = sizeof(U);
+	const size_t head  = (count + 1) / 2;
+
+	if(size < head) {
+		return false;
+	}
+
+	const unsigned char* bytes = in + head;
+	const unsigned char* end   = in + size;
+
+	for(size_t i = 0; i < count; i++) {
+		const unsigned int n = (in[i / 2] >> ((i & 1) * 4)) & 15;
+
+		if(n > width || (size_t)(end - bytes) < n) {
+			return false;
+		}
+
+		U x = 0, p = 0;
+
+		for(unsigned int b = 0; b < n; b++) {
+			x = U(x | (U(bytes[b]) << (b * 8)));
+		}
+
+		bytes += n;
+
+		if(i >= plane) {
+			memcpy(&p, data + (i - plane) * width, width);
+		} else if(i > 0) {
+			memcpy(&p, data + (i - 1) * width, width);
+		}
+
+		x = U(x ^ p);
+		memcpy(data + i * width, &x, width);
+	}
+
+	return bytes == end;
+}
+
+/// Encodes @a count values of type @a U with @a codec, see DifCodec
+template<typename U> void difEncodeWords(enum DifCodec codec, const unsigned char* data, size_t count, size_t plane, std::vector<unsigned char>& out) {
+	const size_t size = count * sizeof(U);
+
+	switch(codec) {
+		case eDifCodecLZ:
+			difLZCompress(data, size, out);
+			break;
+
+		case eDifCodecShuffle: {
+			std::vector<unsigned char> shuffled(size);
+
+			difShuffle<U>(data, count, plane, &shuffled[0]);
+			difLZCompress(&shuffled[0], size, out);
+			break;
+		}
+
+		case eDifCodecPredict:
+			difPredict<U>(data, count, plane, out);
+			break;
+
+		default:
+			out.insert(out.end(), data, data + size);
+			break;
+	}
+}
+
+/// Decodes the output of difEncodeWords(), false if the data is corrupt
+template<typename U> bool difDecodeWords(enum DifCodec codec, const unsigned char* in, size_t size, size_t count, size_t plane, unsigned char* data) {
+	const size_t bytes = count * sizeof(U);
+
+	switch(codec) {
+		case eDifCodecLZ:
+			return difLZDecompress(in, size, data, bytes);
+
+		case eDifCodecShuffle: {
+			std::vector<unsigned char> shuffled(bytes);
+
+			if(!difLZDecompress(in, size, &shuffled[0], bytes)) {
+				return false;
+			}
+
+			difUnshuffle<U>(&shuffled[0], count, plane, data);
+			return true;
+		}
+
+		case eDifCodecPredict:
+			return difUnpredict<U>(in, size, count, plane, data);
+
+		default:
+			if(size != bytes) {
+				return false;
+			}
+
+			memcpy(data, in, bytes);
+			return true;
+	}
+}
+
+/*!
+ * @brief Encodes @a count values of @a width bytes (1, 2, 4 or 8) and appends them to @a out
+ * @param[in] plane Number of values per depth slice
+ */
+inline void difEncode(enum DifCodec codec, const unsigned char* data, size_t count, size_t width, size_t plane, std::vector<unsigned char>& out) {
+	switch(width) {
+		case 1:  difEncodeWords<boost::uint8_t>(codec, data, count, plane, out); break;
+		case 2:  difEncodeWords<boost::uint16_t>(codec, data, count, plane, out); break;
+		case 4:  difEncodeWords<boost::uint32_t>(codec, data, count, plane, out); break;
+		default: difEncodeWords<boost::uint64_t>(codec, data, count, plane, out); break;
+	}
+}
+
+/// Decodes the output of difEncode() into @a data, false if it is corrupt
+inline bool difDecode(enum DifCodec codec, const unsigned char* in, size_t size, size_t count, size_t width, size_t plane, unsigned char* data) {
+	switch(width) {
+		case 1:  return difDecodeWords<boost::uint8_t>(codec, in, size, count, plane, data);
+		case 2:  return difDecodeWords<boost::uint16_t>(codec, in, size, count, plane, data);
+		case 4:  return difDecodeWords<boost::uint32_t>(codec, in, size, count, plane, data);
+		default: return difDecodeWords<boost::uint64_t>(codec, in, size, count, plane, data);
+	}
+}
+
+/*!
+ * @brief Entry of the block table in front of an encoded channel
+ *
+ * Offsets count from the end of the table. A block of size 0 is uniform and
+ * holds @a value, the other blocks are encoded with @a codec.
+ */
+struct DifCodecBlock {
+	boost::uint64_t offset;
+	boost::uint32_t size;
+	boost::uint32_t codec;
+	unsigned char   value[8];
+};
+
+/*!
+ * @brief Byte order of the host, 1234 for little and 4321 for big endian
+ *
+ * Encoded channels hold native words bit-cast into the floats of a layer. A
+ * file read on a host of the other byte order gets these floats swapped by
+ * HDF5, so the payload is only decoded on a host of the writer's byte order.
+ */
+inline int difByteOrder() {
+	const boost::uint32_t probe = 1;
+
+	return (*reinterpret_cast<const unsigned char*>(&probe) == 1) ? 1234 : 4321;
+}
+
+/*!
+ * @brief Types a channel is stored as by DifImage::save(), see DifImage::setChannelStorage()
+ *
+ * eDifStorageUInt8 and eDifStorageUInt16 quantise [0, 1] to the full range of
+ * the integer, meant for masks and mattes. eDifStorageUInt32 rounds to whole
+ * numbers in [0, 2^32 - 1], meant for ids.
+ */
+enum DifStorage {
+	eDifStorageNative = 0,
+	eDifStorageHalf   = 1,
+	eDifStorageUInt8  = 2,
+	eDifStorageUInt16 = 3,
+	eDifStorageUInt32 = 4
+};
+
+/// Returns the bytes per value of @a storage, @a native for eDifStorageNative
+inline size_t difStorageSize(enum DifStorage storage, size_t native) {
+	switch(storage) {
+		case eDifStorageHalf:   return 2;
+		case eDifStorageUInt8:  return 1;
+		case eDifStorageUInt16: return 2;
+		case eDifStorageUInt32: return 4;
+		default:                return native;
+	}
+}
+
+/// Rounds @a count values times @a scale to the integer type @a S, clamped to [0, @a max]
+template<typename S, typename T> void difQuantise(const T* in, size_t count, double scale, double max, unsigned char* out) {
+	for(size_t i = 0; i < count; i++) {
+		double v = double(in[i]) * scale;
+
+		// NaNs end up as 0
+		if(!(v > 0.0)) {
+			v = 0.0;
+		} else if(v > max) {
+			v = max;
+		}
+
+		S q = S(v + 0.5);
+		memcpy(out + i * sizeof(S), &q, sizeof(S));
+	}
+}
+
+/// Reverses difQuantise()
+template<typename S, typename T> void difDequantise(const unsigned char* in, size_t count, double scale, T* out) {
+	for(size_t i = 0; i < count; i++) {
+		S q;
+		memcpy(&q, in + i * sizeof(S), sizeof(S));
+		out[i] = T(double(q) / scale);
+	}
+}
+
+/*!
+ * @brief Converts @a count values to @a storage
+ * @param[out] out count*difStorageSize(storage, sizeof(T)) bytes
+ */
+template<typename T> void difPack(enum DifStorage storage, const T* in, size_t count, unsigned char* out) {
+	switch(storage) {
+		case eDifStorageHalf:
+			for(size_t i = 0; i < count; i++) {
+				half h = float(in[i]);
+				memcpy(out + i * sizeof(half), &h, sizeof(half));
+			}
+			break;
+
+		case eDifStorageUInt8:  difQuantise<boost::uint8_t>(in, count, 255.0, 255.0, out); break;
+		case eDifStorageUInt16: difQuantise<boost::uint16_t>(in, count, 65535.0, 65535.0, out); break;
+		case eDifStorageUInt32: difQuantise<boost::uint32_t>(in, count, 1.0, 4294967295.0, out); break;
+
+		default:
+			memcpy(out, in, count * sizeof(T));
+			break;
+	}
+}
+
+/// Converts @a count values stored as @a storage back, see difPack()
+template<typename T> void difUnpack(enum DifStorage storage, const unsigned char* in, size_t count, T* out) {
+	switch(storage) {
+		case eDifStorageHalf:
+			for(size_t i = 0; i < count; i++) {
+				half h;
+				memcpy(&h, in + i * sizeof(half), sizeof(half));
+				out[i] = T(float(h));
+			}
+			break;
+
+		case eDifStorageUInt8:  difDequantise<boost::uint8_t>(in, count, 255.0, out); break;
+		case eDifStorageUInt16: difDequantise<boost::uint16_t>(in, count, 65535.0, out); break;
+		case eDifStorageUInt32: difDequantise<boost::uint32_t>(in, count, 1.0, out); break;
+
+		default:
+			memcpy(out, in, count * sizeof(T));
+			break;
+	}
+}
+
+template<typename T> class DifField : public SparseField<T> {
+	public:
+		typedef boost::intrusive_ptr<DifField> Ptr;
+
+		DifField(const V2i& size);
+		DifField(const DifField<T>& o);
+		DifField(const _DIF_TYPE& o);
+		~DifField();
+
+		DifField& operator=(const DifField<T>& o);
+
+		void adopt(_DIF_TYPE& o);
+
+		bool writePixel(const V2i& pos, unsigned int dpt, const T data);
+		T readPixel(const V2i& pos, unsigned int dpt = 0, bool *retval = NULL) const;
+
+		int depth() const;
+
+		const V3i& getSize() const;
+		void setContainsData();
+		
+		void updateDepth(unsigned int dpt);
+		void shrinkDepth(unsigned int dpt);
+
+		void setConcurrentWrites(bool enable);
+
+		void writeSpan(const V2i& pos, unsigned int dpt, int count, const T* data, int stride = 1);
+		void readSpan(const V2i& pos, unsigned int dpt, int count, T* data, int stride = 1) const;
+		void lerpSpan(const V2i& pos, unsigned int bfr, unsigned int aftr, float t, int count, T* data, int stride = 1) const;
+		void lerpSlice(unsigned int bfr, unsigned int aftr, float t, T* data) const;
+		void lerpFrom(const DifField<T>& src, unsigned int bfr, unsigned int aftr, float t, unsigned int dpt, int ybegin, int yend);
+
+		void mergeFrom(const DifField<T>& src, unsigned int srcDpt, unsigned int dpt, int ybegin, int yend);
+		void mergeBlocks(DifField<T>& src);
+
+		const T* blockPlane(int bi, int bj, unsigned int dpt, T* scratch, T& value) const;
+		const T* blockData(int bi, int bj, int bk, T* scratch, T& value) const;
+		void assignBlock(int bi, int bj, int bk, const T* data, T value);
+		void readColumn(const V2i& pos, const unsigned int* slices, unsigned int count, T* data, int stride = 1) const;
+
+		unsigned int compact();
+
+		bool blockSummary(int bi, int bj, int bk, T& min, T& max) const;
+		void invalidateSummaries();
+
+		bool isPaged() const;
+		
+	protected:
+		typedef typename _DIF_TYPE::Block Block;
+		typedef std::vector<Block> BlockList;
+
+		int blockIndex(int bi, int bj, int bk) const;
+		void growDepth(int depth);
+		void lerpRun(const Block& a, int offa, const Block& b, int offb, float t, int count, T* data) const;
+
+		virtual void sizeChanged();
+
+		static boost::mutex& blockMutex(const Block& block);
+		boost::mutex& pageMutex() const;
+
+		void updateSummaries() const;
+		void summarise(size_t i) const;
 		
 	private:
-		typedef std::map<std::string, DifField<T> * > ChannelList;
-		typedef typename std::map<std::string, DifField<T> * >::iterator ChannelListIter;
+		V3i   m_vSize; // So we dont need recopmputation through dataResolution()
+		bool  m_bHasData;
+		bool  m_bConcurrent;
+
+		// Bounds of the values of every block, see blockSummary()
+		mutable std::vector<std::pair<T, T> > m_lSummaries;
+		mutable boost::atomic<bool> m_bSummariesValid;
+		mutable boost::mutex        m_mSummaryMutex;
+};
+
+template<typename T> DifField<T>::DifField(const V2i& size) : _DIF_TYPE() {
+	m_vSize.x = size.x;
+	m_vSize.y = size.y;
+
+	m_vSize.z = 1;
+
+	m_bHasData = false;
+	m_bConcurrent = false;
+	m_bSummariesValid = false;
+
+	_DIF_TYPE::setSize(m_vSize);
+	_DIF_TYPE::clear(T(0));
+}
+
+template<typename T> DifField<T>::DifField(const DifField<T>& o) 
+	: _DIF_TYPE(o), m_vSize(o.m_vSize), m_bHasData(o.m_bHasData), m_bConcurrent(false), m_bSummariesValid(false) {
+	// Nothing
+}
+
+template<typename T> DifField<T>::DifField(const _DIF_TYPE& o) 
+	: _DIF_TYPE(o), m_vSize(0), m_bHasData(true), m_bConcurrent(false), m_bSummariesValid(false) {
+	m_vSize = _DIF_TYPE::dataResolution();
+}
+
+template<typename T> DifField<T>::~DifField() {
+
+}
+
+template<typename T> DifField<T>& DifField<T>::operator=(const DifField<T>& o) {
+	_DIF_TYPE::operator=(o);
+
+	m_vSize = o.m_vSize;
+	m_bHasData = o.m_bHasData;
+	m_bSummariesValid = false;
+
+	return *this;
+}
+
+/*!
+ * @brief Takes over the blocks of @a o without copying them
+ *
+ * The rest of @a o (size, mapping, metadata) is copied. @a o keeps its size,
+ * but all of its blocks are empty afterwards. Blocks of a paged field belong
+ * to its file, they are copied instead.
+ */
+template<typename T> void DifField<T>::adopt(_DIF_TYPE& o) {
+	if(&o == this) {
+		return;
+	}
+
+	// SparseField can't hand its blocks over, they are reached through pointers to members
+	BlockList _DIF_TYPE::* blocks = &DifField<T>::m_blocks;
+	SparseFileManager* _DIF_TYPE::* manager = &DifField<T>::m_fileManager;
+
+	BlockList taken;
+
+	if(!(o.*manager)) {
+		taken.swap(o.*blocks);
+		(o.*blocks).resize(taken.size());
+	}
+
+	_DIF_TYPE::operator=(o);
+
+	if(!taken.empty()) {
+		_DIF_TYPE::m_blocks.swap(taken);
+	}
+
+	DifField<T>* field = dynamic_cast<DifField<T>*>(&o);
+
+	m_vSize = _DIF_TYPE::dataResolution();
+	m_bHasData = field ? field->m_bHasData : true;
+	m_bSummariesValid = false;
+
+	if(field) {
+		field->m_bSummariesValid = false;
+	}
+}
+
+template<typename T> T DifField<T>::readPixel(const V2i& pos, unsigned int dpt, bool *retval) const {
+	if(m_vSize.x <= pos.x || m_vSize.y <= pos.y || (unsigned int)m_vSize.z <= dpt) {
+		if(retval) {
+			(*retval) = false;
+		}
+		
+		return T(0);
+	}
+
+	if(retval) {
+		(*retval) = true;
+	}
+
+	if(isPaged()) {
+		boost::mutex::scoped_lock lock(pageMutex());
+
+		return _DIF_TYPE::value(pos.x, pos.y, dpt);
+	}
+
+	return _DIF_TYPE::value(pos.x, pos.y, dpt);
+}
+
+template<typename T> int DifField<T>::depth() const {
+	return m_vSize.z;
+}
+
+template<typename T> bool DifField<T>::writePixel(const V2i& pos, unsigned int dpt, const T data) {
+	if(pos.x >= m_vSize.x || pos.y >= m_vSize.y || isPaged()) {
+		return false;
+	}
+
+	//std::cout << "Write: " << data << " dpt=" << dpt << std::endl;
+
+	updateDepth(dpt);
+	writeSpan(pos, dpt, 1, &data);
+
+	return true;
+}
+
+template<typename T> void DifField<T>::setContainsData() {
+	m_bHasData = true;
+}
+
+
+template<typename T> const V3i& DifField<T>::getSize() const {
+	return m_vSize;
+}
+
+/*!
+ * @brief Grows the field so that depth index @a dpt becomes valid
+ *
+ * SparseField stores its blocks z-major, so growing the z axis only appends
+ * blocks; every existing block keeps its index and its data. See growDepth().
+ *
+ * @param[in] dpt The depth index that has to fit into the field
+ */
+template<typename T> void DifField<T>::updateDepth(unsigned int dpt) {
+	if(depth() > (int)dpt || isPaged()) {
+		return;
+	}
+
+	const bool summarised = m_bSummariesValid;
+	const size_t blocks = _DIF_TYPE::m_blocks.size();
+
+	growDepth(dpt + 1);
+
+	// Summaries of the old blocks still hold, the new ones are uniform
+	if(summarised && blocks < _DIF_TYPE::m_blocks.size()) {
+		m_lSummaries.resize(_DIF_TYPE::m_blocks.size());
+
+		for(size_t i = blocks; i < _DIF_TYPE::m_blocks.size(); i++) {
+			summarise(i);
+		}
+	}
+}
+
+/*!
+ * @brief Extends the field to @a depth depth indices in place
+ *
+ * The only place that changes SparseField's size behind its back.
+ * SparseField::sizeChanged() would drop every block, so the missing rows of
+ * blocks are appended here and only FieldRes::sizeChanged() sees the new
+ * extents. The block list reserves twice the blocks it needs when it has to
+ * move, so growing depth by depth moves each block O(1) times amortised.
+ * Summaries are left to the caller.
+ *
+ * @param[in] depth The new number of depth indices, more than depth()
+ */
+/* Protected */ template<typename T> void DifField<T>::growDepth(int depth) {
+	const int rows = (depth + _DIF_TYPE::blockSize() - 1) >> _DIF_TYPE::blockOrder();
+	const size_t count = size_t(_DIF_TYPE::m_blockRes.x) * _DIF_TYPE::m_blockRes.y * rows;
+
+	if(count > _DIF_TYPE::m_blocks.capacity()) {
+		BlockList blocks;
+		blocks.reserve(std::max(count, 2 * _DIF_TYPE::m_blocks.size()));
+		blocks.resize(_DIF_TYPE::m_blocks.size());
+
+		// Voxels are swapped over, never copied
+		for(size_t i = 0; i < blocks.size(); i++) {
+			Block& dst = blocks[i];
+			Block& src = _DIF_TYPE::m_blocks[i];
+
+			std::swap(dst.isAllocated, src.isAllocated);
+			std::swap(dst.emptyValue, src.emptyValue);
+			dst.data.swap(src.data);
+		}
+
+		_DIF_TYPE::m_blocks.swap(blocks);
+	}
+
+	_DIF_TYPE::m_blocks.resize(count);
+	_DIF_TYPE::m_blockRes.z = rows;
+
+	_DIF_TYPE::m_extents.max.z    = depth - 1;
+	_DIF_TYPE::m_dataWindow.max.z = depth - 1;
+
+	FieldRes::sizeChanged();
+
+	m_vSize.z = depth;
+}
+
+/*!
+ * @brief Shrinks the field to @a dpt depth indices
+ *
+ * Blocks past the new last row of blocks are released. Depth indices cut off
+ * inside that row are reset to the blocks' empty value, so they read as
+ * before if the field grows again.
+ *
+ * @param[in] dpt The new number of depth indices
+ */
+template<typename T> void DifField<T>::shrinkDepth(unsigned int dpt) {
+	const int order = _DIF_TYPE::blockOrder();
+	const int mask  = (1 << order) - 1;
+
+	if((int)dpt >= depth() || isPaged()) {
+		return;
+	}
+
+	m_bSummariesValid = false;
+
+	if(dpt & mask) {
+		const int bk = dpt >> order;
+
+		for(int bj = 0; bj < _DIF_TYPE::m_blockRes.y; bj++) {
+			for(int bi = 0; bi < _DIF_TYPE::m_blockRes.x; bi++) {
+				Block& block = _DIF_TYPE::m_blocks[blockIndex(bi, bj, bk)];
+
+				if(block.isAllocated) {
+					std::fill(block.data.begin() + ((dpt & mask) << order << order), block.data.end(), block.emptyValue);
+				}
+			}
+		}
+	}
+
+	BlockList blocks;
+	blocks.swap(_DIF_TYPE::m_blocks);
+
+	_DIF_TYPE::setSize(V3i(m_vSize.x, m_vSize.y, dpt));
+
+	for(size_t i = 0; i < _DIF_TYPE::m_blocks.size(); i++) {
+		Block& dst = _DIF_TYPE::m_blocks[i];
+		Block& src = blocks[i];
+
+		std::swap(dst.isAllocated, src.isAllocated);
+		std::swap(dst.emptyValue, src.emptyValue);
+		dst.data.swap(src.data);
+	}
+}
+
+/*!
+ * @brief Lets several threads write to the field at the same time
+ *
+ * writeSpan() and writePixel() then lock the block they write to, so distinct
+ * pixels can be written concurrently even if they share blocks. The field
+ * must not grow meanwhile: updateDepth() has to be called beforehand.
+ */
+template<typename T> void DifField<T>::setConcurrentWrites(bool enable) {
+	m_bConcurrent = enable;
+
+	if(enable) {
+		m_bHasData = true;
+	}
+}
+
+/*!
+ * @brief Writes @a count consecutive pixels of a row straight into the blocks
+ *
+ * Unlike writePixel() there is no bounds checking and no resizing: the span
+ * must lie inside the field and updateDepth() must already have been called
+ * for @a dpt. Values equal to the empty value of an unallocated block do not
+ * allocate it. Paged fields are read only and ignore the call.
+ *
+ * @param[in] pos    First pixel of the span
+ * @param[in] dpt    Depth index
+ * @param[in] count  Number of pixels
+ * @param[in] data   Source values
+ * @param[in] stride Distance between two values in @a data
+ */
+template<typename T> void DifField<T>::writeSpan(const V2i& pos, unsigned int dpt, int count, const T* data, int stride) {
+	const int order = _DIF_TYPE::blockOrder();
+	const int size  = 1 << order;
+	const int mask  = size - 1;
+
+	const int bj = pos.y >> order;
+	const int bk = dpt >> order;
+	const int offset = ((dpt & mask) << order << order) + ((pos.y & mask) << order);
+
+	if(isPaged()) {
+		return;
+	}
+
+	int x   = pos.x;
+	int end = pos.x + count;
+
+	while(x < end) {
+		int bi   = x >> order;
+		int stop = std::min(end, (bi + 1) << order);
+
+		Block& block = _DIF_TYPE::m_blocks[blockIndex(bi, bj, bk)];
+
+		boost::unique_lock<boost::mutex> lock(blockMutex(block), boost::defer_lock);
+
+		if(m_bConcurrent) {
+			lock.lock();
+		}
+
+		if(!block.isAllocated) {
+			int i = x;
+
+			for(; i < stop; i++) {
+				if(data[(i - pos.x) * stride] != block.emptyValue) {
+					break;
+				}
+			}
+
+			// Nothing but empty values, keep the block unallocated
+			if(i == stop) {
+				x = stop;
+				continue;
+			}
+
+			block.resize(size << order << order);
+		}
+
+		const int first = x;
+
+		for(; x < stop; x++) {
+			block.data[offset + (x & mask)] = data[(x - pos.x) * stride];
+		}
+
+		// Widen the block's bounds, they only shrink again with a rebuild
+		if(m_bSummariesValid) {
+			std::pair<T, T>& bounds = m_lSummaries[blockIndex(bi, bj, bk)];
+
+			for(int i = first; i < stop; i++) {
+				const T v = data[(i - pos.x) * stride];
+
+				if(v < bounds.first) {
+					bounds.first = v;
+				}
+
+				if(v > bounds.second) {
+					bounds.second = v;
+				}
+			}
+		}
+	}
+
+	// Only written once, so threads filling distinct blocks don't race on it
+	if(!m_bHasData) {
+		m_bHasData = true;
+	}
+}
+
+/*!
+ * @brief Reads @a count consecutive pixels of a row straight from the blocks
+ *
+ * Same preconditions as writeSpan(): the span and @a dpt must lie inside the field.
+ * Paged fields are read through value() so their blocks get paged in.
+ *
+ * @param[in]  pos    First pixel of the span
+ * @param[in]  dpt    Depth index
+ * @param[in]  count  Number of pixels
+ * @param[out] data   Destination
+ * @param[in]  stride Distance between two values in @a data
+ */
+template<typename T> void DifField<T>::readSpan(const V2i& pos, unsigned int dpt, int count, T* data, int stride) const {
+	const int order = _DIF_TYPE::blockOrder();
+	const int mask  = (1 << order) - 1;
+
+	const int bj = pos.y >> order;
+	const int bk = dpt >> order;
+	const int offset = ((dpt & mask) << order << order) + ((pos.y & mask) << order);
+
+	if(isPaged()) {
+		boost::mutex::scoped_lock lock(pageMutex());
+
+		for(int i = 0; i < count; i++) {
+			data[i * stride] = _DIF_TYPE::fastValue(pos.x + i, pos.y, dpt);
+		}
+
+		return;
+	}
+
+	int x   = pos.x;
+	int end = pos.x + count;
+
+	while(x < end) {
+		int bi   = x >> order;
+		int stop = std::min(end, (bi + 1) << order);
+
+		const Block& block = _DIF_TYPE::m_blocks[blockIndex(bi, bj, bk)];
+
+		if(!block.isAllocated) {
+			for(; x < stop; x++) {
+				data[(x - pos.x) * stride] = block.emptyValue;
+			}
+		} else {
+			for(; x < stop; x++) {
+				data[(x - pos.x) * stride] = block.data[offset + (x & mask)];
+			}
+		}
+	}
+}
+
+/*!
+ * @brief Interpolates @a count consecutive pixels of a row between two depth indices
+ *
+ * Same preconditions as readSpan().
+ *
+ * @param[in]  pos    First pixel of the span
+ * @param[in]  bfr    Depth index weighted with 1-t
+ * @param[in]  aftr   Depth index weighted with t
+ * @param[in]  t      Interpolation weight
+ * @param[in]  count  Number of pixels
+ * @param[out] data   Destination
+ * @param[in]  stride Distance between two values in @a data
+ */
+template<typename T> void DifField<T>::lerpSpan(const V2i& pos, unsigned int bfr, unsigned int aftr, float t, int count, T* data, int stride) const {
+	const int order = _DIF_TYPE::blockOrder();
+	const int mask  = (1 << order) - 1;
+
+	const int bj = pos.y >> order;
+	const int ka = bfr >> order;
+	const int kb = aftr >> order;
+	const int offa = ((bfr & mask) << order << order) + ((pos.y & mask) << order);
+	const int offb = ((aftr & mask) << order << order) + ((pos.y & mask) << order);
+
+	if(isPaged()) {
+		boost::mutex::scoped_lock lock(pageMutex());
+
+		for(int i = 0; i < count; i++) {
+			T va = _DIF_TYPE::fastValue(pos.x + i, pos.y, bfr);
+			T vb = _DIF_TYPE::fastValue(pos.x + i, pos.y, aftr);
+
+			data[i * stride] = Imath::lerp(va, vb, t);
+		}
+
+		return;
+	}
+
+	// Interleaved destinations go through a small contiguous buffer
+	const int chunk = 64;
+	T run[chunk];
+
+	int x   = pos.x;
+	int end = pos.x + count;
+
+	while(x < end) {
+		int bi   = x >> order;
+		int stop = std::min(end, (bi + 1) << order);
+
+		const Block& a = _DIF_TYPE::m_blocks[blockIndex(bi, bj, ka)];
+		const Block& b = _DIF_TYPE::m_blocks[blockIndex(bi, bj, kb)];
+
+		if(stride == 1) {
+			lerpRun(a, offa + (x & mask), b, offb + (x & mask), t, stop - x, data + (x - pos.x));
+			x = stop;
+			continue;
+		}
+
+		while(x < stop) {
+			int n = std::min(chunk, stop - x);
+
+			lerpRun(a, offa + (x & mask), b, offb + (x & mask), t, n, run);
+
+			for(int i = 0; i < n; i++) {
+				data[(x - pos.x + i) * stride] = run[i];
+			}
+
+			x += n;
+		}
+	}
+}
+
+/*!
+ * @brief Interpolates a whole depth slice between two depth indices
+ *
+ * Works on one block column at a time with the vectorised kernels of
+ * DifKernel; pairs of unallocated blocks only fill in a constant.
+ *
+ * @param[in]  bfr  Depth index weighted with 1-t
+ * @param[in]  aftr Depth index weighted with t
+ * @param[in]  t    Interpolation weight
+ * @param[out] data Destination of getSize().x * getSize().y values, row by row
+ */
+template<typename T> void DifField<T>::lerpSlice(unsigned int bfr, unsigned int aftr, float t, T* data) const {
+	const int order = _DIF_TYPE::blockOrder();
+	const int size  = 1 << order;
+	const int mask  = size - 1;
+
+	const int width  = m_vSize.x;
+	const int height = m_vSize.y;
+
+	if(isPaged()) {
+		for(int y = 0; y < height; y++) {
+			lerpSpan(V2i(0, y), bfr, aftr, t, width, data + y * width);
+		}
+
+		return;
+	}
+
+	const int ka = bfr >> order;
+	const int kb = aftr >> order;
+	const int offa = (bfr & mask) << order << order;
+	const int offb = (aftr & mask) << order << order;
+
+	for(int bj = 0; bj < _DIF_TYPE::m_blockRes.y; bj++) {
+		const int y0 = bj << order;
+		const int h  = std::min(size, height - y0);
+
+		for(int bi = 0; bi < _DIF_TYPE::m_blockRes.x; bi++) {
+			const int x0 = bi << order;
+			const int w  = std::min(size, width - x0);
+
+			const Block& a = _DIF_TYPE::m_blocks[blockIndex(bi, bj, ka)];
+			const Block& b = _DIF_TYPE::m_blocks[blockIndex(bi, bj, kb)];
+
+			for(int j = 0; j < h; j++) {
+				lerpRun(a, offa + (j << order), b, offb + (j << order), t, w, data + (y0 + j) * width + x0);
+			}
+		}
+	}
+}
+
+/*!
+ * @brief Fills rows of depth index @a dpt by interpolating two depth indices of @a src
+ *
+ * @a src must have the same width and height. Whole block planes are written
+ * at once, and a result equal to an unallocated block's empty value leaves the
+ * block unallocated. Depth indices @a src has not grown to read as 0. Threads
+ * may fill the same field concurrently as long as they write distinct blocks,
+ * i.e. rows starting at block boundaries or different rows of blocks in depth.
+ *
+ * @param[in] src    Source field
+ * @param[in] bfr    Depth index of @a src weighted with 1-t
+ * @param[in] aftr   Depth index of @a src weighted with t, equal to @a bfr copies
+ * @param[in] t      Interpolation weight
+ * @param[in] dpt    Depth index to fill (updateDepth() must have been called)
+ * @param[in] ybegin First row
+ * @param[in] yend   Row after the last one
+ */
+template<typename T> void DifField<T>::lerpFrom(const DifField<T>& src, unsigned int bfr, unsigned int aftr, float t, unsigned int dpt, int ybegin, int yend) {
+	m_bSummariesValid = false;
+
+	const int order = _DIF_TYPE::blockOrder();
+	const int size  = 1 << order;
+	const int mask  = size - 1;
+	const int width = m_vSize.x;
+
+	const bool copy = (bfr == aftr);
+	const bool hasa = (int)bfr  < src.depth();
+	const bool hasb = (int)aftr < src.depth();
+
+	if(isPaged()) {
+		return;
+	}
+
+	yend = std::min(yend, m_vSize.y);
+
+	// Different block layouts are matched row by row
+	if(src.isPaged() || src.blockOrder() != order) {
+		boost::unique_lock<boost::mutex> lock(src.pageMutex(), boost::defer_lock);
+		std::vector<T> row(width);
+
+		if(src.isPaged()) {
+			lock.lock();
+		}
+
+		for(int y = ybegin; y < yend; y++) {
+			for(int x = 0; x < width; x++) {
+				T a = hasa ? src.fastValue(x, y, bfr)  : T(0);
+				T b = hasb ? src.fastValue(x, y, aftr) : T(0);
+
+				row[x] = copy ? a : Imath::lerp(a, b, t);
+			}
+
+			writeSpan(V2i(0, y), dpt, width, &row[0]);
+		}
+
+		return;
+	}
+
+	Block zero;
+	zero.isAllocated = false;
+	zero.emptyValue  = T(0);
+
+	const int ka = bfr >> order;
+	const int kb = aftr >> order;
+	const int kd = dpt >> order;
+	const int offa = (bfr & mask) << order << order;
+	const int offb = (aftr & mask) << order << order;
+	const int offd = (dpt & mask) << order << order;
+
+	for(int bj = ybegin >> order; (bj << order) < yend; bj++) {
+		const int j0 = std::max(ybegin, bj << order) & mask;
+		const int j1 = std::min(yend - (bj << order), size);
+
+		for(int bi = 0; bi < _DIF_TYPE::m_blockRes.x; bi++) {
+			const int w = std::min(size, width - (bi << order));
+
+			const Block& a = hasa ? src.m_blocks[src.blockIndex(bi, bj, ka)] : zero;
+			const Block& b = hasb ? src.m_blocks[src.blockIndex(bi, bj, kb)] : zero;
+			Block& d = _DIF_TYPE::m_blocks[blockIndex(bi, bj, kd)];
+
+			if(!d.isAllocated) {
+				if(!a.isAllocated && (copy || !b.isAllocated)) {
+					T v = copy ? a.emptyValue : T(Imath::lerp(a.emptyValue, b.emptyValue, t));
+
+					// Nothing changes for a uniform result matching the block
+					if(v == d.emptyValue) {
+						continue;
+					}
+				}
+
+				d.resize(size << order << order);
+			}
+
+			for(int j = j0; j < j1; j++) {
+				T* out = &d.data[offd + (j << order)];
+
+				if(!copy) {
+					lerpRun(a, offa + (j << order), b, offb + (j << order), t, w, out);
+				} else if(a.isAllocated) {
+					std::copy(&a.data[offa + (j << order)], &a.data[offa + (j << order)] + w, out);
+				} else {
+					std::fill(out, out + w, a.emptyValue);
+				}
+			}
+		}
+	}
+
+	if(!m_bHasData) {
+		m_bHasData = true;
+	}
+}
+
+/*!
+ * @brief Copies the non-zero voxels of depth index @a srcDpt of @a src into depth index @a dpt
+ *
+ * Only rows [@a ybegin, @a yend) are touched, with the same threading rules
+ * as lerpFrom(). Unallocated source blocks of 0 are skipped, other source
+ * blocks are copied a block plane at a time.
+ *
+ * @param[in] src    Source field of the same width and height
+ * @param[in] srcDpt Depth index of @a src
+ * @param[in] dpt    Depth index to write (updateDepth() must have been called)
+ * @param[in] ybegin First row
+ * @param[in] yend   Row after the last one
+ */
+template<typename T> void DifField<T>::mergeFrom(const DifField<T>& src, unsigned int srcDpt, unsigned int dpt, int ybegin, int yend) {
+	m_bSummariesValid = false;
+
+	const int order = _DIF_TYPE::blockOrder();
+	const int size  = 1 << order;
+	const int mask  = size - 1;
+	const int width = m_vSize.x;
+
+	if(isPaged() || (int)srcDpt >= src.depth()) {
+		return;
+	}
+
+	yend = std::min(yend, m_vSize.y);
+
+	// Different block layouts are matched voxel by voxel
+	if(src.isPaged() || src.blockOrder() != order) {
+		boost::unique_lock<boost::mutex> lock(src.pageMutex(), boost::defer_lock);
+
+		if(src.isPaged()) {
+			lock.lock();
+		}
+
+		for(int y = ybegin; y < yend; y++) {
+			for(int x = 0; x < width; x++) {
+				T v = src.fastValue(x, y, srcDpt);
+
+				if(v != T(0)) {
+					_DIF_TYPE::lvalue(x, y, dpt) = v;
+					if(!m_bHasData) {
+						m_bHasData = true;
+					}
+				}
+			}
+		}
+
+		return;
+	}
+
+	const int ks = srcDpt >> order;
+	const int kd = dpt >> order;
+	const int offs = (srcDpt & mask) << order << order;
+	const int offd = (dpt & mask) << order << order;
+
+	for(int bj = ybegin >> order; (bj << order) < yend; bj++) {
+		const int j0 = std::max(ybegin, bj << order) & mask;
+		const int j1 = std::min(yend - (bj << order), size);
+
+		for(int bi = 0; bi < _DIF_TYPE::m_blockRes.x; bi++) {
+			const int w = std::min(size, width - (bi << order));
+
+			const Block& a = src.m_blocks[src.blockIndex(bi, bj, ks)];
+			Block& d = _DIF_TYPE::m_blocks[blockIndex(bi, bj, kd)];
+
+			if(!a.isAllocated && (a.emptyValue == T(0) || (!d.isAllocated && a.emptyValue == d.emptyValue))) {
+				continue;
+			}
+
+			if(!d.isAllocated) {
+				d.resize(size << order << order);
+			}
+
+			for(int j = j0; j < j1; j++) {
+				T* out = &d.data[offd + (j << order)];
+
+				if(!a.isAllocated) {
+					std::fill(out, out + w, a.emptyValue);
+					continue;
+				}
+
+				const T* in = &a.data[offs + (j << order)];
+
+				for(int x = 0; x < w; x++) {
+					if(in[x] != T(0)) {
+						out[x] = in[x];
+					}
+				}
+			}
+
+			if(!m_bHasData) {
+				m_bHasData = true;
+			}
+		}
+	}
+}
+
+/*!
+ * @brief Moves the blocks of @a src into the field
+ *
+ * Combines the parts of a channel written by DifStreamWriter. Blocks the
+ * field does not have yet are taken over without copying, blocks both have
+ * are merged voxel by voxel with non-zero values of @a src winning. The field
+ * grows to the depth of @a src, which is left empty. Paged sources or
+ * different block sizes fall back to mergeFrom() per depth index.
+ *
+ * @param[in,out] src Field of the same width and height
+ */
+template<typename T> void DifField<T>::mergeBlocks(DifField<T>& src) {
+	m_bSummariesValid = false;
+
+	const int order = _DIF_TYPE::blockOrder();
+	const int n     = 1 << order << order << order;
+
+	if(isPaged() || src.depth() == 0 || src.m_vSize.x != m_vSize.x || src.m_vSize.y != m_vSize.y) {
+		return;
+	}
+
+	updateDepth(src.depth() - 1);
+
+	if(!m_bHasData) {
+		m_bHasData = true;
+	}
+
+	if(src.isPaged() || src.blockOrder() != order) {
+		for(int dpt = 0; dpt < src.depth(); dpt++) {
+			mergeFrom(src, dpt, dpt, 0, m_vSize.y);
+		}
+
+		return;
+	}
+
+	// Both fields have the same rows of blocks, so block indices match
+	for(size_t i = 0; i < src.m_blocks.size(); i++) {
+		Block& a = src.m_blocks[i];
+		Block& d = _DIF_TYPE::m_blocks[i];
+
+		if(!a.isAllocated && a.emptyValue == T(0)) {
+			continue;
+		}
+
+		if(!d.isAllocated && d.emptyValue == T(0)) {
+			std::swap(d.isAllocated, a.isAllocated);
+			std::swap(d.emptyValue, a.emptyValue);
+			d.data.swap(a.data);
+			continue;
+		}
+
+		if(!d.isAllocated) {
+			d.resize(n);
+		}
+
+		// A uniform block of the part was written entirely by it
+		if(!a.isAllocated) {
+			std::fill(d.data.begin(), d.data.end(), a.emptyValue);
+			continue;
+		}
+
+		for(int k = 0; k < n; k++) {
+			if(a.data[k] != T(0)) {
+				d.data[k] = a.data[k];
+			}
+		}
+	}
+
+	src.clear(T(0));
+	src.m_bSummariesValid = false;
+}
+
+/*!
+ * @brief Returns all voxels of block (@a bi, @a bj, @a bk)
+ *
+ * The block is blockSize() planes of blockSize()*blockSize() values. Paged
+ * fields copy it to @a scratch (same size) first. An unallocated block
+ * returns NULL and its value in @a value.
+ */
+template<typename T> const T* DifField<T>::blockData(int bi, int bj, int bk, T* scratch, T& value) const {
+	const int order = _DIF_TYPE::blockOrder();
+	const int plane = 1 << order << order;
+
+	if(isPaged()) {
+		std::fill(scratch, scratch + (plane << order), T(0));
+
+		for(int k = 0; k < (1 << order); k++) {
+			T v = T(0);
+
+			if(!blockPlane(bi, bj, (bk << order) + k, scratch + k * plane, v)) {
+				std::fill(scratch + k * plane, scratch + (k + 1) * plane, v);
+			}
+		}
+
+		return scratch;
+	}
+
+	const Block& block = _DIF_TYPE::m_blocks[blockIndex(bi, bj, bk)];
+
+	if(!block.isAllocated) {
+		value = block.emptyValue;
+		return NULL;
+	}
+
+	return &block.data[0];
+}
+
+/*!
+ * @brief Replaces block (@a bi, @a bj, @a bk)
+ *
+ * The field must already have grown to the block's depths.
+ *
+ * @param[in] data  blockSize()^3 values as returned by blockData(), NULL for a uniform block
+ * @param[in] value Value of a uniform block
+ */
+template<typename T> void DifField<T>::assignBlock(int bi, int bj, int bk, const T* data, T value) {
+	const int order = _DIF_TYPE::blockOrder();
+	const int n     = 1 << order << order << order;
+
+	m_bSummariesValid = false;
+
+	if(isPaged()) {
+		return;
+	}
+
+	Block& block = _DIF_TYPE::m_blocks[blockIndex(bi, bj, bk)];
+
+	if(!data) {
+		std::vector<T>().swap(block.data);
+
+		block.isAllocated = false;
+		block.emptyValue  = value;
+	} else {
+		if(!block.isAllocated) {
+			block.resize(n);
+		}
+
+		std::copy(data, data + n, block.data.begin());
+	}
+
+	if(!m_bHasData) {
+		m_bHasData = true;
+	}
+}
+
+/*!
+ * @brief Returns the voxels of block (@a bi, @a bj) at depth index @a dpt
+ *
+ * The plane is blockSize()*blockSize() values, row by row. Paged fields copy
+ * it to @a scratch (same size) first. An unallocated block, or a depth index
+ * the field has not grown to, returns NULL and its value in @a value.
+ */
+template<typename T> const T* DifField<T>::blockPlane(int bi, int bj, unsigned int dpt, T* scratch, T& value) const {
+	const int order = _DIF_TYPE::blockOrder();
+	const int size  = 1 << order;
+
+	if((int)dpt >= depth()) {
+		value = T(0);
+		return NULL;
+	}
+
+	if(isPaged()) {
+		const int x0 = bi << order;
+		const int y0 = bj << order;
+		const int w  = std::min(size, m_vSize.x - x0);
+		const int h  = std::min(size, m_vSize.y - y0);
+
+		for(int j = 0; j < h; j++) {
+			readSpan(V2i(x0, y0 + j), dpt, w, scratch + (j << order));
+		}
+
+		return scratch;
+	}
+
+	const Block& block = _DIF_TYPE::m_blocks[blockIndex(bi, bj, dpt >> order)];
+
+	if(!block.isAllocated) {
+		value = block.emptyValue;
+		return NULL;
+	}
+
+	return &block.data[(dpt & (size - 1)) << order << order];
+}
+
+/*!
+ * @brief Reads the given depth indices of a single pixel
+ *
+ * The block is only looked up again when a depth index leaves the current one.
+ *
+ * @param[in]  pos    The pixel (must lie inside the field)
+ * @param[in]  slices @a count depth indices to read
+ * @param[in]  count  Number of depth indices
+ * @param[out] data   Destination
+ * @param[in]  stride Distance between two values in @a data
+ */
+template<typename T> void DifField<T>::readColumn(const V2i& pos, const unsigned int* slices, unsigned int count, T* data, int stride) const {
+	const int order = _DIF_TYPE::blockOrder();
+	const int mask  = (1 << order) - 1;
+
+	const int bi = pos.x >> order;
+	const int bj = pos.y >> order;
+	const int offset = ((pos.y & mask) << order) + (pos.x & mask);
+
+	if(isPaged()) {
+		boost::mutex::scoped_lock lock(pageMutex());
+
+		for(unsigned int i = 0; i < count; i++) {
+			data[i * stride] = _DIF_TYPE::fastValue(pos.x, pos.y, slices[i]);
+		}
+
+		return;
+	}
+
+	const Block* block = NULL;
+	int current = -1;
+
+	for(unsigned int i = 0; i < count; i++) {
+		int bk = slices[i] >> order;
+
+		if(bk != current) {
+			block   = &_DIF_TYPE::m_blocks[blockIndex(bi, bj, bk)];
+			current = bk;
+		}
+
+		data[i * stride] = block->isAllocated ? block->data[((slices[i] & mask) << order << order) + offset] : block->emptyValue;
+	}
+}
+
+/*!
+ * @brief Releases allocated blocks that hold a single value only
+ *
+ * Such a block is turned back into an unallocated block whose empty value is
+ * that value, which is cheaper to keep in memory and to write to disk.
+ *
+ * @return The number of released blocks
+ */
+template<typename T> unsigned int DifField<T>::compact() {
+	unsigned int released = 0;
+
+	if(isPaged()) {
+		return released;
+	}
+
+	for(size_t i = 0; i < _DIF_TYPE::m_blocks.size(); i++) {
+		Block& block = _DIF_TYPE::m_blocks[i];
+
+		if(!block.isAllocated || block.data.empty()) {
+			continue;
+		}
+
+		const T first = block.data[0];
+		size_t j = 1;
+
+		for(; j < block.data.size(); j++) {
+			if(block.data[j] != first) {
+				break;
+			}
+		}
+
+		if(j == block.data.size()) {
+			std::vector<T>().swap(block.data);
+
+			block.isAllocated = false;
+			block.emptyValue  = first;
+
+			++released;
+		}
+	}
+
+	return released;
+}
+
+/*!
+ * @brief Returns bounds of the values of block (@a bi, @a bj, @a bk)
+ *
+ * The bounds are built from the blocks on first use and widened by every
+ * writeSpan() and writePixel() after that, so they may be wider than the
+ * values actually left in a block but never narrower. Other changes to the
+ * blocks have them rebuilt on the next call. Writes through the SparseField
+ * interface bypass this and need invalidateSummaries(). Building the bounds of
+ * a paged field reads all of its blocks once.
+ *
+ * @param[out] min Lower bound
+ * @param[out] max Upper bound
+ * @return false if the block lies outside the field, which reads as 0 there
+ */
+template<typename T> bool DifField<T>::blockSummary(int bi, int bj, int bk, T& min, T& max) const {
+	const V3i& res = _DIF_TYPE::m_blockRes;
+
+	if(bi < 0 || bj < 0 || bk < 0 || bi >= res.x || bj >= res.y || bk >= res.z) {
+		min = max = T(0);
+		return false;
+	}
+
+	if(!m_bSummariesValid) {
+		updateSummaries();
+	}
+
+	const std::pair<T, T>& bounds = m_lSummaries[blockIndex(bi, bj, bk)];
+
+	min = bounds.first;
+	max = bounds.second;
+
+	return true;
+}
+
+/// Has the bounds of blockSummary() rebuilt on the next call
+template<typename T> void DifField<T>::invalidateSummaries() {
+	m_bSummariesValid = false;
+}
+
+/// Rebuilds the bounds of every block, see blockSummary()
+/* Protected */ template<typename T> void DifField<T>::updateSummaries() const {
+	boost::mutex::scoped_lock lock(m_mSummaryMutex);
+
+	if(m_bSummariesValid) {
+		return;
+	}
+
+	m_lSummaries.resize(_DIF_TYPE::m_blocks.size());
+
+	for(size_t i = 0; i < m_lSummaries.size(); i++) {
+		summarise(i);
+	}
+
+	m_bSummariesValid = true;
+}
+
+/// Computes the bounds of block @a i from its values
+/* Protected */ template<typename T> void DifField<T>::summarise(size_t i) const {
+	const Block& block = _DIF_TYPE::m_blocks[i];
+	std::pair<T, T>& bounds = m_lSummaries[i];
+
+	const T* data = NULL;
+	size_t count  = 0;
+	std::vector<T> scratch;
+
+	if(isPaged()) {
+		const V3i& res  = _DIF_TYPE::m_blockRes;
+		const int order = _DIF_TYPE::blockOrder();
+		T value;
+
+		scratch.resize(1 << order << order << order);
+		data  = blockData(i % res.x, (i / res.x) % res.y, i / _DIF_TYPE::m_blockXYSize, &scratch[0], value);
+		count = scratch.size();
+	} else if(block.isAllocated) {
+		data  = &block.data[0];
+		count = block.data.size();
+	}
+
+	if(!data || count == 0) {
+		bounds.first = bounds.second = block.emptyValue;
+		return;
+	}
+
+	bounds.first = bounds.second = data[0];
+
+	for(size_t j = 1; j < count; j++) {
+		if(data[j] < bounds.first) {
+			bounds.first = data[j];
+		}
+
+		if(data[j] > bounds.second) {
+			bounds.second = data[j];
+		}
+	}
+}
+
+/*!
+ * @brief Determines whether the blocks are paged in from a file on demand
+ *
+ * That is the case for fields read while SparseFileManager limits the memory
+ * use (see DifImage::eOutOfCore). Such fields are read only.
+ */
+template<typename T> bool DifField<T>::isPaged() const {
+	return (_DIF_TYPE::m_fileManager != NULL);
+}
+
+/// Returns the position of block (@a bi, @a bj, @a bk) in the block list
+/* Protected */ template<typename T> int DifField<T>::blockIndex(int bi, int bj, int bk) const {
+	return bk * _DIF_TYPE::m_blockXYSize + bj * _DIF_TYPE::m_blockRes.x + bi;
+}
+
+/*!
+ * @brief Interpolates @a count voxels at offsets @a offa / @a offb of two blocks
+ *
+ * Unallocated blocks take part with their empty value.
+ */
+/* Protected */ template<typename T> void DifField<T>::lerpRun(const Block& a, int offa, const Block& b, int offb, float t, int count, T* data) const {
+	if(a.isAllocated && b.isAllocated) {
+		DifKernel<T>::lerp(&a.data[offa], &b.data[offb], t, data, count);
+	} else if(a.isAllocated) {
+		DifKernel<T>::scaleAdd(&a.data[offa], 1.0f - t, b.emptyValue, t, data, count);
+	} else if(b.isAllocated) {
+		DifKernel<T>::scaleAdd(&b.data[offb], t, a.emptyValue, 1.0f - t, data, count);
+	} else {
+		std::fill(data, data + count, T(Imath::lerp(a.emptyValue, b.emptyValue, t)));
+	}
+}
+
+/// Returns the lock guarding @a block while writes are concurrent
+/* Protected */ template<typename T> boost::mutex& DifField<T>::blockMutex(const Block& block) {
+	static boost::mutex stripes[64];
+
+	return stripes[(reinterpret_cast<size_t>(&block) / sizeof(Block)) % 64];
+}
+
+/*!
+ * @brief Returns the lock serialising reads of paged fields
+ *
+ * Field3D's dynamic block loading is not safe for concurrent access in every
+ * version. Every paged field loads and evicts its blocks through the one
+ * SparseFileManager of the process, so they all share this lock.
+ */
+/* Protected */ template<typename T> boost::mutex& DifField<T>::pageMutex() const {
+	return difPageMutex();
+}
+
+/* Protected */ template<typename T> void DifField<T>::sizeChanged() {
+	m_vSize = _DIF_TYPE::dataResolution();
+	m_bSummariesValid = false;
+
+	_DIF_TYPE::sizeChanged();
+}
+
+/*!
+ * @brief The blocks of a DifField converted to a narrower DifStorage
+ *
+ * Uniform blocks keep their value as T, the others their voxels converted
+ * with difPack(). readPixel() converts single values back, unpack() the
+ * whole field. The blocks can't be written, so one packed field may be
+ * shared by several images.
+ */
+template<typename T> class DifPackedField {
+	public:
+		typedef boost::shared_ptr<DifPackedField> Ptr;
+
+		DifPackedField(const DifField<T>& field, enum DifStorage storage);
+
+		T readPixel(const V2i& pos, unsigned int dpt) const;
+		int depth() const;
+
+		enum DifStorage storage() const;
+		size_t memorySize() const;
+
+		DifField<T>* unpack() const;
+
+	private:
+		struct Block {
+			T value;
+			std::vector<unsigned char> data;
+		};
+
+		V3i m_vSize;
+		V3i m_vBlockRes;
+		int m_iBlockOrder;
+
+		enum DifStorage m_eStorage;
+
+		std::vector<Block> m_lBlocks;
+};
+
+/// Converts every block of @a field, paged fields are read block by block
+template<typename T> DifPackedField<T>::DifPackedField(const DifField<T>& field, enum DifStorage storage)
+	: m_vSize(field.getSize()), m_vBlockRes(field.blockRes()), m_iBlockOrder(field.blockOrder()), m_eStorage(storage) {
+	const int n = 1 << m_iBlockOrder << m_iBlockOrder << m_iBlockOrder;
+	const size_t width = difStorageSize(storage, sizeof(T));
+
+	std::vector<T> scratch(n);
+
+	m_lBlocks.resize(m_vBlockRes.x * m_vBlockRes.y * m_vBlockRes.z);
+
+	for(size_t i = 0; i < m_lBlocks.size(); i++) {
+		Block& block = m_lBlocks[i];
+		block.value = T(0);
+
+		const T* data = field.blockData(i % m_vBlockRes.x, (i / m_vBlockRes.x) % m_vBlockRes.y, i / m_vBlockRes.x / m_vBlockRes.y, &scratch[0], block.value);
+
+		if(data) {
+			block.data.resize(n * width);
+			difPack(storage, data, n, &block.data[0]);
+		}
+	}
+}
+
+/// Reads one voxel like DifField::readPixel(), 0 outside the field
+template<typename T> T DifPackedField<T>::readPixel(const V2i& pos, unsigned int dpt) const {
+	if(pos.x < 0 || pos.y < 0 || m_vSize.x <= pos.x || m_vSize.y <= pos.y || (unsigned int)m_vSize.z <= dpt) {
+		return T(0);
+	}
+
+	const int mask = (1 << m_iBlockOrder) - 1;
+	const Block& block = m_lBlocks[((int(dpt) >> m_iBlockOrder) * m_vBlockRes.y + (pos.y >> m_iBlockOrder)) * m_vBlockRes.x + (pos.x >> m_iBlockOrder)];
+
+	if(block.data.empty()) {
+		return block.value;
+	}
+
+	const int offset = ((int(dpt) & mask) << m_iBlockOrder << m_iBlockOrder) + ((pos.y & mask) << m_iBlockOrder) + (pos.x & mask);
+	const size_t width = difStorageSize(m_eStorage, sizeof(T));
+
+	T value;
+	difUnpack(m_eStorage, &block.data[offset * width], 1, &value);
+
+	return value;
+}
+
+template<typename T> int DifPackedField<T>::depth() const {
+	return m_vSize.z;
+}
+
+template<typename T> enum DifStorage DifPackedField<T>::storage() const {
+	return m_eStorage;
+}
+
+/// Returns the bytes held by the blocks
+template<typename T> size_t DifPackedField<T>::memorySize() const {
+	size_t bytes = m_lBlocks.size() * sizeof(Block);
+
+	for(size_t i = 0; i < m_lBlocks.size(); i++) {
+		bytes += m_lBlocks[i].data.capacity();
+	}
+
+	return bytes;
+}
+
+/// Converts the blocks back into a new DifField
+template<typename T> DifField<T>* DifPackedField<T>::unpack() const {
+	const int n = 1 << m_iBlockOrder << m_iBlockOrder << m_iBlockOrder;
+
+	DifField<T>* field = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+
+	if(field->blockOrder() != m_iBlockOrder) {
+		field->setBlockOrder(m_iBlockOrder);
+	}
+
+	if(m_vSize.z > 0) {
+		field->updateDepth(m_vSize.z - 1);
+	}
+
+	std::vector<T> data(n);
+
+	for(size_t i = 0; i < m_lBlocks.size(); i++) {
+		const Block& block = m_lBlocks[i];
+		const int bi = i % m_vBlockRes.x;
+		const int bj = (i / m_vBlockRes.x) % m_vBlockRes.y;
+		const int bk = i / m_vBlockRes.x / m_vBlockRes.y;
+
+		if(block.data.empty()) {
+			field->assignBlock(bi, bj, bk, NULL, block.value);
+		} else {
+			difUnpack(m_eStorage, &block.data[0], n, &data[0]);
+			field->assignBlock(bi, bj, bk, &data[0], T(0));
+		}
+	}
+
+	return field;
+}
+
+
+
+
+/*!
+ * @brief Per-pixel sample lists in a CSR layout
+ *
+ * Every pixel owns a contiguous run of samples: m_lOffsets[p] .. m_lOffsets[p+1]
+ * index into the slice array and into one value array per channel. A sample
+ * carries all channels and the depth index (slice) it belongs to, so memory
+ * only grows with the number of samples actually written.
+ *
+ * New samples are staged and merged into the CSR arrays by commit(), which
+ * readers call before they look at the data. Each commit rebuilds the arrays,
+ * so writes are best batched before the next read. Overwriting an existing
+ * sample is done in place. Once committed, any number of threads may read.
+ */
+template<typename T> class DifSampleList {
+	public:
+		DifSampleList(const V2i& size);
+		DifSampleList(const DifSampleList<T>& o);
+
+		const V2i& getSize() const;
+
+		void addChannel();
+		unsigned int channels() const;
+
+		unsigned int samples() const;
+		unsigned int samples(const V2i& pos) const;
+
+		void write(const V2i& pos, unsigned int slice, const T* data, int stride = 1);
+		T read(const V2i& pos, unsigned int slice, unsigned int channel) const;
+
+		void commit();
+
+		const std::vector<unsigned int>& offsets() const;
+		const std::vector<unsigned int>& slices() const;
+		const std::vector<T>& values(unsigned int channel) const;
+
+		void assign(const std::vector<unsigned int>& counts, const std::vector<unsigned int>& slices);
+		std::vector<T>& values(unsigned int channel);
+
+	private:
+		// Returns the position of @a slice in the committed samples of pixel @a p or -1
+		int find(unsigned int p, unsigned int slice) const;
+
+		V2i m_vSize;
+
+		std::vector<unsigned int>    m_lOffsets;
+		std::vector<unsigned int>    m_lSlices;
+		std::vector< std::vector<T> > m_lValues;
+
+		// Samples written since the last commit(), channels interleaved
+		struct Stage {
+			std::vector<unsigned int> pixels;
+			std::vector<unsigned int> slices;
+			std::vector<T>            values;
+
+			boost::mutex mutex;
+		};
+
+		// A pixel always stages into the same stripe, so its write order is kept
+		Stage& stage(unsigned int p);
+
+		// Orders staged samples by their pixel
+		struct PixelOrder {
+			const std::vector<unsigned int>* pixels;
+
+			bool operator()(unsigned int a, unsigned int b) const {
+				return (*pixels)[a] < (*pixels)[b];
+			}
+		};
+
+		static const unsigned int m_sculStages = 16;
+
+		Stage m_aStages[m_sculStages];
+
+		// Number of staged samples, readers only look at this before committing
+		boost::atomic<unsigned int> m_ulStaged;
+
+		mutable boost::mutex m_mMutex;
+};
+
+template<typename T> const unsigned int DifSampleList<T>::m_sculStages;
+
+template<typename T> DifSampleList<T>::DifSampleList(const V2i& size) : m_vSize(size), m_ulStaged(0) {
+	m_lOffsets.resize(size.x * size.y + 1, 0);
+}
+
+/// Copies committed and staged samples, @a o must not be written meanwhile
+template<typename T> DifSampleList<T>::DifSampleList(const DifSampleList<T>& o)
+	: m_vSize(o.m_vSize), m_lOffsets(o.m_lOffsets), m_lSlices(o.m_lSlices), m_lValues(o.m_lValues), m_ulStaged(o.m_ulStaged.load(boost::memory_order_acquire)) {
+	for(unsigned int i = 0; i < m_sculStages; i++) {
+		m_aStages[i].pixels = o.m_aStages[i].pixels;
+		m_aStages[i].slices = o.m_aStages[i].slices;
+		m_aStages[i].values = o.m_aStages[i].values;
+	}
+}
+
+template<typename T> const V2i& DifSampleList<T>::getSize() const {
+	return m_vSize;
+}
+
+/// Adds a channel, existing samples get 0 in it
+template<typename T> void DifSampleList<T>::addChannel() {
+	commit();
+
+	m_lValues.push_back(std::vector<T>(m_lSlices.size(), T(0)));
+}
+
+template<typename T> unsigned int DifSampleList<T>::channels() const {
+	return m_lValues.size();
+}
+
+/// Returns the number of samples including the ones not committed yet
+template<typename T> unsigned int DifSampleList<T>::samples() const {
+	// A concurrent commit() swaps the arrays and resets the count under this lock
+	boost::mutex::scoped_lock lock(m_mMutex);
+
+	return m_lSlices.size() + m_ulStaged.load(boost::memory_order_acquire);
+}
+
+/// Returns the number of committed samples of the pixel at @a pos
+template<typename T> unsigned int DifSampleList<T>::samples(const V2i& pos) const {
+	if(pos.x < 0 || pos.y < 0 || pos.x >= m_vSize.x || pos.y >= m_vSize.y) {
+		return 0;
+	}
+
+	unsigned int p = pos.y * m_vSize.x + pos.x;
+
+	return m_lOffsets[p + 1] - m_lOffsets[p];
+}
+
+/*!
+ * @brief Writes all channels of one sample
+ *
+ * Several threads may write distinct pixels at the same time as long as
+ * nobody calls commit() meanwhile.
+ *
+ * @param[in] pos    Pixel (ignored if outside)
+ * @param[in] slice  Depth index of the sample
+ * @param[in] data   One value per channel
+ * @param[in] stride Distance between two channel values in @a data
+ */
+template<typename T> void DifSampleList<T>::write(const V2i& pos, unsigned int slice, const T* data, int stride) {
+	if(pos.x < 0 || pos.y < 0 || pos.x >= m_vSize.x || pos.y >= m_vSize.y) {
+		return;
+	}
+
+	unsigned int p = pos.y * m_vSize.x + pos.x;
+	int idx = find(p, slice);
+
+	if(idx >= 0) {
+		for(unsigned int c = 0; c < channels(); c++) {
+			m_lValues[c][idx] = data[c * stride];
+		}
+
+		return;
+	}
+
+	Stage& st = stage(p);
+	boost::mutex::scoped_lock lock(st.mutex);
+
+	st.pixels.push_back(p);
+	st.slices.push_back(slice);
+
+	for(unsigned int c = 0; c < channels(); c++) {
+		st.values.push_back(data[c * stride]);
+	}
+
+	m_ulStaged.fetch_add(1, boost::memory_order_release);
+}
+
+/*!
+ * @brief Reads a single channel of a sample
+ *
+ * Pixels without a sample at @a slice read as 0. Staged samples are only
+ * visible after commit().
+ */
+template<typename T> T DifSampleList<T>::read(const V2i& pos, unsigned int slice, unsigned int channel) const {
+	if(pos.x < 0 || pos.y < 0 || pos.x >= m_vSize.x || pos.y >= m_vSize.y || channel >= channels()) {
+		return T(0);
+	}
+
+	int idx = find(pos.y * m_vSize.x + pos.x, slice);
+
+	return (idx >= 0) ? m_lValues[channel][idx] : T(0);
+}
+
+/*!
+ * @brief Merges the staged samples into the CSR arrays
+ *
+ * Only the pixels with staged samples are merged, the runs of the others are
+ * copied in bulk. The arrays are still rebuilt, so a commit with staged
+ * samples costs O(pixels + samples): reading after every write pays it each
+ * time, writing a whole batch first pays it once.
+ *
+ * Samples written twice keep the last value. Safe to call from several
+ * threads, only one of them does the merge and the others wait for it.
+ * Without staged samples this is a single atomic load.
+ */
+template<typename T> void DifSampleList<T>::commit() {
+	// Pairs with the release store below: seeing 0 means the merged arrays are visible
+	if(m_ulStaged.load(boost::memory_order_acquire) == 0) {
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(m_mMutex);
+
+	// Somebody else committed meanwhile
+	if(m_ulStaged.load(boost::memory_order_acquire) == 0) {
+		return;
+	}
+
+	// Gather the stripes, each pixel's samples stay in write order
+	std::vector<unsigned int> stagedPixels;
+	std::vector<unsigned int> stagedSlices;
+	std::vector<T>            stagedValues;
+
+	for(unsigned int i = 0; i < m_sculStages; i++) {
+		Stage& st = m_aStages[i];
+		boost::mutex::scoped_lock stageLock(st.mutex);
+
+		stagedPixels.insert(stagedPixels.end(), st.pixels.begin(), st.pixels.end());
+		stagedSlices.insert(stagedSlices.end(), st.slices.begin(), st.slices.end());
+		stagedValues.insert(stagedValues.end(), st.values.begin(), st.values.end());
+
+		std::vector<unsigned int>().swap(st.pixels);
+		std::vector<unsigned int>().swap(st.slices);
+		std::vector<T>().swap(st.values);
+	}
+
+	if(stagedSlices.empty()) {
+		return;
+	}
+
+	const unsigned int staged   = stagedSlices.size();
+	const unsigned int pixels   = m_vSize.x * m_vSize.y;
+	const unsigned int nchannel = channels();
+
+	// Group the staged samples by pixel, keeping their write order
+	std::vector<unsigned int> order(staged);
+
+	for(unsigned int i = 0; i < staged; i++) {
+		order[i] = i;
+	}
+
+	PixelOrder byPixel;
+	byPixel.pixels = &stagedPixels;
+
+	std::stable_sort(order.begin(), order.end(), byPixel);
+
+	std::vector<unsigned int>     offsets(pixels + 1, 0);
+	std::vector<unsigned int>     slices;
+	std::vector< std::vector<T> > values(nchannel);
+
+	slices.reserve(m_lSlices.size() + staged);
+
+	for(unsigned int c = 0; c < nchannel; c++) {
+		values[c].reserve(m_lSlices.size() + staged);
+	}
+
+	// Per pixel: (slice, source) where source < 0 is committed sample -source-1
+	std::vector< std::pair<unsigned int, int> > merged;
+
+	unsigned int from  = 0; // First pixel not taken over yet
+	unsigned int shift = 0; // Samples added to the pixels before it
+
+	for(unsigned int g = 0; from < pixels; ) {
+		const unsigned int p = (g < staged) ? stagedPixels[order[g]] : pixels;
+
+		// Runs of untouched pixels are copied as they are and only move
+		slices.insert(slices.end(), m_lSlices.begin() + m_lOffsets[from], m_lSlices.begin() + m_lOffsets[p]);
+
+		for(unsigned int c = 0; c < nchannel; c++) {
+			values[c].insert(values[c].end(), m_lValues[c].begin() + m_lOffsets[from], m_lValues[c].begin() + m_lOffsets[p]);
+		}
+
+		for(unsigned int q = from; q < p; q++) {
+			offsets[q + 1] = m_lOffsets[q + 1] + shift;
+		}
+
+		if(p == pixels) {
+			break;
+		}
+
+		merged.clear();
+
+		for(unsigned int i = m_lOffsets[p]; i < m_lOffsets[p + 1]; i++) {
+			merged.push_back(std::make_pair(m_lSlices[i], -(int)i - 1));
+		}
+
+		for(; g < staged && stagedPixels[order[g]] == p; g++) {
+			unsigned int s = order[g];
+			size_t j = 0;
+
+			for(; j < merged.size(); j++) {
+				if(merged[j].first == stagedSlices[s]) {
+					merged[j].second = s;
+					break;
+				}
+			}
+
+			if(j == merged.size()) {
+				merged.push_back(std::make_pair(stagedSlices[s], (int)s));
+			}
+		}
+
+		std::sort(merged.begin(), merged.end());
+
+		for(size_t j = 0; j < merged.size(); j++) {
+			slices.push_back(merged[j].first);
+
+			for(unsigned int c = 0; c < nchannel; c++) {
+				int src = merged[j].second;
+
+				values[c].push_back((src < 0) ? m_lValues[c][-src - 1] : stagedValues[src * nchannel + c]);
+			}
+		}
+
+		offsets[p + 1] = slices.size();
+
+		shift = slices.size() - m_lOffsets[p + 1];
+		from  = p + 1;
+	}
+
+	m_lOffsets.swap(offsets);
+	m_lSlices.swap(slices);
+	m_lValues.swap(values);
+
+	m_ulStaged.store(0, boost::memory_order_release);
+}
+
+/// Offsets of the pixels' sample runs (pixels+1 entries)
+template<typename T> const std::vector<unsigned int>& DifSampleList<T>::offsets() const {
+	return m_lOffsets;
+}
+
+/// Depth index of every committed sample
+template<typename T> const std::vector<unsigned int>& DifSampleList<T>::slices() const {
+	return m_lSlices;
+}
+
+/// Values of every committed sample in one channel
+template<typename T> const std::vector<T>& DifSampleList<T>::values(unsigned int channel) const {
+	return m_lValues[channel];
+}
+
+template<typename T> std::vector<T>& DifSampleList<T>::values(unsigned int channel) {
+	return m_lValues[channel];
+}
+
+/*!
+ * @brief Replaces the samples by @a counts samples per pixel with the given slices
+ *
+ * The values of all channels are reset to 0 and can be filled through values().
+ */
+template<typename T> void DifSampleList<T>::assign(const std::vector<unsigned int>& counts, const std::vector<unsigned int>& slices) {
+	for(unsigned int i = 0; i < m_sculStages; i++) {
+		std::vector<unsigned int>().swap(m_aStages[i].pixels);
+		std::vector<unsigned int>().swap(m_aStages[i].slices);
+		std::vector<T>().swap(m_aStages[i].values);
+	}
+
+	m_ulStaged.store(0, boost::memory_order_release);
+
+	m_lOffsets.assign(m_vSize.x * m_vSize.y + 1, 0);
+
+	for(size_t p = 0; p < counts.size() && p + 1 < m_lOffsets.size(); p++) {
+		m_lOffsets[p + 1] = m_lOffsets[p] + counts[p];
+	}
+
+	m_lSlices = slices;
+	m_lSlices.resize(m_lOffsets.back(), 0);
+
+	for(unsigned int c = 0; c < channels(); c++) {
+		m_lValues[c].assign(m_lSlices.size(), T(0));
+	}
+}
+
+/* Private */ template<typename T> typename DifSampleList<T>::Stage& DifSampleList<T>::stage(unsigned int p) {
+	return m_aStages[(p >> 4) % m_sculStages];
+}
+
+template<typename T> int DifSampleList<T>::find(unsigned int p, unsigned int slice) const {
+	for(unsigned int i = m_lOffsets[p]; i < m_lOffsets[p + 1]; i++) {
+		if(m_lSlices[i] == slice) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+
+template<typename T> class DifStreamWriter;
+template<typename T> class DifMappedImage;
+template<typename T> class DifDepthPyramid;
+
+/*!
+ * @brief A deep image: one DifField (or sample list) per channel over shared depths
+ *
+ * All const members can be called from any number of threads at the same
+ * time without locking, as long as nobody calls a non-const member
+ * meanwhile. Lazy channels are decoded on first access under a reader/writer
+ * lock, paged (eOutOfCore) channels look their blocks up under one lock
+ * for the process and sample lists commit pending samples once. For writes from several
+ * threads see beginConcurrentWrites().
+ */
+template<typename T> class DifImage {
+	public:
+		typedef boost::intrusive_ptr<DifImage> Ptr;
+
+		enum DifImageStorage {
+			eDense   = 0,
+			eSamples = 1
+		};
+
+		DifImage(const V2i& size, enum DifImageStorage storage = eDense);
+		DifImage(const DifImage<T>& o);
+		~DifImage();
+
+		DifImage& operator=(const DifImage<T>& o);
+
+		enum DifImageStorage storage() const;
+		unsigned int numberOfSamples() const;
+
+		bool addChannel(const std::string& name, const DifField<T>& i, unsigned int& retid);
+		bool addChannel(const std::string& name, typename SparseField<T>::Ptr field, unsigned int& retid);
+		bool addChannel(const std::string& name, unsigned int& retid);
+
+		bool swap(DifImage<T>& o);
+
+		unsigned int numberOfChannels() const;
+
+		enum DifImageLoadMode {
+			eEager     = 0,
+			eLazy      = 1,
+			eOutOfCore = 2
+		};
+
+		void save(Field3DOutputFile& ofp);
+		bool load(Field3DInputFile& ifp);
+		bool load(Field3DInputFile& ifp, const std::vector<std::string>& channels, enum DifImageLoadMode mode = eEager);
+
+		bool saveMapped(const std::string& path);
+		bool load(const DifMappedImage<T>& map);
+
+		bool setChannelCodec(unsigned int channelid, enum DifCodec codec);
+		enum DifCodec channelCodec(unsigned int channelid) const;
+
+		bool setChannelStorage(unsigned int channelid, enum DifStorage storage);
+		enum DifStorage channelStorage(unsigned int channelid) const;
+
+		bool isLazy() const;
+		bool isOutOfCore() const;
+		void resolveChannels();
+
+		unsigned int packChannels();
+		void unpackChannels();
+		bool isPacked(unsigned int channelid) const;
+		bool isPacked() const;
+
+		unsigned int threads() const;
+		void setThreads(unsigned int threads);
+
+		bool beginConcurrentWrites(unsigned int capacity);
+		void endConcurrentWrites();
+		bool concurrentWrites() const;
+
+		const std::string& channelName(unsigned int idx) const;
+		unsigned int channelIndex(const std::string& name, bool *retval=0) const;
+
+		float depthAtIndex(unsigned int idx, bool* retval = 0) const;
+		float depthAtSortedIndex(unsigned int idx) const;
+		unsigned int indexAtDepth(float dpt, bool* retval = 0) const;
+		
+		void addDepth(float dpt, bool sync=true);
+		bool addDepths(const std::vector<float>& depths);
+		bool reserveDepths(unsigned int count);
+
+		bool resampleDepths(const std::vector<float>& depths);
+		bool resampleDepths(const std::vector<float>& depths, DifImage<T>& dst) const;
+
+		bool merge(const DifImage<T>& image);
+		bool merge(const std::vector<const DifImage<T>*>& images);
+
+		bool holdout(const DifImage<T>& matte, DifImage<T>& dst, const std::string& alpha = "a") const;
+
+		float depthTolerance() const;
+		void setDepthTolerance(float tolerance);
+
+		bool validChannelId(unsigned int id) const;
+
+		bool hasChannel(const std::string& name) const;
+
+		unsigned int depthLevels() const;
+
+		enum DifImageInterpolation {
+			eNone     = 0,
+			eLinear   = 1
+		};
+
+		enum DifImageLayout {
+			eInterleaved = 0,
+			ePlanar      = 1
+		};
+
+		// data must be at least sizeof(T)*numberOfChannels()
+		void writeData(const V2i& pos, float depth, T* data);
+
+		bool writeTile(const V2i& origin, const V2i& size, float depth, const T* data, enum DifImageLayout layout = eInterleaved);
+		bool writeTile(const V2i& origin, const V2i& size, const float* depths, const T* data, enum DifImageLayout layout = eInterleaved);
+		bool writeScanline(const V2i& pos, int width, float depth, const T* data, enum DifImageLayout layout = eInterleaved);
+		bool readData(const V2i& pos, float depth, T *buffer, enum DifImageInterpolation type = eLinear) const;
+
+		bool readTile(const V2i& origin, const V2i& size, float depth, T* data, enum DifImageInterpolation type = eLinear, enum DifImageLayout layout = eInterleaved) const;
+		unsigned int readDepthColumn(const V2i& pos, T* data, float* depths = 0) const;
+
+		bool flatten(T* data, const std::string& alpha = "a", enum DifImageLayout layout = eInterleaved) const;
+
+		bool firstHit(unsigned int channelid, float* depths, T threshold = T(0)) const;
+		bool lastHit(unsigned int channelid, float* depths, T threshold = T(0)) const;
+		bool coverage(unsigned int channelid, unsigned char* mask, T threshold = T(0)) const;
+		unsigned int occupiedBlocks(unsigned int channelid, std::vector<V3i>& blocks) const;
+
+		bool readChannelData(unsigned int channelid, const V2i& pos, float depth, T& retval, enum DifImageInterpolation type = eLinear) const;
+		bool readChannelData(const std::string& channelname, const V2i& pos, float depth, T& retval, enum DifImageInterpolation type = eLinear) const;
+
+		enum DifImageGetType {
+			eBefore,
+			eAfter
+		};
+
+		bool getNearestDepthIndex(float dpt, enum DifImageGetType type, unsigned int& retid) const;
+		bool depthBracket(float dpt, unsigned int& bfr, unsigned int& aftr, float& t) const;
+
+#ifndef _NEXCEPTIONS
+		bool exceptionsEnabled() const;
+		void setExceptionsEnabled(bool yorn);
+
+		
+		class DifException : public std::exception {
+			public:
+				DifException(const std::string& what) throw() : m_sWhat(what) {}
+				~DifException() throw() {}
+				virtual const char* what() const throw() {return m_sWhat.c_str();}
+			private:
+				std::string m_sWhat;
+		};
+
+		#define _THROW(what) \
+			if(m_bExceptionsEnabled) {\
+				throw DifException(#what);\
+			}
+#else
+		#define _THROW(what)
+#endif //_NEXCEPTIONS
+
+	protected:
+		void loadDepthMapping(const SparseField<float>::Ptr field);
+		void assignDepths(const std::vector<float>& depths);
+		void resampleChannels(const std::vector<float>& depths, std::vector<typename DifField<T>::Ptr>& targets) const;
+		unsigned int insertDepth(float dpt, bool* added = 0);
+		void growChannels(unsigned int depths);
+		unsigned int sortedDepthPosition(float dpt) const;
+		bool clipTile(const V2i& origin, const V2i& size, V2i& min, V2i& max) const;
+		bool resolveRead(float depth, enum DifImageInterpolation type, unsigned int& bfr, unsigned int& aftr, float& t, bool& lerp) const;
+		bool findHits(unsigned int channelid, T threshold, float* depths, unsigned char* mask, bool last, const V2i& min, const V2i& max) const;
+
+		void readSamples(const V2i& pos, unsigned int bfr, unsigned int aftr, float t, bool lerp, T* data, int stride, unsigned int first, unsigned int count) const;
+		void saveDepthMapping(Field3DOutputFile& ofp);
+		void saveSamples(Field3DOutputFile& ofp);
+		bool loadSamples(Field3DInputFile& ifp, const std::vector<std::string>& channels);
+		bool saveEncoded(Field3DOutputFile& ofp, unsigned int channelid);
+		DifField<T>* decodeChannel(const SparseField<float>& payload) const;
+		void adoptCodec(unsigned int channelid, DifField<T>* field) const;
+		static bool isEncoded(const FieldRes& layer);
+	
+		DifField<T>* getField(unsigned int channelid);
+		const DifField<T>* getField(unsigned int channelid) const;
+		DifField<T>* resolveChannel(unsigned int channelid) const;
+		const DifPackedField<T>* packedChannel(unsigned int channelid) const;
+		void decodePackedChannels(std::vector<unsigned int>& decoded);
+		void releaseChannels(const std::vector<unsigned int>& decoded);
+		bool writeMapped(const std::string& path);
+		DifField<T>* readChannel(Field3DInputFile& ifp, const std::string& name) const;
+		DifField<T>* combineParts(const typename Field<T>::Vec& fields, const Field<float>::Vec& payloads, const std::string& name) const;
+		void registerChannel(const std::string& name, DifField<T>* field, unsigned int& retid);
+		
+	private:
+		friend class DifStreamWriter<T>;
+		friend class DifDepthPyramid<T>;
+
+		// Channels are indexed by their id, names are only resolved through m_lChannelIndex
+		typedef std::vector<typename DifField<T>::Ptr> ChannelList;
+		typedef std::vector<std::string> ChannelNameList;
+		typedef boost::unordered_map<std::string, unsigned int> ChannelIndexMap;
+		typedef typename ChannelIndexMap::const_iterator ChannelIndexMapConstIter;
+
+		// Lazily loaded channels stay NULL until their first access
+		mutable ChannelList m_lChannels;
+		ChannelNameList     m_lChannelNames;
+		ChannelIndexMap     m_lChannelIndex;
+
+		// Codec and storage type save() uses per channel, taken over from the file by load()
+		typedef std::vector<enum DifCodec> CodecList;
+		typedef std::vector<enum DifStorage> StorageList;
+		mutable CodecList   m_lChannelCodecs;
+		mutable StorageList m_lChannelStorages;
+
+		// Channels packChannels() keeps in their storage type, their DifField
+		// stays NULL until a read other than readData() needs it
+		typedef std::vector<typename DifPackedField<T>::Ptr> PackedChannelList;
+		PackedChannelList m_lPackedChannels;
+		bool              m_bPacked;
+
+		// File the lazy channels are decoded from, NULL once everything is loaded
+		Field3DInputFile    *m_pLazyFile;
+		mutable boost::shared_mutex m_mLazyMutex;
+
+		// Channels are paged in by SparseFileManager and can't be written to
+		bool m_bOutOfCore;
+
+		// Sample list storage, channels have no DifField then
+		boost::shared_ptr< DifSampleList<T> > m_pSamples;
+
+		// Between beginConcurrentWrites() and endConcurrentWrites() the depth
+		// registry is locked and can't grow past m_ulDepthCapacity
+		bool m_bConcurrentWrites;
+		unsigned int m_ulDepthCapacity;
+		boost::shared_mutex m_mDepthMutex;
+	
+		typedef std::vector<float> DepthMappingList;
+		typedef std::vector<float>::iterator DepthMappingListIter;
+		typedef std::vector<float>::const_iterator DepthMappingListConstIter;
+		typedef std::vector<unsigned int> DepthOrderList;
+
+		// Depths in storage order, i.e. m_lDepthMapping[i] is the depth of slice i
+		DepthMappingList m_lDepthMapping;
+
+		// The same depths sorted ascending and the storage index of each of them
+		DepthMappingList m_lSortedDepths;
+		DepthOrderList   m_lDepthOrder;
+
+		float m_fDepthTolerance;
+
+		unsigned int m_ulThreads;
+
+		// Work items for DifParallelFor
+		struct CompactChannel {
+			ChannelList* channels;
+
+			void operator()(unsigned int i) {
+				(*channels)[i]->compact();
+			}
+		};
+
+		struct PackChannel {
+			ChannelList*       channels;
+			PackedChannelList* packed;
+			const StorageList* storages;
+
+			void operator()(unsigned int i) {
+				if((*storages)[i] != eDifStorageNative && (*channels)[i]) {
+					(*packed)[i].reset(new DifPackedField<T>(*(*channels)[i], (*storages)[i]));
+					(*channels)[i] = typename DifField<T>::Ptr();
+				}
+			}
+		};
+
+		struct GrowChannel {
+			ChannelList* channels;
+			unsigned int depths;
+
+			void operator()(unsigned int i) {
+				(*channels)[i]->updateDepth(depths - 1);
+			}
+		};
+
+		struct ConvertChannel {
+			std::vector<SparseField<T>*>* sources;
+			std::vector<DifField<T>*>*    targets;
+
+			void operator()(unsigned int i) {
+				if(!(*targets)[i]) {
+					DifField<T>* field = new DifField<T>(V2i(0, 0));
+
+					field->adopt(*(*sources)[i]);
+					(*targets)[i] = field;
+				}
+			}
+		};
+
+		// Encodes one block of a channel, see saveEncoded()
+		struct EncodeBlocks {
+			const DifField<T>* field;
+			enum DifCodec codec;
+			enum DifStorage storage;
+			std::vector<std::vector<unsigned char> >* encoded;
+			std::vector<DifCodecBlock>* table;
+
+			void operator()(unsigned int i) {
+				const V3i res   = field->blockRes();
+				const int order = field->blockOrder();
+				const int plane = 1 << order << order;
+				const int n     = plane << order;
+
+				std::vector<T> scratch(n);
+				T value = T(0);
+				const T* data = field->blockData(i % res.x, (i / res.x) % res.y, i / res.x / res.y, &scratch[0], value);
+
+				DifCodecBlock& entry = (*table)[i];
+				std::vector<unsigned char>& out = (*encoded)[i];
+
+				memset(&entry, 0, sizeof(entry));
+
+				if(!data) {
+					difPack(storage, &value, 1, entry.value);
+					return;
+				}
+
+				const size_t width = difStorageSize(storage, sizeof(T));
+				const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+				std::vector<unsigned char> packed;
+
+				if(storage != eDifStorageNative) {
+					packed.resize(n * width);
+					difPack(storage, data, n, &packed[0]);
+					bytes = &packed[0];
+				}
+
+				difEncode(codec, bytes, n, width, plane, out);
+				entry.codec = codec;
+
+				// Data that doesn't compress is kept as is
+				if(out.size() >= n * width) {
+					out.assign(bytes, bytes + n * width);
+					entry.codec = eDifCodecNone;
+				}
+
+				entry.size = out.size();
+			}
+		};
+
+		// Decodes one block of a channel, see decodeChannel()
+		struct DecodeBlocks {
+			const unsigned char* payload;
+			size_t size;
+			enum DifStorage storage;
+			DifField<T>* field;
+			std::vector<char>* failed;
+
+			void operator()(unsigned int i) {
+				const V3i res   = field->blockRes();
+				const int order = field->blockOrder();
+				const int plane = 1 << order << order;
+				const int n     = plane << order;
+				const size_t tableSize = sizeof(DifCodecBlock) * res.x * res.y * res.z;
+
+				DifCodecBlock entry;
+				memcpy(&entry, payload + i * sizeof(DifCodecBlock), sizeof(entry));
+
+				const int bi = i % res.x;
+				const int bj = (i / res.x) % res.y;
+				const int bk = i / res.x / res.y;
+
+				if(entry.size == 0) {
+					T value;
+					difUnpack(storage, entry.value, 1, &value);
+					field->assignBlock(bi, bj, bk, NULL, value);
+					return;
+				}
+
+				const size_t width = difStorageSize(storage, sizeof(T));
+				std::vector<T> data(n);
+				std::vector<unsigned char> packed;
+				unsigned char* bytes = reinterpret_cast<unsigned char*>(&data[0]);
+
+				if(storage != eDifStorageNative) {
+					packed.resize(n * width);
+					bytes = &packed[0];
+				}
+
+				if(entry.offset > size - tableSize || entry.size > size - tableSize - entry.offset ||
+						!difDecode((enum DifCodec)entry.codec, payload + tableSize + entry.offset, entry.size, n, width, plane, bytes)) {
+					(*failed)[i] = 1;
+					return;
+				}
+
+				if(storage != eDifStorageNative) {
+					difUnpack(storage, bytes, n, &data[0]);
+				}
+
+				field->assignBlock(bi, bj, bk, &data[0], T(0));
+			}
+		};
+
+		// Copies the blocks of one channel out of a mapped image
+		struct UnmapChannel {
+			const DifMappedImage<T>*   map;
+			std::vector<DifField<T>*>* targets;
+
+			void operator()(unsigned int c) {
+				DifField<T>* field = (*targets)[c];
+				const V3i res = field->blockRes();
+
+				for(int bk = 0; bk < res.z; bk++) {
+					for(int bj = 0; bj < res.y; bj++) {
+						for(int bi = 0; bi < res.x; bi++) {
+							T value = T(0);
+							const T* data = map->blockData(c, bi, bj, bk, value);
+
+							field->assignBlock(bi, bj, bk, data, value);
+						}
+					}
+				}
+			}
+		};
+
+		// Where a target depth of resampleDepths() reads from
+		struct ResampleEntry {
+			unsigned int bfr;
+			unsigned int aftr;
+			float        t;
+			bool         valid;
+		};
+
+		// One item per channel, row of blocks and block of target depths
+		struct ResampleChannel {
+			std::vector<const DifField<T>*>* sources;
+			ChannelList*                     targets;
+			std::vector<ResampleEntry>*      table;
+			unsigned int rows;
+			unsigned int slabs;
+			int          order;
+
+			void operator()(unsigned int i) {
+				unsigned int c  = i / (rows * slabs);
+				unsigned int bj = (i / slabs) % rows;
+				unsigned int bk = i % slabs;
+
+				const DifField<T>* src = (*sources)[c];
+
+				if(!src) {
+					return;
+				}
+
+				unsigned int end = std::min<unsigned int>((bk + 1) << order, table->size());
+
+				for(unsigned int k = bk << order; k < end; k++) {
+					const ResampleEntry& e = (*table)[k];
+
+					if(e.valid) {
+						(*targets)[c]->lerpFrom(*src, e.bfr, e.aftr, e.t, k, bj << order, (bj + 1) << order);
+					}
+				}
+			}
+		};
+
+		// One item per target channel and row of blocks, see merge()
+		struct MergeChannel {
+			const std::vector<std::vector<const DifField<T>*> >* sources;
+			const std::vector<std::vector<unsigned int> >*      slices;
+			ChannelList* targets;
+			unsigned int rows;
+
+			void operator()(unsigned int i) {
+				unsigned int c  = i / rows;
+				unsigned int bj = i % rows;
+
+				DifField<T>* dst = (*targets)[c].get();
+				const int order  = dst->blockOrder();
+
+				if((int)(bj << order) >= dst->getSize().y) {
+					return;
+				}
+
+				// Later images overwrite earlier ones
+				for(unsigned int k = 0; k < sources->size(); k++) {
+					const DifField<T>* src = (*sources)[k][c];
+
+					if(!src) {
+						continue;
+					}
+
+					const std::vector<unsigned int>& map = (*slices)[k];
+
+					for(unsigned int s = 0; s < map.size(); s++) {
+						dst->mergeFrom(*src, s, map[s], bj << order, (bj + 1) << order);
+					}
+				}
+			}
+		};
+
+		// Attenuates the depth columns of one block column by a matte, see holdout()
+		struct HoldoutTile {
+			const std::vector<const DifField<T>*>* sources;
+			ChannelList* targets;
+			const DifField<T>* matte;
+			const DepthOrderList* order;
+			const DepthOrderList* matteOrder;
+			const std::vector<unsigned int>* front;
+			int blockOrder;
+			int columns;
+			V2i size;
+
+			void operator()(unsigned int i) {
+				const unsigned int channels = sources->size();
+				const int bsize = 1 << blockOrder;
+				const int n     = bsize * bsize;
+
+				const int bi = i % columns;
+				const int bj = i / columns;
+				const int x0 = bi << blockOrder;
+				const int y0 = bj << blockOrder;
+				const int w  = std::min(bsize, size.x - x0);
+				const int h  = std::min(bsize, size.y - y0);
+
+				// Matte opacity accumulated in front of the current depth
+				std::vector<T> acc(n, T(0));
+				std::vector<T> scratch(n);
+				std::vector<T> row(bsize);
+
+				unsigned int m = 0;
+				int opaque = 0;
+
+				for(unsigned int k = 0; k < order->size() && opaque < w * h; k++) {
+					T lo, hi, value;
+
+					for(; m < (*front)[k]; m++) {
+						unsigned int slice = (*matteOrder)[m];
+
+						if(!matte->blockSummary(bi, bj, slice >> blockOrder, lo, hi) || (lo == T(0) && hi == T(0))) {
+							continue;
+						}
+
+						const T* plane = matte->blockPlane(bi, bj, slice, &scratch[0], value);
+
+						for(int y = 0; y < h; y++) {
+							for(int x = 0; x < w; x++) {
+								int p = (y << blockOrder) + x;
+
+								if(acc[p] >= T(1)) {
+									continue;
+								}
+
+								acc[p] += (T(1) - acc[p]) * (plane ? plane[p] : value);
+
+								if(acc[p] >= T(1)) {
+									++opaque;
+								}
+							}
+						}
+					}
+
+					if(opaque == w * h) {
+						break;
+					}
+
+					unsigned int slice = (*order)[k];
+
+					for(unsigned int c = 0; c < channels; c++) {
+						const DifField<T>* src = (*sources)[c];
+
+						// Blocks without data stay unallocated in the target
+						if(!src || !src->blockSummary(bi, bj, slice >> blockOrder, lo, hi) || (lo == T(0) && hi == T(0))) {
+							continue;
+						}
+
+						const T* plane = src->blockPlane(bi, bj, slice, &scratch[0], value);
+						DifField<T>* dst = (*targets)[c].get();
+
+						for(int y = 0; y < h; y++) {
+							for(int x = 0; x < w; x++) {
+								int p = (y << blockOrder) + x;
+
+								row[x] = (plane ? plane[p] : value) * (T(1) - acc[p]);
+							}
+
+							dst->writeSpan(V2i(x0, y0 + y), slice, w, &row[0]);
+						}
+					}
+				}
+			}
+		};
+
+		// Composites the depth columns of one block column, see flatten()
+		struct FlattenTile {
+			const std::vector<const DifField<T>*>* fields;
+			const DepthOrderList* order;
+			unsigned int alpha;
+			int blockOrder;
+			int columns;
+			V2i size;
+			T*   data;
+			bool planar;
+
+			void operator()(unsigned int i) {
+				const unsigned int channels = fields->size();
+				const int bsize = 1 << blockOrder;
+				const int n     = bsize * bsize;
+
+				const int bi = i % columns;
+				const int bj = i / columns;
+				const int x0 = bi << blockOrder;
+				const int y0 = bj << blockOrder;
+				const int w  = std::min(bsize, size.x - x0);
+				const int h  = std::min(bsize, size.y - y0);
+
+				std::vector<T> acc(n * channels, T(0));
+				std::vector<T> scratch(n * channels);
+				std::vector<const T*> planes(channels);
+				std::vector<T> values(channels);
+
+				T* opacity = &acc[alpha * n];
+				int open = w * h;
+
+				for(unsigned int k = 0; k < order->size() && open > 0; k++) {
+					unsigned int slice = (*order)[k];
+					bool blank = true;
+
+					for(unsigned int c = 0; c < channels; c++) {
+						const DifField<T>* field = (*fields)[c];
+
+						planes[c] = field ? field->blockPlane(bi, bj, slice, &scratch[c * n], values[c]) : NULL;
+
+						if(!field) {
+							values[c] = T(0);
+						}
+
+						blank = blank && !planes[c] && values[c] == T(0);
+					}
+
+					// Nothing but empty blocks of 0 at this depth
+					if(blank) {
+						continue;
+					}
+
+					for(int y = 0; y < h; y++) {
+						for(int x = 0; x < w; x++) {
+							int p = (y << blockOrder) + x;
+
+							if(opacity[p] >= T(1)) {
+								continue;
+							}
+
+							T transparency = T(1) - opacity[p];
+
+							for(unsigned int c = 0; c < channels; c++) {
+								T v = planes[c] ? planes[c][p] : values[c];
+
+								acc[c * n + p] = T(acc[c * n + p] + transparency * v);
+							}
+
+							if(opacity[p] >= T(1)) {
+								--open;
+							}
+						}
+					}
+				}
+
+				for(int y = 0; y < h; y++) {
+					for(int x = 0; x < w; x++) {
+						int p = (y << blockOrder) + x;
+						int q = (y0 + y) * size.x + (x0 + x);
+
+						for(unsigned int c = 0; c < channels; c++) {
+							data[planar ? c * size.x * size.y + q : q * channels + c] = acc[c * n + p];
+						}
+					}
+				}
+			}
+		};
+
+		// Finds the first or last depth above the threshold for one block column, see findHits()
+		struct FirstHitTile {
+			const DifField<T>* field;
+			const DepthOrderList* order;
+			const DepthMappingList* sorted;
+			T threshold;
+			bool last;
+			float miss;
+			V2i min;
+			V2i max;
+			int columns;
+			int width;
+			float* depths;
+			unsigned char* mask;
+
+			void operator()(unsigned int i) {
+				const int blockOrder = field->blockOrder();
+				const int bsize = 1 << blockOrder;
+
+				const int bi = (min.x >> blockOrder) + i % columns;
+				const int bj = (min.y >> blockOrder) + i / columns;
+				const int x0 = std::max(bi << blockOrder, min.x);
+				const int y0 = std::max(bj << blockOrder, min.y);
+				const int x1 = std::min((bi + 1) << blockOrder, max.x);
+				const int y1 = std::min((bj + 1) << blockOrder, max.y);
+
+				std::vector<T>    scratch(bsize * bsize);
+				std::vector<char> hit(bsize * bsize, 0);
+
+				int open = (x1 - x0) * (y1 - y0);
+
+				for(int y = y0; y < y1; y++) {
+					for(int x = x0; x < x1; x++) {
+						if(depths) {
+							depths[y * width + x] = miss;
+						}
+
+						if(mask) {
+							mask[y * width + x] = 0;
+						}
+					}
+				}
+
+				const unsigned int count = order->size();
+
+				for(unsigned int n = 0; n < count && open > 0; n++) {
+					const unsigned int k = last ? count - 1 - n : n;
+					const unsigned int slice = (*order)[k];
+					const T* plane = NULL;
+					T value = T(0);
+					T lo, hi;
+
+					// Nothing in this block gets above the threshold, depths
+					// the field hasn't grown to yet read as 0
+					if(field->blockSummary(bi, bj, slice >> blockOrder, lo, hi)) {
+						if(!(hi > threshold)) {
+							continue;
+						}
+
+						plane = field->blockPlane(bi, bj, slice, &scratch[0], value);
+					} else if(!(value > threshold)) {
+						continue;
+					}
+
+					for(int y = y0; y < y1; y++) {
+						for(int x = x0; x < x1; x++) {
+							int p = ((y & (bsize - 1)) << blockOrder) + (x & (bsize - 1));
+
+							if(hit[p] || !((plane ? plane[p] : value) > threshold)) {
+								continue;
+							}
+
+							hit[p] = 1;
+							--open;
+
+							if(depths) {
+								depths[y * width + x] = (*sorted)[k];
+							}
+
+							if(mask) {
+								mask[y * width + x] = 1;
+							}
+						}
+					}
+				}
+			}
+		};
+
+		// Composites the sample lists of one row, see flatten()
+		struct FlattenSamples {
+			const DifSampleList<T>* samples;
+			const std::vector<unsigned int>* rank;
+			unsigned int alpha;
+			V2i  size;
+			T*   data;
+			bool planar;
+
+			void operator()(unsigned int y) {
+				const unsigned int channels = samples->channels();
+				const std::vector<unsigned int>& offsets = samples->offsets();
+				const std::vector<unsigned int>& slices  = samples->slices();
+
+				std::vector<std::pair<unsigned int, unsigned int> > column;
+				std::vector<T> acc(channels);
+
+				for(int x = 0; x < size.x; x++) {
+					unsigned int p = y * size.x + x;
+
+					column.clear();
+
+					for(unsigned int i = offsets[p]; i < offsets[p + 1]; i++) {
+						column.push_back(std::make_pair((*rank)[slices[i]], i));
+					}
+
+					std::sort(column.begin(), column.end());
+					std::fill(acc.begin(), acc.end(), T(0));
+
+					for(size_t s = 0; s < column.size() && acc[alpha] < T(1); s++) {
+						T transparency = T(1) - acc[alpha];
+
+						for(unsigned int c = 0; c < channels; c++) {
+							acc[c] = T(acc[c] + transparency * samples->values(c)[column[s].second]);
+						}
+					}
+
+					for(unsigned int c = 0; c < channels; c++) {
+						data[planar ? c * size.x * size.y + p : p * channels + c] = acc[c];
+					}
+				}
+			}
+		};
+
+		V3i m_vSize;
+
+
+		unsigned int m_ulChannelIndex;
+
+#ifndef _NEXCEPTIONS
+		bool m_bExceptionsEnabled;
+#endif //_NEXCEPTIONS
+
+		static const char *m_scDepthMappingName;
+		static const char *m_scChannelIndexName;
+		static const char *m_scSampleStorageName;
+		static const char *m_scSampleCountsName;
+		static const char *m_scSampleSlicesName;
+		static const char *m_scSampleCountName;
+		static const char *m_scDepthToleranceName;
+		static const char *m_scCodecName;
+		static const char *m_scCodecWidthName;
+		static const char *m_scCodecHeightName;
+		static const char *m_scCodecDepthName;
+		static const char *m_scCodecBlockOrderName;
+		static const char *m_scCodecValueSizeName;
+		static const char *m_scCodecBytesName;
+		static const char *m_scCodecStorageName;
+		static const char *m_scCodecByteOrderName;
+
+		// Sample arrays are stored as rows of this length
+		static const int m_sciSampleRowLength = 4096;
+};
+
+template<typename T> const char * DifImage<T>::m_scDepthMappingName = "depthMapping";
+template<typename T> const char * DifImage<T>::m_scChannelIndexName = "channelIndex";
+template<typename T> const char * DifImage<T>::m_scSampleStorageName = "sampleStorage";
+template<typename T> const char * DifImage<T>::m_scSampleCountsName = "sampleCounts";
+template<typename T> const char * DifImage<T>::m_scSampleSlicesName = "sampleSlices";
+template<typename T> const char * DifImage<T>::m_scSampleCountName = "sampleCount";
+template<typename T> const char * DifImage<T>::m_scDepthToleranceName = "depthTolerance";
+template<typename T> const char * DifImage<T>::m_scCodecName = "codec";
+template<typename T> const char * DifImage<T>::m_scCodecWidthName = "codecWidth";
+template<typename T> const char * DifImage<T>::m_scCodecHeightName = "codecHeight";
+template<typename T> const char * DifImage<T>::m_scCodecDepthName = "codecDepth";
+template<typename T> const char * DifImage<T>::m_scCodecBlockOrderName = "codecBlockOrder";
+template<typename T> const char * DifImage<T>::m_scCodecValueSizeName = "codecValueSize";
+template<typename T> const char * DifImage<T>::m_scCodecBytesName = "codecBytes";
+template<typename T> const char * DifImage<T>::m_scCodecStorageName = "codecStorage";
+template<typename T> const char * DifImage<T>::m_scCodecByteOrderName = "codecByteOrder";
+template<typename T> const int DifImage<T>::m_sciSampleRowLength;
+
+/*!
+ * @brief Assignment constructor
+ *
+ * @param[in] size    The Initial size. Note that the size cannot be altered after
+ *                    this point except for if you're loading a Dif file through
+ *                    DifImage::load()
+ * @param[in] storage eDense keeps a SparseField per channel with a slot for
+ *                    every depth, eSamples keeps per-pixel sample lists (see
+ *                    DifSampleList) whose size only depends on the samples written
+ */
+template<typename T> DifImage<T>::DifImage(const V2i& size, enum DifImageStorage storage)
+	: m_bPacked(false), m_pLazyFile(NULL), m_bOutOfCore(false), m_bConcurrentWrites(false), m_ulDepthCapacity(0), m_fDepthTolerance(0.0f), m_ulThreads(difDefaultThreads()), m_ulChannelIndex(0) {
+	m_vSize.x = size.x;
+	m_vSize.y = size.y;
+	m_vSize.z = 1;
+
+	if(storage == eSamples) {
+		m_pSamples.reset(new DifSampleList<T>(size));
+	}
+
+#ifndef _NEXCEPTIONS
+	m_bExceptionsEnabled = false;
+#endif //_NEXCEPTIONS
+}
+
+/*!
+ * @brief Copy constructor, copies every channel
+ *
+ * Channels of @a o that are still lazy stay lazy in the copy and are decoded
+ * from the same file, which then has to outlive both images. Locks are not
+ * copied and the copy is never in concurrent write mode. @a o must not be
+ * written meanwhile.
+ *
+ * Every block is copied, SparseField gives no way to share blocks between
+ * fields. Packed channels (see packChannels()) are shared, they are never
+ * written. To hand an image over without a copy use swap().
+ */
+template<typename T> DifImage<T>::DifImage(const DifImage<T>& o)
+	: m_lChannelNames(o.m_lChannelNames), m_lChannelIndex(o.m_lChannelIndex), m_lPackedChannels(o.m_lPackedChannels), m_bPacked(o.m_bPacked),
+	  m_pLazyFile(o.m_pLazyFile), m_bOutOfCore(o.m_bOutOfCore),
+	  m_bConcurrentWrites(false), m_ulDepthCapacity(0), m_lDepthMapping(o.m_lDepthMapping), m_lSortedDepths(o.m_lSortedDepths), m_lDepthOrder(o.m_lDepthOrder),
+	  m_fDepthTolerance(o.m_fDepthTolerance), m_ulThreads(o.m_ulThreads), m_vSize(o.m_vSize), m_ulChannelIndex(o.m_ulChannelIndex) {
+	{
+		// Lazy channels of o may be decoded meanwhile
+		boost::shared_lock<boost::shared_mutex> lock(o.m_mLazyMutex);
+
+		m_lChannels.resize(o.m_lChannels.size());
+
+		// Packed channels are shared without the DifField reads decoded
+		for(size_t i = 0; i < o.m_lChannels.size(); i++) {
+			if(o.m_lChannels[i] && !o.packedChannel(i)) {
+				m_lChannels[i] = new DifField<T>(*o.m_lChannels[i]);
+			}
+		}
+
+		m_lChannelCodecs   = o.m_lChannelCodecs;
+		m_lChannelStorages = o.m_lChannelStorages;
+	}
+
+	if(o.m_pSamples) {
+		m_pSamples.reset(new DifSampleList<T>(*o.m_pSamples));
+	}
+
+#ifndef _NEXCEPTIONS
+	m_bExceptionsEnabled = o.m_bExceptionsEnabled;
+#endif //_NEXCEPTIONS
+}
+
+/// Default destructor
+template<typename T> DifImage<T>::~DifImage() {
+	m_lChannels.clear();
+	m_lChannelNames.clear();
+	m_lChannelIndex.clear();
+}
+
+/*!
+ * @brief Replaces the image by a copy of @a o, see the copy constructor
+ *
+ * The image is left unchanged if it is written concurrently.
+ */
+template<typename T> DifImage<T>& DifImage<T>::operator=(const DifImage<T>& o) {
+	if(&o != this) {
+		DifImage<T> copy(o);
+		swap(copy);
+	}
+
+	return *this;
+}
+
+/// Returns how the image stores its data
+template<typename T> typename DifImage<T>::DifImageStorage DifImage<T>::storage() const {
+	return m_pSamples ? eSamples : eDense;
+}
+
+/// Returns the number of samples of an eSamples image, 0 for eDense
+template<typename T> unsigned int DifImage<T>::numberOfSamples() const {
+	return m_pSamples ? m_pSamples->samples() : 0;
+}
+
+#ifndef _NEXCEPTIONS
+template<typename T> bool DifImage<T>::exceptionsEnabled() const {
+	return m_bExceptionsEnabled;
+}
+
+template<typename T> void DifImage<T>::setExceptionsEnabled(bool yorn) {
+	m_bExceptionsEnabled = yorn;
+}
+#endif //_NEXCEPTIONS
+
+/*!
+ * @brief Adds a channel by using an existing DifField
+ * @param[in] name    Name of the channel
+ * @param[in] i       A DifField to copy values from
+ * @param[out] retid  Identification number of the channel
+ * @retval true  Success
+ * @retval false Size mismatch or channel of the same name already existing  
+ */
+template<typename T> bool DifImage<T>::addChannel(const std::string& name, const DifField<T>& i, unsigned int& retid) {
+	return addChannel(name, typename SparseField<T>::Ptr(new DifField<T>(i)), retid);
+}
+
+/*!
+ * @brief Adds a channel by taking over an existing field without copying it
+ *
+ * A DifField is kept as it is and shared with the caller, changes through
+ * @a field show up in the image. The blocks of any other SparseField are
+ * moved into a new DifField and @a field is left empty. Depths the field
+ * hasn't grown to yet read as 0.
+ *
+ * @param[in] name    Name of the channel
+ * @param[in] field   Width and height of the image, no more depths than the image
+ * @param[out] retid  Identification number of the channel
+ * @retval true  Success
+ * @retval false Size mismatch or channel of the same name already existing
+ */
+template<typename T> bool DifImage<T>::addChannel(const std::string& name, typename SparseField<T>::Ptr field, unsigned int& retid) {
+	if(m_bConcurrentWrites) {
+		_THROW("addChannel() : image is written concurrently");
+		return false;
+	}
+
+	if(m_pSamples) {
+		_THROW("addChannel() : sample list images can't adopt a DifField.");
+		return false;
+	}
+
+	if(!field) {
+		_THROW("addChannel() : no field given.");
+		return false;
+	}
+
+	V3i res = field->dataResolution();
+
+	if(res.x != m_vSize.x || res.y != m_vSize.y || res.z > (int)std::max(depthLevels(), 1u)) {
+		_THROW("addChannel() : size mismatch with provided channel.");
+		return false;
+	}
+
+	if(hasChannel(name)) {
+		_THROW("addChannel() : channel of the same name exists.");
+		return false;
+	}
+
+	typename DifField<T>::Ptr handle = field_dynamic_cast< DifField<T> >(field);
+
+	if(!handle) {
+		handle = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+		handle->adopt(*field);
+	}
+
+	registerChannel(name, handle.get(), retid);
+
+	return true;
+}
+
+/*!
+ * @brief Exchanges the contents of two images without copying any channel
+ *
+ * With an empty image on one side this moves an image, e.g. out of a function,
+ * where the copy constructor would copy every block.
+ *
+ * @return false if either image is written concurrently
+ */
+template<typename T> bool DifImage<T>::swap(DifImage<T>& o) {
+	if(m_bConcurrentWrites || o.m_bConcurrentWrites) {
+		_THROW("swap() : image is written concurrently");
+		return false;
+	}
+
+	if(&o == this) {
+		return true;
+	}
+
+	std::swap(m_vSize, o.m_vSize);
+	m_lChannels.swap(o.m_lChannels);
+	m_lChannelNames.swap(o.m_lChannelNames);
+	m_lChannelIndex.swap(o.m_lChannelIndex);
+	m_lChannelCodecs.swap(o.m_lChannelCodecs);
+	m_lChannelStorages.swap(o.m_lChannelStorages);
+	m_lPackedChannels.swap(o.m_lPackedChannels);
+	std::swap(m_bPacked, o.m_bPacked);
+	std::swap(m_ulChannelIndex, o.m_ulChannelIndex);
+	std::swap(m_pLazyFile, o.m_pLazyFile);
+	std::swap(m_bOutOfCore, o.m_bOutOfCore);
+	m_pSamples.swap(o.m_pSamples);
+	std::swap(m_ulDepthCapacity, o.m_ulDepthCapacity);
+	m_lDepthMapping.swap(o.m_lDepthMapping);
+	m_lSortedDepths.swap(o.m_lSortedDepths);
+	m_lDepthOrder.swap(o.m_lDepthOrder);
+	std::swap(m_fDepthTolerance, o.m_fDepthTolerance);
+	std::swap(m_ulThreads, o.m_ulThreads);
+
+#ifndef _NEXCEPTIONS
+	std::swap(m_bExceptionsEnabled, o.m_bExceptionsEnabled);
+#endif //_NEXCEPTIONS
+
+	return true;
+}
+
+/*!
+ * @brief Stores @a field under the next free channel id
+ *
+ * The name and id are also written to the field so they survive save() and load().
+ */
+template<typename T> void DifImage<T>::registerChannel(const std::string& name, DifField<T>* field, unsigned int& retid) {
+	// A NULL field is a lazy channel, resolveChannel() fills it in
+	if(field) {
+		field->name = name;
+		field->metadata().setIntMetadata(m_scChannelIndexName, m_ulChannelIndex);
+	}
+
+	m_lChannels.push_back(field);
+	m_lChannelNames.push_back(name);
+	m_lChannelCodecs.push_back(eDifCodecNone);
+	m_lChannelStorages.push_back(eDifStorageNative);
+	m_lPackedChannels.push_back(typename DifPackedField<T>::Ptr());
+	m_lChannelIndex[name] = m_ulChannelIndex;
+
+	retid = m_ulChannelIndex;
+
+	++m_ulChannelIndex;
+
+	if(field) {
+		adoptCodec(retid, field);
+	}
+}
+
+/*!
+ * @brief Takes over the codec and storage type a channel was loaded with
+ *
+ * decodeChannel() leaves them in the field's metadata, they are reset there
+ * so they don't linger in layers a later save() writes.
+ */
+/* Protected */ template<typename T> void DifImage<T>::adoptCodec(unsigned int channelid, DifField<T>* field) const {
+	int codec   = field->metadata().intMetadata(m_scCodecName, eDifCodecNone);
+	int storage = field->metadata().intMetadata(m_scCodecStorageName, eDifStorageNative);
+
+	if(codec != eDifCodecNone) {
+		m_lChannelCodecs[channelid] = (enum DifCodec)codec;
+		field->metadata().setIntMetadata(m_scCodecName, eDifCodecNone);
+	}
+
+	if(storage != eDifStorageNative) {
+		m_lChannelStorages[channelid] = (enum DifStorage)storage;
+		field->metadata().setIntMetadata(m_scCodecStorageName, eDifStorageNative);
+	}
+}
+
+/// Returns true for layers written by saveEncoded()
+/* Protected */ template<typename T> bool DifImage<T>::isEncoded(const FieldRes& layer) {
+	return layer.metadata().intMetadata(m_scCodecBytesName, -1) >= 0;
+}
+
+/*!
+ * @brief Adds a channel
+ * @param[in] name Name of the channel
+ * @param[out] retid Identification number of the channel
+ * @retval true Success
+ * @retval false Channel of the same name existing
+ */
+template<typename T> bool DifImage<T>::addChannel(const std::string& name, unsigned int& retid) {
+	if(m_bConcurrentWrites) {
+		_THROW("addChannel() : image is written concurrently");
+		return false;
+	}
+
+	if(hasChannel(name)) {
+		_THROW("addChannel() : channel of the same name exists.");
+		return false;
+	}
+
+	if(m_pSamples) {
+		m_pSamples->addChannel();
+		registerChannel(name, NULL, retid);
+		return true;
+	}
+
+	DifField<T> * handle = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+
+	handle->setSize(V3i(m_vSize.x, m_vSize.y, depthLevels()));
+
+	registerChannel(name, handle, retid);
+
+	return true;
+}
+
+/*!
+ * @brief Returns the name of the channel at index @a idx
+ * @param[in]  The Index (0..numberOfChannels()-1)
+ * @return A String (empty if @a idx is out of range)
+ */
+template<typename T> const std::string& DifImage<T>::channelName(unsigned int idx) const {
+	static const std::string empty;
+
+	if(!validChannelId(idx)) {
+		return empty;
+	}
+
+	return m_lChannelNames[idx];
+}
+
+/*!
+ * @brief Returns the index of the channel named @a name
+ * @param[in]  name   Channel's Name
+ * @param[out] retval (Optional) Pointer to a bool for the return code
+ * @return The channel id, 0 if there is no such channel
+ */
+template<typename T> unsigned int DifImage<T>::channelIndex(const std::string& name, bool *retval) const {
+	ChannelIndexMapConstIter it = m_lChannelIndex.find(name);
+
+	if(retval) {
+		(*retval) = (it != m_lChannelIndex.end());
+	}
+
+	return (it != m_lChannelIndex.end()) ? it->second : 0;
+}
+
+/*!
+ * @brief Determines whether the Image as a achannel named @a name
+ * @param[in] name Channel's Name
+ * @return boolean
+ */
+template<typename T> bool DifImage<T>::hasChannel(const std::string& name) const {
+	return (m_lChannelIndex.find(name) != m_lChannelIndex.end());
+}
+
+/// Returns the number of channels.
+template<typename T> unsigned int DifImage<T>::numberOfChannels() const {
+	return m_lChannels.size();
+}
+
+/*!
+ * @brief Determines whether the given channel index @a id is valid
+ * @param[in] id Channel ID
+ * @return boolean
+ */
+template<typename T> bool DifImage<T>::validChannelId(unsigned int id) const {
+	return (id < m_lChannels.size());
+}
+
+template<typename T> DifField<T>* DifImage<T>::getField(unsigned int channelid) {
+	if(!validChannelId(channelid)) {
+		return NULL;
+	}
+
+	if(m_pLazyFile) {
+		return resolveChannel(channelid);
+	}
+
+	// Packed channels have no field to write to until unpackChannels()
+	if(packedChannel(channelid)) {
+		return NULL;
+	}
+
+	return m_lChannels[channelid].get();
+}
+
+template<typename T> const DifField<T>* DifImage<T>::getField(unsigned int channelid) const {
+	if(!validChannelId(channelid)) {
+		return NULL;
+	}
+
+	if(m_pLazyFile || m_bPacked) {
+		return resolveChannel(channelid);
+	}
+
+	return m_lChannels[channelid].get();
+}
+
+/*!
+ * @brief Returns a channel, decoding it from the lazy file or its packed blocks first if needed
+ *
+ * Packed blocks are kept, readData() may still be reading them.
+ *
+ * @return NULL if the channel couldn't be decoded
+ */
+/* Protected */ template<typename T> DifField<T>* DifImage<T>::resolveChannel(unsigned int channelid) const {
+	{
+		boost::shared_lock<boost::shared_mutex> lock(m_mLazyMutex);
+
+		if(m_lChannels[channelid]) {
+			return m_lChannels[channelid].get();
+		}
+	}
+
+	boost::unique_lock<boost::shared_mutex> lock(m_mLazyMutex);
+
+	if(!m_lChannels[channelid] && m_lPackedChannels[channelid]) {
+		DifField<T>* field = m_lPackedChannels[channelid]->unpack();
+
+		field->name = m_lChannelNames[channelid];
+		field->metadata().setIntMetadata(m_scChannelIndexName, channelid);
+		m_lChannels[channelid] = field;
+	} else if(!m_lChannels[channelid] && m_pLazyFile) {
+		boost::shared_lock<boost::shared_mutex> reading(difLoadMutex());
+		DifField<T>* field = readChannel(*m_pLazyFile, m_lChannelNames[channelid]);
+
+		if(field) {
+			field->metadata().setIntMetadata(m_scChannelIndexName, channelid);
+			adoptCodec(channelid, field);
+			m_lChannels[channelid] = field;
+		}
+	}
+
+	return m_lChannels[channelid].get();
+}
+
+/*!
+ * @brief Reads the layer @a name from @a ifp
+ * @return A new DifField or NULL if there is no such SparseField layer matching the image size
+ */
+/* Protected */ template<typename T> DifField<T>* DifImage<T>::readChannel(Field3DInputFile& ifp, const std::string& name) const {
+	Field<float>::Vec payloads;
+
+	// Encoded channels are float layers, float images have read them already
+	if(!boost::is_same<T, float>::value) {
+		payloads = ifp.readScalarLayers<float>(name);
+	}
+
+	return combineParts(ifp.readScalarLayers<T>(name), payloads, name);
+}
+
+/*!
+ * @brief Builds a channel from the layers read for it
+ *
+ * Files written by DifStreamWriter hold a channel in several layers of the
+ * same name, one per flush(). Those are merged with DifField::mergeBlocks(),
+ * paged parts are copied into memory then. Layers of another width or height
+ * are ignored. Channels saved with a codec are float layers found either in
+ * @a fields (float images) or in @a payloads, they are always decoded into
+ * memory.
+ *
+ * @return A new DifField or NULL if no layer matches the image size
+ */
+/* Protected */ template<typename T> DifField<T>* DifImage<T>::combineParts(const typename Field<T>::Vec& fields, const Field<float>::Vec& payloads, const std::string& name) const {
+	std::vector<typename SparseField<T>::Ptr> parts;
+	std::vector<SparseField<float>::Ptr> encoded;
+
+	for(size_t i = 0; i < fields.size(); i++) {
+		typename SparseField<T>::Ptr handle = field_dynamic_cast< SparseField<T> >(fields[i]);
+		V3i res = handle ? handle->dataResolution() : V3i(0);
+
+		if(handle && isEncoded(*handle)) {
+			encoded.push_back(field_dynamic_cast< SparseField<float> >(fields[i]));
+		} else if(handle && res.x == m_vSize.x && res.y == m_vSize.y) {
+			parts.push_back(handle);
+		}
+	}
+
+	for(size_t i = 0; i < payloads.size(); i++) {
+		SparseField<float>::Ptr handle = field_dynamic_cast< SparseField<float> >(payloads[i]);
+
+		if(handle && isEncoded(*handle)) {
+			encoded.push_back(handle);
+		}
+	}
+
+	if(parts.empty() && encoded.empty()) {
+		return NULL;
+	}
+
+	DifField<T>* field = NULL;
+
+	if(parts.size() == 1 && encoded.empty()) {
+		field = new DifField<T>(V2i(0, 0));
+		field->adopt(*parts[0]);
+	} else if(parts.empty() && encoded.size() == 1) {
+		field = decodeChannel(*encoded[0]);
+
+		if(!field) {
+			return NULL;
+		}
+	} else {
+		field = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+
+		for(size_t i = 0; i < parts.size(); i++) {
+			DifField<T> part(V2i(0, 0));
+
+			part.adopt(*parts[i]);
+			parts[i] = NULL;
+			field->mergeBlocks(part);
+		}
+
+		for(size_t i = 0; i < encoded.size(); i++) {
+			DifField<T>* part = decodeChannel(*encoded[i]);
+
+			if(part) {
+				field->mergeBlocks(*part);
+				delete part;
+			}
+		}
+
+		if(!encoded.empty()) {
+			field->metadata().setIntMetadata(m_scCodecName, encoded[0]->metadata().intMetadata(m_scCodecName, eDifCodecNone));
+			field->metadata().setIntMetadata(m_scCodecStorageName, encoded[0]->metadata().intMetadata(m_scCodecStorageName, eDifStorageNative));
+		}
+	}
+
+	field->name = name;
+
+	return field;
+}
+
+/*!
+ * @brief Determines whether the image was loaded with eOutOfCore
+ *
+ * Out-of-core images only keep the blocks in memory that were accessed
+ * recently (see difSetMemoryBudget()) and are read only.
+ */
+template<typename T> bool DifImage<T>::isOutOfCore() const {
+	return m_bOutOfCore;
+}
+
+/// Returns true while some channels of a lazy load() have not been decoded yet
+template<typename T> bool DifImage<T>::isLazy() const {
+	return (m_pLazyFile != NULL);
+}
+
+/*!
+ * @brief Decodes every channel a lazy load() left pending
+ *
+ * Must be called before the file handed to load() is closed if not every
+ * channel has been accessed yet. Channels that fail to decode are left empty.
+ */
+template<typename T> void DifImage<T>::resolveChannels() {
+	if(!m_pLazyFile) {
+		return;
+	}
+
+	for(unsigned int i = 0; i < numberOfChannels(); i++) {
+		if(!resolveChannel(i)) {
+			_THROW("resolveChannels() : couldn't decode channel");
+			m_lChannels[i] = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+			m_lChannels[i]->setSize(m_vSize);
+			m_lChannels[i]->name = m_lChannelNames[i];
+		}
+	}
+
+	m_pLazyFile = NULL;
+}
+
+/*!
+ * @brief Keeps the channels in their storage type in memory
+ *
+ * Every channel with a storage type other than eDifStorageNative (see
+ * setChannelStorage()) is converted to it block by block, the channels in
+ * parallel, and its DifField is released. readData() and readChannelData()
+ * convert the values they read back to T. Other reads decode the channel to a
+ * DifField next to its packed blocks, save() and saveMapped() only for as long
+ * as they write it.
+ *
+ * The image is read only until unpackChannels(): writes, new depths, merge()
+ * and loads fail. Nothing is packed unless this is called.
+ *
+ * Images with sample lists, out of core or written concurrently are left
+ * alone. Lazy channels are decoded first.
+ *
+ * @return The number of packed channels
+ */
+template<typename T> unsigned int DifImage<T>::packChannels() {
+	if(m_pSamples || m_bOutOfCore || m_bConcurrentWrites) {
+		return 0;
+	}
+
+	if(m_pLazyFile) {
+		resolveChannels();
+	}
+
+	PackChannel work;
+	work.channels = &m_lChannels;
+	work.packed   = &m_lPackedChannels;
+	work.storages = &m_lChannelStorages;
+
+	DifParallelFor<PackChannel>(0, numberOfChannels(), m_ulThreads, work);
+
+	unsigned int packed = 0;
+
+	for(unsigned int i = 0; i < numberOfChannels(); i++) {
+		if(m_lPackedChannels[i]) {
+			++packed;
+		}
+	}
+
+	m_bPacked = (packed > 0);
+
+	return packed;
+}
+
+/*!
+ * @brief Decodes the channels packChannels() packed and makes the image writable again
+ *
+ * Decoded values are the packed ones, the precision lost to the storage type
+ * is not restored.
+ */
+template<typename T> void DifImage<T>::unpackChannels() {
+	if(!m_bPacked) {
+		return;
+	}
+
+	for(unsigned int i = 0; i < numberOfChannels(); i++) {
+		resolveChannel(i);
+	}
+
+	m_lPackedChannels.assign(m_lPackedChannels.size(), typename DifPackedField<T>::Ptr());
+	m_bPacked = false;
+}
+
+/// Returns true if the channel is held packed, see packChannels()
+template<typename T> bool DifImage<T>::isPacked(unsigned int channelid) const {
+	return validChannelId(channelid) && packedChannel(channelid) != NULL;
+}
+
+/// Returns true while packChannels() keeps any channel packed
+template<typename T> bool DifImage<T>::isPacked() const {
+	return m_bPacked;
+}
+
+/*!
+ * @brief Decodes the packed channels that have no DifField for writing them
+ * @param[out] decoded The decoded channels, to be handed to releaseChannels()
+ */
+/* Protected */ template<typename T> void DifImage<T>::decodePackedChannels(std::vector<unsigned int>& decoded) {
+	for(unsigned int i = 0; m_bPacked && i < numberOfChannels(); i++) {
+		if(!m_lChannels[i] && m_lPackedChannels[i]) {
+			resolveChannel(i);
+			decoded.push_back(i);
+		}
+	}
+}
+
+/// Releases the DifFields of decodePackedChannels(), the packed blocks stay
+/* Protected */ template<typename T> void DifImage<T>::releaseChannels(const std::vector<unsigned int>& decoded) {
+	for(unsigned int i = 0; i < decoded.size(); i++) {
+		m_lChannels[decoded[i]] = typename DifField<T>::Ptr();
+	}
+}
+
+/// Returns the packed blocks of a channel or NULL
+/* Protected */ template<typename T> const DifPackedField<T>* DifImage<T>::packedChannel(unsigned int channelid) const {
+	return m_bPacked ? m_lPackedChannels[channelid].get() : NULL;
+}
+
+/*!
+ * @brief Returns the associated depth value to a depth index
+ * @param[in]  idx The Index (range 0..depthLevels()-1)
+ * @param[out] retval (Optimal) Pointer to a bool for the return code
+ * @return A float
+ */
+template<typename T> float DifImage<T>::depthAtIndex(unsigned int idx, bool* retval) const {
+	if(idx >= m_lDepthMapping.size()) {
+		if(retval) {
+			(*retval) = false;
+		}
+
+		return 0.0f;
+	}
+
+	if(retval) {
+		(*retval) = true;
+	}
+
+	return m_lDepthMapping.at(idx);
+}
+
+/*!
+ * @brief Returns the @a idx th depth in ascending order
+ * @param[in] idx The sorted index (range 0..depthLevels()-1)
+ * @return A float, 0 if @a idx is out of range
+ */
+template<typename T> float DifImage<T>::depthAtSortedIndex(unsigned int idx) const {
+	if(idx >= m_lSortedDepths.size()) {
+		return 0.0f;
+	}
+
+	return m_lSortedDepths[idx];
+}
+
+/*!
+ * @brief Returns the index of the given depth
+ * @param[in]  dpt The depth
+ * @param[out] retval (Optimal) Pointer to a bool for the return code
+ * @return An unsigned integer in range 0..depthLevels()-1 also 0 on error
+ */
+template<typename T> unsigned int DifImage<T>::indexAtDepth(float dpt, bool* retval) const {
+	DepthMappingListConstIter it = std::lower_bound(m_lSortedDepths.begin(), m_lSortedDepths.end(), dpt - m_fDepthTolerance);
+
+	// Within the tolerance pick the closest depth
+	DepthMappingListConstIter best = m_lSortedDepths.end();
+
+	for(; it != m_lSortedDepths.end() && (*it) <= dpt + m_fDepthTolerance; it++) {
+		if(best == m_lSortedDepths.end() || std::fabs((*it) - dpt) < std::fabs((*best) - dpt)) {
+			best = it;
+		}
+	}
+
+	if(retval) {
+		(*retval) = (best != m_lSortedDepths.end());
+	}
+
+	if(best == m_lSortedDepths.end()) {
+		return 0;
+	}
+
+	return m_lDepthOrder[best - m_lSortedDepths.begin()];
+}
+
+/*!
+ * @brief Returns the tolerance used to match depths
+ *
+ * Depths closer than the tolerance to an existing depth are treated as that
+ * depth by indexAtDepth(), writeData() and addDepth(). The default is 0, which
+ * only matches exactly equal depths.
+ */
+template<typename T> float DifImage<T>::depthTolerance() const {
+	return m_fDepthTolerance;
+}
+
+/*!
+ * @brief Sets the tolerance used to match depths
+ * @param[in] tolerance Maximum distance (>= 0) at which two depths are considered equal
+ */
+template<typename T> void DifImage<T>::setDepthTolerance(float tolerance) {
+	m_fDepthTolerance = (tolerance < 0.0f) ? 0.0f : tolerance;
+}
+
+/// Returns the position of the first sorted depth greater than @a dpt
+/* Protected */ template<typename T> unsigned int DifImage<T>::sortedDepthPosition(float dpt) const {
+	return std::upper_bound(m_lSortedDepths.begin(), m_lSortedDepths.end(), dpt) - m_lSortedDepths.begin();
+}
+
+/*!
+ * @brief Registers a depth unless it is already known
+ *
+ * New depths are appended to the storage order, so existing slice indices
+ * stay valid, and inserted into the sorted index. While writes are concurrent
+ * lookups share the registry and insertions lock it exclusively.
+ *
+ * @param[in]  dpt   The depth
+ * @param[out] added (Optional) Set to true if the depth was not known before
+ * @return The storage index of the depth, UINT_MAX if the capacity reserved
+ *         by beginConcurrentWrites() is exhausted
+ */
+/* Protected */ template<typename T> unsigned int DifImage<T>::insertDepth(float dpt, bool* added) {
+	bool status = false;
+	unsigned int idx;
+
+	if(added) {
+		(*added) = false;
+	}
+
+	if(m_bConcurrentWrites) {
+		{
+			boost::shared_lock<boost::shared_mutex> lock(m_mDepthMutex);
+
+			idx = indexAtDepth(dpt, &status);
+		}
+
+		if(status) {
+			return idx;
+		}
+
+		boost::unique_lock<boost::shared_mutex> lock(m_mDepthMutex);
+
+		// Somebody else may have added it meanwhile
+		idx = indexAtDepth(dpt, &status);
+
+		if(status) {
+			return idx;
+		}
+
+		if(depthLevels() >= m_ulDepthCapacity) {
+			return UINT_MAX;
+		}
+
+		if(added) {
+			(*added) = true;
+		}
+
+		idx = m_lDepthMapping.size();
+		m_lDepthMapping.push_back(dpt);
+
+		unsigned int pos = sortedDepthPosition(dpt);
+
+		m_lSortedDepths.insert(m_lSortedDepths.begin() + pos, dpt);
+		m_lDepthOrder.insert(m_lDepthOrder.begin() + pos, idx);
+
+		return idx;
+	}
+
+	idx = indexAtDepth(dpt, &status);
+
+	if(added) {
+		(*added) = !status;
+	}
+
+	if(status) {
+		return idx;
+	}
+
+	idx = m_lDepthMapping.size();
+	m_lDepthMapping.push_back(dpt);
+
+	unsigned int pos = sortedDepthPosition(dpt);
+
+	m_lSortedDepths.insert(m_lSortedDepths.begin() + pos, dpt);
+	m_lDepthOrder.insert(m_lDepthOrder.begin() + pos, idx);
+
+	return idx;
+}
+
+/// Returns the number of depth levels
+template<typename T> unsigned int DifImage<T>::depthLevels() const {
+	return m_lDepthMapping.size();
+}
+
+/*!
+ * @brief Write Data to the image
+ *
+ * This function has no return value and will simply ignore the data if the given
+ * Position @a pos is invalid.
+ * @param[in] pos The Position
+ * @param[in] depth The depth level.
+ * @param[in] data Data to write (must be at least sizeof(T)* numberOfChannels())
+ */
+template<typename T> void DifImage<T>::writeData(const V2i& pos, float depth, T* data) {
+	if(m_bOutOfCore || m_bPacked) {
+		_THROW("writeData() : out-of-core and packed images are read only");
+		return;
+	}
+
+	unsigned int idx = insertDepth(depth);
+	unsigned int current = 0;
+
+	if(idx == UINT_MAX) {
+		_THROW("writeData() : depth capacity exhausted");
+		return;
+	}
+
+	if(m_pSamples) {
+		m_pSamples->write(V2i(pos.x, pos.y), idx, data);
+		return;
+	}
+
+	for(; current < numberOfChannels(); current++) {
+		DifField<T>* field = getField(current);
+
+		if(field) {
+			field->writePixel(pos, idx, data[current]);
+		} else {
+			_THROW("writeData() : channel invalid");
+		}
+	}
+}
+
+/// Clips the rectangle @a origin / @a size against the image, @a max is exclusive
+/* Protected */ template<typename T> bool DifImage<T>::clipTile(const V2i& origin, const V2i& size, V2i& min, V2i& max) const {
+	min.x = std::max(origin.x, 0);
+	min.y = std::max(origin.y, 0);
+	max.x = std::min(origin.x + size.x, m_vSize.x);
+	max.y = std::min(origin.y + size.y, m_vSize.y);
+
+	return (min.x < max.x && min.y < max.y);
+}
+
+/*!
+ * @brief Writes a rectangle of pixels at one depth
+ *
+ * The depth and the channels are resolved once for the whole tile and the
+ * rows are written straight into the channels' blocks. Pixels outside the
+ * image are ignored.
+ *
+ * @param[in] origin Upper left pixel of the tile
+ * @param[in] size   Width and height of the tile
+ * @param[in] depth  The depth level
+ * @param[in] data   size.x*size.y*numberOfChannels() values, row by row
+ * @param[in] layout eInterleaved (all channels of a pixel are adjacent) or
+ *                   ePlanar (one complete tile per channel)
+ * @return false if the tile lies outside the image or a channel couldn't be
+ *         decoded, the other channels are written anyway
+ */
+template<typename T> bool DifImage<T>::writeTile(const V2i& origin, const V2i& size, float depth, const T* data, enum DifImageLayout layout) {
+	V2i min, max;
+
+	if(m_bOutOfCore || m_bPacked) {
+		_THROW("writeTile() : out-of-core and packed images are read only");
+		return false;
+	}
+
+	if(!clipTile(origin, size, min, max)) {
+		return false;
+	}
+
+	unsigned int idx      = insertDepth(depth);
+	unsigned int channels = numberOfChannels();
+
+	if(idx == UINT_MAX) {
+		_THROW("writeTile() : depth capacity exhausted");
+		return false;
+	}
+
+	if(m_pSamples) {
+		int stride = (layout == eInterleaved) ? 1 : size.x * size.y;
+
+		for(int y = min.y; y < max.y; y++) {
+			for(int x = min.x; x < max.x; x++) {
+				int p = (y - origin.y) * size.x + (x - origin.x);
+
+				m_pSamples->write(V2i(x, y), idx, data + ((layout == eInterleaved) ? p * channels : p), stride);
+			}
+		}
+
+		return true;
+	}
+
+	int stride = (layout == eInterleaved) ? channels : 1;
+	bool written = true;
+
+	for(unsigned int c = 0; c < channels; c++) {
+		DifField<T>* field = getField(c);
+
+		if(!field) {
+			_THROW("writeTile() : channel invalid");
+			written = false;
+			continue;
+		}
+
+		const T* base = data + ((layout == eInterleaved) ? c : c * size.x * size.y);
+
+		field->updateDepth(idx);
+
+		for(int y = min.y; y < max.y; y++) {
+			const T* row = base + ((y - origin.y) * size.x + (min.x - origin.x)) * stride;
+
+			field->writeSpan(V2i(min.x, y), idx, max.x - min.x, row, stride);
+		}
+	}
+
+	return written;
+}
+
+/*!
+ * @brief Writes a rectangle of pixels, each with its own depth
+ * @param[in] origin Upper left pixel of the tile
+ * @param[in] size   Width and height of the tile
+ * @param[in] depths size.x*size.y depths, row by row
+ * @param[in] data   size.x*size.y*numberOfChannels() values, see writeTile()
+ * @param[in] layout Layout of @a data
+ * @return false if the tile lies outside the image or a channel couldn't be decoded
+ */
+template<typename T> bool DifImage<T>::writeTile(const V2i& origin, const V2i& size, const float* depths, const T* data, enum DifImageLayout layout) {
+	V2i min, max;
+
+	if(m_bOutOfCore || m_bPacked) {
+		_THROW("writeTile() : out-of-core and packed images are read only");
+		return false;
+	}
+
+	if(!clipTile(origin, size, min, max)) {
+		return false;
+	}
+
+	// Resolve every depth first so each channel only grows once
+	std::vector<unsigned int> indices(size.x * size.y);
+
+	unsigned int maxIdx = 0;
+	unsigned int idx    = 0;
+	float last          = 0.0f;
+	bool valid          = false;
+
+	for(int y = min.y; y < max.y; y++) {
+		for(int x = min.x; x < max.x; x++) {
+			int p = (y - origin.y) * size.x + (x - origin.x);
+
+			if(!valid || depths[p] != last) {
+				last  = depths[p];
+				idx   = insertDepth(last);
+				valid = true;
+
+				if(idx == UINT_MAX) {
+					_THROW("writeTile() : depth capacity exhausted");
+					return false;
+				}
+			}
+
+			indices[p] = idx;
+			maxIdx = std::max(maxIdx, idx);
+		}
+	}
+
+	unsigned int channels = numberOfChannels();
+
+	if(m_pSamples) {
+		int stride = (layout == eInterleaved) ? 1 : size.x * size.y;
+
+		for(int y = min.y; y < max.y; y++) {
+			for(int x = min.x; x < max.x; x++) {
+				int p = (y - origin.y) * size.x + (x - origin.x);
+
+				m_pSamples->write(V2i(x, y), indices[p], data + ((layout == eInterleaved) ? p * channels : p), stride);
+			}
+		}
+
+		return true;
+	}
+
+	int stride = (layout == eInterleaved) ? channels : 1;
+	bool written = true;
+
+	for(unsigned int c = 0; c < channels; c++) {
+		DifField<T>* field = getField(c);
+
+		if(!field) {
+			_THROW("writeTile() : channel invalid");
+			written = false;
+			continue;
+		}
+
+		const T* base = data + ((layout == eInterleaved) ? c : c * size.x * size.y);
+
+		field->updateDepth(maxIdx);
+
+		for(int y = min.y; y < max.y; y++) {
+			for(int x = min.x; x < max.x; x++) {
+				int p = (y - origin.y) * size.x + (x - origin.x);
+
+				field->writeSpan(V2i(x, y), indices[p], 1, base + p * stride);
+			}
+		}
+	}
+
+	return written;
+}
+
+/*!
+ * @brief Writes @a width pixels of a row at one depth
+ * @see writeTile()
+ */
+template<typename T> bool DifImage<T>::writeScanline(const V2i& pos, int width, float depth, const T* data, enum DifImageLayout layout) {
+	return writeTile(pos, V2i(width, 1), depth, data, layout);
+}
+
+/*!
+ * @brief Reads data from the image
+ * @param[in] pos    Position
+ * @param[in] depth  Desired depth
+ * @param[in] buffer Buffer to write data to
+ * @param[in] type   Interpolation type
+ * @return boolean
+ *
+ * If no data is available at the given @a depth it will be interpolated by the nearest two 
+ * depths available if @a type is eLinear or will return false otherwise.
+ */
+template<typename T> bool DifImage<T>::readData(const V2i& pos, float depth, T *buffer, enum DifImage<T>::DifImageInterpolation type) const {
+	unsigned int i = 0;
+
+	// No channels available
+	if(m_lChannels.size() == 0) {
+		return false;
+	}
+
+	if(m_pSamples) {
+		unsigned int bfr, aftr;
+		float t;
+		bool lerp;
+
+		if(!resolveRead(depth, type, bfr, aftr, t, lerp)) {
+			return false;
+		}
+
+		m_pSamples->commit();
+		readSamples(pos, bfr, aftr, t, lerp, buffer, 1, 0, numberOfChannels());
+
+		return true;
+	}
+
+	if(type == eNone) {
+		unsigned int idx = 0;
+		bool status = false;
+
+		idx = indexAtDepth(depth, &status);
+
+		// Must have at least one channel at the given depth
+		if(!status) {
+			return false;
+		}
+
+		for(; i < numberOfChannels(); i++) {
+			const DifPackedField<T>* packed = packedChannel(i);
+
+			if(packed) {
+				buffer[i] = packed->readPixel(pos, idx);
+				continue;
+			}
+
+			const DifField<T>* field = getField(i);
+
+			if(field) {
+				buffer[i] = field->readPixel(pos, idx);
+			}
+		}
+	}
+	else if(type == eLinear) {
+		unsigned int bfr, aftr;
+		float t;
+
+		if(!depthBracket(depth, bfr, aftr, t)) {
+			return readData(pos, depth, buffer, eNone);
+		}
+
+		// Interpolate straight into the caller's buffer, no scratch memory needed
+		for(; i < numberOfChannels(); i++) {
+			const DifPackedField<T>* packed = packedChannel(i);
+
+			if(packed) {
+				buffer[i] = Imath::lerp(packed->readPixel(pos, bfr), packed->readPixel(pos, aftr), t);
+				continue;
+			}
+
+			const DifField<T>* field = getField(i);
+
+			if(field) {
+				T a = field->readPixel(pos, bfr);
+				T b = field->readPixel(pos, aftr);
+
+				buffer[i] = Imath::lerp(a, b, t);
+			}
+		}
+	}
+
+	return true;
+}
+
+/*!
+ * @brief Resolves @a depth to the depth indices to read
+ * @param[in]  depth Desired depth
+ * @param[in]  type  Interpolation type
+ * @param[out] bfr   Depth index to read (weighted with 1-t when interpolating)
+ * @param[out] aftr  Second depth index when interpolating
+ * @param[out] t     Interpolation weight of @a aftr
+ * @param[out] lerp  Whether the two indices have to be interpolated
+ * @return false if there is nothing to read at @a depth
+ */
+/* Protected */ template<typename T> bool DifImage<T>::resolveRead(float depth, enum DifImageInterpolation type, unsigned int& bfr, unsigned int& aftr, float& t, bool& lerp) const {
+	lerp = (type == eLinear) && depthBracket(depth, bfr, aftr, t);
+
+	if(!lerp) {
+		bool status = false;
+
+		bfr  = indexAtDepth(depth, &status);
+		aftr = bfr;
+		t    = 0.0f;
+
+		return status;
+	}
+
+	return true;
+}
+
+/*!
+ * @brief Reads @a count channels starting at @a first from the sample lists
+ *
+ * The sample lists must be committed.
+ */
+/* Protected */ template<typename T> void DifImage<T>::readSamples(const V2i& pos, unsigned int bfr, unsigned int aftr, float t, bool lerp, T* data, int stride, unsigned int first, unsigned int count) const {
+	for(unsigned int c = 0; c < count; c++) {
+		T a = m_pSamples->read(pos, bfr, first + c);
+
+		data[c * stride] = lerp ? Imath::lerp(a, m_pSamples->read(pos, aftr, first + c), t) : a;
+	}
+}
+
+/*!
+ * @brief Reads a rectangle of pixels at one depth
+ *
+ * Rows are read straight from the channels' blocks. Pixels outside the image
+ * are set to 0.
+ *
+ * @param[in]  origin Upper left pixel of the tile
+ * @param[in]  size   Width and height of the tile
+ * @param[in]  depth  Desired depth
+ * @param[out] data   size.x*size.y*numberOfChannels() values, row by row
+ * @param[in]  type   Interpolation type, see readData()
+ * @param[in]  layout eInterleaved or ePlanar, see writeTile()
+ * @return false if there is no data at @a depth or the tile lies outside the image
+ */
+template<typename T> bool DifImage<T>::readTile(const V2i& origin, const V2i& size, float depth, T* data, enum DifImageInterpolation type, enum DifImageLayout layout) const {
+	V2i min, max;
+
+	if(numberOfChannels() == 0 || !clipTile(origin, size, min, max)) {
+		return false;
+	}
+
+	unsigned int bfr = 0, aftr = 0;
+	float t = 0.0f;
+	bool lerp = false;
+
+	if(!resolveRead(depth, type, bfr, aftr, t, lerp)) {
+		return false;
+	}
+
+	unsigned int channels = numberOfChannels();
+
+	if(min != origin || max.x - min.x != size.x || max.y - min.y != size.y) {
+		std::fill(data, data + size.x * size.y * channels, T(0));
+	}
+
+	if(m_pSamples) {
+		int stride = (layout == eInterleaved) ? 1 : size.x * size.y;
+
+		m_pSamples->commit();
+
+		for(int y = min.y; y < max.y; y++) {
+			for(int x = min.x; x < max.x; x++) {
+				int p = (y - origin.y) * size.x + (x - origin.x);
+
+				readSamples(V2i(x, y), bfr, aftr, t, lerp, data + ((layout == eInterleaved) ? p * channels : p), stride, 0, channels);
+			}
+		}
+
+		return true;
+	}
+
+	int stride = (layout == eInterleaved) ? channels : 1;
+
+	for(unsigned int c = 0; c < channels; c++) {
+		const DifField<T>* field = getField(c);
+
+		if(!field) {
+			continue;
+		}
+
+		T* base = data + ((layout == eInterleaved) ? c : c * size.x * size.y);
+
+		// A channel that has not grown to the depth yet reads as 0
+		bool grown = (int)std::max(bfr, lerp ? aftr : bfr) < field->depth();
+
+		// A whole planar channel is interpolated block by block
+		if(grown && lerp && layout == ePlanar && origin == V2i(0, 0) && size.x == m_vSize.x && size.y == m_vSize.y) {
+			field->lerpSlice(bfr, aftr, t, base);
+			continue;
+		}
+
+		for(int y = min.y; y < max.y; y++) {
+			T* row = base + ((y - origin.y) * size.x + (min.x - origin.x)) * stride;
+
+			if(!grown) {
+				// readPixel() reads 0 past the field's depth and locks paged fields
+				for(int x = min.x; x < max.x; x++) {
+					T a = field->readPixel(V2i(x, y), bfr);
+					T b = field->readPixel(V2i(x, y), aftr);
+
+					row[(x - min.x) * stride] = lerp ? Imath::lerp(a, b, t) : a;
+				}
+			} else if(lerp) {
+				field->lerpSpan(V2i(min.x, y), bfr, aftr, t, max.x - min.x, row, stride);
+			} else {
+				field->readSpan(V2i(min.x, y), bfr, max.x - min.x, row, stride);
+			}
+		}
+	}
+
+	return true;
+}
+
+/*!
+ * @brief Reads every depth sample of a pixel
+ *
+ * The samples are returned front to back, i.e. in ascending depth order, with
+ * all channels of a sample next to each other.
+ *
+ * @param[in]  pos    Position
+ * @param[out] data   depthLevels()*numberOfChannels() values
+ * @param[out] depths (Optional) depthLevels() values receiving the depth of each sample
+ * @return The number of samples written, 0 if @a pos is outside the image
+ */
+template<typename T> unsigned int DifImage<T>::readDepthColumn(const V2i& pos, T* data, float* depths) const {
+	if(pos.x < 0 || pos.y < 0 || pos.x >= m_vSize.x || pos.y >= m_vSize.y) {
+		return 0;
+	}
+
+	unsigned int channels = numberOfChannels();
+	unsigned int count    = depthLevels();
+
+	if(count == 0) {
+		return 0;
+	}
+
+	if(m_pSamples) {
+		std::fill(data, data + count * channels, T(0));
+
+		m_pSamples->commit();
+
+		const std::vector<unsigned int>& offsets = m_pSamples->offsets();
+		const std::vector<unsigned int>& slices  = m_pSamples->slices();
+
+		unsigned int p = pos.y * m_vSize.x + pos.x;
+
+		for(unsigned int i = offsets[p]; i < offsets[p + 1]; i++) {
+			unsigned int slice = slices[i];
+
+			// Position of the slice in depth order
+			unsigned int s = std::lower_bound(m_lSortedDepths.begin(), m_lSortedDepths.end(), m_lDepthMapping[slice]) - m_lSortedDepths.begin();
+
+			while(s < count && m_lDepthOrder[s] != slice) {
+				++s;
+			}
+
+			for(unsigned int c = 0; c < channels && s < count; c++) {
+				data[s * channels + c] = m_pSamples->values(c)[i];
+			}
+		}
+
+		if(depths) {
+			std::copy(m_lSortedDepths.begin(), m_lSortedDepths.end(), depths);
+		}
+
+		return count;
+	}
+
+	for(unsigned int c = 0; c < channels; c++) {
+		const DifField<T>* field = getField(c);
+
+		if(!field) {
+			for(unsigned int i = 0; i < count; i++) {
+				data[i * channels + c] = T(0);
+			}
+		} else if(field->depth() < (int)count) {
+			// A channel might not have grown to the last depth yet, readPixel() reads 0 there
+			for(unsigned int i = 0; i < count; i++) {
+				data[i * channels + c] = field->readPixel(V2i(pos.x, pos.y), m_lDepthOrder[i]);
+			}
+		} else {
+			field->readColumn(V2i(pos.x, pos.y), &m_lDepthOrder[0], count, data + c, channels);
+		}
+	}
+
+	if(depths) {
+		std::copy(m_lSortedDepths.begin(), m_lSortedDepths.end(), depths);
+	}
+
+	return count;
+}
+
+/*!
+ * @brief Flattens the image by compositing every pixel front to back
+ *
+ * The samples of a pixel are combined in ascending depth order with the
+ * "over" operator, colours being premultiplied by alpha:
+ * C += (1 - A) * c for every channel, including @a alpha itself.
+ * A pixel stops as soon as its alpha reaches 1. Blocks are visited in
+ * storage order one block column at a time, in parallel over block columns
+ * (rows for sample list images); depths where every channel only has empty
+ * blocks of 0 are skipped.
+ *
+ * @param[out] data   size.x*size.y*numberOfChannels() values, row by row
+ * @param[in]  alpha  Name of the alpha channel
+ * @param[in]  layout eInterleaved or ePlanar, see writeTile()
+ * @return false if there is no channel named @a alpha
+ */
+template<typename T> bool DifImage<T>::flatten(T* data, const std::string& alpha, enum DifImageLayout layout) const {
+	bool status = false;
+	unsigned int alphaid = channelIndex(alpha, &status);
+
+	if(!status) {
+		_THROW("flatten() : no such alpha channel");
+		return false;
+	}
+
+	const V2i size(m_vSize.x, m_vSize.y);
+
+	if(m_pSamples) {
+		m_pSamples->commit();
+
+		// Sorted position of every slice
+		std::vector<unsigned int> rank(m_lDepthOrder.size());
+
+		for(unsigned int k = 0; k < m_lDepthOrder.size(); k++) {
+			rank[m_lDepthOrder[k]] = k;
+		}
+
+		FlattenSamples work;
+		work.samples = m_pSamples.get();
+		work.rank    = &rank;
+		work.alpha   = alphaid;
+		work.size    = size;
+		work.data    = data;
+		work.planar  = (layout == ePlanar);
+
+		DifParallelFor<FlattenSamples>(0, size.y, m_ulThreads, work);
+
+		return true;
+	}
+
+	std::vector<const DifField<T>*> fields(numberOfChannels());
+
+	for(unsigned int c = 0; c < fields.size(); c++) {
+		fields[c] = getField(c);
+	}
+
+	FlattenTile work;
+	work.fields     = &fields;
+	work.order      = &m_lDepthOrder;
+	work.alpha      = alphaid;
+	work.blockOrder = fields[alphaid] ? fields[alphaid]->blockOrder() : 0;
+	work.size       = size;
+	work.data       = data;
+	work.planar     = (layout == ePlanar);
+
+	// blockPlane() hands out planes of the alpha channel's block size
+	for(unsigned int c = 0; c < fields.size(); c++) {
+		if(fields[c] && fields[c]->blockOrder() != work.blockOrder) {
+			_THROW("flatten() : channels differ in block size");
+			return false;
+		}
+	}
+
+	work.columns = (size.x + (1 << work.blockOrder) - 1) >> work.blockOrder;
+
+	int rows = (size.y + (1 << work.blockOrder) - 1) >> work.blockOrder;
+
+	DifParallelFor<FlattenTile>(0, work.columns * rows, m_ulThreads, work);
+
+	return true;
+}
+
+/*!
+ * @brief Finds the first depth at which a channel exceeds @a threshold, for every pixel
+ *
+ * Depths are visited in ascending order, in parallel over block columns. The
+ * bounds of DifField::blockSummary() skip every block that can't exceed
+ * @a threshold, so only blocks holding such values are read.
+ *
+ * @param[in]  channelid The channel, e.g. alpha
+ * @param[out] depths    width*height depths, row by row; infinity where the
+ *                       channel never exceeds @a threshold
+ * @param[in]  threshold Values have to be greater than this
+ * @return false if there is no such channel or the image uses sample lists
+ */
+template<typename T> bool DifImage<T>::firstHit(unsigned int channelid, float* depths, T threshold) const {
+	return findHits(channelid, threshold, depths, NULL, false, V2i(0, 0), V2i(m_vSize.x, m_vSize.y));
+}
+
+/*!
+ * @brief Finds the last depth at which a channel exceeds @a threshold, for every pixel
+ *
+ * Works like firstHit() with the depths visited in descending order.
+ *
+ * @param[out] depths width*height depths, row by row; -infinity where the
+ *                    channel never exceeds @a threshold
+ * @return false if there is no such channel or the image uses sample lists
+ */
+template<typename T> bool DifImage<T>::lastHit(unsigned int channelid, float* depths, T threshold) const {
+	return findHits(channelid, threshold, depths, NULL, true, V2i(0, 0), V2i(m_vSize.x, m_vSize.y));
+}
+
+/*!
+ * @brief Marks the pixels where a channel exceeds @a threshold at any depth
+ *
+ * Works like firstHit(), including the skipped blocks.
+ *
+ * @param[out] mask width*height values, row by row, 1 for covered pixels and 0 otherwise
+ * @return false if there is no such channel or the image uses sample lists
+ */
+template<typename T> bool DifImage<T>::coverage(unsigned int channelid, unsigned char* mask, T threshold) const {
+	return findHits(channelid, threshold, NULL, mask, false, V2i(0, 0), V2i(m_vSize.x, m_vSize.y));
+}
+
+/*!
+ * @brief Lists the blocks of a channel that may hold values other than 0
+ *
+ * The list comes from the bounds of DifField::blockSummary(), it is ordered
+ * by depth, then row, then column. Iterating it together with
+ * DifField::blockData() skips every empty block. Blocks that were emptied by
+ * overwriting them with 0 may still be listed.
+ *
+ * @param[in]  channelid The channel
+ * @param[out] blocks    Block coordinates (bi, bj, bk), replaced
+ * @return The number of blocks listed
+ */
+template<typename T> unsigned int DifImage<T>::occupiedBlocks(unsigned int channelid, std::vector<V3i>& blocks) const {
+	blocks.clear();
+
+	const DifField<T>* field = validChannelId(channelid) ? getField(channelid) : NULL;
+
+	if(!field) {
+		return 0;
+	}
+
+	const V3i res = field->blockRes();
+
+	for(int bk = 0; bk < res.z; bk++) {
+		for(int bj = 0; bj < res.y; bj++) {
+			for(int bi = 0; bi < res.x; bi++) {
+				T lo, hi;
+
+				field->blockSummary(bi, bj, bk, lo, hi);
+
+				if(lo != T(0) || hi != T(0)) {
+					blocks.push_back(V3i(bi, bj, bk));
+				}
+			}
+		}
+	}
+
+	return blocks.size();
+}
+
+/*!
+ * @brief Fills the outputs of firstHit(), lastHit() and coverage() for the pixels in [@a min, @a max)
+ *
+ * The outputs are width*height, pixels outside the region are left alone and
+ * either output may be NULL.
+ */
+/* Protected */ template<typename T> bool DifImage<T>::findHits(unsigned int channelid, T threshold, float* depths, unsigned char* mask, bool last, const V2i& min, const V2i& max) const {
+	if(m_pSamples) {
+		_THROW("findHits() : not supported for sample list images");
+		return false;
+	}
+
+	const DifField<T>* field = validChannelId(channelid) ? getField(channelid) : NULL;
+
+	if(!field) {
+		_THROW("findHits() : invalid channel id");
+		return false;
+	}
+
+	if(min.x >= max.x || min.y >= max.y) {
+		return true;
+	}
+
+	const int order = field->blockOrder();
+
+	FirstHitTile work;
+	work.field     = field;
+	work.order     = &m_lDepthOrder;
+	work.sorted    = &m_lSortedDepths;
+	work.threshold = threshold;
+	work.last      = last;
+	work.miss      = last ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity();
+	work.min       = min;
+	work.max       = max;
+	work.width     = m_vSize.x;
+	work.depths    = depths;
+	work.mask      = mask;
+	work.columns   = ((max.x - 1) >> order) - (min.x >> order) + 1;
+
+	int rows = ((max.y - 1) >> order) - (min.y >> order) + 1;
+
+	// Built once up front instead of by the first block column
+	T lo, hi;
+	field->blockSummary(0, 0, 0, lo, hi);
+
+	DifParallelFor<FirstHitTile>(0, work.columns * rows, m_ulThreads, work);
+
+	return true;
+}
+
+/*!
+ * @brief Reads the data at the given position and depth of a single channel
+ * @param[in] channelid Channel Index
+ * @param[in] depth     Desired depth
+ * @param[out] retval   Variable to write the data in
+ * @param[in] type      Interpolation type
+ * @return boolean
+ */
+template<typename T> bool DifImage<T>::readChannelData(unsigned int channelid, const V2i& pos, float depth, T& retval, enum DifImage<T>::DifImageInterpolation type) const {
+	if(m_pSamples) {
+		unsigned int bfr, aftr;
+		float t;
+		bool lerp;
+
+		if(!validChannelId(channelid) || pos.x >= m_vSize.x || pos.y >= m_vSize.y || !resolveRead(depth, type, bfr, aftr, t, lerp)) {
+			return false;
+		}
+
+		m_pSamples->commit();
+		readSamples(pos, bfr, aftr, t, lerp, &retval, 1, channelid, 1);
+
+		return true;
+	}
+
+	// Packed channels are read without decoding a DifField
+	const DifPackedField<T>* packed = validChannelId(channelid) ? packedChannel(channelid) : NULL;
+	const DifField<T> *field = packed ? NULL : getField(channelid);
+
+	if(!packed && !field) {
+		return false;
+	}
+
+	if(type == eNone) {
+		bool status = false;
+		unsigned int depthid = 0;
+
+		depthid = indexAtDepth(depth, &status);
+
+		if(!status || pos.x >= m_vSize.x || pos.y >= m_vSize.y) {
+			return false;
+		}
+
+		if(packed) {
+			retval = packed->readPixel(pos, depthid);
+			return true;
+		}
+
+		// A channel that has not grown to the depth yet reads as 0, like readData()
+		retval = ((int)depthid < field->depth()) ? field->readPixel(pos, depthid) : T(0);
+
+		return true;
+	}
+	else if(type == eLinear) {
+		unsigned int bfr, aftr;
+		float t;
+
+		if(!depthBracket(depth, bfr, aftr, t)) {
+			return readChannelData(channelid, pos, depth, retval, eNone);
+		}
+
+		if(pos.x >= m_vSize.x || pos.y >= m_vSize.y) {
+			return false;
+		}
+
+		if(packed) {
+			retval = Imath::lerp(packed->readPixel(pos, bfr), packed->readPixel(pos, aftr), t);
+			return true;
+		}
+
+		T a = ((int)bfr  < field->depth()) ? field->readPixel(pos, bfr)  : T(0);
+		T b = ((int)aftr < field->depth()) ? field->readPixel(pos, aftr) : T(0);
+
+		retval = Imath::lerp(a, b, t);
+
+		return true;
+	}
+
+	return false;
+}
+
+template<typename T> bool DifImage<T>::readChannelData(const std::string& channelname, const V2i& pos, float depth, T& retval, enum DifImageInterpolation type) const {
+	bool status = false;
+	unsigned int channelid = channelIndex(channelname, &status);
+
+	if(!status) {
+		return false;
+	}
+
+	return readChannelData(channelid, pos, depth, retval, type);
+}
+
+/*!
+ * @brief Returns the number of threads used by save(), load() and the other bulk operations
+ *
+ * Defaults to the number of hardware threads.
+ */
+template<typename T> unsigned int DifImage<T>::threads() const {
+	return m_ulThreads;
+}
+
+/*!
+ * @brief Sets the number of threads used by the bulk operations
+ * @param[in] threads Number of threads, 0 selects the number of hardware threads
+ */
+template<typename T> void DifImage<T>::setThreads(unsigned int threads) {
+	m_ulThreads = (threads > 0) ? threads : difDefaultThreads();
+}
+
+/*!
+ * @brief Lets several threads write distinct pixels at the same time
+ *
+ * Every channel is grown to room for @a capacity more depths up front, so
+ * writes never resize a channel. Until endConcurrentWrites() writeData(),
+ * writeTile(), writeScanline() and addDepth() may be called from any number of
+ * threads as long as no two of them write the same pixel; pixels sharing a
+ * block are fine. Depths are registered under a reader/writer lock, sample
+ * lists stage into striped buffers merged by the next commit(). Depths beyond
+ * the capacity are refused. Reads, adding channels, merge(), resampleDepths()
+ * and save() must wait for endConcurrentWrites().
+ *
+ * @param[in] capacity Number of new depths the writers may add
+ * @return false if the image is out-of-core, packed or already in this mode
+ */
+template<typename T> bool DifImage<T>::beginConcurrentWrites(unsigned int capacity) {
+	if(m_bOutOfCore || m_bPacked || m_bConcurrentWrites) {
+		_THROW("beginConcurrentWrites() : image is out-of-core, packed or already written concurrently");
+		return false;
+	}
+
+	resolveChannels();
+
+	m_ulDepthCapacity = depthLevels() + capacity;
+
+	if(!m_pSamples) {
+		for(unsigned int c = 0; c < numberOfChannels(); c++) {
+			if(m_ulDepthCapacity > 0) {
+				m_lChannels[c]->updateDepth(m_ulDepthCapacity - 1);
+			}
+
+			m_lChannels[c]->setConcurrentWrites(true);
+		}
+	}
+
+	m_bConcurrentWrites = true;
+
+	return true;
+}
+
+/*!
+ * @brief Ends the mode started by beginConcurrentWrites()
+ *
+ * All writer threads must have finished. Channels give back the depths that
+ * were reserved but not used.
+ */
+template<typename T> void DifImage<T>::endConcurrentWrites() {
+	if(!m_bConcurrentWrites) {
+		return;
+	}
+
+	m_bConcurrentWrites = false;
+	m_ulDepthCapacity   = 0;
+
+	if(!m_pSamples) {
+		for(unsigned int c = 0; c < numberOfChannels(); c++) {
+			m_lChannels[c]->setConcurrentWrites(false);
+			m_lChannels[c]->shrinkDepth(depthLevels());
+		}
+	}
+}
+
+/// Returns true between beginConcurrentWrites() and endConcurrentWrites()
+template<typename T> bool DifImage<T>::concurrentWrites() const {
+	return m_bConcurrentWrites;
+}
+
+/*!
+ * Saves the Deep image to the given output file.
+ *
+ * The channels are compacted in parallel first (see DifField::compact()), so
+ * uniform blocks are not handed to HDF5 at all. The layers themselves are
+ * written serially since HDF5 is not thread safe.
+ */
+template<typename T> void DifImage<T>::save(Field3DOutputFile& ofp) {
+	if(m_pSamples) {
+		saveSamples(ofp);
+		return;
+	}
+
+	resolveChannels();
+
+	// Packed channels are decoded for writing only, their packed blocks stay
+	std::vector<unsigned int> decoded;
+	decodePackedChannels(decoded);
+
+	// Room left over from reserveDepths()
+	for(unsigned int i = 0; i < numberOfChannels(); i++) {
+		m_lChannels[i]->shrinkDepth(depthLevels());
+	}
+
+	{
+		CompactChannel compact;
+		compact.channels = &m_lChannels;
+
+		DifParallelFor<CompactChannel>(0, numberOfChannels(), m_ulThreads, compact);
+	}
+
+	saveDepthMapping(ofp);
+
+	for(unsigned int i = 0; i < numberOfChannels(); i++) {
+		if((m_lChannelCodecs[i] != eDifCodecNone || m_lChannelStorages[i] != eDifStorageNative) && saveEncoded(ofp, i)) {
+			continue;
+		}
+
+		ofp.writeScalarLayer<T>(m_lChannelNames[i], m_lChannels[i]);
+	}
+
+	releaseChannels(decoded);
+}
+
+/*!
+ * @brief Selects the codec save() encodes a channel with
+ *
+ * With eDifCodecNone (the default) the channel is written as a SparseField
+ * layer Field3D compresses itself. Any other codec writes it as a float layer
+ * of the same name holding a block table and the blocks encoded with @a codec
+ * (see DifCodec), uniform blocks as their value only. The codec is recorded in
+ * the layer's metadata, so load() picks it up again. Such files need this
+ * library to be read, and only on machines of the same byte order.
+ *
+ * @param[in] channelid The channel
+ * @param[in] codec     The codec
+ * @return false if there is no such channel
+ */
+template<typename T> bool DifImage<T>::setChannelCodec(unsigned int channelid, enum DifCodec codec) {
+	if(!validChannelId(channelid)) {
+		_THROW("setChannelCodec() : invalid channel id");
+		return false;
+	}
+
+	m_lChannelCodecs[channelid] = codec;
+
+	return true;
+}
+
+/// Returns the codec save() encodes a channel with, see setChannelCodec()
+template<typename T> enum DifCodec DifImage<T>::channelCodec(unsigned int channelid) const {
+	if(!validChannelId(channelid)) {
+		return eDifCodecNone;
+	}
+
+	return m_lChannelCodecs[channelid];
+}
+
+/*!
+ * @brief Selects the type save() stores a channel as
+ *
+ * Any type other than eDifStorageNative writes the channel like a codec does
+ * (see setChannelCodec()), its blocks converted to @a storage before they are
+ * encoded. load() converts them back to T, so a channel saved as
+ * eDifStorageHalf may be loaded into a DifImage<half> as well as a
+ * DifImage<float>. The channel keeps its full precision in memory unless
+ * packChannels() is called.
+ *
+ * @param[in] channelid The channel
+ * @param[in] storage   The type, see DifStorage
+ * @return false if there is no such channel
+ */
+template<typename T> bool DifImage<T>::setChannelStorage(unsigned int channelid, enum DifStorage storage) {
+	if(!validChannelId(channelid)) {
+		_THROW("setChannelStorage() : invalid channel id");
+		return false;
+	}
+
+	m_lChannelStorages[channelid] = storage;
+
+	return true;
+}
+
+/// Returns the type save() stores a channel as, see setChannelStorage()
+template<typename T> enum DifStorage DifImage<T>::channelStorage(unsigned int channelid) const {
+	if(!validChannelId(channelid)) {
+		return eDifStorageNative;
+	}
+
+	return m_lChannelStorages[channelid];
+}
+
+/*!
+ * @brief Writes a channel encoded with its codec, see setChannelCodec()
+ *
+ * The blocks are encoded in parallel. The bytes are then packed into the
+ * floats of a field of whole blocks, so Field3D stores no padding. Field3D
+ * has no layer of raw bytes, the layer records the byte order of the host
+ * instead, see difByteOrder().
+ *
+ * @return false if the encoded channel is too large for the layer metadata
+ */
+/* Protected */ template<typename T> bool DifImage<T>::saveEncoded(Field3DOutputFile& ofp, unsigned int channelid) {
+	const DifField<T>* field = m_lChannels[channelid].get();
+	const V3i res    = field->blockRes();
+	const int blocks = res.x * res.y * res.z;
+
+	std::vector<std::vector<unsigned char> > encoded(blocks);
+	std::vector<DifCodecBlock> table(blocks);
+
+	EncodeBlocks work;
+	work.field   = field;
+	work.codec   = m_lChannelCodecs[channelid];
+	work.storage = m_lChannelStorages[channelid];
+	work.encoded = &encoded;
+	work.table   = &table;
+
+	DifParallelFor<EncodeBlocks>(0, blocks, m_ulThreads, work);
+
+	size_t bytes = blocks * sizeof(DifCodecBlock);
+
+	for(int i = 0; i < blocks; i++) {
+		table[i].offset = bytes - blocks * sizeof(DifCodecBlock);
+		bytes += encoded[i].size();
+	}
+
+	if(bytes > (size_t)INT_MAX) {
+		return false;
+	}
+
+	// A layer one block wide and high
+	const int size  = 1 << field->blockOrder();
+	const int plane = size * size;
+	const int words = (bytes + sizeof(float) - 1) / sizeof(float);
+	const int depth = std::max(1, (words + plane - 1) / plane);
+
+	DifField<float>::Ptr layer = new DifField<float>(V2i(size, size));
+
+	if(layer->blockOrder() != field->blockOrder()) {
+		layer->setBlockOrder(field->blockOrder());
+	}
+
+	layer->updateDepth(depth - 1);
+
+	{
+		// Whole blocks, the words are assigned to them unchanged
+		const int slabs = layer->blockRes().z;
+		std::vector<float> packed(slabs * size * plane, 0.0f);
+		unsigned char* out = reinterpret_cast<unsigned char*>(&packed[0]);
+
+		if(blocks > 0) {
+			memcpy(out, &table[0], blocks * sizeof(DifCodecBlock));
+			out += blocks * sizeof(DifCodecBlock);
+		}
+
+		for(int i = 0; i < blocks; i++) {
+			if(!encoded[i].empty()) {
+				memcpy(out, &encoded[i][0], encoded[i].size());
+				out += encoded[i].size();
+			}
+
+			std::vector<unsigned char>().swap(encoded[i]);
+		}
+
+		// writeSpan() would skip words equal to the empty value, -0.0f among them
+		for(int k = 0; k < slabs; k++) {
+			layer->assignBlock(0, 0, k, &packed[k * size * plane], 0.0f);
+		}
+	}
+
+	layer->name = m_lChannelNames[channelid];
+	layer->metadata().setIntMetadata(m_scChannelIndexName, channelid);
+	layer->metadata().setIntMetadata(m_scCodecName, m_lChannelCodecs[channelid]);
+	layer->metadata().setIntMetadata(m_scCodecWidthName, m_vSize.x);
+	layer->metadata().setIntMetadata(m_scCodecHeightName, m_vSize.y);
+	layer->metadata().setIntMetadata(m_scCodecDepthName, field->depth());
+	layer->metadata().setIntMetadata(m_scCodecBlockOrderName, field->blockOrder());
+	layer->metadata().setIntMetadata(m_scCodecValueSizeName, sizeof(T));
+	layer->metadata().setIntMetadata(m_scCodecBytesName, bytes);
+	layer->metadata().setIntMetadata(m_scCodecStorageName, m_lChannelStorages[channelid]);
+	layer->metadata().setIntMetadata(m_scCodecByteOrderName, difByteOrder());
+
+	ofp.writeScalarLayer<float>(m_lChannelNames[channelid], layer);
+
+	return true;
+}
+
+/*!
+ * @brief Decodes a layer written by saveEncoded()
+ *
+ * The blocks are decoded in parallel. The codec is left in the metadata of the
+ * new field for adoptCodec(). Layers written on a host of another byte order
+ * are rejected, see difByteOrder().
+ *
+ * @return A new DifField or NULL if the layer doesn't match the image or is corrupt
+ */
+/* Protected */ template<typename T> DifField<T>* DifImage<T>::decodeChannel(const SparseField<float>& payload) const {
+	const int width  = payload.metadata().intMetadata(m_scCodecWidthName, 0);
+	const int height = payload.metadata().intMetadata(m_scCodecHeightName, 0);
+	const int depth  = payload.metadata().intMetadata(m_scCodecDepthName, 0);
+	const int order  = payload.metadata().intMetadata(m_scCodecBlockOrderName, -1);
+	const int bytes  = payload.metadata().intMetadata(m_scCodecBytesName, -1);
+
+	const enum DifStorage storage = (enum DifStorage)payload.metadata().intMetadata(m_scCodecStorageName, eDifStorageNative);
+
+	// Native values only load into images of the same value size
+	if(width != m_vSize.x || height != m_vSize.y || depth < 0 || order < 0 || order > 8 || bytes < 0 || storage > eDifStorageUInt32 ||
+			(storage == eDifStorageNative && payload.metadata().intMetadata(m_scCodecValueSizeName, 0) != (int)sizeof(T))) {
+		_THROW("decodeChannel() : encoded layer doesn't match the image");
+		return NULL;
+	}
+
+	if(payload.metadata().intMetadata(m_scCodecByteOrderName, 0) != difByteOrder()) {
+		_THROW("decodeChannel() : encoded layer was written with another byte order");
+		return NULL;
+	}
+
+	// Unpack the bytes from the floats
+	std::vector<float> packed;
+
+	{
+		DifField<float> layer(payload);
+		const V3i res = layer.getSize();
+
+		packed.resize(res.x * res.y * res.z);
+
+		if(packed.size() * sizeof(float) < (size_t)bytes) {
+			_THROW("decodeChannel() : encoded layer is truncated");
+			return NULL;
+		}
+
+		for(int k = 0; k < res.z; k++) {
+			for(int j = 0; j < res.y; j++) {
+				layer.readSpan(V2i(0, j), k, res.x, &packed[(k * res.y + j) * res.x]);
+			}
+		}
+	}
+
+	DifField<T>* field = new DifField<T>(V2i(width, height));
+
+	if(field->blockOrder() != order) {
+		field->setBlockOrder(order);
+	}
+
+	if(depth > 0) {
+		field->updateDepth(depth - 1);
+	}
+
+	const V3i res    = field->blockRes();
+	const int blocks = res.x * res.y * res.z;
+
+	if((size_t)bytes < blocks * sizeof(DifCodecBlock)) {
+		_THROW("decodeChannel() : encoded layer is truncated");
+		delete field;
+		return NULL;
+	}
+
+	// Blocks are assigned concurrently, the flag must not change meanwhile
+	field->setContainsData();
+
+	std::vector<char> failed(blocks, 0);
+
+	DecodeBlocks work;
+	work.payload = blocks > 0 ? reinterpret_cast<const unsigned char*>(&packed[0]) : NULL;
+	work.size    = bytes;
+	work.storage = storage;
+	work.field   = field;
+	work.failed  = &failed;
+
+	DifParallelFor<DecodeBlocks>(0, blocks, m_ulThreads, work);
+
+	if(std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+		_THROW("decodeChannel() : encoded layer is corrupt");
+		delete field;
+		return NULL;
+	}
+
+	field->name = payload.name;
+	field->metadata().setIntMetadata(m_scChannelIndexName, payload.metadata().intMetadata(m_scChannelIndexName, -1));
+	field->metadata().setIntMetadata(m_scCodecName, payload.metadata().intMetadata(m_scCodecName, eDifCodecNone));
+	field->metadata().setIntMetadata(m_scCodecStorageName, storage);
+
+	return field;
+}
+
+/// Writes the depth mapping layer, flagged as sample storage for eSamples images
+/* Protected */ template<typename T> void DifImage<T>::saveDepthMapping(Field3DOutputFile& ofp) {
+	SparseField<float>::Ptr dptmapping = new SparseField<float>();
+	dptmapping->name = m_scDepthMappingName;
+	dptmapping->setSize(V3i(1, 1, m_lDepthMapping.size()));
+
+	if(m_pSamples) {
+		dptmapping->metadata().setIntMetadata(m_scSampleStorageName, 1);
+	}
+
+	dptmapping->metadata().setFloatMetadata(m_scDepthToleranceName, m_fDepthTolerance);
+
+	DepthMappingListIter dit;
+	unsigned int i = 0;
+
+	for(dit = m_lDepthMapping.begin(); dit != m_lDepthMapping.end(); dit++) {
+		dptmapping->lvalue(0, 0, i) = (*dit);
+		++i;
+	}
+
+	ofp.writeScalarLayer<float>(m_scDepthMappingName, dptmapping);
+}
+
+/*!
+ * @brief Saves an eSamples image
+ *
+ * Besides the depth mapping three kinds of layers are written: the number of
+ * samples per pixel (float, image sized), the depth index of every sample and
+ * one layer per channel with the value of every sample. The sample arrays are
+ * stored as rows of m_sciSampleRowLength samples.
+ */
+/* Protected */ template<typename T> void DifImage<T>::saveSamples(Field3DOutputFile& ofp) {
+	m_pSamples->commit();
+
+	saveDepthMapping(ofp);
+
+	const std::vector<unsigned int>& offsets = m_pSamples->offsets();
+	const std::vector<unsigned int>& slices  = m_pSamples->slices();
+
+	{
+		SparseField<float>::Ptr counts = new SparseField<float>();
+		counts->name = m_scSampleCountsName;
+		counts->setSize(V3i(m_vSize.x, m_vSize.y, 1));
+		counts->clear(0.0f);
+
+		for(int y = 0; y < m_vSize.y; y++) {
+			for(int x = 0; x < m_vSize.x; x++) {
+				unsigned int p = y * m_vSize.x + x;
+
+				if(offsets[p + 1] != offsets[p]) {
+					counts->lvalue(x, y, 0) = float(offsets[p + 1] - offsets[p]);
+				}
+			}
+		}
+
+		ofp.writeScalarLayer<float>(m_scSampleCountsName, counts);
+	}
+
+	const int samples = slices.size();
+	const int width   = std::max(1, std::min(samples, m_sciSampleRowLength));
+	const int rows    = std::max(1, (samples + width - 1) / width);
+
+	{
+		SparseField<float>::Ptr field = new SparseField<float>();
+		field->name = m_scSampleSlicesName;
+		field->setSize(V3i(width, rows, 1));
+		field->clear(0.0f);
+		field->metadata().setIntMetadata(m_scSampleCountName, samples);
+
+		for(int i = 0; i < samples; i++) {
+			field->lvalue(i % width, i / width, 0) = float(slices[i]);
+		}
+
+		ofp.writeScalarLayer<float>(m_scSampleSlicesName, field);
+	}
+
+	for(unsigned int c = 0; c < numberOfChannels(); c++) {
+		const std::vector<T>& values = m_pSamples->values(c);
+
+		typename SparseField<T>::Ptr field = new SparseField<T>();
+		field->name = m_lChannelNames[c];
+		field->setSize(V3i(width, rows, 1));
+		field->clear(T(0));
+		field->metadata().setIntMetadata(m_scChannelIndexName, c);
+
+		for(int i = 0; i < samples; i++) {
+			if(values[i] != T(0)) {
+				field->lvalue(i % width, i / width, 0) = values[i];
+			}
+		}
+
+		ofp.writeScalarLayer<T>(m_lChannelNames[c], field);
+	}
+}
+
+/*!
+ * @brief Loads the sample layers written by saveSamples()
+ * @param[in] ifp      An opened Input file
+ * @param[in] channels Names of the channels to load, empty for all of them
+ */
+/* Protected */ template<typename T> bool DifImage<T>::loadSamples(Field3DInputFile& ifp, const std::vector<std::string>& channels) {
+	SparseField<float>::Ptr counts;
+	SparseField<float>::Ptr slices;
+
+	{
+		Field<float>::Vec fields = ifp.readScalarLayers<float>(m_scSampleCountsName);
+
+		if(fields.size() > 0) {
+			counts = field_dynamic_cast< SparseField<float> >(fields[0]);
+		}
+
+		fields = ifp.readScalarLayers<float>(m_scSampleSlicesName);
+
+		if(fields.size() > 0) {
+			slices = field_dynamic_cast< SparseField<float> >(fields[0]);
+		}
+	}
+
+	if(!counts || !slices) {
+		_THROW("load() : sample layers missing");
+		return false;
+	}
+
+	V3i res = counts->dataResolution();
+	V3i shape = slices->dataResolution();
+
+	int samples = slices->metadata().intMetadata(m_scSampleCountName, 0);
+
+	{
+		std::vector<unsigned int> lcounts(res.x * res.y);
+		size_t total = 0;
+
+		for(int y = 0; y < res.y; y++) {
+			for(int x = 0; x < res.x; x++) {
+				lcounts[y * res.x + x] = (unsigned int)counts->fastValue(x, y, 0);
+				total += lcounts[y * res.x + x];
+			}
+		}
+
+		// The count is only metadata, the sample layers have to hold exactly that many
+		if(samples < 0 || (size_t)samples != total || (size_t)samples > size_t(shape.x) * shape.y) {
+			_THROW("load() : sample count doesn't match the sample layers");
+			return false;
+		}
+
+		m_vSize = V3i(res.x, res.y, 1);
+		m_pSamples.reset(new DifSampleList<T>(V2i(res.x, res.y)));
+
+		std::vector<unsigned int> lslices(samples);
+
+		for(int i = 0; i < samples; i++) {
+			lslices[i] = (unsigned int)slices->fastValue(i % shape.x, i / shape.x, 0);
+		}
+
+		m_pSamples->assign(lcounts, lslices);
+	}
+
+	// Channels keep their saved order unless a selection is given
+	std::vector<std::string> names(channels);
+	bool ordered = names.empty();
+
+	if(ordered) {
+		std::vector<std::string> partitions;
+		ifp.getPartitionNames(partitions);
+
+		for(size_t i = 0; i < partitions.size(); i++) {
+			std::vector<std::string> layers;
+			ifp.getScalarLayerNames(layers, partitions[i]);
+
+			for(size_t j = 0; j < layers.size(); j++) {
+				if(layers[j] != m_scDepthMappingName && layers[j] != m_scSampleCountsName && layers[j] != m_scSampleSlicesName &&
+				   layers[j].length() > 0 && std::find(names.begin(), names.end(), layers[j]) == names.end()) {
+					names.push_back(layers[j]);
+				}
+			}
+		}
+	}
+
+	std::multimap<int, typename SparseField<T>::Ptr> fields;
+
+	for(size_t i = 0; i < names.size(); i++) {
+		typename Field<T>::Vec layer = ifp.readScalarLayers<T>(names[i]);
+
+		for(size_t j = 0; j < layer.size(); j++) {
+			typename SparseField<T>::Ptr handle = field_dynamic_cast< SparseField<T> >(layer[j]);
+
+			if(!handle || handle->dataResolution() != shape) {
+				continue;
+			}
+
+			handle->name = names[i];
+
+			int idx = ordered ? handle->metadata().intMetadata(m_scChannelIndexName, INT_MAX) : (int)i;
+			fields.insert(std::make_pair(idx, handle));
+			break;
+		}
+	}
+
+	typename std::multimap<int, typename SparseField<T>::Ptr>::iterator it;
+
+	for(it = fields.begin(); it != fields.end(); it++) {
+		if(hasChannel(it->second->name)) {
+			continue;
+		}
+
+		unsigned int retid;
+
+		m_pSamples->addChannel();
+		registerChannel(it->second->name, NULL, retid);
+
+		std::vector<T>& values = m_pSamples->values(retid);
+
+		for(int i = 0; i < samples; i++) {
+			values[i] = it->second->fastValue(i % shape.x, i / shape.x, 0);
+		}
+	}
+
+	return (numberOfChannels() > 0);
+}
+
+template<typename T> void DifImage<T>::loadDepthMapping(const SparseField<float>::Ptr field) {
+	V3i dptDim = field->dataResolution();
+
+	std::vector<float> depths(dptDim.z);
+
+	for(int i = 0; i < dptDim.z; i++) {
+		depths[i] = field->fastValue(0, 0, i);
+	}
+
+	m_fDepthTolerance = field->metadata().floatMetadata(m_scDepthToleranceName, m_fDepthTolerance);
+
+	assignDepths(depths);
+}
+
+/*!
+ * @brief Replaces the depth mapping
+ *
+ * Depths are taken as they are, duplicates keep their own slice.
+ *
+ * @param[in] depths The depth of every slice in storage order
+ */
+/* Protected */ template<typename T> void DifImage<T>::assignDepths(const std::vector<float>& depths) {
+	m_lDepthMapping.clear();
+	m_lSortedDepths.clear();
+	m_lDepthOrder.clear();
+
+	for(unsigned int i = 0; i < depths.size(); i++) {
+		float dpt = depths[i];
+		unsigned int pos = sortedDepthPosition(dpt);
+
+		m_lDepthMapping.push_back(dpt);
+		m_lSortedDepths.insert(m_lSortedDepths.begin() + pos, dpt);
+		m_lDepthOrder.insert(m_lDepthOrder.begin() + pos, i);
+	}
+}
+
+/// Loads the Dif Image from an Input file.
+template<typename T> bool DifImage<T>::load(Field3DInputFile& ifp) {
+	typedef typename Field< T >::Vec           FieldVector;
+	typedef typename Field< T >::Vec::iterator FieldVectorIterator;
+	typedef typename SparseField< T >::Ptr     SparseFieldPtr;
+	typedef typename std::map<std::string, SparseFieldPtr> SparseFieldList;
+	typedef typename std::map<std::string, SparseFieldPtr>::iterator SparseFieldListIterator;
+	typedef typename std::multimap<int, SparseFieldPtr> SparseFieldOrder;
+	typedef typename std::multimap<int, SparseFieldPtr>::iterator SparseFieldOrderIterator;
+
+	if(m_bPacked) {
+		_THROW("load() : packed images are read only");
+		return false;
+	}
+
+	// No out of core load may switch paging on meanwhile
+	boost::shared_lock<boost::shared_mutex> reading(difLoadMutex());
+
+	// giving a layerName does not work for some reason so we look manually for our structure
+	Field<float>::Vec dptMappings = ifp.readScalarLayers<float>();
+	bool depthLoaded = false;
+
+	if(dptMappings.size() < 1) {
+		_THROW("load() : no depth mapping field available");
+		return false;
+	}
+
+	{
+		Field<float>::Vec::iterator it;
+
+		for(it = dptMappings.begin(); it != dptMappings.end();  it++) {
+			if((*it)->name == m_scDepthMappingName) {
+				SparseField<float>::Ptr depthField = field_dynamic_cast< SparseField<float> >(*it);
+
+				if(!depthField) {
+					_THROW("load() : depth field is not a SparseField of type float");
+					return false;
+				}
+
+				loadDepthMapping(depthField);
+				depthLoaded = true;
+
+				if(depthField->metadata().intMetadata(m_scSampleStorageName, 0)) {
+					return loadSamples(ifp, std::vector<std::string>());
+				}
+
+				break;
+			}
+		}
+	}
+
+	// No depth mapping available
+	if(!depthLoaded) {
+		_THROW("load() : couldn't load depth mapping");
+		return false;
+	}
+	
+
+	std::vector<SparseField<float>::Ptr> payloads;
+
+	for(size_t i = 0; i < dptMappings.size(); i++) {
+		SparseField<float>::Ptr handle = field_dynamic_cast< SparseField<float> >(dptMappings[i]);
+
+		if(handle && isEncoded(*handle)) {
+			payloads.push_back(handle);
+		}
+	}
+
+	// Float channels are among these layers, they are released before being read again below
+	dptMappings.clear();
+
+	FieldVector fields = ifp.readScalarLayers<T>();
+
+	if(fields.size() < 1 && payloads.empty()) {
+		_THROW("load() : no channels available");
+		return false;
+	}
+
+	{
+		FieldVectorIterator it;
+		V3i initialSize;
+		bool sizeSet = false;
+
+		// Channels get their ids in the order they were saved with
+		SparseFieldOrder ordered;
+
+		for(it = fields.begin(); it != fields.end();  it++) {
+			if((*it)->name == m_scDepthMappingName || (*it)->name.length() == 0) {
+				continue;
+			}
+
+			SparseFieldPtr handle = field_dynamic_cast< SparseField<T> >(*it);
+
+			if(!handle || isEncoded(*handle)) {
+				continue;
+			}
+
+			if(!sizeSet) {
+				m_vSize = handle->dataResolution();
+				sizeSet = true;
+			}
+
+			// check for size mismatch, streamed parts may have fewer depths
+			if(m_vSize.x != handle->dataResolution().x || m_vSize.y != handle->dataResolution().y) {
+				continue;
+			}
+
+			int idx = handle->metadata().intMetadata(m_scChannelIndexName, -1);
+
+			ordered.insert(std::make_pair(idx < 0 ? INT_MAX : idx, handle));
+		}
+
+		// Encoded channels are decoded right away, each in parallel over its blocks
+		std::vector<typename DifField<T>::Ptr> decoded;
+
+		for(size_t i = 0; i < payloads.size(); i++) {
+			if(!sizeSet) {
+				m_vSize = V3i(payloads[i]->metadata().intMetadata(m_scCodecWidthName, 0), payloads[i]->metadata().intMetadata(m_scCodecHeightName, 0), 1);
+				sizeSet = true;
+			}
+
+			DifField<T>* field = decodeChannel(*payloads[i]);
+
+			if(!field) {
+				continue;
+			}
+
+			int idx = field->metadata().intMetadata(m_scChannelIndexName, -1);
+
+			decoded.push_back(field);
+			ordered.insert(std::make_pair(idx < 0 ? INT_MAX : idx, SparseFieldPtr(field)));
+		}
+
+		// Layers have been read serially, converting them is done in parallel
+		std::vector<SparseField<T>*> sources;
+		std::vector<DifField<T>*>    targets(ordered.size(), (DifField<T>*)NULL);
+
+		SparseFieldOrderIterator oit;
+
+		for(oit = ordered.begin(); oit != ordered.end(); oit++) {
+			sources.push_back(oit->second.get());
+
+			// Decoded channels are taken over as they are
+			for(size_t i = 0; i < decoded.size(); i++) {
+				if(decoded[i].get() == oit->second.get()) {
+					targets[sources.size() - 1] = decoded[i].get();
+				}
+			}
+		}
+
+		ConvertChannel convert;
+		convert.sources = &sources;
+		convert.targets = &targets;
+
+		DifParallelFor<ConvertChannel>(0, sources.size(), m_ulThreads, convert);
+
+		for(size_t i = 0; i < targets.size(); i++) {
+			unsigned int retid;
+
+			// Another part of a streamed channel
+			if(hasChannel(sources[i]->name)) {
+				m_lChannels[channelIndex(sources[i]->name)]->mergeBlocks(*targets[i]);
+				delete targets[i];
+				continue;
+			}
+
+			registerChannel(sources[i]->name, targets[i], retid);
+		}
+	}
+
+	return (m_lChannels.size() > 0) ? true : false;
+}
+
+/*!
+ * @brief Loads only some channels of a Dif Image from an Input file
+ *
+ * Only the layers named in @a channels are read, the others are never
+ * decoded. Channels get their ids in the order of @a channels, an empty list
+ * selects every channel in the file.
+ *
+ * With @a mode eLazy only the first channel is decoded right away, the others
+ * are registered by name and decoded on their first access. @a ifp then has
+ * to stay open until every channel has been accessed or resolveChannels()
+ * has been called.
+ *
+ * With @a mode eOutOfCore the channels are read through Field3D's dynamic
+ * block loading: a block is only read from the file when it is accessed and
+ * evicted again once the budget set with difSetMemoryBudget() is exceeded.
+ * @a ifp may be closed afterwards, the image is read only. Such loads turn
+ * paging on for the whole process while they read, so they wait for all
+ * other loads and lazy decodes to finish and block them meanwhile, see
+ * difLoadMutex().
+ *
+ * Images saved with eSamples storage are always loaded eagerly.
+ *
+ * @param[in] ifp      An opened Input file
+ * @param[in] channels Names of the channels to load
+ * @param[in] mode     eEager, eLazy or eOutOfCore
+ * @return false if the depth mapping or none of the channels could be read
+ */
+template<typename T> bool DifImage<T>::load(Field3DInputFile& ifp, const std::vector<std::string>& channels, enum DifImageLoadMode mode) {
+	if(m_bPacked) {
+		_THROW("load() : packed images are read only");
+		return false;
+	}
+
+	boost::shared_lock<boost::shared_mutex> reading(difLoadMutex(), boost::defer_lock);
+	boost::unique_lock<boost::shared_mutex> paging(difLoadMutex(), boost::defer_lock);
+
+	if(mode == eOutOfCore) {
+		paging.lock();
+	} else {
+		reading.lock();
+	}
+
+	{
+		Field<float>::Vec dptMappings = ifp.readScalarLayers<float>(m_scDepthMappingName);
+		SparseField<float>::Ptr depthField;
+
+		if(dptMappings.size() > 0) {
+			depthField = field_dynamic_cast< SparseField<float> >(dptMappings[0]);
+		}
+
+		if(!depthField) {
+			_THROW("load() : couldn't load depth mapping");
+			return false;
+		}
+
+		loadDepthMapping(depthField);
+
+		if(depthField->metadata().intMetadata(m_scSampleStorageName, 0)) {
+			return loadSamples(ifp, channels);
+		}
+	}
+
+	// Every layer listed in the file
+	std::vector<std::string> available;
+
+	{
+		std::vector<std::string> partitions;
+		ifp.getPartitionNames(partitions);
+
+		for(size_t i = 0; i < partitions.size(); i++) {
+			std::vector<std::string> layers;
+			ifp.getScalarLayerNames(layers, partitions[i]);
+
+			for(size_t j = 0; j < layers.size(); j++) {
+				if(layers[j] != m_scDepthMappingName && layers[j].length() > 0 && std::find(available.begin(), available.end(), layers[j]) == available.end()) {
+					available.push_back(layers[j]);
+				}
+			}
+		}
+	}
+
+	// No filter, take every layer
+	std::vector<std::string> names(channels.empty() ? available : channels);
+
+	bool sizeSet = false;
+
+	// The memory limit has to be active while reading so blocks are paged
+	SparseFileManager& manager = SparseFileManager::singleton();
+	const bool limited = manager.doLimitMemUse();
+
+	if(mode == eOutOfCore) {
+		manager.setLimitMemUse(true);
+	}
+
+	for(size_t i = 0; i < names.size(); i++) {
+		if(hasChannel(names[i])) {
+			continue;
+		}
+
+		unsigned int retid;
+
+		// Like eager loads, names the file doesn't have are skipped
+		if(mode == eLazy && sizeSet) {
+			if(std::find(available.begin(), available.end(), names[i]) != available.end()) {
+				registerChannel(names[i], NULL, retid);
+			}
+
+			continue;
+		}
+
+		DifField<T>* field = NULL;
+
+		// The first channel defines the image size
+		if(!sizeSet) {
+			typename Field<T>::Vec fields = ifp.readScalarLayers<T>(names[i]);
+			Field<float>::Vec payloads;
+			FieldRes::Ptr handle;
+
+			if(!boost::is_same<T, float>::value) {
+				payloads = ifp.readScalarLayers<float>(names[i]);
+			}
+
+			if(fields.size() > 0) {
+				handle = field_dynamic_cast< SparseField<T> >(fields[0]);
+			} else if(payloads.size() > 0) {
+				handle = field_dynamic_cast< SparseField<float> >(payloads[0]);
+			}
+
+			if(!handle) {
+				continue;
+			}
+
+			// Encoded channels carry their size in the metadata
+			if(isEncoded(*handle)) {
+				m_vSize = V3i(handle->metadata().intMetadata(m_scCodecWidthName, 0), handle->metadata().intMetadata(m_scCodecHeightName, 0), 1);
+			} else {
+				m_vSize = handle->dataResolution();
+			}
+
+			sizeSet = true;
+
+			field = combineParts(fields, payloads, names[i]);
+		} else {
+			field = readChannel(ifp, names[i]);
+		}
+
+		if(field) {
+			registerChannel(names[i], field, retid);
+		}
+	}
+
+	if(mode == eOutOfCore) {
+		manager.setLimitMemUse(limited);
+	}
+
+	if(mode == eLazy && numberOfChannels() > 0) {
+		m_pLazyFile = &ifp;
+	}
+
+	m_bOutOfCore = (mode == eOutOfCore);
+
+	return (m_lChannels.size() > 0) ? true : false;
+}
+
+/*!
+ * @brief Computes the nearest depth
+ *
+ * An (within depthTolerance()) equal depth is always returned, otherwise the
+ * closest depth before resp. after @a dpt.
+ *
+ * @param[in] dpt    The Depth
+ * @param[in] type   Type
+ * @param[out] retid The nearest depth Index (0 if there is none)
+ * @return false if there is no depth in the requested direction
+ */
+template<typename T> bool DifImage<T>::getNearestDepthIndex(float dpt, DifImage<T>::DifImageGetType type, unsigned int& retid) const {
+	bool status = false;
+
+	retid = indexAtDepth(dpt, &status);
+
+	if(status) {
+		return true;
+	}
+
+	unsigned int pos = sortedDepthPosition(dpt);
+
+	if(type == eBefore) {
+		if(pos == 0) {
+			return false;
+		}
+
+		retid = m_lDepthOrder[pos - 1];
+	} else {
+		if(pos >= m_lDepthOrder.size()) {
+			return false;
+		}
+
+		retid = m_lDepthOrder[pos];
+	}
+
+	return true;
+}
+
+/*!
+ * @brief Finds the two depths enclosing @a dpt
+ * @param[in]  dpt  The Depth
+ * @param[out] bfr  Index of the closest depth before @a dpt
+ * @param[out] aftr Index of the closest depth after @a dpt
+ * @param[out] t    Interpolation weight of @a aftr (0..1)
+ * @return false if @a dpt matches an existing depth or lies outside the depth range
+ */
+template<typename T> bool DifImage<T>::depthBracket(float dpt, unsigned int& bfr, unsigned int& aftr, float& t) const {
+	unsigned int pos = sortedDepthPosition(dpt);
+
+	if(pos == 0 || pos >= m_lSortedDepths.size()) {
+		return false;
+	}
+
+	float d_bfr  = m_lSortedDepths[pos - 1];
+	float d_aftr = m_lSortedDepths[pos];
+
+	if(dpt - d_bfr <= m_fDepthTolerance || d_aftr - dpt <= m_fDepthTolerance) {
+		return false;
+	}
+
+	bfr  = m_lDepthOrder[pos - 1];
+	aftr = m_lDepthOrder[pos];
+	t    = (dpt - d_bfr) / (d_aftr - d_bfr);
+
+	return true;
+}
+
+/*!
+ * @brief Adds a depth
+ *
+ * With @a sync every channel grows to the new depth right away. Without it
+ * only the depth is registered: channels grow on the first write to it and
+ * read as 0 there until then. Use addDepths() or reserveDepths() to add many
+ * depths at once.
+ *
+ * @param[in] dpt  The depth
+ * @param[in] sync Grow the channels now
+ */
+template<typename T> void DifImage<T>::addDepth(float dpt, bool sync) {
+	if(m_bOutOfCore || m_bPacked) {
+		_THROW("addDepth() : out-of-core and packed images are read only");
+		return;
+	}
+
+	bool added = false;
+	unsigned int idx = insertDepth(dpt, &added);
+
+	if(idx == UINT_MAX) {
+		_THROW("addDepth() : depth capacity exhausted");
+		return;
+	}
+
+	if(!added) {
+		return;
+	}
+
+	if(sync) {
+		growChannels(idx + 1);
+	}
+}
+
+/*!
+ * @brief Adds several depths, growing every channel only once
+ *
+ * All depths are registered first, then the channels grow to the new depth
+ * count in parallel.
+ *
+ * @param[in] depths The depths, in the storage order they should get
+ * @return false if the image is out-of-core or the capacity of
+ *         beginConcurrentWrites() is exhausted
+ */
+template<typename T> bool DifImage<T>::addDepths(const std::vector<float>& depths) {
+	if(m_bOutOfCore || m_bPacked) {
+		_THROW("addDepths() : out-of-core and packed images are read only");
+		return false;
+	}
+
+	for(size_t i = 0; i < depths.size(); i++) {
+		if(insertDepth(depths[i]) == UINT_MAX) {
+			_THROW("addDepths() : depth capacity exhausted");
+			return false;
+		}
+	}
+
+	growChannels(depthLevels());
+
+	return true;
+}
+
+/*!
+ * @brief Makes room for @a count more depths up front
+ *
+ * Every channel grows once, in parallel, to depthLevels() + @a count depth
+ * indices, so neither addDepth() nor writes to the next @a count new depths
+ * resize a channel again. Room that is still unused when the image is saved
+ * is given back first.
+ *
+ * @param[in] count Number of depths to make room for
+ * @return false if the image is out-of-core, packed or written concurrently
+ */
+template<typename T> bool DifImage<T>::reserveDepths(unsigned int count) {
+	if(m_bOutOfCore || m_bPacked || m_bConcurrentWrites) {
+		_THROW("reserveDepths() : image is out-of-core, packed or written concurrently");
+		return false;
+	}
+
+	m_lDepthMapping.reserve(depthLevels() + count);
+	m_lSortedDepths.reserve(depthLevels() + count);
+	m_lDepthOrder.reserve(depthLevels() + count);
+
+	growChannels(depthLevels() + count);
+
+	return true;
+}
+
+/// Grows every channel to at least @a depths depth indices, in parallel over channels
+/* Protected */ template<typename T> void DifImage<T>::growChannels(unsigned int depths) {
+	if(m_pSamples || depths == 0) {
+		return;
+	}
+
+	resolveChannels();
+
+	GrowChannel grow;
+	grow.channels = &m_lChannels;
+	grow.depths   = depths;
+
+	DifParallelFor<GrowChannel>(0, numberOfChannels(), m_ulThreads, grow);
+}
+
+
+/*!
+ * @brief Resamples every channel to a new list of depths
+ *
+ * Each target depth reads what readTile() with eLinear would return there:
+ * the matching slice or an interpolation of the two enclosing ones. Depths
+ * outside the range of the image read as 0. The brackets are computed once and
+ * the channels are streamed through DifField::lerpFrom() block by block, in
+ * parallel over channels, rows of blocks and blocks of target depths.
+ *
+ * Out-of-core and lazily loaded images end up fully in memory. Sample list
+ * and packed images are not supported.
+ *
+ * @param[in] depths The new depths in storage order
+ * @return false for sample list and packed images
+ */
+template<typename T> bool DifImage<T>::resampleDepths(const std::vector<float>& depths) {
+	if(m_bPacked || m_bConcurrentWrites) {
+		_THROW("resampleDepths() : image is packed or written concurrently");
+		return false;
+	}
+
+	if(m_pSamples) {
+		_THROW("resampleDepths() : sample list images can't be resampled");
+		return false;
+	}
+
+	resolveChannels();
+
+	ChannelList targets;
+	resampleChannels(depths, targets);
+
+	m_lChannels.swap(targets);
+	assignDepths(depths);
+
+	m_bOutOfCore = false;
+
+	return true;
+}
+
+/*!
+ * @brief Resamples every channel into another image
+ *
+ * Same as resampleDepths(), but this image is left untouched.
+ *
+ * @param[in]  depths The new depths in storage order
+ * @param[out] dst    An image of the same size without channels and depths
+ * @return false for sample list images or an unsuitable @a dst
+ */
+template<typename T> bool DifImage<T>::resampleDepths(const std::vector<float>& depths, DifImage<T>& dst) const {
+	if(m_pSamples || dst.m_pSamples) {
+		_THROW("resampleDepths() : sample list images can't be resampled");
+		return false;
+	}
+
+	// Loaded images keep their depth count in z, only width and height have to match
+	if(dst.m_vSize.x != m_vSize.x || dst.m_vSize.y != m_vSize.y || dst.numberOfChannels() > 0 || dst.depthLevels() > 0) {
+		_THROW("resampleDepths() : destination has to be an empty image of the same size");
+		return false;
+	}
+
+	ChannelList targets;
+	resampleChannels(depths, targets);
+
+	for(unsigned int c = 0; c < targets.size(); c++) {
+		unsigned int id;
+
+		dst.registerChannel(m_lChannelNames[c], targets[c].get(), id);
+	}
+
+	dst.assignDepths(depths);
+
+	return true;
+}
+
+/// Creates one field per channel holding the channel resampled to @a depths
+/* Protected */ template<typename T> void DifImage<T>::resampleChannels(const std::vector<float>& depths, std::vector<typename DifField<T>::Ptr>& targets) const {
+	const unsigned int channels = numberOfChannels();
+
+	std::vector<ResampleEntry> table(depths.size());
+
+	for(unsigned int k = 0; k < depths.size(); k++) {
+		bool lerp;
+
+		table[k].valid = resolveRead(depths[k], eLinear, table[k].bfr, table[k].aftr, table[k].t, lerp);
+	}
+
+	std::vector<const DifField<T>*> sources(channels);
+	targets.resize(channels);
+
+	for(unsigned int c = 0; c < channels; c++) {
+		DifField<T>* field = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+
+		field->setSize(V3i(m_vSize.x, m_vSize.y, depths.size()));
+		field->setContainsData();
+		field->name = m_lChannelNames[c];
+		field->metadata().setIntMetadata(m_scChannelIndexName, c);
+
+		sources[c] = getField(c);
+		targets[c] = field;
+	}
+
+	if(channels == 0 || depths.empty()) {
+		return;
+	}
+
+	ResampleChannel work;
+	work.sources = &sources;
+	work.targets = &targets;
+	work.table   = &table;
+	work.order   = targets[0]->blockOrder();
+	work.rows    = (m_vSize.y + (1 << work.order) - 1) >> work.order;
+	work.slabs   = (depths.size() + (1 << work.order) - 1) >> work.order;
+
+	DifParallelFor<ResampleChannel>(0, channels * work.rows * work.slabs, m_ulThreads, work);
+}
+
+/// Merges a single image, see merge(const std::vector<const DifImage<T>*>&)
+template<typename T> bool DifImage<T>::merge(const DifImage<T>& image) {
+	return merge(std::vector<const DifImage<T>*>(1, &image));
+}
+
+/*!
+ * @brief Merges other images of the same size into this one
+ *
+ * The depths of all images are registered once (matched with this image's
+ * depth tolerance), channels missing here are added and every channel is
+ * grown to the final depth count a single time. The slices are then copied
+ * block by block, in parallel over channels and rows of blocks. Where images
+ * overlap, non-zero values of later images overwrite earlier ones and this
+ * image's own data; zeros count as "no data". Channels an image does not have
+ * receive nothing from it.
+ *
+ * @param[in] images Images to merge in, in order
+ * @return false if an image differs in size or uses sample lists, or this image is out-of-core or packed
+ */
+template<typename T> bool DifImage<T>::merge(const std::vector<const DifImage<T>*>& images) {
+	if(m_bOutOfCore || m_bPacked || m_bConcurrentWrites) {
+		_THROW("merge() : image is out-of-core, packed or written concurrently");
+		return false;
+	}
+
+	for(unsigned int k = 0; k < images.size(); k++) {
+		const DifImage<T>* image = images[k];
+
+		// Loaded images keep their depth count in z, only width and height have to match
+		if(!image || image->m_vSize.x != m_vSize.x || image->m_vSize.y != m_vSize.y || image->m_pSamples || m_pSamples) {
+			_THROW("merge() : images must be dense and of the same size");
+			return false;
+		}
+	}
+
+	resolveChannels();
+
+	// Target slice of every source slice and the union of the channels
+	std::vector<std::vector<unsigned int> > slices(images.size());
+
+	for(unsigned int k = 0; k < images.size(); k++) {
+		const DifImage<T>* image = images[k];
+
+		for(unsigned int s = 0; s < image->depthLevels(); s++) {
+			slices[k].push_back(insertDepth(image->m_lDepthMapping[s]));
+		}
+
+		for(unsigned int c = 0; c < image->numberOfChannels(); c++) {
+			unsigned int id;
+
+			if(!hasChannel(image->m_lChannelNames[c])) {
+				addChannel(image->m_lChannelNames[c], id);
+			}
+		}
+	}
+
+	if(depthLevels() == 0 || numberOfChannels() == 0) {
+		return true;
+	}
+
+	for(unsigned int c = 0; c < numberOfChannels(); c++) {
+		m_lChannels[c]->updateDepth(depthLevels() - 1);
+		m_lChannels[c]->setContainsData();
+	}
+
+	std::vector<std::vector<const DifField<T>*> > sources(images.size());
+	int order = INT_MAX;
+
+	for(unsigned int k = 0; k < images.size(); k++) {
+		sources[k].resize(numberOfChannels(), NULL);
+
+		for(unsigned int c = 0; c < images[k]->numberOfChannels(); c++) {
+			sources[k][channelIndex(images[k]->m_lChannelNames[c])] = images[k]->getField(c);
+		}
+	}
+
+	for(unsigned int c = 0; c < numberOfChannels(); c++) {
+		order = std::min(order, m_lChannels[c]->blockOrder());
+	}
+
+	MergeChannel work;
+	work.sources = &sources;
+	work.slices  = &slices;
+	work.targets = &m_lChannels;
+	work.rows    = (m_vSize.y + (1 << order) - 1) >> order;
+
+	DifParallelFor<MergeChannel>(0, numberOfChannels() * work.rows, m_ulThreads, work);
+
+	return true;
+}
+
+/*!
+ * @brief Holds this image out with a matte, writing the result to @a dst
+ *
+ * Every sample is multiplied by the transmittance of the matte in front of
+ * it, 1 minus the matte's @a alpha composited front to back over all matte
+ * depths strictly nearer than the sample. The sorted depths of both images
+ * are merged once up front, then the block columns are processed in parallel,
+ * skipping blocks without data and the depths behind fully opaque matte
+ * pixels. @a dst receives the channels and depths of this image.
+ *
+ * @param[in]  matte The holdout, e.g. a deep environment render
+ * @param[out] dst   An empty image of the same size
+ * @param[in]  alpha The matte's opacity channel
+ * @return false if the sizes differ, @a dst is not empty, @a matte lacks
+ *         @a alpha, the channels differ in block size or an image uses sample lists
+ */
+template<typename T> bool DifImage<T>::holdout(const DifImage<T>& matte, DifImage<T>& dst, const std::string& alpha) const {
+	if(m_pSamples || matte.m_pSamples || dst.m_pSamples) {
+		_THROW("holdout() : sample list images are not supported");
+		return false;
+	}
+
+	// Loaded images keep their depth count in z, only width and height have to match
+	if(matte.m_vSize.x != m_vSize.x || matte.m_vSize.y != m_vSize.y || dst.m_vSize.x != m_vSize.x || dst.m_vSize.y != m_vSize.y ||
+	   dst.numberOfChannels() > 0 || dst.depthLevels() > 0) {
+		_THROW("holdout() : matte and destination must be of the same size, destination empty");
+		return false;
+	}
+
+	bool found = false;
+	unsigned int alphaid = matte.channelIndex(alpha, &found);
+
+	if(!found) {
+		_THROW("holdout() : matte has no alpha channel");
+		return false;
+	}
+
+	const unsigned int channels = numberOfChannels();
+
+	std::vector<const DifField<T>*> sources(channels);
+	ChannelList targets(channels);
+
+	for(unsigned int c = 0; c < channels; c++) {
+		DifField<T>* field = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+
+		sources[c] = getField(c);
+
+		// Targets are written block by block, so they take the source's block size
+		if(sources[c]) {
+			field->setBlockOrder(sources[c]->blockOrder());
+		}
+
+		field->setSize(V3i(m_vSize.x, m_vSize.y, depthLevels()));
+		field->setContainsData();
+
+		targets[c] = field;
+	}
+
+	HoldoutTile work;
+	work.matte = matte.getField(alphaid);
+
+	// Also checked without any channel, the matte is read below regardless
+	if(!work.matte) {
+		_THROW("holdout() : matte alpha channel can't be read");
+		return false;
+	}
+
+	work.blockOrder = work.matte->blockOrder();
+
+	// blockPlane() hands out planes of the matte's block size
+	for(unsigned int c = 0; c < channels; c++) {
+		if((sources[c] && sources[c]->blockOrder() != work.blockOrder) || targets[c]->blockOrder() != work.blockOrder) {
+			_THROW("holdout() : channels differ in block size");
+			return false;
+		}
+	}
+
+	// Number of matte depths in front of every sorted depth
+	std::vector<unsigned int> front(m_lSortedDepths.size());
+	unsigned int m = 0;
+
+	for(unsigned int k = 0; k < front.size(); k++) {
+		while(m < matte.m_lSortedDepths.size() && matte.m_lSortedDepths[m] < m_lSortedDepths[k]) {
+			++m;
+		}
+
+		front[k] = m;
+	}
+
+	work.sources    = &sources;
+	work.targets    = &targets;
+	work.order      = &m_lDepthOrder;
+	work.matteOrder = &matte.m_lDepthOrder;
+	work.front      = &front;
+	work.size       = V2i(m_vSize.x, m_vSize.y);
+	work.columns    = (m_vSize.x + (1 << work.blockOrder) - 1) >> work.blockOrder;
+
+	int rows = (m_vSize.y + (1 << work.blockOrder) - 1) >> work.blockOrder;
+
+	// Block summaries are built once up front instead of by the first block column
+	T lo, hi;
+	work.matte->blockSummary(0, 0, 0, lo, hi);
+
+	for(unsigned int c = 0; c < channels; c++) {
+		if(sources[c]) {
+			sources[c]->blockSummary(0, 0, 0, lo, hi);
+		}
+	}
+
+	if(channels > 0) {
+		DifParallelFor<HoldoutTile>(0, work.columns * rows, m_ulThreads, work);
+	}
+
+	for(unsigned int c = 0; c < channels; c++) {
+		unsigned int id;
+
+		dst.registerChannel(m_lChannelNames[c], targets[c].get(), id);
+	}
+
+	dst.assignDepths(m_lDepthMapping);
+
+	return true;
+}
+
+/*!
+ * @brief Writes a deep image to a file while it is being rendered
+ *
+ * Tiles are written as with DifImage, but only kept until the next flush().
+ * flush() appends what has been written since the last one to the file as one
+ * more layer per channel, all of the same name, and releases the blocks, so
+ * memory is bounded by the buckets in flight. Depths are registered as they
+ * come and the depth mapping is written by close(). DifImage::load() merges
+ * the layers of a channel back into one.
+ *
+ * Buckets of one flush() should not share pixels with later ones: a pixel
+ * written in two parts reads as the last non-zero value.
+ */
+template<typename T> class DifStreamWriter {
+	public:
+		DifStreamWriter(Field3DOutputFile& ofp, const V2i& size);
+		~DifStreamWriter();
+
+		bool addChannel(const std::string& name, unsigned int& retid);
+		unsigned int numberOfChannels() const;
+
+		unsigned int depthLevels() const;
+		unsigned int parts() const;
+
+		void writeData(const V2i& pos, float depth, T* data);
+		bool writeTile(const V2i& origin, const V2i& size, float depth, const T* data, enum DifImage<T>::DifImageLayout layout = DifImage<T>::eInterleaved);
+		bool writeTile(const V2i& origin, const V2i& size, const float* depths, const T* data, enum DifImage<T>::DifImageLayout layout = DifImage<T>::eInterleaved);
+		bool writeScanline(const V2i& pos, int width, float depth, const T* data, enum DifImage<T>::DifImageLayout layout = DifImage<T>::eInterleaved);
+
+		void flush();
+		void close();
+		bool isOpen() const;
+
+	private:
+		// Not copyable, the file is shared
+		DifStreamWriter(const DifStreamWriter<T>& o);
+		DifStreamWriter& operator=(const DifStreamWriter<T>& o);
+
+		Field3DOutputFile* m_pFile;
+
+		// Keeps the depth registry and the blocks written since the last flush()
+		DifImage<T> m_image;
+
+		unsigned int m_ulParts;
+		bool m_bPending;
+};
+
+/*!
+ * @brief Starts a streamed image
+ * @param[in] ofp  A created output file, it must stay open until close()
+ * @param[in] size Width and height of the image
+ */
+template<typename T> DifStreamWriter<T>::DifStreamWriter(Field3DOutputFile& ofp, const V2i& size)
+	: m_pFile(&ofp), m_image(size), m_ulParts(0), m_bPending(false) {
+}
+
+/// Calls close()
+template<typename T> DifStreamWriter<T>::~DifStreamWriter() {
+	close();
+}
+
+/*!
+ * @brief Adds a channel, see DifImage::addChannel()
+ * @return false if the channel exists or the first part has been written already
+ */
+template<typename T> bool DifStreamWriter<T>::addChannel(const std::string& name, unsigned int& retid) {
+	if(!m_pFile || m_ulParts > 0) {
+		return false;
+	}
+
+	return m_image.addChannel(name, retid);
+}
+
+template<typename T> unsigned int DifStreamWriter<T>::numberOfChannels() const {
+	return m_image.numberOfChannels();
+}
+
+/// Returns the number of depths registered so far
+template<typename T> unsigned int DifStreamWriter<T>::depthLevels() const {
+	return m_image.depthLevels();
+}
+
+/// Returns the number of parts flushed so far
+template<typename T> unsigned int DifStreamWriter<T>::parts() const {
+	return m_ulParts;
+}
+
+/// See DifImage::writeData()
+template<typename T> void DifStreamWriter<T>::writeData(const V2i& pos, float depth, T* data) {
+	if(!m_pFile) {
+		return;
+	}
+
+	m_image.writeData(pos, depth, data);
+	m_bPending = true;
+}
+
+/// See DifImage::writeTile()
+template<typename T> bool DifStreamWriter<T>::writeTile(const V2i& origin, const V2i& size, float depth, const T* data, enum DifImage<T>::DifImageLayout layout) {
+	if(!m_pFile || !m_image.writeTile(origin, size, depth, data, layout)) {
+		return false;
+	}
+
+	m_bPending = true;
+
+	return true;
+}
+
+/// See DifImage::writeTile()
+template<typename T> bool DifStreamWriter<T>::writeTile(const V2i& origin, const V2i& size, const float* depths, const T* data, enum DifImage<T>::DifImageLayout layout) {
+	if(!m_pFile || !m_image.writeTile(origin, size, depths, data, layout)) {
+		return false;
+	}
+
+	m_bPending = true;
+
+	return true;
+}
+
+/// See DifImage::writeScanline()
+template<typename T> bool DifStreamWriter<T>::writeScanline(const V2i& pos, int width, float depth, const T* data, enum DifImage<T>::DifImageLayout layout) {
+	if(!m_pFile || !m_image.writeScanline(pos, width, depth, data, layout)) {
+		return false;
+	}
+
+	m_bPending = true;
+
+	return true;
+}
+
+/*!
+ * @brief Appends everything written since the last flush() to the file
+ *
+ * The channels are compacted in parallel and written as one layer each, then
+ * their blocks are released. Does nothing if nothing has been written.
+ */
+template<typename T> void DifStreamWriter<T>::flush() {
+	if(!m_pFile || !m_bPending) {
+		return;
+	}
+
+	typename DifImage<T>::ChannelList& channels = m_image.m_lChannels;
+
+	{
+		typename DifImage<T>::CompactChannel compact;
+		compact.channels = &channels;
+
+		DifParallelFor<typename DifImage<T>::CompactChannel>(0, channels.size(), m_image.threads(), compact);
+	}
+
+	for(unsigned int c = 0; c < channels.size(); c++) {
+		m_pFile->writeScalarLayer<T>(m_image.channelName(c), channels[c]);
+		channels[c]->clear(T(0));
+		channels[c]->invalidateSummaries();
+	}
+
+	++m_ulParts;
+	m_bPending = false;
+}
+
+/*!
+ * @brief Flushes the last part and writes the depth mapping
+ *
+ * Channels that never received data are written empty so the file lists
+ * them. The output file may be closed afterwards, further writes are ignored.
+ */
+template<typename T> void DifStreamWriter<T>::close() {
+	if(!m_pFile) {
+		return;
+	}
+
+	flush();
+
+	if(m_ulParts == 0) {
+		for(unsigned int c = 0; c < numberOfChannels(); c++) {
+			m_pFile->writeScalarLayer<T>(m_image.channelName(c), m_image.m_lChannels[c]);
+		}
+	}
+
+	m_image.saveDepthMapping(*m_pFile);
+	m_pFile = NULL;
+}
+
+/// Returns false once close() has been called
+template<typename T> bool DifStreamWriter<T>::isOpen() const {
+	return (m_pFile != NULL);
+}
+
+/*!
+ * @brief Mip pyramid of the nearest and farthest occupied depth of every pixel
+ *
+ * A pixel is occupied at a depth where a channel, usually alpha, exceeds a
+ * threshold. Level 0 holds the nearest and farthest such depth of every
+ * pixel, every further level the minimum and maximum of 2x2 cells of the
+ * level below, down to a single cell. Empty cells hold +infinity as nearest
+ * and -infinity as farthest depth.
+ *
+ * Region queries read at most 4x4 cells of one level, so they cost
+ * O(log(width + height)) regardless of the size of the region. Their bounds
+ * are conservative: they may cover a few pixels around the region, but never
+ * miss anything inside it.
+ *
+ * The pyramid doesn't follow the image, call update() for regions written
+ * after build().
+ */
+template<typename T> class DifDepthPyramid {
+	public:
+		DifDepthPyramid();
+
+		bool build(const DifImage<T>& image, const std::string& channel = "a", T threshold = T(0));
+		bool update(const DifImage<T>& image, const V2i& origin, const V2i& size);
+		void clear();
+
+		bool isBuilt() const;
+		unsigned int levels() const;
+		const V2i& levelSize(unsigned int level) const;
+
+		bool query(const V2i& origin, const V2i& size, float& nearest, float& farthest) const;
+		bool inFront(const V2i& origin, const V2i& size, float depth) const;
+
+	protected:
+		struct Level {
+			V2i size;
+			std::vector<float> nearest;
+			std::vector<float> farthest;
+		};
+
+		typedef std::vector<Level> LevelList;
+
+		// Reduces 2x2 cells of the level below for one row of a level
+		struct ReduceRow {
+			const Level* src;
+			Level* dst;
+			int x0;
+			int x1;
+			int y0;
+
+			void operator()(unsigned int j) {
+				const int y = y0 + j;
+				const int ys = std::min(2 * y + 1, src->size.y - 1);
+
+				for(int x = x0; x < x1; x++) {
+					const int xs = std::min(2 * x + 1, src->size.x - 1);
+
+					const int a = 2 * y * src->size.x + 2 * x;
+					const int b = 2 * y * src->size.x + xs;
+					const int c = ys * src->size.x + 2 * x;
+					const int d = ys * src->size.x + xs;
+
+					dst->nearest[y * dst->size.x + x] = std::min(std::min(src->nearest[a], src->nearest[b]), std::min(src->nearest[c], src->nearest[d]));
+					dst->farthest[y * dst->size.x + x] = std::max(std::max(src->farthest[a], src->farthest[b]), std::max(src->farthest[c], src->farthest[d]));
+				}
+			}
+		};
+
+		bool refresh(const DifImage<T>& image, V2i min, V2i max);
+
+	private:
+		LevelList m_lLevels;
+
+		unsigned int m_ulChannel;
+		T m_fThreshold;
+};
+
+template<typename T> DifDepthPyramid<T>::DifDepthPyramid() : m_ulChannel(0), m_fThreshold(T(0)) {
+}
+
+/*!
+ * @brief Builds the pyramid from a channel of @a image
+ *
+ * Level 0 comes from DifImage::firstHit() and DifImage::lastHit(), so only
+ * occupied blocks are read. The levels above are reduced in parallel by rows.
+ *
+ * @param[in] image     A depth image, sample list images are not supported
+ * @param[in] channel   The channel that marks occupied depths
+ * @param[in] threshold Depths where @a channel is greater than this are occupied
+ * @return false if there is no such channel
+ */
+template<typename T> bool DifDepthPyramid<T>::build(const DifImage<T>& image, const std::string& channel, T threshold) {
+	clear();
+
+	bool found = false;
+	unsigned int id = image.channelIndex(channel, &found);
 
-		ChannelList m_lChannels;
-	
-		typedef std::vector<float> DepthMappingList;
-		typedef std::vector<float>::iterator DepthMappingListIter;
+	if(!found || image.m_pSamples) {
+		return false;
+	}
 
-		DepthMappingList m_lDepthMapping;
+	m_ulChannel  = id;
+	m_fThreshold = threshold;
 
-		V3i m_vSize;
+	V2i size(std::max(image.m_vSize.x, 1), std::max(image.m_vSize.y, 1));
 
+	for(;;) {
+		Level level;
+		level.size = size;
+		level.nearest.resize(size.x * size.y, std::numeric_limits<float>::infinity());
+		level.farthest.resize(size.x * size.y, -std::numeric_limits<float>::infinity());
 
-		unsigned int m_ulChannelIndex;
+		m_lLevels.push_back(level);
 
-#ifndef _NEXCEPTIONS
-		bool m_bExceptionsEnabled;
-#endif //_NEXCEPTIONS
+		if(size.x == 1 && size.y == 1) {
+			break;
+		}
 
-		static const char *m_scDepthMappingName;
-		static const char *m_scChannelIndexName;
-};
+		size = V2i((size.x + 1) / 2, (size.y + 1) / 2);
+	}
 
-template<typename T> const char * DifImage<T>::m_scDepthMappingName = "depthMapping";
-template<typename T> const char * DifImage<T>::m_scChannelIndexName = "channelIndex";
+	if(!refresh(image, V2i(0, 0), V2i(image.m_vSize.x, image.m_vSize.y))) {
+		clear();
+		return false;
+	}
+
+	return true;
+}
 
 /*!
- * @brief Assignment constructor
+ * @brief Rebuilds the pyramid for a region of @a image written since build()
  *
- * @param[in] size The Initial size. Note that the size cannot be altered after
- *                 this point except for if you're loading a Dif file through
- *                 DifImage::load()
+ * Only the pixels in the region and the cells above them are recomputed.
+ *
+ * @param[in] image  The image the pyramid was built from
+ * @param[in] origin Upper left pixel of the region
+ * @param[in] size   Width and height of the region
+ * @return false if the pyramid is not built or doesn't match @a image
  */
-template<typename T> DifImage<T>::DifImage(const V2i& size) : m_ulChannelIndex(0) {
-	m_vSize.x = size.x;
-	m_vSize.y = size.y;
-	m_vSize.z = 1;
+template<typename T> bool DifDepthPyramid<T>::update(const DifImage<T>& image, const V2i& origin, const V2i& size) {
+	if(!isBuilt() || image.m_vSize.x != m_lLevels[0].size.x || image.m_vSize.y != m_lLevels[0].size.y) {
+		return false;
+	}
 
-#ifndef _NEXCEPTIONS
-	m_bExceptionsEnabled = false;
-#endif //_NEXCEPTIONS
+	V2i min, max;
+
+	if(!image.clipTile(origin, size, min, max)) {
+		return true;
+	}
+
+	return refresh(image, min, max);
 }
 
-/// Default destructor
-template<typename T> DifImage<T>::~DifImage() {
-	m_lChannels.clear();
+/// Releases all levels
+template<typename T> void DifDepthPyramid<T>::clear() {
+	m_lLevels.clear();
 }
 
-#ifndef _NEXCEPTIONS
-template<typename T> bool DifImage<T>::exceptionsEnabled() const {
-	return m_bExceptionsEnabled;
+/// Returns true once build() succeeded
+template<typename T> bool DifDepthPyramid<T>::isBuilt() const {
+	return !m_lLevels.empty();
 }
 
-template<typename T> void DifImage<T>::setExceptionsEnabled(bool yorn) {
-	m_bExceptionsEnabled = yorn;
+/// Returns the number of levels, including level 0 and the single cell level
+template<typename T> unsigned int DifDepthPyramid<T>::levels() const {
+	return m_lLevels.size();
+}
+
+/// Returns the cells of level @a level in x and y, the pyramid has to be built
+template<typename T> const V2i& DifDepthPyramid<T>::levelSize(unsigned int level) const {
+	return m_lLevels[level].size;
 }
-#endif //_NEXCEPTIONS
 
 /*!
- * @brief Adds a channel by using an existing DifField
- * @param[in] name    Name of the channel
- * @param[in] i       A DifField to copy values from
- * @param[out] retid  Identification number of the channel
- * @retval true  Success
- * @retval false Size mismatch or channel of the same name already existing  
+ * @brief Returns bounds of the occupied depths in a region
+ *
+ * Picks the finest level at which the region spans at most 4x4 cells and
+ * reduces those.
+ *
+ * @param[in]  origin   Upper left pixel of the region
+ * @param[in]  size     Width and height of the region
+ * @param[out] nearest  No occupied depth in the region is nearer, +infinity if it is empty
+ * @param[out] farthest No occupied depth in the region is farther, -infinity if it is empty
+ * @return false if the pyramid is not built or the region lies outside the image
  */
-template<typename T> bool DifImage<T>::addChannel(const std::string& name, const DifField<T>& i, unsigned int& retid) {
-	DifField<T> * handle = addChannelIntern(name, i, retid);
+template<typename T> bool DifDepthPyramid<T>::query(const V2i& origin, const V2i& size, float& nearest, float& farthest) const {
+	nearest  = std::numeric_limits<float>::infinity();
+	farthest = -std::numeric_limits<float>::infinity();
 
-	if(!handle) {
-		_THROW("addChannel() : addChannelIntern() returned an invalid pointer.");
+	if(!isBuilt() || size.x <= 0 || size.y <= 0) {
 		return false;
 	}
 
-	handle->metadata().setIntMetadata(m_scChannelIndexName, m_ulChannelIndex);
-	handle->setSize(V3i(m_vSize.x, m_vSize.y, depthLevels()));
+	const V2i& res = m_lLevels[0].size;
 
-	return true;
-}
+	V2i min(std::max(origin.x, 0), std::max(origin.y, 0));
+	V2i max(std::min(origin.x + size.x, res.x), std::min(origin.y + size.y, res.y));
 
-template<typename T> DifField<T>* DifImage<T>::addChannelIntern(const std::string& name, const DifField<T>& i, unsigned int& retid) {
-	if(i.getSize() != m_vSize) {
-		_THROW("addChannelIntern() : size mismatch with provided channel.");
+	if(min.x >= max.x || min.y >= max.y) {
 		return false;
 	}
 
-	if(m_lChannels.find(name) != m_lChannels.end()) {
-		_THROW("addChannelIntern() : channel of the same name exists.");
-		return false;
-	}
+	max = V2i(max.x - 1, max.y - 1);
 
-	DifField<T> * handle = new DifField<T>(i);
+	unsigned int l = 0;
 
-	m_lChannels[name] = handle;
+	while(l + 1 < m_lLevels.size() && ((max.x >> l) - (min.x >> l) >= 4 || (max.y >> l) - (min.y >> l) >= 4)) {
+		++l;
+	}
 
-	retid = m_ulChannelIndex;
+	const Level& level = m_lLevels[l];
 
-	++m_ulChannelIndex;
+	for(int y = min.y >> l; y <= (max.y >> l); y++) {
+		for(int x = min.x >> l; x <= (max.x >> l); x++) {
+			nearest  = std::min(nearest, level.nearest[y * level.size.x + x]);
+			farthest = std::max(farthest, level.farthest[y * level.size.x + x]);
+		}
+	}
 
-	return handle;
+	return true;
 }
 
 /*!
- * @brief Adds a channel
- * @param[in] name Name of the channel
- * @param[out] retid Identification number of the channel
- * @retval true Success
- * @retval false Channel of the same name existing
+ * @brief Tests whether anything in a region may be nearer than @a depth
+ *
+ * Conservative like query(): false means nothing in the region is in front
+ * of @a depth, true means something may be.
  */
-template<typename T> bool DifImage<T>::addChannel(const std::string& name, unsigned int& retid) {
-	if(m_lChannels.find(name) != m_lChannels.end()) {
-		_THROW("addChannel() : channel of the same name exists.");
-		return false;
-	}
+template<typename T> bool DifDepthPyramid<T>::inFront(const V2i& origin, const V2i& size, float depth) const {
+	float nearest, farthest;
 
-	DifField<T> * handle = new DifField<T>(V2i(m_vSize.x, m_vSize.y));
+	return query(origin, size, nearest, farthest) && nearest < depth;
+}
 
-	handle->metadata().setIntMetadata(m_scChannelIndexName, m_ulChannelIndex);
-	handle->setSize(V3i(m_vSize.x, m_vSize.y, depthLevels()));
+/// Recomputes level 0 in [@a min, @a max) and the cells above it
+/* Protected */ template<typename T> bool DifDepthPyramid<T>::refresh(const DifImage<T>& image, V2i min, V2i max) {
+	Level& base = m_lLevels[0];
+
+	if(!image.findHits(m_ulChannel, m_fThreshold, &base.nearest[0], NULL, false, min, max) ||
+	   !image.findHits(m_ulChannel, m_fThreshold, &base.farthest[0], NULL, true, min, max)) {
+		return false;
+	}
 
-	m_lChannels[name] = handle;
+	for(unsigned int l = 1; l < m_lLevels.size(); l++) {
+		min = V2i(min.x / 2, min.y / 2);
+		max = V2i((max.x + 1) / 2, (max.y + 1) / 2);
 
-	retid = m_ulChannelIndex;
+		ReduceRow work;
+		work.src = &m_lLevels[l - 1];
+		work.dst = &m_lLevels[l];
+		work.x0  = min.x;
+		work.x1  = max.x;
+		work.y0  = min.y;
 
-	++m_ulChannelIndex;
+		DifParallelFor<ReduceRow>(0, max.y - min.y, image.threads(), work);
+	}
 
-	return (numberOfChannels() - 1);
+	return true;
 }
 
 /*!
- * @brief Returns the name of the channel at index @a idx
- * @param[in]  The Index (0..numberOfChannels()-1)
- * @return A String (empty if @a idx is out of range)
+ * @brief Header of the memory-mapped deep image format, see DifMappedImage
+ *
+ * The file holds, in native byte order: this header, the depth table (the
+ * depths in storage order, the same sorted ascending and the storage index
+ * of every sorted depth), one DifMapChannel per channel, a DifMapBlock table
+ * per channel and finally the voxels of every stored block, 64 byte aligned.
  */
-template<typename T> const std::string& DifImage<T>::channelName(unsigned int idx) const {
-	if(m_lChannels.size() == 0 || !validChannelId(idx)) {
-		return std::string();
-	}
-	
-	ChannelListIter it = m_lChannels.begin();
-
-	std::advance(it, idx);
+struct DifMapHeader {
+	char            magic[4];
+	boost::uint32_t version;
+	boost::uint32_t valueSize;
+	boost::uint32_t width;
+	boost::uint32_t height;
+	boost::uint32_t depths;
+	boost::uint32_t channels;
+	float           depthTolerance;
+	boost::uint64_t depthTable;
+	boost::uint64_t channelTable;
+	boost::uint64_t fileSize;
+};
 
-	return (*it).first;
-}
+/// A channel of a mapped image, its blocks are listed x fastest, then y, then depth
+struct DifMapChannel {
+	char            name[48];
+	boost::uint32_t blockOrder;
+	boost::uint32_t depth;
+	boost::uint64_t blockTable;
+};
 
-template<typename T> unsigned int DifImage<T>::channelIndex(const std::string& name, bool *retval) {
-	if(numberOfChannels() == 0) {
-		return false;
-	}
+/// How a block of a mapped image is stored
+enum DifMapEncoding {
+	eDifMapUniform = 0,
+	eDifMapRaw     = 1
+};
 
-	ChannelListIter it;
+/// A block of a mapped image, @a offset points to its voxels unless it is uniform
+template<typename T> struct DifMapBlock {
+	boost::uint64_t offset;
+	boost::uint32_t encoding;
+	T               value;
+};
 
-	for(it = m_lChannels.begin(); it != m_lChannels.end(); it++) {
-		if((*it).first == name) {
-			if(retval) {
-				(*retval) = true;
-			}
+/// Pads @a out with zeros up to position @a pos
+inline void difMapPad(std::ostream& out, boost::uint64_t pos) {
+	static const char zeros[64] = {0};
 
-			return ((*it).second)->metadata().intMetadata(m_scChannelIndexName, 0);
-		}
+	for(boost::uint64_t at = out.tellp(); at < pos; at = out.tellp()) {
+		out.write(zeros, std::min<boost::uint64_t>(pos - at, sizeof(zeros)));
 	}
+}
 
-	if(retval) {
-		(*retval) = false;
-	}
+/// Rounds @a pos up to a multiple of @a alignment
+inline boost::uint64_t difMapAlign(boost::uint64_t pos, boost::uint64_t alignment) {
+	return (pos + alignment - 1) / alignment * alignment;
+}
 
-	return 0;
+/// Returns true if @a count items of @a item bytes at @a offset lie inside @a size bytes, never overflows
+inline bool difMapFits(boost::uint64_t offset, boost::uint64_t count, boost::uint64_t item, boost::uint64_t size) {
+	return offset <= size && count <= (size - offset) / item;
 }
 
 /*!
- * @brief Determines whether the Image as a achannel named @a name
- * @param[in] name Channel's Name
- * @return boolean
+ * @brief Read-only deep image mapped straight from a file
+ *
+ * Written by DifImage::saveMapped(). open() only validates the header and the
+ * tables, the blocks are paged in by the OS when they are first read and
+ * uncompressed blocks are read in place without any copy. Reads follow the
+ * same rules as DifImage and are safe from any number of threads.
+ *
+ * Where mmap() is not available the file is read into memory instead.
  */
-template<typename T> bool DifImage<T>::hasChannel(const std::string& name) {
-	return validChannelId(channelIndex(name));
+template<typename T> class DifMappedImage {
+	public:
+		DifMappedImage();
+		~DifMappedImage();
+
+		bool open(const std::string& path);
+		void close();
+		bool isOpen() const;
+
+		V2i getSize() const;
+
+		unsigned int numberOfChannels() const;
+		std::string channelName(unsigned int idx) const;
+		unsigned int channelIndex(const std::string& name, bool* retval = 0) const;
+
+		unsigned int depthLevels() const;
+		float depthAtIndex(unsigned int idx) const;
+		unsigned int indexAtDepth(float dpt, bool* retval = 0) const;
+		bool depthBracket(float dpt, unsigned int& bfr, unsigned int& aftr, float& t) const;
+		float depthTolerance() const;
+
+		bool readData(const V2i& pos, float depth, T* buffer, enum DifImage<T>::DifImageInterpolation type = DifImage<T>::eLinear) const;
+		bool readChannelData(unsigned int channelid, const V2i& pos, float depth, T& retval, enum DifImage<T>::DifImageInterpolation type = DifImage<T>::eLinear) const;
+
+		int blockOrder(unsigned int channelid) const;
+		int depth(unsigned int channelid) const;
+		const T* blockData(unsigned int channelid, int bi, int bj, int bk, T& value) const;
+
+	private:
+		// Not copyable, the mapping is owned
+		DifMappedImage(const DifMappedImage<T>& o);
+		DifMappedImage& operator=(const DifMappedImage<T>& o);
+
+		bool validate();
+		T voxel(unsigned int channelid, const V2i& pos, unsigned int dpt) const;
+
+		const char*  m_pData;
+		size_t       m_ulSize;
+		bool         m_bMapped;
+
+		// Without mmap() the file is read into memory
+		std::vector<char> m_lBuffer;
+
+		const DifMapHeader*    m_pHeader;
+		const float*           m_pDepths;
+		const float*           m_pSortedDepths;
+		const boost::uint32_t* m_pDepthOrder;
+		const DifMapChannel*   m_pChannels;
+};
+
+template<typename T> DifMappedImage<T>::DifMappedImage()
+	: m_pData(NULL), m_ulSize(0), m_bMapped(false), m_pHeader(NULL), m_pDepths(NULL), m_pSortedDepths(NULL), m_pDepthOrder(NULL), m_pChannels(NULL) {
 }
 
-/// Returns the number of channels.
-template<typename T> unsigned int DifImage<T>::numberOfChannels() const {
-	return m_lChannels.size();
+template<typename T> DifMappedImage<T>::~DifMappedImage() {
+	close();
 }
 
 /*!
- * @brief Determines whether the given channel index @a id is valid
- * @param[in] id Channel ID
- * @return boolean
+ * @brief Maps a file written by DifImage::saveMapped()
+ * @param[in] path File name
+ * @return false if the file can't be read, is no mapped image or stores another value type
  */
-template<typename T> bool DifImage<T>::validChannelId(unsigned int id) const {
-	return (id < m_lChannels.size());
-}
+template<typename T> bool DifMappedImage<T>::open(const std::string& path) {
+	close();
 
-template<typename T> DifField<T>* DifImage<T>::getField(unsigned int channelid) {
-	if(!validChannelId(channelid)) {
-		return NULL;
+#ifdef _DIF_MMAP
+	int fd = ::open(path.c_str(), O_RDONLY);
+
+	if(fd < 0) {
+		return false;
 	}
 
-	ChannelListIter it = m_lChannels.begin();
+	struct stat st;
 
-	for(; it != m_lChannels.end(); it++) {
-		if(((*it).second)->metadata().intMetadata(m_scChannelIndexName, -1) == channelid) {
-			return (*it).second;
-		}
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(DifMapHeader)) {
+		::close(fd);
+		return false;
 	}
 
-	return NULL;
-}
-
-/*!
- * @brief Returns the associated depth value to a depth index
- * @param[in]  idx The Index (range 0..depthLevels()-1)
- * @param[out] retval (Optimal) Pointer to a bool for the return code
- * @return A float
- */
-template<typename T> float DifImage<T>::depthAtIndex(unsigned int idx, bool* retval) const {
-	if(idx >= m_lDepthMapping.size()) {
-		if(retval) {
-			(*retval) = false;
-		}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
 
-		return 0.0f;
+	if(data == MAP_FAILED) {
+		return false;
 	}
 
-	if(retval) {
-		(*retval) = true;
+	m_pData   = static_cast<const char*>(data);
+	m_ulSize  = st.st_size;
+	m_bMapped = true;
+#else
+	std::ifstream in(path.c_str(), std::ios::binary);
+
+	if(!in) {
+		return false;
 	}
 
-	return m_lDepthMapping.at(idx);
-}
+	in.seekg(0, std::ios::end);
+	m_lBuffer.resize((size_t)in.tellg());
+	in.seekg(0, std::ios::beg);
 
-/*!
- * @brief Returns the index of the given depth
- * @param[in]  dpt The depth
- * @param[out] retval (Optimal) Pointer to a bool for the return code
- * @return An unsigned integer in range 0..depthLevels()-1 also 0 on error
- */
-template<typename T> unsigned int DifImage<T>::indexAtDepth(float dpt, bool* retval) const {
+	if(m_lBuffer.empty() || !in.read(&m_lBuffer[0], m_lBuffer.size())) {
+		std::vector<char>().swap(m_lBuffer);
+		return false;
+	}
 
-	for(unsigned int i = 0; i < m_lDepthMapping.size(); i++) {
-		if(m_lDepthMapping.at(i) == dpt) {
-			if(retval) {
-				(*retval) = true;
-			}
+	m_pData  = &m_lBuffer[0];
+	m_ulSize = m_lBuffer.size();
+#endif
 
-			return i;
-		}
+	if(!validate()) {
+		close();
+		return false;
 	}
 
-	if(retval) {
-		(*retval) = false;
+	return true;
+}
+
+/// Unmaps the file, pointers returned by blockData() become invalid
+template<typename T> void DifMappedImage<T>::close() {
+#ifdef _DIF_MMAP
+	if(m_bMapped) {
+		munmap(const_cast<char*>(m_pData), m_ulSize);
 	}
+#endif
 
-	return 0;
+	std::vector<char>().swap(m_lBuffer);
+
+	m_pData   = NULL;
+	m_ulSize  = 0;
+	m_bMapped = false;
+	m_pHeader = NULL;
 }
 
-/// Returns the number of depth levels
-template<typename T> unsigned int DifImage<T>::depthLevels() const {
-	return m_lDepthMapping.size();
+template<typename T> bool DifMappedImage<T>::isOpen() const {
+	return (m_pHeader != NULL);
 }
 
-/*!
- * @brief Write Data to the image
- *
- * This function has no return value and will simply ignore the data if the given
- * Position @a pos is invalid.
- * @param[in] pos The Position
- * @param[in] depth The depth level.
- * @param[in] data Data to write (must be at least sizeof(T)* numberOfChannels())
- */
-template<typename T> void DifImage<T>::writeData(const V2i& pos, float depth, T* data) {
-	unsigned int idx = 0;
-	bool status = false;
+/// Checks the header and that all tables lie inside the file
+/* Private */ template<typename T> bool DifMappedImage<T>::validate() {
+	const DifMapHeader* header = reinterpret_cast<const DifMapHeader*>(m_pData);
 
-	idx = indexAtDepth(depth, &status);
+	if(m_ulSize < sizeof(DifMapHeader) || std::memcmp(header->magic, "DIFM", 4) != 0 || header->version != 1 || header->valueSize != sizeof(T) || header->fileSize != m_ulSize) {
+		return false;
+	}
 
-	if(!status) {
-		m_lDepthMapping.push_back(depth);
-		idx = (m_lDepthMapping.size()-1);
+	if(header->width > INT_MAX || header->height > INT_MAX || header->depths > INT_MAX) {
+		return false;
 	}
 
-	unsigned int current = 0;
+	const boost::uint64_t depths = header->depths;
 
-	for(; current < numberOfChannels(); current++) {
-		DifField<T>* field = getField(current);
+	// The tables are read in place, so they must be aligned for their members
+	if(header->depthTable % sizeof(float) != 0 || header->channelTable % sizeof(boost::uint64_t) != 0) {
+		return false;
+	}
 
-		if(field) {
-			field->writePixel(pos, idx, data[current]);
-		} else {
-			_THROW("writeData() : channel invalid");
+	if(!difMapFits(header->depthTable, depths, 2 * sizeof(float) + sizeof(boost::uint32_t), m_ulSize)
+		|| !difMapFits(header->channelTable, header->channels, sizeof(DifMapChannel), m_ulSize)) {
+		return false;
+	}
+
+	m_pDepths       = reinterpret_cast<const float*>(m_pData + header->depthTable);
+	m_pSortedDepths = m_pDepths + depths;
+	m_pDepthOrder   = reinterpret_cast<const boost::uint32_t*>(m_pSortedDepths + depths);
+	m_pChannels     = reinterpret_cast<const DifMapChannel*>(m_pData + header->channelTable);
+
+	for(boost::uint64_t i = 0; i < depths; i++) {
+		if(m_pDepthOrder[i] >= depths) {
+			return false;
 		}
 	}
-}
 
-/*!
- * @brief Reads data from the image
- * @param[in] pos    Position
- * @param[in] depth  Desired depth
- * @param[in] buffer Buffer to write data to
- * @param[in] type   Interpolation type
- * @return boolean
- *
- * If no data is available at the given @a depth it will be interpolated by the nearest two 
- * depths available if @a type is eLinear or will return false otherwise.
- */
-template<typename T> bool DifImage<T>::readData(const V2i& pos, float depth, T *buffer, enum DifImage<T>::DifImageInterpolation type) {
-	unsigned int i = 0;
+	for(unsigned int c = 0; c < header->channels; c++) {
+		const DifMapChannel& channel = m_pChannels[c];
 
-	// No channels available
-	if(m_lChannels.size() == 0) {
-		return false;
+		if(channel.blockOrder > 8 || channel.depth > depths || channel.blockTable % sizeof(boost::uint64_t) != 0) {
+			return false;
+		}
+
+		const boost::uint64_t size = 1 << channel.blockOrder;
+		const boost::uint64_t limit = (m_ulSize / sizeof(DifMapBlock<T>)) + 1;
+		const boost::uint64_t bx = (header->width + size - 1) / size;
+		const boost::uint64_t by = (header->height + size - 1) / size;
+		const boost::uint64_t bz = (channel.depth + size - 1) / size;
+
+		// Each factor is below 2^31, so only the last product can overflow
+		if(bz > 0 && bx * by > limit / bz) {
+			return false;
+		}
+
+		if(!difMapFits(channel.blockTable, bx * by * bz, sizeof(DifMapBlock<T>), m_ulSize)) {
+			return false;
+		}
 	}
 
-	if(type == eNone) {
-		unsigned int idx = 0;
-		bool status = false;
+	m_pHeader = header;
 
-		idx = indexAtDepth(depth, &status);
+	return true;
+}
 
-		// Must have at least one channel at the given depth
-		if(!status) {
-			return false;
-		}
+template<typename T> V2i DifMappedImage<T>::getSize() const {
+	return m_pHeader ? V2i(m_pHeader->width, m_pHeader->height) : V2i(0, 0);
+}
 
-		for(; i < numberOfChannels(); i++) {
-			DifField<T>* field = getField(i);
+template<typename T> unsigned int DifMappedImage<T>::numberOfChannels() const {
+	return m_pHeader ? m_pHeader->channels : 0;
+}
 
-			if(field) {
-				buffer[i] = field->readPixel(pos, idx);
+template<typename T> std::string DifMappedImage<T>::channelName(unsigned int idx) const {
+	if(idx >= numberOfChannels()) {
+		return std::string();
+	}
+
+	const char* name = m_pChannels[idx].name;
+
+	return std::string(name, std::find(name, name + sizeof(m_pChannels[idx].name), '\0'));
+}
+
+/// See DifImage::channelIndex()
+template<typename T> unsigned int DifMappedImage<T>::channelIndex(const std::string& name, bool* retval) const {
+	for(unsigned int c = 0; c < numberOfChannels(); c++) {
+		if(channelName(c) == name) {
+			if(retval) {
+				(*retval) = true;
 			}
+
+			return c;
 		}
 	}
-	else if(type == eLinear) {
-		unsigned int bfr, aftr;
 
-		getNearestDepthIndex(depth, eBefore, bfr);
+	if(retval) {
+		(*retval) = false;
+	}
 
-		if(depthAtIndex(bfr) >= depth || (bfr == aftr) || (bfr + 1) >=  depthLevels()) {
-			return readData(pos, depth, buffer, eNone);
-		}
+	return 0;
+}
 
-		aftr = (bfr + 1);
+template<typename T> unsigned int DifMappedImage<T>::depthLevels() const {
+	return m_pHeader ? m_pHeader->depths : 0;
+}
 
-		T *a = new T[numberOfChannels()];
-		T *b = new T[numberOfChannels()];
+/// Returns the depth of storage index @a idx, 0 if there is none
+template<typename T> float DifMappedImage<T>::depthAtIndex(unsigned int idx) const {
+	return (idx < depthLevels()) ? m_pDepths[idx] : 0.0f;
+}
 
-		for(; i < numberOfChannels(); i++) {
-			DifField<T>* field = getField(i);
+/// Returns the depth tolerance the image was saved with, see DifImage::depthTolerance()
+template<typename T> float DifMappedImage<T>::depthTolerance() const {
+	return m_pHeader ? m_pHeader->depthTolerance : 0.0f;
+}
 
-			if(field) {
-				a[i] = field->readPixel(pos, bfr);
-				b[i] = field->readPixel(pos, aftr);
-			}
+/// See DifImage::indexAtDepth()
+template<typename T> unsigned int DifMappedImage<T>::indexAtDepth(float dpt, bool* retval) const {
+	const float  tolerance = depthTolerance();
+	const float* end = m_pSortedDepths + depthLevels();
+	const float* it  = std::lower_bound(m_pSortedDepths, end, dpt - tolerance);
+	const float* best = end;
+
+	for(; it != end && (*it) <= dpt + tolerance; it++) {
+		if(best == end || std::fabs((*it) - dpt) < std::fabs((*best) - dpt)) {
+			best = it;
 		}
+	}
 
-		{
-			float d_bfr  = depthAtIndex(bfr);
-			float d_aftr = depthAtIndex(aftr);
+	if(retval) {
+		(*retval) = (best != end);
+	}
 
-			float dt = d_aftr - d_bfr;
-			float t  = (depth - d_bfr) / dt;
+	return (best != end) ? m_pDepthOrder[best - m_pSortedDepths] : 0;
+}
 
-			for(i = 0; i < numberOfChannels(); i++) {
-				buffer[i] = Imath::lerp(a[i], b[i], t);
-			}
-		}
+/// See DifImage::depthBracket()
+template<typename T> bool DifMappedImage<T>::depthBracket(float dpt, unsigned int& bfr, unsigned int& aftr, float& t) const {
+	const unsigned int pos = std::upper_bound(m_pSortedDepths, m_pSortedDepths + depthLevels(), dpt) - m_pSortedDepths;
+
+	if(pos == 0 || pos >= depthLevels()) {
+		return false;
+	}
 
-		delete[] a;
-		delete[] b;
+	float d_bfr  = m_pSortedDepths[pos - 1];
+	float d_aftr = m_pSortedDepths[pos];
+
+	if(dpt - d_bfr <= depthTolerance() || d_aftr - dpt <= depthTolerance()) {
+		return false;
 	}
 
+	bfr  = m_pDepthOrder[pos - 1];
+	aftr = m_pDepthOrder[pos];
+	t    = (dpt - d_bfr) / (d_aftr - d_bfr);
+
 	return true;
 }
 
+/// Returns the block order of a channel, see SparseField::blockOrder()
+template<typename T> int DifMappedImage<T>::blockOrder(unsigned int channelid) const {
+	return (channelid < numberOfChannels()) ? (int)m_pChannels[channelid].blockOrder : 0;
+}
+
+/// Returns the number of depth indices stored for a channel
+template<typename T> int DifMappedImage<T>::depth(unsigned int channelid) const {
+	return (channelid < numberOfChannels()) ? (int)m_pChannels[channelid].depth : 0;
+}
+
 /*!
- * @brief Reads the data at the given position and depth of a single channel
- * @param[in] channelid Channel Index
- * @param[in] depth     Desired depth
- * @param[out] retval   Variable to write the data in
- * @param[in] type      Interpolation type
- * @return boolean
+ * @brief Returns the voxels of a block, pointing into the mapping
+ *
+ * Laid out like DifField::blockData(). Uniform blocks, blocks outside the
+ * channel and blocks pointing outside the file return NULL and their value
+ * in @a value.
  */
-template<typename T> bool DifImage<T>::readChannelData(unsigned int channelid, const V2i& pos, float depth, T& retval, enum DifImage<T>::DifImageInterpolation type) {
-	DifField<T> *field = getField(channelid);
+template<typename T> const T* DifMappedImage<T>::blockData(unsigned int channelid, int bi, int bj, int bk, T& value) const {
+	value = T(0);
 
-	if(!field) {
-		return false;
+	if(channelid >= numberOfChannels()) {
+		return NULL;
 	}
 
-	if(type == eNone) {
-		bool status = false;
-		unsigned int depthid = 0;
+	const DifMapChannel& channel = m_pChannels[channelid];
+	const int size = 1 << channel.blockOrder;
+	const int bx = (m_pHeader->width + size - 1) / size;
+	const int by = (m_pHeader->height + size - 1) / size;
+	const int bz = (channel.depth + size - 1) / size;
 
-		depthid = indexAtDepth(depth, &status);
+	if(bi < 0 || bj < 0 || bk < 0 || bi >= bx || bj >= by || bk >= bz) {
+		return NULL;
+	}
 
-		if(!status) {
-			return false;	
-		}
-			
-		T value = field->readPixel(pos, depthid, &status);
+	const DifMapBlock<T>& block = reinterpret_cast<const DifMapBlock<T>*>(m_pData + channel.blockTable)[(bk * by + bj) * bx + bi];
+	const boost::uint64_t bytes = (boost::uint64_t)size * size * size * sizeof(T);
 
-		if(!status) {
-			return false;
-		}
+	if(block.encoding != eDifMapRaw || block.offset % sizeof(T) != 0 || !difMapFits(block.offset, bytes, 1, m_ulSize)) {
+		value = block.value;
+		return NULL;
+	}
 
-		retval = value;
+	return reinterpret_cast<const T*>(m_pData + block.offset);
+}
 
-		return true;
+/// Reads a single voxel, 0 outside the channel
+/* Private */ template<typename T> T DifMappedImage<T>::voxel(unsigned int channelid, const V2i& pos, unsigned int dpt) const {
+	const int order = m_pChannels[channelid].blockOrder;
+	const int mask  = (1 << order) - 1;
+
+	if(pos.x < 0 || pos.y < 0 || pos.x >= (int)m_pHeader->width || pos.y >= (int)m_pHeader->height) {
+		return T(0);
 	}
-	else if(type == eLinear) {
-		unsigned int bfr, aftr;
 
-		getNearestDepthIndex(depth, eBefore, bfr);
+	T value;
+	const T* data = blockData(channelid, pos.x >> order, pos.y >> order, dpt >> order, value);
 
-		if(depthAtIndex(bfr) >= depth || (bfr == aftr) || (bfr + 1) >=  depthLevels()) {
-			return readChannelData(channelid, pos, depth, retval, eNone);
-		}
+	if(!data) {
+		return value;
+	}
 
-		{
-			aftr = (bfr + 1);
+	return data[((dpt & mask) << order << order) + ((pos.y & mask) << order) + (pos.x & mask)];
+}
 
-			float d_bfr  = depthAtIndex(bfr);
-			float d_aftr = depthAtIndex(aftr);
+/// See DifImage::readData()
+template<typename T> bool DifMappedImage<T>::readData(const V2i& pos, float depth, T* buffer, enum DifImage<T>::DifImageInterpolation type) const {
+	if(numberOfChannels() == 0) {
+		return false;
+	}
 
-			float dt = d_aftr - d_bfr;
-			float t  = (depth - d_bfr) / dt;
-			
-			bool stata = false;
-			bool statb = false;
+	unsigned int bfr, aftr;
+	float t;
 
-			T a = field->readPixel(pos, bfr,  &stata);
-			T b = field->readPixel(pos, aftr, &statb);
+	if(type == DifImage<T>::eLinear && depthBracket(depth, bfr, aftr, t)) {
+		for(unsigned int c = 0; c < numberOfChannels(); c++) {
+			buffer[c] = Imath::lerp(voxel(c, pos, bfr), voxel(c, pos, aftr), t);
+		}
 
-			if(!stata || !statb) {
-				return false;
-			}
+		return true;
+	}
 
-			retval = Imath::lerp(a, b, t);
+	bool status = false;
+	unsigned int idx = indexAtDepth(depth, &status);
 
-			return true;
-		}
+	if(!status) {
+		return false;
 	}
 
-	return false;
+	for(unsigned int c = 0; c < numberOfChannels(); c++) {
+		buffer[c] = voxel(c, pos, idx);
+	}
+
+	return true;
 }
 
-template<typename T> bool DifImage<T>::readChannelData(const std::string& channelname, const V2i& pos, float depth, T& retval, enum DifImageInterpolation type) {
+/// See DifImage::readChannelData()
+template<typename T> bool DifMappedImage<T>::readChannelData(unsigned int channelid, const V2i& pos, float depth, T& retval, enum DifImage<T>::DifImageInterpolation type) const {
+	if(channelid >= numberOfChannels()) {
+		return false;
+	}
+
+	unsigned int bfr, aftr;
+	float t;
+
+	if(type == DifImage<T>::eLinear && depthBracket(depth, bfr, aftr, t)) {
+		retval = Imath::lerp(voxel(channelid, pos, bfr), voxel(channelid, pos, aftr), t);
+		return true;
+	}
+
 	bool status = false;
-	unsigned int channelid = channelIndex(channelname, &status);
+	unsigned int idx = indexAtDepth(depth, &status);
 
-	if(!status) {
-		return false;
+	if(status) {
+		retval = voxel(channelid, pos, idx);
 	}
 
-	return readChannelData(channelid, pos, depth, retval, type);
+	return status;
 }
 
 /*!
- * Saves the Deep image to the given output file.
+ * @brief Saves the image in the memory-mapped format, see DifMappedImage
+ *
+ * Channels are compacted first like save() does, uniform blocks are then only
+ * stored in the block table. Packed channels are decoded while they are
+ * written, like save() does.
+ *
+ * @param[in] path File name
+ * @return false for sample list images, channel names of 48 characters or
+ *         more and write errors
  */
-template<typename T> void DifImage<T>::save(Field3DOutputFile& ofp) {
+template<typename T> bool DifImage<T>::saveMapped(const std::string& path) {
+	if(m_pSamples) {
+		_THROW("saveMapped() : sample list images can't be mapped");
+		return false;
+	}
 
-	ChannelListIter it = m_lChannels.begin();
+	resolveChannels();
 
-	{
-		SparseField<float>::Ptr dptmapping = new SparseField<float>();
-		dptmapping->setSize(V3i(1, 1, m_lDepthMapping.size()));
+	std::vector<unsigned int> decoded;
+	decodePackedChannels(decoded);
 
-		DepthMappingListIter dit;
-		unsigned int i = 0;
+	const bool ok = writeMapped(path);
 
-		for(dit = m_lDepthMapping.begin(); dit != m_lDepthMapping.end(); dit++) {
-			dptmapping->lvalue(0, 0, i) = (*dit);
-			++i;
-		}
+	releaseChannels(decoded);
 
-		ofp.writeScalarLayer<float>(m_scDepthMappingName, dptmapping);
+	return ok;
+}
+
+/// Writes the mapped file of saveMapped(), every channel has a DifField
+/* Protected */ template<typename T> bool DifImage<T>::writeMapped(const std::string& path) {
+	{
+		CompactChannel compact;
+		compact.channels = &m_lChannels;
 
+		DifParallelFor<CompactChannel>(0, numberOfChannels(), m_ulThreads, compact);
 	}
 
-	for(; it != m_lChannels.end(); it++) {
-		typename DifField<T>::Ptr ptr = (it->second);
+	DifMapHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "DIFM", 4);
 
-		ofp.writeScalarLayer<T>(std::string(it->first), ptr);	
-	}
-}
+	header.version        = 1;
+	header.valueSize      = sizeof(T);
+	header.width          = m_vSize.x;
+	header.height         = m_vSize.y;
+	header.depths         = depthLevels();
+	header.channels       = numberOfChannels();
+	header.depthTolerance = m_fDepthTolerance;
 
-template<typename T> void DifImage<T>::loadDepthMapping(const SparseField<float>::Ptr field) {
-	V3i dptDim = field->dataResolution();
+	boost::uint64_t cursor = sizeof(DifMapHeader);
 
-	for(int i = 0; i < dptDim.z; i++) {
-		m_lDepthMapping.push_back(field->fastValue(0, 0, i));
-	}
-}
+	header.depthTable = cursor;
+	cursor += header.depths * (2 * sizeof(float) + sizeof(boost::uint32_t));
 
-/// Loads the Dif Image from an Input file.
-template<typename T> bool DifImage<T>::load(Field3DInputFile& ifp) {
-	typedef typename Field< T >::Vec           FieldVector;
-	typedef typename Field< T >::Vec::iterator FieldVectorIterator;
-	typedef typename SparseField< T >::Ptr     SparseFieldPtr;
-	typedef typename std::map<std::string, SparseFieldPtr> SparseFieldList;
-	typedef typename std::map<std::string, SparseFieldPtr>::iterator SparseFieldListIterator;
+	header.channelTable = difMapAlign(cursor, 8);
+	cursor = header.channelTable + header.channels * sizeof(DifMapChannel);
 
-	// giving a layerName does not work for some reason so we look manually for our structure
-	Field<float>::Vec dptMappings = ifp.readScalarLayers<float>();
-	bool depthLoaded = false;
+	std::vector<DifMapChannel> channels(header.channels);
+	std::vector< std::vector< DifMapBlock<T> > > tables(header.channels);
 
-	if(dptMappings.size() < 1) {
-		_THROW("load() : no depth mapping field available");
-		return false;
+	for(unsigned int c = 0; c < header.channels; c++) {
+		if(m_lChannelNames[c].length() >= sizeof(channels[c].name)) {
+			_THROW("saveMapped() : channel name too long");
+			return false;
+		}
+
+		std::memset(&channels[c], 0, sizeof(DifMapChannel));
+		std::memcpy(channels[c].name, m_lChannelNames[c].c_str(), m_lChannelNames[c].length());
+
+		channels[c].blockOrder = m_lChannels[c]->blockOrder();
+		channels[c].depth      = m_lChannels[c]->depth();
+		channels[c].blockTable = difMapAlign(cursor, 8);
+
+		const V3i res = m_lChannels[c]->blockRes();
+
+		tables[c].resize(res.x * res.y * res.z);
+		cursor = channels[c].blockTable + tables[c].size() * sizeof(DifMapBlock<T>);
 	}
 
-	{
-		Field<float>::Vec::iterator it;
+	// Blocks follow in table order
+	cursor = difMapAlign(cursor, 64);
 
-		for(it = dptMappings.begin(); it != dptMappings.end();  it++) {
-			if((*it)->name == m_scDepthMappingName) {
-				SparseField<float>::Ptr depthField = field_dynamic_cast< SparseField<float> >(dptMappings[0]);
+	for(unsigned int c = 0; c < header.channels; c++) {
+		const DifField<T>* field = m_lChannels[c].get();
+		const V3i res = field->blockRes();
+		const boost::uint64_t bytes = (boost::uint64_t)sizeof(T) << (3 * field->blockOrder());
 
-				if(!depthField) {
-					_THROW("load() : depth field is not a SparseField of type float");
-					return false;
-				}
+		std::vector<T> scratch(1 << (3 * field->blockOrder()));
 
-				loadDepthMapping(depthField);
-				depthLoaded = true;
+		for(int i = 0; i < res.x * res.y * res.z; i++) {
+			DifMapBlock<T>& block = tables[c][i];
+			std::memset(&block, 0, sizeof(block));
 
-				break;
+			block.value = T(0);
+
+			if(field->blockData(i % res.x, (i / res.x) % res.y, i / (res.x * res.y), &scratch[0], block.value)) {
+				block.encoding = eDifMapRaw;
+				block.offset   = cursor;
+
+				cursor = difMapAlign(cursor + bytes, 64);
+			} else {
+				block.encoding = eDifMapUniform;
 			}
 		}
 	}
 
-	// No depth mapping available
-	if(!depthLoaded) {
-		_THROW("load() : couldn't load depth mapping");
+	header.fileSize = cursor;
+
+	std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+
+	if(!out) {
+		_THROW("saveMapped() : couldn't create file");
 		return false;
 	}
-	
 
-	FieldVector fields = ifp.readScalarLayers<T>();
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
 
-	if(fields.size() < 1) {
-		_THROW("load() : no channels available");
-		return false;
+	if(header.depths > 0) {
+		std::vector<boost::uint32_t> order(m_lDepthOrder.begin(), m_lDepthOrder.end());
+
+		out.write(reinterpret_cast<const char*>(&m_lDepthMapping[0]), header.depths * sizeof(float));
+		out.write(reinterpret_cast<const char*>(&m_lSortedDepths[0]), header.depths * sizeof(float));
+		out.write(reinterpret_cast<const char*>(&order[0]), header.depths * sizeof(boost::uint32_t));
 	}
 
-	{
-		FieldVectorIterator it;
-		V3i initialSize;
-		bool sizeSet = false;
+	difMapPad(out, header.channelTable);
 
-		for(it = fields.begin(); it != fields.end();  it++) {
-			if((*it)->name == m_scDepthMappingName || (*it)->name.length() == 0) {
-				continue;
-			}
+	for(unsigned int c = 0; c < header.channels; c++) {
+		out.write(reinterpret_cast<const char*>(&channels[c]), sizeof(DifMapChannel));
+	}
 
-			SparseFieldPtr handle = field_dynamic_cast< SparseField<T> >(*it);
+	for(unsigned int c = 0; c < header.channels; c++) {
+		difMapPad(out, channels[c].blockTable);
+		out.write(reinterpret_cast<const char*>(&tables[c][0]), tables[c].size() * sizeof(DifMapBlock<T>));
+	}
 
-			if(!handle) {
-				continue;
-			}
+	for(unsigned int c = 0; c < header.channels; c++) {
+		const DifField<T>* field = m_lChannels[c].get();
+		const V3i res = field->blockRes();
+		const size_t bytes = sizeof(T) << (3 * field->blockOrder());
 
-			if(!sizeSet) {
-				m_vSize = handle->dataResolution();
-				sizeSet = true;
-			}
+		std::vector<T> scratch(1 << (3 * field->blockOrder()));
 
-			// check for size mismatch
-			if(m_vSize != handle->dataResolution()) {
+		for(int i = 0; i < res.x * res.y * res.z; i++) {
+			if(tables[c][i].encoding != eDifMapRaw) {
 				continue;
 			}
 
-			unsigned int retid;
-			addChannelIntern((*it)->name, DifField<T>(*handle), retid);
+			T value;
+			const T* data = field->blockData(i % res.x, (i / res.x) % res.y, i / (res.x * res.y), &scratch[0], value);
+
+			difMapPad(out, tables[c][i].offset);
+			out.write(reinterpret_cast<const char*>(data), bytes);
 		}
 	}
 
-	return (m_lChannels.size() > 0) ? true : false;
+	difMapPad(out, header.fileSize);
+
+	if(!out.good()) {
+		_THROW("saveMapped() : write error");
+		return false;
+	}
+
+	return true;
 }
 
 /*!
- * @brief Computes the nearest depth
+ * @brief Loads a mapped image into memory
  *
- * @param[in] dpt    The Depth
- * @param[in] type   Type
- * @param[out] retid The nearest depth Index
+ * The blocks are copied in parallel over channels. Together with save() this
+ * converts a mapped image back to the Field3D format. The image is replaced,
+ * its previous channels, samples and packed channels are dropped.
+ *
+ * @param[in] map An opened mapped image
+ * @return false if @a map is not open or has no channels
  */
-template<typename T> void DifImage<T>::getNearestDepthIndex(float dpt, DifImage<T>::DifImageGetType type, unsigned int& retid) {
-	DepthMappingListIter it;
+template<typename T> bool DifImage<T>::load(const DifMappedImage<T>& map) {
+	if(!map.isOpen()) {
+		_THROW("load() : mapped image is not open");
+		return false;
+	}
 
-	float current     = 0.0f;
-	unsigned int lidx = 0;
-	unsigned int i    = 0;
-	bool aset         = false;
+	if(m_bConcurrentWrites) {
+		_THROW("load() : image is written concurrently");
+		return false;
+	}
 
-	for(it = m_lDepthMapping.begin(); it != m_lDepthMapping.end(); it++, i++) {
-		if((*it) == dpt) {
-			retid = i;
-			return;
-		}
+	// The map replaces the image, no channel, sample or packed state survives
+	m_lChannels.clear();
+	m_lChannelNames.clear();
+	m_lChannelIndex.clear();
+	m_lChannelCodecs.clear();
+	m_lChannelStorages.clear();
+	m_lPackedChannels.clear();
+	m_bPacked = false;
+	m_ulChannelIndex = 0;
+	m_pLazyFile = NULL;
+	m_bOutOfCore = false;
+	m_pSamples.reset();
+	m_ulDepthCapacity = 0;
+
+	const V2i size = map.getSize();
+
+	m_vSize = V3i(size.x, size.y, 1);
+	m_fDepthTolerance = map.depthTolerance();
 
-		if(type == eBefore) {
-			if((*it) < dpt && (*it) > current) {
-				lidx = i;
-				current = *it;
-			}
-		} else {
-			if((*it) > dpt) {
-				if(!aset) {
-					current = *it;
-					lidx = i;
-					aset = true;
-				} else if ((*it) < current) {
-					lidx = i;
-					current = *it;
-				}
-			}
+	{
+		std::vector<float> depths(map.depthLevels());
+
+		for(unsigned int i = 0; i < depths.size(); i++) {
+			depths[i] = map.depthAtIndex(i);
 		}
+
+		assignDepths(depths);
 	}
 
-	retid = lidx;
-}
+	std::vector<DifField<T>*> targets(map.numberOfChannels());
 
-template<typename T> void DifImage<T>::addDepth(float dpt, bool sync) {
-	unsigned int idx = 0;
-	bool status = false;
+	for(unsigned int c = 0; c < targets.size(); c++) {
+		targets[c] = new DifField<T>(size);
 
-	idx = indexAtDepth(dpt, &status);
+		if(targets[c]->blockOrder() != map.blockOrder(c)) {
+			targets[c]->setBlockOrder(map.blockOrder(c));
+		}
 
-	if(status) {
-		return;
+		if(map.depth(c) > 0) {
+			targets[c]->updateDepth(map.depth(c) - 1);
+		}
 	}
-	
-	m_lDepthMapping.push_back(dpt);
-	idx = (m_lDepthMapping.size()-1);
 
-	if(sync) {
-		unsigned int current = 0;
+	UnmapChannel unmap;
+	unmap.map     = &map;
+	unmap.targets = &targets;
 
-		for(; current < numberOfChannels(); current++) {
-			DifField<T>* field = getField(current);
+	DifParallelFor<UnmapChannel>(0, targets.size(), m_ulThreads, unmap);
 
-			if(field) {
-				field->updateDepth(idx);
-			} else {
-				_THROW("addDepth() : channel invalid");
-			}
+	for(unsigned int c = 0; c < targets.size(); c++) {
+		unsigned int retid;
+
+		if(hasChannel(map.channelName(c))) {
+			delete targets[c];
+			continue;
 		}
+
+		registerChannel(map.channelName(c), targets[c], retid);
 	}
+
+	return (m_lChannels.size() > 0);
+}
+
+/*!
+ * @brief Converts a Field3D deep image file to the mapped format
+ * @param[in] ifp  An opened Input file
+ * @param[in] path Name of the mapped file
+ */
+template<typename T> bool difConvertToMapped(Field3DInputFile& ifp, const std::string& path) {
+	DifImage<T> image(V2i(0, 0));
+
+	return image.load(ifp) && image.saveMapped(path);
 }
 
+/*!
+ * @brief Converts a mapped deep image to the Field3D format
+ * @param[in] path Name of the mapped file
+ * @param[in] ofp  A created Output file
+ */
+template<typename T> bool difConvertFromMapped(const std::string& path, Field3DOutputFile& ofp) {
+	DifMappedImage<T> map;
+	DifImage<T> image(V2i(0, 0));
+
+	if(!map.open(path) || !image.load(map)) {
+		return false;
+	}
+
+	image.save(ofp);
+
+	return true;
+}
 
 #undef _THROW
 #undef _DIF_TYPE
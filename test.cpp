@@ -4,92 +4,2585 @@
 
 #include <Field3D/InitIO.h>
 
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <new>
+
+#include <malloc.h>
+#include <unistd.h>
 
 using namespace Field3D;
 
-void highrestest() {
-	DifImage<float> dif(V2i(4096, 4096));
-	
-	unsigned int r,g,b,a,z;
-	
-	dif.addChannel("r", r);
-	dif.addChannel("g", g);
-	dif.addChannel("b", b);
-	dif.addChannel("a", a);
-	dif.addChannel("z", z);
-	
-	for(int i = 0; i < 10; i++) {
-		dif.addDepth((float)i);
+// Reports a failed condition and fails the calling test, also in NDEBUG builds
+#define CHECK(expr) \
+	do { \
+		if(!(expr)) { \
+			std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " << #expr << std::endl; \
+			return -1; \
+		} \
+	} while(0)
+
+// Counts heap allocations while g_countAllocations is set
+static bool g_countAllocations = false;
+static unsigned int g_allocations = 0;
+
+// Heap bytes in use and their peak while g_trackHeap is set, single threaded only
+static bool g_trackHeap = false;
+static long g_heapBytes = 0;
+static long g_heapPeak = 0;
+
+// Dynamic exception specifications are gone since C++17
+#if __cplusplus < 201103L
+#define TEST_THROWS_BAD_ALLOC throw(std::bad_alloc)
+#define TEST_NOTHROW          throw()
+#else
+#define TEST_THROWS_BAD_ALLOC
+#define TEST_NOTHROW          noexcept
+#endif
+
+void* operator new(std::size_t size) TEST_THROWS_BAD_ALLOC {
+	if(g_countAllocations) {
+		++g_allocations;
+	}
+
+	void *ptr = malloc(size ? size : 1);
+
+	if(!ptr) {
+		throw std::bad_alloc();
+	}
+
+	if(g_trackHeap) {
+		g_heapBytes += malloc_usable_size(ptr);
+		g_heapPeak = std::max(g_heapPeak, g_heapBytes);
+	}
+
+	return ptr;
+}
+
+void* operator new[](std::size_t size) TEST_THROWS_BAD_ALLOC {
+	return operator new(size);
+}
+
+// Kept out of line, inlined into a delete GCC takes its free() for a mismatch
+__attribute__((noinline)) void operator delete(void *ptr) TEST_NOTHROW {
+	if(g_trackHeap && ptr) {
+		g_heapBytes -= malloc_usable_size(ptr);
+	}
+
+	free(ptr);
+}
+
+void operator delete[](void *ptr) TEST_NOTHROW {
+	operator delete(ptr);
+}
+
+void highrestest() {
+	DifImage<float> dif(V2i(4096, 4096));
+	
+	unsigned int r,g,b,a,z;
+	
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+	dif.addChannel("b", b);
+	dif.addChannel("a", a);
+	dif.addChannel("z", z);
+	
+	for(int i = 0; i < 10; i++) {
+		dif.addDepth((float)i);
+	}
+	
+	
+}
+
+int depthreservetest() {
+	const V2i size(37, 21);
+
+	DifImage<float> single(size);
+	DifImage<float> bulk(size);
+
+	unsigned int id;
+	single.addChannel("r", id);
+	single.addChannel("a", id);
+	bulk.addChannel("r", id);
+	bulk.addChannel("a", id);
+
+	std::vector<float> depths;
+
+	for(int i = 0; i < 40; i++) {
+		depths.push_back(float((i * 7) % 40));
+		single.addDepth(depths.back());
+	}
+
+	// Duplicates are only registered once
+	depths.push_back(3.0f);
+
+	CHECK(bulk.addDepths(depths));
+	CHECK(bulk.depthLevels() == 40 && single.depthLevels() == 40);
+
+	for(unsigned int i = 0; i < 40; i++) {
+		CHECK(bulk.depthAtIndex(i) == single.depthAtIndex(i));
+	}
+
+	float data[2] = {1.5f, 0.5f};
+	float a[2], b[2];
+
+	single.writeData(V2i(3, 4), 17.0f, data);
+	bulk.writeData(V2i(3, 4), 17.0f, data);
+
+	for(int d = 0; d < 40; d++) {
+		CHECK(single.readData(V2i(3, 4), float(d), a) && bulk.readData(V2i(3, 4), float(d), b));
+		CHECK(a[0] == b[0] && a[1] == b[1]);
+	}
+
+	// Reserved room is used by the next depths and not saved
+	DifImage<float> reserved(size);
+	reserved.addChannel("r", id);
+	CHECK(reserved.reserveDepths(20));
+
+	for(int d = 0; d < 5; d++) {
+		data[0] = float(d + 1);
+		reserved.writeData(V2i(d, d), float(d), data);
+	}
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_reserve.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		reserved.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_reserve.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	Field<float>::Vec layers = ifp.readScalarLayers<float>("r");
+	CHECK(layers.size() == 1 && layers[0]->dataResolution().z == 5);
+
+	DifImage<float> back(V2i(0, 0));
+	CHECK(back.load(ifp));
+
+	for(int d = 0; d < 5; d++) {
+		float v = 0.0f;
+		CHECK(back.readChannelData(0, V2i(d, d), float(d), v, DifImage<float>::eNone));
+		CHECK(v == float(d + 1));
+	}
+
+	// Unsynced depths read as 0 through every read until they are written
+	DifImage<float> lazy(size);
+	lazy.addChannel("r", id);
+	lazy.addChannel("a", id);
+	lazy.writeData(V2i(1, 1), 0.0f, data);
+
+	for(int d = 1; d < 40; d++) {
+		lazy.addDepth(float(d), false);
+	}
+
+	float v = -1.0f;
+	CHECK(lazy.readChannelData(0, V2i(1, 1), 39.0f, v, DifImage<float>::eNone) && v == 0.0f);
+	CHECK(lazy.readChannelData(1, V2i(1, 1), 0.5f, v) && v == data[1] * 0.5f);
+	CHECK(lazy.readData(V2i(1, 1), 0.5f, a) && a[1] == v);
+	CHECK(!lazy.readChannelData(0, V2i(size.x, 1), 39.0f, v, DifImage<float>::eNone));
+
+	lazy.writeData(V2i(1, 1), 39.0f, data);
+	CHECK(lazy.readChannelData(0, V2i(1, 1), 39.0f, v, DifImage<float>::eNone) && v == data[0]);
+
+	return 0;
+}
+
+int summarycheck(const DifImage<float>& image, const V2i& size, const std::vector<float>& sorted) {
+	std::vector<float> depths(size.x * size.y);
+	std::vector<unsigned char> mask(size.x * size.y);
+	std::vector<V3i> blocks;
+
+	const float thresholds[2] = {0.0f, 0.5f};
+
+	for(int t = 0; t < 2; t++) {
+		CHECK(image.firstHit(1, &depths[0], thresholds[t]));
+		CHECK(image.coverage(1, &mask[0], thresholds[t]));
+
+		for(int y = 0; y < size.y; y++) {
+			for(int x = 0; x < size.x; x++) {
+				float expected = std::numeric_limits<float>::infinity();
+
+				for(unsigned int k = 0; k < sorted.size(); k++) {
+					float v = 0.0f;
+					image.readChannelData(1, V2i(x, y), sorted[k], v, DifImage<float>::eNone);
+
+					if(v > thresholds[t]) {
+						expected = sorted[k];
+						break;
+					}
+				}
+
+				CHECK(depths[y * size.x + x] == expected);
+				CHECK(mask[y * size.x + x] == (expected != std::numeric_limits<float>::infinity()));
+			}
+		}
+	}
+
+	// Every value other than 0 lies in a listed block
+	unsigned int listed = image.occupiedBlocks(1, blocks);
+	CHECK(listed == blocks.size() && listed > 0);
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			for(unsigned int k = 0; k < sorted.size(); k++) {
+				float v = 0.0f;
+				image.readChannelData(1, V2i(x, y), sorted[k], v, DifImage<float>::eNone);
+
+				if(v != 0.0f) {
+					V3i b(x >> 4, y >> 4, int(sorted[k]) >> 4);
+					CHECK(std::find(blocks.begin(), blocks.end(), b) != blocks.end());
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+int summarytest() {
+	const V2i size(45, 33);
+
+	DifImage<float> image(size);
+
+	unsigned int id;
+	image.addChannel("r", id);
+	image.addChannel("a", id);
+
+	std::vector<float> sorted;
+
+	for(int i = 0; i < 30; i++) {
+		image.addDepth(float((i * 11) % 30));
+		sorted.push_back(float(i));
+	}
+
+	srand(7);
+
+	for(int i = 0; i < 200; i++) {
+		float data[2] = {1.0f, float(rand() % 3) * 0.4f};
+		image.writeData(V2i(rand() % size.x, rand() % size.y), float(rand() % 30), data);
+	}
+
+	CHECK(summarycheck(image, size, sorted) == 0);
+
+	// Writes widen the built bounds, zeros leave them conservative
+	for(int i = 0; i < 150; i++) {
+		float data[2] = {0.0f, (i & 1) ? 0.0f : 0.9f};
+		image.writeData(V2i(rand() % size.x, rand() % size.y), float(rand() % 30), data);
+	}
+
+	CHECK(summarycheck(image, size, sorted) == 0);
+
+	std::vector<float> depths(size.x * size.y);
+	std::vector<V3i> blocks;
+
+	CHECK(!image.firstHit(2, &depths[0]));
+	CHECK(image.occupiedBlocks(2, blocks) == 0 && blocks.empty());
+
+	// Negative thresholds hit the first depth everywhere
+	CHECK(image.firstHit(0, &depths[0], -1.0f));
+	CHECK(depths[0] == sorted[0] && depths[size.x * size.y - 1] == sorted[0]);
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_summary.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		image.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_summary.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> back(V2i(0, 0));
+	CHECK(back.load(ifp));
+
+	CHECK(summarycheck(back, size, sorted) == 0);
+
+	return 0;
+}
+
+int pyramidtest() {
+	const V2i size(53, 38);
+
+	DifImage<float> image(size);
+
+	unsigned int id;
+	image.addChannel("r", id);
+	image.addChannel("a", id);
+
+	for(int i = 0; i < 24; i++) {
+		image.addDepth(float((i * 7) % 24));
+	}
+
+	srand(11);
+
+	for(int i = 0; i < 150; i++) {
+		float data[2] = {1.0f, float(rand() % 3) * 0.4f};
+		image.writeData(V2i(rand() % size.x, rand() % size.y), float(rand() % 24), data);
+	}
+
+	DifDepthPyramid<float> pyramid;
+	CHECK(!pyramid.isBuilt() && !pyramid.inFront(V2i(0, 0), size, 100.0f));
+	CHECK(!pyramid.build(image, "z"));
+	CHECK(pyramid.build(image, "a", 0.5f));
+
+	// 53x38, 27x19, 14x10, 7x5, 4x3, 2x2, 1x1
+	CHECK(pyramid.levels() == 7 && pyramid.levelSize(6) == V2i(1, 1) && pyramid.levelSize(1) == V2i(27, 19));
+
+	for(int pass = 0; pass < 2; pass++) {
+		std::vector<float> nearest(size.x * size.y), farthest(size.x * size.y);
+
+		for(int y = 0; y < size.y; y++) {
+			for(int x = 0; x < size.x; x++) {
+				float n = std::numeric_limits<float>::infinity();
+				float f = -std::numeric_limits<float>::infinity();
+
+				for(int d = 0; d < 24; d++) {
+					float v = 0.0f;
+					image.readChannelData(1, V2i(x, y), float(d), v, DifImage<float>::eNone);
+
+					if(v > 0.5f) {
+						n = std::min(n, float(d));
+						f = std::max(f, float(d));
+					}
+				}
+
+				nearest[y * size.x + x] = n;
+				farthest[y * size.x + x] = f;
+
+				// Single pixels are exact
+				float qn, qf;
+				CHECK(pyramid.query(V2i(x, y), V2i(1, 1), qn, qf) && qn == n && qf == f);
+			}
+		}
+
+		// Regions are conservative
+		for(int i = 0; i < 300; i++) {
+			V2i origin(rand() % size.x - 4, rand() % size.y - 4);
+			V2i extent(1 + rand() % 40, 1 + rand() % 30);
+
+			float n = std::numeric_limits<float>::infinity();
+			float f = -std::numeric_limits<float>::infinity();
+
+			for(int y = std::max(origin.y, 0); y < std::min(origin.y + extent.y, size.y); y++) {
+				for(int x = std::max(origin.x, 0); x < std::min(origin.x + extent.x, size.x); x++) {
+					n = std::min(n, nearest[y * size.x + x]);
+					f = std::max(f, farthest[y * size.x + x]);
+				}
+			}
+
+			const bool inside = origin.x + extent.x > 0 && origin.y + extent.y > 0;
+
+			float qn, qf;
+			CHECK(pyramid.query(origin, extent, qn, qf) == inside);
+			CHECK(qn <= n && qf >= f);
+			CHECK(n == std::numeric_limits<float>::infinity() || pyramid.inFront(origin, extent, n + 0.5f));
+		}
+
+		float qn, qf;
+		CHECK(pyramid.query(V2i(-10, -10), V2i(100, 100), qn, qf));
+		CHECK(qn == *std::min_element(nearest.begin(), nearest.end()));
+		CHECK(qf == *std::max_element(farthest.begin(), farthest.end()));
+		CHECK(!pyramid.query(V2i(size.x, 0), V2i(4, 4), qn, qf));
+
+		// Writes after build() only show up through update()
+		float data[2] = {1.0f, 1.0f};
+		image.writeData(V2i(20, 17), 0.0f, data);
+		data[1] = 0.0f;
+		image.writeData(V2i(21, 17), 23.0f, data);
+		image.writeData(V2i(5, 3), 23.0f, data);
+
+		CHECK(pyramid.update(image, V2i(20, 17), V2i(2, 1)));
+		CHECK(pyramid.update(image, V2i(5, 3), V2i(1, 1)));
+	}
+
+	DifImage<float> other(V2i(8, 8));
+	other.addChannel("a", id);
+	CHECK(!pyramid.update(other, V2i(0, 0), V2i(8, 8)));
+
+	return 0;
+}
+
+int holdouttest() {
+	const V2i size(41, 35);
+
+	DifImage<float> image(size);
+	DifImage<float> matte(size);
+
+	unsigned int id;
+	image.addChannel("r", id);
+	image.addChannel("a", id);
+	matte.addChannel("a", id);
+
+	// Interleaved depths, some of them shared
+	for(int i = 0; i < 20; i++) {
+		image.addDepth(float((i * 7) % 20) * 2.0f);
+		matte.addDepth(float((i * 3) % 20) * 3.0f);
+	}
+
+	srand(13);
+
+	for(int i = 0; i < 300; i++) {
+		float data[2] = {float(rand() % 5), float(rand() % 4) * 0.25f};
+		image.writeData(V2i(rand() % size.x, rand() % size.y), float(rand() % 20) * 2.0f, data);
+	}
+
+	for(int i = 0; i < 300; i++) {
+		float a = float(rand() % 5) * 0.25f;
+		matte.writeData(V2i(rand() % size.x, rand() % size.y), float(rand() % 20) * 3.0f, &a);
+	}
+
+	DifImage<float> dst(size);
+	CHECK(image.holdout(matte, dst));
+	CHECK(dst.numberOfChannels() == 2 && dst.depthLevels() == image.depthLevels());
+	CHECK(dst.channelName(0) == "r" && dst.channelName(1) == "a");
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			float acc = 0.0f;
+			int m = 0;
+
+			for(int k = 0; k < 20; k++) {
+				const float depth = float(k) * 2.0f;
+
+				// Matte depths strictly in front
+				for(; m < 20 && float(m) * 3.0f < depth; m++) {
+					float a = 0.0f;
+					matte.readChannelData(0, V2i(x, y), float(m) * 3.0f, a, DifImage<float>::eNone);
+					acc += (1.0f - acc) * a;
+				}
+
+				for(unsigned int c = 0; c < 2; c++) {
+					float v = 0.0f, r = -1.0f;
+					image.readChannelData(c, V2i(x, y), depth, v, DifImage<float>::eNone);
+					CHECK(dst.readChannelData(c, V2i(x, y), depth, r, DifImage<float>::eNone));
+					CHECK(std::fabs(r - v * (1.0f - acc)) < 1e-5f);
+				}
+			}
+		}
+	}
+
+	DifImage<float> filled(size);
+	DifImage<float> small(V2i(8, 8));
+
+	CHECK(!image.holdout(matte, dst));
+	CHECK(!image.holdout(small, filled));
+	CHECK(!image.holdout(matte, filled, "z"));
+	CHECK(filled.numberOfChannels() == 0);
+
+	// Loaded images and block sizes other than the default give the same result
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_holdout.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		image.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_holdout.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> back(V2i(0, 0));
+	CHECK(back.load(ifp));
+
+	DifImage<float> coarse(size), coarseMatte(size);
+	const char *names[2] = {"r", "a"};
+
+	DifField<float> field(size);
+	field.setBlockOrder(3);
+
+	for(int c = 0; c < 2; c++) {
+		CHECK(coarse.addChannel(names[c], field, id));
+	}
+
+	CHECK(coarseMatte.addChannel("a", field, id));
+
+	for(int i = 0; i < 20; i++) {
+		coarse.addDepth(float((i * 7) % 20) * 2.0f);
+		coarseMatte.addDepth(float((i * 3) % 20) * 3.0f);
+	}
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			float data[2];
+
+			for(int k = 0; k < 20; k++) {
+				image.readData(V2i(x, y), float(k) * 2.0f, data, DifImage<float>::eNone);
+				coarse.writeData(V2i(x, y), float(k) * 2.0f, data);
+
+				matte.readData(V2i(x, y), float(k) * 3.0f, data, DifImage<float>::eNone);
+				coarseMatte.writeData(V2i(x, y), float(k) * 3.0f, data);
+			}
+		}
+	}
+
+	DifImage<float> loaded(size), blocked(size);
+
+	CHECK(back.holdout(matte, loaded));
+	CHECK(coarse.holdout(coarseMatte, blocked));
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			for(int k = 0; k < 20; k++) {
+				float expected[2], a[2], b[2];
+
+				dst.readData(V2i(x, y), float(k) * 2.0f, expected, DifImage<float>::eNone);
+				loaded.readData(V2i(x, y), float(k) * 2.0f, a, DifImage<float>::eNone);
+				blocked.readData(V2i(x, y), float(k) * 2.0f, b, DifImage<float>::eNone);
+
+				for(int c = 0; c < 2; c++) {
+					CHECK(a[c] == expected[c] && b[c] == expected[c]);
+				}
+			}
+		}
+	}
+
+	ifp.close();
+
+	// A matte alpha that can't be read fails, also for an image without channels
+	{
+		// The first channel of a lazy load is read right away
+		CHECK(matte.addChannel("z", id));
+		CHECK(matte.setChannelCodec(0, eDifCodecLZ));
+
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_holdout_matte.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		matte.save(ofp);
+		ofp.close();
+
+		if(!ifp.open("test_holdout_matte.dif")) {
+			std::cout << "Error opening input file" << std::endl;
+			return -1;
+		}
+
+		Field<float>::Vec layers = ifp.readScalarLayers<float>();
+		Field3DOutputFile swapped;
+
+		if(!swapped.create("test_holdout_swapped.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		for(size_t i = 0; i < layers.size(); i++) {
+			if(layers[i]->name == "a") {
+				layers[i]->metadata().setIntMetadata("codecByteOrder", difByteOrder() == 1234 ? 4321 : 1234);
+			}
+
+			swapped.writeScalarLayer<float>(layers[i]->name, layers[i]);
+		}
+
+		swapped.close();
+		ifp.close();
+	}
+
+	if(!ifp.open("test_holdout_swapped.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	std::vector<std::string> selected;
+	selected.push_back("z");
+	selected.push_back("a");
+
+	DifImage<float> unreadable(V2i(0, 0));
+	CHECK(unreadable.load(ifp, selected, DifImage<float>::eLazy));
+
+	DifImage<float> none(size), empty(size);
+	CHECK(!none.holdout(unreadable, empty));
+	CHECK(empty.numberOfChannels() == 0);
+
+	ifp.close();
+
+	return 0;
+}
+
+int hardtest() {
+	Field3DOutputFile ofp;
+
+	if(!ofp.create("test_hardcore.dif")) {
+		std::cout << "Error opening output file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> dif(V2i(128, 128));
+	printf("adding channels\n");
+	unsigned int r, g, b, a;
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+	dif.addChannel("b", b);
+	dif.addChannel("a", a);
+
+	float data[4];
+
+	for(int i = 0; i < 128; i++) {
+
+		for(int j = 0; j < 4; j++) {
+			data[0] = j + i;
+			data[1] = j + i + 1;
+			data[2] = j + i + 2;
+			data[3] = j + i + 3;
+
+			printf("%dx%d -> %d data=%f\n", i,i,j, data[0]);
+			dif.writeData(V2i(i,i), float(j), data);
+		}
+
+	}
+
+	printf("done\n");
+		
+	dif.save(ofp);
+	ofp.close();
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_hardcore.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> difi(V2i(0,0));
+	if(!difi.load(ifp)) {
+		std::cout << "Error loading deep image file" << std::endl;
+		return -1;		
+	}
+
+	float rdata[4];
+
+	for(int i = 0; i < 128; i++) {
+		for(int j = 0; j < 4; j++) {
+			difi.readData(V2i(i,i), float(j), rdata);
+
+			CHECK(rdata[0] == j + i);
+			CHECK(rdata[1] == j + i + 1);
+			CHECK(rdata[2] == j + i + 2);
+			CHECK(rdata[3] == j + i + 3);
+		}
+
+	}
+
+	return 0;
+}
+
+int depthordertest() {
+	DifImage<float> dif(V2i(4, 4));
+
+	unsigned int a;
+	dif.addChannel("a", a);
+
+	// Depths arrive out of order, slice indices must stay stable
+	float data = 5.0f;
+	dif.writeData(V2i(1, 1), 5.0f, &data);
+	data = 1.0f;
+	dif.writeData(V2i(1, 1), 1.0f, &data);
+	data = 3.0f;
+	dif.writeData(V2i(1, 1), 3.0f, &data);
+
+	CHECK(dif.indexAtDepth(5.0f) == 0);
+	CHECK(dif.indexAtDepth(1.0f) == 1);
+	CHECK(dif.indexAtDepth(3.0f) == 2);
+
+	float rdata = 0.0f;
+	dif.readData(V2i(1, 1), 2.0f, &rdata);
+	CHECK(rdata == 2.0f);
+
+	dif.readData(V2i(1, 1), 4.5f, &rdata);
+	CHECK(rdata == 4.5f);
+
+	CHECK(!dif.readData(V2i(1, 1), 6.0f, &rdata));
+
+	unsigned int idx = 0;
+	dif.getNearestDepthIndex(2.0f, DifImage<float>::eBefore, idx);
+	CHECK(idx == 1);
+	dif.getNearestDepthIndex(2.0f, DifImage<float>::eAfter, idx);
+	CHECK(idx == 2);
+
+	// Near-equal depths end up in the same slice
+	dif.setDepthTolerance(0.01f);
+	data = 7.0f;
+	dif.writeData(V2i(1, 1), 3.001f, &data);
+
+	CHECK(dif.depthLevels() == 3);
+	dif.readData(V2i(1, 1), 3.0f, &rdata, DifImage<float>::eNone);
+	CHECK(rdata == 7.0f);
+
+	return 0;
+}
+
+int allocationtest() {
+	DifImage<float> dif(V2i(16, 16));
+
+	unsigned int r, g, b, a;
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+	dif.addChannel("b", b);
+	dif.addChannel("a", a);
+
+	float data[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+	dif.writeData(V2i(3, 3), 0.0f, data);
+	dif.writeData(V2i(3, 3), 2.0f, data);
+
+	float rdata[4];
+	float cdata = 0.0f;
+
+	g_allocations = 0;
+	g_countAllocations = true;
+
+	for(int i = 0; i < 1000; i++) {
+		dif.readData(V2i(3, 3), 1.0f, rdata, DifImage<float>::eLinear);
+		dif.readData(V2i(3, 3), 2.0f, rdata, DifImage<float>::eNone);
+		dif.readChannelData(a, V2i(3, 3), 1.5f, cdata);
+	}
+
+	g_countAllocations = false;
+
+	CHECK(g_allocations == 0);
+	CHECK(rdata[3] == 4.0f);
+	CHECK(cdata == 4.0f);
+
+	return 0;
+}
+
+int tiletest() {
+	DifImage<float> dif(V2i(40, 40));
+
+	unsigned int r, g;
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+
+	// 20x20 interleaved tile overlapping the right image border
+	std::vector<float> tile(20 * 20 * 2);
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 20; x++) {
+			tile[(y * 20 + x) * 2 + 0] = float(x + y);
+			tile[(y * 20 + x) * 2 + 1] = float(x * y);
+		}
+	}
+
+	CHECK(dif.writeTile(V2i(30, 3), V2i(20, 20), 1.0f, &tile[0]));
+	CHECK(!dif.writeTile(V2i(40, 0), V2i(20, 20), 1.0f, &tile[0]));
+
+	float rdata[2];
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 10; x++) {
+			dif.readData(V2i(30 + x, 3 + y), 1.0f, rdata, DifImage<float>::eNone);
+			CHECK(rdata[0] == float(x + y));
+			CHECK(rdata[1] == float(x * y));
+		}
+	}
+
+	// Planar scanline and per-pixel depths
+	float planar[8] = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f};
+	dif.writeScanline(V2i(0, 0), 4, 3.0f, planar, DifImage<float>::ePlanar);
+
+	dif.readData(V2i(2, 0), 3.0f, rdata, DifImage<float>::eNone);
+	CHECK(rdata[0] == 3.0f && rdata[1] == 7.0f);
+
+	float depths[4] = {5.0f, 6.0f, 5.0f, 1.0f};
+	dif.writeTile(V2i(0, 1), V2i(2, 2), depths, planar, DifImage<float>::ePlanar);
+
+	CHECK(dif.depthLevels() == 4);
+
+	dif.readData(V2i(1, 1), 6.0f, rdata, DifImage<float>::eNone);
+	CHECK(rdata[0] == 2.0f && rdata[1] == 6.0f);
+
+	dif.readData(V2i(1, 2), 1.0f, rdata, DifImage<float>::eNone);
+	CHECK(rdata[0] == 4.0f && rdata[1] == 8.0f);
+
+	return 0;
+}
+
+int regiontest() {
+	DifImage<float> dif(V2i(37, 21));
+
+	unsigned int r, g;
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+
+	float data[2];
+
+	for(int d = 0; d < 3; d++) {
+		for(int y = 0; y < 21; y++) {
+			for(int x = 0; x < 37; x += 2) {
+				data[0] = float(x + y + d);
+				data[1] = float(d * 10);
+				dif.writeData(V2i(x, y), float(2 - d), data);
+			}
+		}
+	}
+
+	// Region reads must match per-pixel reads
+	std::vector<float> tile(20 * 20 * 2);
+	float rdata[2];
+
+	CHECK(dif.readTile(V2i(25, 10), V2i(20, 20), 0.5f, &tile[0]));
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 20; x++) {
+			if(x + 25 >= 37 || y + 10 >= 21) {
+				CHECK(tile[(y * 20 + x) * 2] == 0.0f);
+				continue;
+			}
+
+			dif.readData(V2i(x + 25, y + 10), 0.5f, rdata);
+			CHECK(tile[(y * 20 + x) * 2 + 0] == rdata[0]);
+			CHECK(tile[(y * 20 + x) * 2 + 1] == rdata[1]);
+		}
+	}
+
+	CHECK(dif.readTile(V2i(0, 0), V2i(20, 20), 1.0f, &tile[0], DifImage<float>::eNone, DifImage<float>::ePlanar));
+	CHECK(tile[3 * 20 + 4] == 4.0f + 3.0f + 1.0f);
+	CHECK(tile[20 * 20 + 3 * 20 + 4] == 10.0f);
+	CHECK(!dif.readTile(V2i(0, 0), V2i(20, 20), 1.5f, &tile[0], DifImage<float>::eNone));
+
+	// Depth columns come back front to back
+	float column[3 * 2];
+	float depths[3];
+
+	CHECK(dif.readDepthColumn(V2i(6, 4), column, depths) == 3);
+	CHECK(depths[0] == 0.0f && depths[1] == 1.0f && depths[2] == 2.0f);
+	CHECK(column[0] == 6.0f + 4.0f + 2.0f && column[1] == 20.0f);
+	CHECK(column[4] == 6.0f + 4.0f && column[5] == 0.0f);
+
+	return 0;
+}
+
+int selectiveloadtest() {
+	Field3DOutputFile ofp;
+
+	if(!ofp.create("test_selective.dif")) {
+		std::cout << "Error opening output file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> dif(V2i(8, 8));
+
+	unsigned int r, g, b, a;
+	dif.addChannel("r", r);
+	dif.addChannel("g", g);
+	dif.addChannel("b", b);
+	dif.addChannel("a", a);
+
+	float data[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+	dif.writeData(V2i(2, 5), 1.5f, data);
+
+	dif.save(ofp);
+	ofp.close();
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_selective.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	std::vector<std::string> names;
+	names.push_back("a");
+	names.push_back("g");
+
+	// Only the requested channels, in the requested order
+	DifImage<float> difs(V2i(0, 0));
+	CHECK(difs.load(ifp, names));
+	CHECK(difs.numberOfChannels() == 2);
+	CHECK(difs.channelName(0) == "a" && difs.channelName(1) == "g");
+	CHECK(!difs.hasChannel("r"));
+
+	float rdata[2];
+	difs.readData(V2i(2, 5), 1.5f, rdata, DifImage<float>::eNone);
+	CHECK(rdata[0] == 4.0f && rdata[1] == 2.0f);
+
+	// Lazy load of every channel
+	DifImage<float> difl(V2i(0, 0));
+	CHECK(difl.load(ifp, std::vector<std::string>(), DifImage<float>::eLazy));
+	CHECK(difl.numberOfChannels() == 4);
+	CHECK(difl.isLazy());
+
+	float cret = 0.0f;
+	CHECK(difl.readChannelData("b", V2i(2, 5), 1.5f, cret));
+	CHECK(cret == 3.0f);
+
+	// Copies keep the unresolved channels lazy and own the resolved ones
+	DifImage<float> copy(difl);
+	CHECK(copy.isLazy() && copy.numberOfChannels() == 4);
+
+	DifImage<float> assigned(V2i(1, 1));
+	assigned = copy;
+
+	float wdata[4] = {5.0f, 6.0f, 7.0f, 8.0f};
+	copy.writeData(V2i(2, 5), 1.5f, wdata);
+
+	bool ok = copy.readChannelData("b", V2i(2, 5), 1.5f, cret);
+	CHECK(ok && cret == 7.0f);
+
+	ok = difl.readChannelData("b", V2i(2, 5), 1.5f, cret);
+	CHECK(ok && cret == 3.0f);
+
+	ok = assigned.readChannelData("r", V2i(2, 5), 1.5f, cret);
+	CHECK(ok && cret == 1.0f);
+
+	ok = assigned.readChannelData("b", V2i(2, 5), 1.5f, cret);
+	CHECK(ok && cret == 3.0f);
+
+	difl.resolveChannels();
+	CHECK(!difl.isLazy());
+
+	// Names the file doesn't have are skipped like in eager loads
+	std::vector<std::string> some;
+	some.push_back("x");
+	some.push_back("g");
+	some.push_back("y");
+	some.push_back("a");
+
+	DifImage<float> difm(V2i(0, 0));
+	ok = difm.load(ifp, some, DifImage<float>::eLazy);
+	CHECK(ok);
+	CHECK(difm.numberOfChannels() == 2 && difm.hasChannel("a") && !difm.hasChannel("y"));
+
+	ok = difm.readChannelData("a", V2i(2, 5), 1.5f, cret);
+	CHECK(ok && cret == 4.0f);
+
+	ifp.close();
+
+	return 0;
+}
+
+int sampletest() {
+	DifImage<float> dense(V2i(24, 20));
+	DifImage<float> samples(V2i(24, 20), DifImage<float>::eSamples);
+
+	CHECK(samples.storage() == DifImage<float>::eSamples);
+
+	unsigned int r, a;
+	dense.addChannel("r", r);
+	dense.addChannel("a", a);
+	samples.addChannel("r", r);
+	samples.addChannel("a", a);
+
+	// A few samples per pixel at depths unique to the pixel
+	float data[2];
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 24; x += 3) {
+			for(int k = 0; k < 2; k++) {
+				float depth = float(x * 20 + y) + 0.25f * k;
+
+				data[0] = float(x + k);
+				data[1] = float(y + 1);
+
+				dense.writeData(V2i(x, y), depth, data);
+				samples.writeData(V2i(x, y), depth, data);
+			}
+		}
+	}
+
+	// Overwrite one sample twice
+	data[0] = 99.0f;
+	samples.writeData(V2i(3, 2), float(3 * 20 + 2), data);
+	dense.writeData(V2i(3, 2), float(3 * 20 + 2), data);
+
+	CHECK(samples.numberOfSamples() == 8 * 20 * 2 + 1);
+
+	float a1[2], a2[2];
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 24; x++) {
+			float depth = float(x * 20 + y) + 0.125f;
+
+			CHECK(dense.readData(V2i(x, y), depth, a1) == samples.readData(V2i(x, y), depth, a2));
+			CHECK(a1[0] == a2[0] && a1[1] == a2[1]);
+
+			depth = float(x * 20 + y);
+
+			CHECK(dense.readData(V2i(x, y), depth, a1, DifImage<float>::eNone) == samples.readData(V2i(x, y), depth, a2, DifImage<float>::eNone));
+			CHECK(a1[0] == a2[0] && a1[1] == a2[1]);
+		}
+	}
+
+	CHECK(samples.numberOfSamples() == 8 * 20 * 2);
+
+	std::vector<float> c1(dense.depthLevels() * 2), c2(dense.depthLevels() * 2);
+
+	dense.readDepthColumn(V2i(3, 2), &c1[0]);
+	samples.readDepthColumn(V2i(3, 2), &c2[0]);
+	CHECK(c1 == c2);
+
+	// Reads between writes commit a few scattered pixels at a time
+	const V2i scattered[4] = {V2i(0, 0), V2i(3, 2), V2i(23, 19), V2i(3, 2)};
+
+	for(int i = 0; i < 4; i++) {
+		data[0] = float(100 + i);
+		data[1] = float(i);
+
+		dense.writeData(scattered[i], 1000.5f + float(i % 2), data);
+		samples.writeData(scattered[i], 1000.5f + float(i % 2), data);
+
+		for(int y = 0; y < 20; y++) {
+			for(int x = 0; x < 24; x++) {
+				float depth = (x == scattered[i].x && y == scattered[i].y) ? 1000.5f + float(i % 2) : float(x * 20 + y) + 0.25f;
+
+				CHECK(dense.readData(V2i(x, y), depth, a1, DifImage<float>::eNone) == samples.readData(V2i(x, y), depth, a2, DifImage<float>::eNone));
+				CHECK(a1[0] == a2[0] && a1[1] == a2[1]);
+			}
+		}
+	}
+
+	CHECK(samples.numberOfSamples() == 8 * 20 * 2 + 3);
+
+	// Round trip through the Field3D container
+	Field3DOutputFile ofp;
+
+	if(!ofp.create("test_samples.dif")) {
+		std::cout << "Error opening output file" << std::endl;
+		return -1;
+	}
+
+	samples.save(ofp);
+	ofp.close();
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_samples.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> difi(V2i(0, 0));
+	CHECK(difi.load(ifp));
+	CHECK(difi.storage() == DifImage<float>::eSamples);
+	CHECK(difi.numberOfSamples() == samples.numberOfSamples());
+	CHECK(difi.channelName(1) == "a");
+
+	std::vector<float> t1(24 * 20 * 2), t2(24 * 20 * 2);
+
+	samples.readTile(V2i(0, 0), V2i(24, 20), 100.1f, &t1[0]);
+	difi.readTile(V2i(0, 0), V2i(24, 20), 100.1f, &t2[0]);
+	CHECK(t1 == t2);
+
+	// The sample count is metadata, one that doesn't match the layers fails the load
+	{
+		Field<float>::Vec layers = ifp.readScalarLayers<float>();
+		Field3DOutputFile bad;
+
+		if(!bad.create("test_badsamples.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		for(size_t i = 0; i < layers.size(); i++) {
+			if(layers[i]->name == "sampleSlices") {
+				layers[i]->metadata().setIntMetadata("sampleCount", samples.numberOfSamples() + 1);
+			}
+
+			bad.writeScalarLayer<float>(layers[i]->name, layers[i]);
+		}
+
+		bad.close();
+	}
+
+	ifp.close();
+
+	if(!ifp.open("test_badsamples.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> broken(V2i(0, 0));
+	CHECK(!broken.load(ifp) && broken.storage() == DifImage<float>::eDense);
+
+	ifp.close();
+
+	return 0;
+}
+
+template<typename T> int lerptest() {
+	DifImage<T> dif(V2i(37, 21));
+
+	unsigned int r, a;
+	dif.addChannel("r", r);
+	dif.addChannel("a", a);
+
+	// The left half is only written at depth 1, so one side of the lerp is unallocated there
+	T data[2];
+
+	for(int y = 0; y < 21; y++) {
+		for(int x = 0; x < 37; x++) {
+			data[0] = T(float(x) * 0.37f + float(y));
+			data[1] = T(float(y) / 7.0f);
+
+			dif.writeData(V2i(x, y), 1.0f, data);
+
+			if(x >= 18) {
+				data[0] = T(float(x * y) - 3.1f);
+				dif.writeData(V2i(x, y), 3.0f, data);
+			}
+		}
+	}
+
+	const int count = 37 * 21;
+	std::vector<T> expected(count * 2), planar(count * 2), interleaved(count * 2);
+
+	T bfr[2], aftr[2];
+
+	for(int p = 0; p < count; p++) {
+		dif.readData(V2i(p % 37, p / 37), 1.0f, bfr, DifImage<T>::eNone);
+		dif.readData(V2i(p % 37, p / 37), 3.0f, aftr, DifImage<T>::eNone);
+
+		for(int c = 0; c < 2; c++) {
+			expected[c * count + p] = Imath::lerp(bfr[c], aftr[c], 0.65f);
+		}
+	}
+
+	// Every instruction set the CPU supports has to agree with Imath::lerp()
+	DifSimd level = difSimd();
+
+	for(int l = eDifSimdNone; l <= level; l++) {
+		difSetSimd(DifSimd(l));
+
+		CHECK(dif.readTile(V2i(0, 0), V2i(37, 21), 2.3f, &planar[0], DifImage<T>::eLinear, DifImage<T>::ePlanar));
+		CHECK(dif.readTile(V2i(0, 0), V2i(37, 21), 2.3f, &interleaved[0]));
+
+		for(int p = 0; p < count; p++) {
+			for(int c = 0; c < 2; c++) {
+				CHECK(planar[c * count + p] == expected[c * count + p]);
+				CHECK(interleaved[p * 2 + c] == expected[c * count + p]);
+			}
+		}
+	}
+
+	difSetSimd(level);
+
+	return 0;
+}
+
+int resampletest() {
+	DifImage<float> dif(V2i(40, 35));
+	dif.setThreads(4);
+
+	unsigned int r, a;
+	dif.addChannel("r", r);
+	dif.addChannel("a", a);
+
+	// Depth 4 only covers the lower part of the image
+	float data[2];
+
+	for(int y = 0; y < 35; y++) {
+		for(int x = 0; x < 40; x++) {
+			data[0] = float(x + y);
+			data[1] = 1.0f;
+			dif.writeData(V2i(x, y), 2.0f, data);
+
+			data[0] = float(x * y) * 0.5f;
+			data[1] = float(y) / 35.0f;
+			dif.writeData(V2i(x, y), 1.0f, data);
+
+			if(y >= 20) {
+				data[0] = 7.0f;
+				dif.writeData(V2i(x, y), 4.0f, data);
+			}
+		}
+	}
+
+	std::vector<float> depths;
+	depths.push_back(3.0f);
+	depths.push_back(0.5f);
+	depths.push_back(1.0f);
+	depths.push_back(1.5f);
+	depths.push_back(5.0f);
+
+	// Reference straight from readTile()
+	const int count = 40 * 35 * 2;
+	std::vector<float> expected(count * depths.size(), 0.0f);
+
+	for(unsigned int k = 0; k < depths.size(); k++) {
+		dif.readTile(V2i(0, 0), V2i(40, 35), depths[k], &expected[k * count]);
+	}
+
+	DifImage<float> dst(V2i(40, 35));
+	CHECK(dif.resampleDepths(depths, dst));
+	CHECK(!dif.resampleDepths(depths, dst));
+	CHECK(dst.depthLevels() == depths.size());
+	CHECK(dst.channelName(1) == "a");
+
+	// A loaded image resamples into a new one just the same
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_resample.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		dif.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_resample.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> back(V2i(0, 0));
+	DifImage<float> loaded(V2i(40, 35));
+
+	bool ok = back.load(ifp);
+	CHECK(ok);
+
+	ok = back.resampleDepths(depths, loaded);
+	CHECK(ok && loaded.depthLevels() == depths.size());
+
+	CHECK(dif.resampleDepths(depths));
+	CHECK(dif.depthLevels() == depths.size());
+
+	std::vector<float> tile(count);
+
+	for(unsigned int k = 0; k < depths.size(); k++) {
+		CHECK(dst.readTile(V2i(0, 0), V2i(40, 35), depths[k], &tile[0], DifImage<float>::eNone));
+		CHECK(std::equal(tile.begin(), tile.end(), expected.begin() + k * count));
+
+		CHECK(dif.readTile(V2i(0, 0), V2i(40, 35), depths[k], &tile[0], DifImage<float>::eNone));
+		CHECK(std::equal(tile.begin(), tile.end(), expected.begin() + k * count));
+
+		ok = loaded.readTile(V2i(0, 0), V2i(40, 35), depths[k], &tile[0], DifImage<float>::eNone);
+		CHECK(ok && std::equal(tile.begin(), tile.end(), expected.begin() + k * count));
+	}
+
+	return 0;
+}
+
+int flattentest() {
+	DifImage<float> dense(V2i(30, 20));
+	DifImage<float> samples(V2i(30, 20), DifImage<float>::eSamples);
+	dense.setThreads(3);
+	samples.setThreads(3);
+
+	unsigned int id;
+	const char *names[4] = {"r", "g", "a", "b"};
+
+	for(int c = 0; c < 4; c++) {
+		dense.addChannel(names[c], id);
+		samples.addChannel(names[c], id);
+	}
+
+	// Depths are written back to front so storage and depth order differ
+	float data[4];
+
+	for(int d = 5; d >= 0; d--) {
+		for(int y = 0; y < 20; y++) {
+			for(int x = (d % 2) * 7; x < 30; x += 2) {
+				float alpha = (x < 10) ? 1.0f : float((x + y + d) % 5) * 0.2f;
+
+				data[0] = alpha * float(d);
+				data[1] = alpha * 0.5f;
+				data[2] = alpha;
+				data[3] = alpha * float(y) * 0.1f;
+
+				dense.writeData(V2i(x, y), float(d) * 1.5f, data);
+				samples.writeData(V2i(x, y), float(d) * 1.5f, data);
+			}
+		}
+	}
+
+	std::vector<float> flat(30 * 20 * 4), planar(30 * 20 * 4), flatSamples(30 * 20 * 4);
+
+	CHECK(!dense.flatten(&flat[0], "alpha"));
+	CHECK(dense.flatten(&flat[0]));
+	CHECK(dense.flatten(&planar[0], "a", DifImage<float>::ePlanar));
+	CHECK(samples.flatten(&flatSamples[0]));
+
+	std::vector<float> column(dense.depthLevels() * 4);
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 30; x++) {
+			unsigned int count = dense.readDepthColumn(V2i(x, y), &column[0]);
+			float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+			for(unsigned int s = 0; s < count && acc[2] < 1.0f; s++) {
+				float transparency = 1.0f - acc[2];
+
+				for(int c = 0; c < 4; c++) {
+					acc[c] = acc[c] + transparency * column[s * 4 + c];
+				}
+			}
+
+			int p = y * 30 + x;
+
+			for(int c = 0; c < 4; c++) {
+				CHECK(flat[p * 4 + c] == acc[c]);
+				CHECK(planar[c * 30 * 20 + p] == acc[c]);
+				CHECK(flatSamples[p * 4 + c] == acc[c]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int mergetest() {
+	DifImage<float> fx(V2i(36, 20)), chars(V2i(36, 20)), env(V2i(36, 20));
+
+	unsigned int id;
+	fx.addChannel("r", id);
+	fx.addChannel("a", id);
+	chars.addChannel("a", id);
+	chars.addChannel("z", id);
+	env.addChannel("r", id);
+
+	float data[2];
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 36; x++) {
+			data[0] = float(x + 1);
+			data[1] = 0.5f;
+			fx.writeData(V2i(x, y), 2.0f, data);
+
+			if(x >= 18) {
+				data[0] = 1.0f;
+				data[1] = float(y) + 10.0f;
+				chars.writeData(V2i(x, y), 1.0f, data);
+
+				// Overlaps fx at depth 2
+				chars.writeData(V2i(x, y), 2.0f, data);
+			}
+
+			data[0] = float(y) * 2.0f;
+			env.writeData(V2i(x, y), 9.0f, data);
+		}
+	}
+
+	DifImage<float> dif(V2i(36, 20));
+	dif.setThreads(3);
+
+	std::vector<const DifImage<float>*> images;
+	images.push_back(&fx);
+	images.push_back(&chars);
+	images.push_back(&env);
+
+	CHECK(dif.merge(images));
+
+	CHECK(dif.numberOfChannels() == 3);
+	CHECK(dif.channelName(0) == "r" && dif.channelName(1) == "a" && dif.channelName(2) == "z");
+	CHECK(dif.depthLevels() == 3);
+
+	float rdata[3];
+
+	for(int y = 0; y < 20; y++) {
+		for(int x = 0; x < 36; x++) {
+			CHECK(dif.readData(V2i(x, y), 1.0f, rdata, DifImage<float>::eNone));
+			CHECK(rdata[0] == 0.0f);
+			CHECK(rdata[1] == ((x >= 18) ? 1.0f : 0.0f));
+			CHECK(rdata[2] == ((x >= 18) ? float(y) + 10.0f : 0.0f));
+
+			CHECK(dif.readData(V2i(x, y), 2.0f, rdata, DifImage<float>::eNone));
+			CHECK(rdata[0] == float(x + 1));
+			CHECK(rdata[1] == ((x >= 18) ? 1.0f : 0.5f));
+			CHECK(rdata[2] == ((x >= 18) ? float(y) + 10.0f : 0.0f));
+
+			CHECK(dif.readData(V2i(x, y), 9.0f, rdata, DifImage<float>::eNone));
+			CHECK(rdata[0] == float(y) * 2.0f && rdata[1] == 0.0f && rdata[2] == 0.0f);
+		}
+	}
+
+	DifImage<float> other(V2i(10, 10));
+	CHECK(!dif.merge(other));
+
+	// Loaded images merge like constructed ones, in either direction
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_merge.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		chars.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_merge.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> back(V2i(0, 0));
+	DifImage<float> fresh(V2i(36, 20));
+
+	bool ok = back.load(ifp);
+	CHECK(ok);
+
+	ok = fresh.merge(back);
+	CHECK(ok && fresh.depthLevels() == 2);
+
+	ok = back.merge(fx);
+	CHECK(ok && back.depthLevels() == 2);
+
+	float r = 0.0f;
+	ok = fresh.readChannelData("z", V2i(20, 4), 1.0f, r, DifImage<float>::eNone);
+	CHECK(ok && r == 14.0f);
+
+	ok = back.readChannelData("r", V2i(3, 4), 2.0f, r, DifImage<float>::eNone);
+	CHECK(ok && r == 4.0f);
+
+	return 0;
+}
+
+// Writes every 8th bucket of a 100x90 image, starting at bucket @a first
+struct BucketWriter {
+	DifImage<float>* dif;
+	int first;
+	int* failures;
+
+	void operator()() {
+		if(run() != 0) {
+			++(*failures);
+		}
+	}
+
+	int run() {
+		float data[2];
+		std::vector<float> tile(20 * 18 * 2);
+
+		for(int b = first; b < 25; b += 8) {
+			V2i origin((b % 5) * 20, (b / 5) * 18);
+
+			// Shared depths through writeTile(), a depth of our own through writeData()
+			for(int d = 1; d <= 3; d++) {
+				for(int i = 0; i < 20 * 18; i++) {
+					tile[i * 2 + 0] = float(b * 1000 + d * 100 + i % 20);
+					tile[i * 2 + 1] = float(d);
+				}
+
+				CHECK(dif->writeTile(origin, V2i(20, 18), float(d), &tile[0]));
+			}
+
+			for(int y = 0; y < 18; y++) {
+				for(int x = 0; x < 20; x++) {
+					data[0] = float(b + x + y);
+					data[1] = 0.5f;
+
+					dif->writeData(V2i(origin.x + x, origin.y + y), 10.0f + float(b), data);
+				}
+			}
+		}
+
+		return 0;
+	}
+};
+
+int concurrentwritetest() {
+	for(int storage = 0; storage < 2; storage++) {
+		DifImage<float> dif(V2i(100, 90), storage ? DifImage<float>::eSamples : DifImage<float>::eDense);
+
+		unsigned int id;
+		dif.addChannel("r", id);
+		dif.addChannel("a", id);
+
+		CHECK(dif.beginConcurrentWrites(3 + 25));
+		CHECK(dif.concurrentWrites());
+
+		int failures[8] = {0};
+		boost::thread_group group;
+
+		for(int t = 0; t < 8; t++) {
+			BucketWriter writer;
+			writer.dif      = &dif;
+			writer.first    = t;
+			writer.failures = &failures[t];
+
+			group.create_thread(writer);
+		}
+
+		group.join_all();
+
+		for(int t = 0; t < 8; t++) {
+			CHECK(failures[t] == 0);
+		}
+
+		// The capacity is used up
+		float data[2] = {1.0f, 1.0f};
+		CHECK(!dif.writeTile(V2i(0, 0), V2i(1, 1), 99.0f, data));
+
+		dif.endConcurrentWrites();
+		CHECK(!dif.concurrentWrites());
+		CHECK(dif.depthLevels() == 28);
+
+		float rdata[2];
+
+		for(int y = 0; y < 90; y++) {
+			for(int x = 0; x < 100; x++) {
+				int b = (y / 18) * 5 + (x / 20);
+				int i = (y % 18) * 20 + (x % 20);
+
+				for(int d = 1; d <= 3; d++) {
+					CHECK(dif.readData(V2i(x, y), float(d), rdata, DifImage<float>::eNone));
+					CHECK(rdata[0] == float(b * 1000 + d * 100 + i % 20) && rdata[1] == float(d));
+				}
+
+				CHECK(dif.readData(V2i(x, y), 10.0f + float(b), rdata, DifImage<float>::eNone));
+				CHECK(rdata[0] == float(b + x % 20 + y % 18) && rdata[1] == 0.5f);
+			}
+		}
+
+		// Back to normal writes, the channels grow as usual again
+		dif.writeData(V2i(0, 0), 99.0f, data);
+		CHECK(dif.depthLevels() == 29);
+	}
+
+	return 0;
+}
+
+// Reads a 64x48 image through every const read path, rows @a first, first + 4, ...
+struct ImageReader {
+	const DifImage<float>* dif;
+	int first;
+	int* failures;
+
+	void operator()() {
+		if(run() != 0) {
+			++(*failures);
+		}
+	}
+
+	int run() {
+		float data[3];
+		std::vector<float> tile(64 * 3);
+
+		// Counted while the other readers commit
+		unsigned int samples = dif->numberOfSamples();
+		CHECK(samples == (dif->storage() == DifImage<float>::eSamples ? 64u * 48 * 4 : 0u));
+
+		for(int y = first; y < 48; y += 4) {
+			for(int d = 0; d < 4; d++) {
+				CHECK(dif->readTile(V2i(0, y), V2i(64, 1), float(d), &tile[0], DifImage<float>::eNone));
+
+				for(int x = 0; x < 64; x++) {
+					float value = float(x + y * 64 + d * 10000);
+
+					CHECK(dif->readData(V2i(x, y), float(d), data, DifImage<float>::eNone));
+					CHECK(data[0] == value && data[1] == -value && data[2] == 1.0f);
+					CHECK(tile[x * 3 + 1] == -value);
+
+					float c = 0.0f;
+					CHECK(dif->readChannelData("a", V2i(x, y), float(d), c, DifImage<float>::eNone));
+					CHECK(c == 1.0f);
+				}
+			}
+
+			// Halfway between two depths
+			CHECK(dif->readData(V2i(3, y), 0.5f, data));
+			CHECK(data[0] == float(3 + y * 64 + 5000));
+		}
+
+		return 0;
+	}
+};
+
+int concurrentreadtest() {
+	for(int storage = 0; storage < 2; storage++) {
+		DifImage<float> dif(V2i(64, 48), storage ? DifImage<float>::eSamples : DifImage<float>::eDense);
+
+		unsigned int id;
+		dif.addChannel("r", id);
+		dif.addChannel("g", id);
+		dif.addChannel("a", id);
+
+		std::vector<float> tile(64 * 48 * 3);
+
+		for(int d = 0; d < 4; d++) {
+			for(int i = 0; i < 64 * 48; i++) {
+				tile[i * 3 + 0] = float(i + d * 10000);
+				tile[i * 3 + 1] = -float(i + d * 10000);
+				tile[i * 3 + 2] = 1.0f;
+			}
+
+			CHECK(dif.writeTile(V2i(0, 0), V2i(64, 48), float(d), &tile[0]));
+		}
+
+		// Sample lists are still staged, the readers race for the commit
+		if(storage) {
+			CHECK(dif.numberOfSamples() == 64 * 48 * 4);
+		}
+
+		Field3DInputFile ifp;
+		DifImage<float> lazy(V2i(0, 0));
+
+		// Lazy channels are decoded by whichever reader gets there first
+		if(!storage) {
+			Field3DOutputFile ofp;
+
+			if(!ofp.create("test_concurrentread.dif")) {
+				std::cout << "Error opening output file" << std::endl;
+				return -1;
+			}
+
+			dif.save(ofp);
+			ofp.close();
+
+			if(!ifp.open("test_concurrentread.dif")) {
+				std::cout << "Error opening input file" << std::endl;
+				return -1;
+			}
+
+			CHECK(lazy.load(ifp, std::vector<std::string>(), DifImage<float>::eLazy));
+			CHECK(lazy.isLazy());
+		}
+
+		for(int pass = 0; pass < (storage ? 1 : 2); pass++) {
+			const DifImage<float>& image = pass ? lazy : dif;
+			int failures[4] = {0};
+			boost::thread_group group;
+
+			for(int t = 0; t < 4; t++) {
+				ImageReader reader;
+				reader.dif      = &image;
+				reader.first    = t;
+				reader.failures = &failures[t];
+
+				group.create_thread(reader);
+			}
+
+			group.join_all();
+
+			for(int t = 0; t < 4; t++) {
+				CHECK(failures[t] == 0);
+			}
+		}
+
+		CHECK(dif.numberOfSamples() == (storage ? 64u * 48 * 4 : 0u));
+	}
+
+	return 0;
+}
+
+int streamtest() {
+	const V2i size(100, 90);
+
+	// The same buckets go to a DifImage and through a DifStreamWriter
+	DifImage<float> ref(size);
+	unsigned int id;
+	ref.addChannel("r", id);
+	ref.addChannel("a", id);
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_stream.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		DifStreamWriter<float> writer(ofp, size);
+		CHECK(writer.addChannel("r", id));
+		CHECK(writer.addChannel("a", id));
+		CHECK(!writer.addChannel("a", id));
+
+		std::vector<float> tile(20 * 18 * 2);
+
+		for(int b = 0; b < 25; b++) {
+			V2i origin((b % 5) * 20, (b / 5) * 18);
+
+			// Every bucket sees a shared depth and one of its own
+			float depths[2] = {1.0f, 2.0f + float(b)};
+
+			for(int d = 0; d < 2; d++) {
+				for(int i = 0; i < 20 * 18; i++) {
+					tile[i * 2 + 0] = float(b * 1000 + d * 400 + i);
+					tile[i * 2 + 1] = (i % 7) ? 0.5f : 0.0f;
+				}
+
+				CHECK(writer.writeTile(origin, V2i(20, 18), depths[d], &tile[0]));
+				CHECK(ref.writeTile(origin, V2i(20, 18), depths[d], &tile[0]));
+			}
+
+			if(b % 3 == 2) {
+				writer.flush();
+			}
+		}
+
+		// Channels are fixed once the first part is out
+		CHECK(!writer.addChannel("g", id));
+		CHECK(writer.depthLevels() == 26);
+
+		writer.close();
+		CHECK(writer.parts() == 9);
+		CHECK(!writer.isOpen());
+		CHECK(!writer.writeTile(V2i(0, 0), V2i(20, 18), 1.0f, &tile[0]));
+
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_stream.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	for(int mode = 0; mode < 3; mode++) {
+		DifImage<float> dif(V2i(0, 0));
+
+		if(mode == 0) {
+			CHECK(dif.load(ifp));
+		} else {
+			CHECK(dif.load(ifp, std::vector<std::string>(), mode == 1 ? DifImage<float>::eLazy : DifImage<float>::eOutOfCore));
+		}
+
+		CHECK(dif.numberOfChannels() == 2);
+		CHECK(dif.channelName(0) == "r" && dif.channelName(1) == "a");
+		CHECK(dif.depthLevels() == ref.depthLevels());
+
+		float a[2], b[2];
+
+		for(unsigned int s = 0; s < ref.depthLevels(); s++) {
+			float depth = ref.depthAtIndex(s);
+
+			for(int y = 0; y < size.y; y++) {
+				for(int x = 0; x < size.x; x++) {
+					CHECK(ref.readData(V2i(x, y), depth, a, DifImage<float>::eNone));
+					CHECK(dif.readData(V2i(x, y), depth, b, DifImage<float>::eNone));
+					CHECK(a[0] == b[0] && a[1] == b[1]);
+				}
+			}
+		}
+	}
+
+	ifp.close();
+
+	return 0;
+}
+
+int mappedtest() {
+	const V2i size(70, 40);
+
+	DifImage<float> dif(size);
+	dif.setDepthTolerance(0.01f);
+
+	unsigned int id;
+	dif.addChannel("r", id);
+	dif.addChannel("a", id);
+
+	std::vector<float> tile(size.x * size.y * 2);
+
+	// Depths out of order, the upper left corner stays empty
+	float depths[3] = {5.0f, 1.0f, 3.0f};
+
+	for(int d = 0; d < 3; d++) {
+		for(int i = 0; i < size.x * size.y; i++) {
+			bool empty = (i % size.x < 32 && i / size.x < 16);
+
+			tile[i * 2 + 0] = empty ? 0.0f : float(i + d * 10000);
+			tile[i * 2 + 1] = empty ? 0.0f : float(i % 3);
+		}
+
+		CHECK(dif.writeTile(V2i(0, 0), size, depths[d], &tile[0]));
+	}
+
+	CHECK(dif.saveMapped("test_mapped.difm"));
+
+	DifMappedImage<float> map;
+	CHECK(map.open("test_mapped.difm"));
+	CHECK(map.getSize() == size);
+	CHECK(map.numberOfChannels() == 2);
+	CHECK(map.channelName(1) == "a" && map.channelIndex("a") == 1);
+	CHECK(map.depthLevels() == 3 && map.depthAtIndex(0) == 5.0f);
+	CHECK(map.depthTolerance() == 0.01f);
+
+	float a[2], b[2];
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			// Exact depths, depths within the tolerance and between two depths
+			float probes[4] = {1.0f, 3.005f, 5.0f, 2.5f};
+
+			for(int k = 0; k < 4; k++) {
+				CHECK(dif.readData(V2i(x, y), probes[k], a));
+				CHECK(map.readData(V2i(x, y), probes[k], b));
+				CHECK(a[0] == b[0] && a[1] == b[1]);
+			}
+
+			float c = 0.0f;
+			CHECK(map.readChannelData(1, V2i(x, y), 5.0f, c, DifImage<float>::eNone));
+			CHECK(dif.readChannelData(1, V2i(x, y), 5.0f, a[0], DifImage<float>::eNone));
+			CHECK(c == a[0]);
+		}
+	}
+
+	CHECK(!map.readData(V2i(0, 0), 4.0f, b, DifImage<float>::eNone));
+
+	// Uniform blocks are not stored, raw ones are read in place
+	float value = 0.0f;
+	CHECK(!map.blockData(0, 0, 0, 0, value));
+	CHECK(map.blockData(0, 4, 0, 0, value));
+
+	// Only images of the same value type open
+	DifMappedImage<double> other;
+	CHECK(!other.open("test_mapped.difm"));
+	CHECK(!map.open("test_missing.difm") && !map.isOpen());
+	CHECK(map.open("test_mapped.difm"));
+
+	// Back to Field3D and again to the mapped format
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_mapped.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		CHECK(difConvertFromMapped<float>("test_mapped.difm", ofp));
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_mapped.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	CHECK(difConvertToMapped<float>(ifp, "test_mapped2.difm"));
+	ifp.close();
+
+	DifMappedImage<float> map2;
+	CHECK(map2.open("test_mapped2.difm"));
+
+	DifImage<float> back(V2i(0, 0));
+	CHECK(back.load(map2));
+	CHECK(back.depthLevels() == 3 && back.depthTolerance() == 0.01f);
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			for(int d = 0; d < 3; d++) {
+				CHECK(dif.readData(V2i(x, y), depths[d], a, DifImage<float>::eNone));
+				CHECK(back.readData(V2i(x, y), depths[d], b, DifImage<float>::eNone));
+				CHECK(a[0] == b[0] && a[1] == b[1]);
+			}
+		}
+	}
+
+	// Loading replaces the channels and the samples of the image
+	{
+		DifImage<float> old(V2i(3, 3), DifImage<float>::eSamples);
+		old.addChannel("z", id);
+
+		CHECK(old.load(map2));
+		CHECK(old.storage() == DifImage<float>::eDense);
+		CHECK(old.numberOfChannels() == 2 && !old.hasChannel("z"));
+		CHECK(old.readData(V2i(size.x - 1, size.y - 1), depths[0], a, DifImage<float>::eNone));
+		CHECK(dif.readData(V2i(size.x - 1, size.y - 1), depths[0], b, DifImage<float>::eNone));
+		CHECK(a[0] == b[0] && a[1] == b[1]);
+	}
+
+	// Tables out of the file, misaligned or with out of range entries are rejected
+	{
+		std::ifstream in("test_mapped.difm", std::ios::binary);
+		const std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		in.close();
+
+		const DifMapHeader* header = reinterpret_cast<const DifMapHeader*>(bytes.data());
+		const boost::uint64_t order = header->depthTable + header->depths * 2 * sizeof(float);
+
+		for(int k = 0; k < 4; k++) {
+			std::string corrupt(bytes);
+			DifMapHeader* h = reinterpret_cast<DifMapHeader*>(&corrupt[0]);
+
+			switch(k) {
+				case 0: h->channelTable = ~boost::uint64_t(7); break;
+				case 1: h->depthTable += 2; break;
+				case 2: h->channelTable += 4; break;
+				case 3: reinterpret_cast<boost::uint32_t*>(&corrupt[order])[0] = 3; break;
+			}
+
+			std::ofstream out("test_corrupt.difm", std::ios::binary);
+			out.write(corrupt.data(), corrupt.size());
+			out.close();
+
+			DifMappedImage<float> bad;
+			CHECK(!bad.open("test_corrupt.difm"));
+		}
+	}
+
+	return 0;
+}
+
+template<typename T> int codectest() {
+	const V2i size(50, 37);
+
+	// Raw codec round trips, including incompressible and empty data
+	{
+		std::vector<unsigned char> raw(4096 * sizeof(T));
+
+		for(size_t i = 0; i < raw.size(); i++) {
+			raw[i] = (unsigned char)((i * 7919) >> 3 ^ (i % 13 == 0 ? i : 0));
+		}
+
+		for(int c = eDifCodecNone; c <= eDifCodecPredict; c++) {
+			std::vector<unsigned char> encoded;
+			std::vector<unsigned char> decoded(raw.size());
+
+			difEncode((enum DifCodec)c, &raw[0], 4096, sizeof(T), 256, encoded);
+			CHECK(difDecode((enum DifCodec)c, &encoded[0], encoded.size(), 4096, sizeof(T), 256, &decoded[0]));
+			CHECK(decoded == raw);
+
+			if(encoded.size() > 1) {
+				CHECK(!difDecode((enum DifCodec)c, &encoded[0], encoded.size() - 1, 4096, sizeof(T), 256, &decoded[0]));
+			}
+
+			encoded.clear();
+			difEncode((enum DifCodec)c, NULL, 0, sizeof(T), 256, encoded);
+			CHECK(difDecode((enum DifCodec)c, encoded.empty() ? NULL : &encoded[0], encoded.size(), 0, sizeof(T), 256, NULL));
+		}
+	}
+
+	DifImage<T> dif(size);
+
+	const char* names[4] = {"r", "g", "b", "a"};
+	unsigned int id;
+
+	for(int c = 0; c < 4; c++) {
+		dif.addChannel(names[c], id);
 	}
-	
-	
+
+	// r is left to Field3D
+	CHECK(dif.setChannelCodec(1, eDifCodecLZ));
+	CHECK(dif.setChannelCodec(2, eDifCodecShuffle));
+	CHECK(dif.setChannelCodec(3, eDifCodecPredict));
+	CHECK(!dif.setChannelCodec(4, eDifCodecLZ));
+	CHECK(dif.channelCodec(0) == eDifCodecNone);
+
+	std::vector<T> tile(size.x * size.y * 4);
+
+	// Smooth along depth, a band stays empty so some blocks are uniform
+	for(int d = 0; d < 20; d++) {
+		for(int i = 0; i < size.x * size.y; i++) {
+			bool empty = (i / size.x < 16);
+
+			for(int c = 0; c < 4; c++) {
+				tile[i * 4 + c] = empty ? T(0) : T(float(i % size.x) * 0.25f + float(d) * 0.125f + float(c));
+			}
+		}
+
+		CHECK(dif.writeTile(V2i(0, 0), size, float(d), &tile[0]));
+	}
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_codec.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		dif.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_codec.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<T> eager(V2i(0, 0));
+	CHECK(eager.load(ifp));
+	CHECK(eager.numberOfChannels() == 4);
+
+	// Channel ids and codecs come back
+	for(int c = 0; c < 4; c++) {
+		CHECK(eager.channelIndex(names[c]) == (unsigned int)c);
+		CHECK(eager.channelCodec(c) == dif.channelCodec(c));
+	}
+
+	std::vector<std::string> selected;
+	selected.push_back("b");
+	selected.push_back("a");
+	selected.push_back("r");
+
+	DifImage<T> lazy(V2i(0, 0));
+	CHECK(lazy.load(ifp, selected, DifImage<T>::eLazy));
+	CHECK(lazy.numberOfChannels() == 3);
+
+	T a[4], b[4], c[3];
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			for(int d = 0; d < 20; d++) {
+				CHECK(dif.readData(V2i(x, y), float(d), a, DifImage<T>::eNone));
+				CHECK(eager.readData(V2i(x, y), float(d), b, DifImage<T>::eNone));
+				CHECK(lazy.readData(V2i(x, y), float(d), c, DifImage<T>::eNone));
+
+				for(int k = 0; k < 4; k++) {
+					CHECK(a[k] == b[k]);
+				}
+
+				CHECK(c[0] == a[2] && c[1] == a[3] && c[2] == a[0]);
+			}
+		}
+	}
+
+	lazy.resolveChannels();
+	CHECK(lazy.channelCodec(0) == eDifCodecShuffle && lazy.channelCodec(2) == eDifCodecNone);
+
+	// Encoded layers of another byte order are not decoded
+	{
+		Field<float>::Vec layers = ifp.readScalarLayers<float>();
+		Field3DOutputFile swapped;
+
+		if(!swapped.create("test_codec_swapped.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		for(size_t i = 0; i < layers.size(); i++) {
+			if(layers[i]->metadata().intMetadata("codecBytes", -1) >= 0) {
+				layers[i]->metadata().setIntMetadata("codecByteOrder", difByteOrder() == 1234 ? 4321 : 1234);
+			}
+
+			swapped.writeScalarLayer<float>(layers[i]->name, layers[i]);
+		}
+
+		swapped.close();
+	}
+
+	ifp.close();
+
+	if(!ifp.open("test_codec_swapped.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<T> swapped(V2i(0, 0));
+	CHECK(!(swapped.load(ifp) && swapped.hasChannel("a")));
+
+	ifp.close();
+
+	return 0;
 }
 
-int hardtest() {
-	Field3DOutputFile ofp;
+template<typename T> static int storagecheck(const DifImage<float>& dif, Field3DInputFile& ifp, const V2i& size, unsigned int channels) {
+	const char* names[4] = {"r", "a", "id", "mask"};
+	const float tolerance[4] = {0.0f, 0.5f / 255.0f + 1e-6f, 0.0f, 0.5f / 65535.0f + 1e-6f};
+
+	DifImage<T> back(V2i(0, 0));
+	CHECK(back.load(ifp));
+	CHECK(back.numberOfChannels() == channels);
+	CHECK(back.channelStorage(back.channelIndex("r")) == eDifStorageHalf);
+	CHECK(back.channelStorage(back.channelIndex("mask")) == eDifStorageUInt16);
+	CHECK(back.channelCodec(back.channelIndex("mask")) == eDifCodecShuffle);
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			for(int d = 0; d < 4; d++) {
+				for(int c = 0; c < 4; c++) {
+					float a = 0.0f;
+					T b = T(0);
+
+					CHECK(dif.readChannelData(names[c], V2i(x, y), float(d), a, DifImage<float>::eNone));
+					CHECK(back.readChannelData(names[c], V2i(x, y), float(d), b, DifImage<T>::eNone));
+
+					// Half images round once more and can't hold the ids
+					if(sizeof(T) == sizeof(half)) {
+						CHECK(c == 2 || std::fabs(float(b) - a) <= tolerance[c] + std::fabs(a) / 1024.0f);
+					} else if(c == 0) {
+						CHECK(float(b) == float(half(a)));
+					} else {
+						CHECK(std::fabs(float(b) - a) <= tolerance[c]);
+					}
+				}
+			}
+		}
+	}
 
-	if(!ofp.create("test_hardcore.dif")) {
-		std::cout << "Error opening output file" << std::endl;
+	return 0;
+}
+
+int storagetest() {
+	const V2i size(40, 33);
+
+	DifImage<float> dif(size);
+
+	const char* names[5] = {"z", "r", "a", "id", "mask"};
+	unsigned int id;
+
+	for(int c = 0; c < 5; c++) {
+		dif.addChannel(names[c], id);
+	}
+
+	CHECK(dif.setChannelStorage(1, eDifStorageHalf));
+	CHECK(dif.setChannelStorage(2, eDifStorageUInt8));
+	CHECK(dif.setChannelStorage(3, eDifStorageUInt32));
+	CHECK(dif.setChannelStorage(4, eDifStorageUInt16));
+	CHECK(dif.setChannelCodec(4, eDifCodecShuffle));
+	CHECK(!dif.setChannelStorage(5, eDifStorageHalf));
+
+	std::vector<float> tile(size.x * size.y * 5);
+
+	for(int d = 0; d < 4; d++) {
+		for(int i = 0; i < size.x * size.y; i++) {
+			tile[i * 5 + 0] = float(d) + 0.1f;
+			tile[i * 5 + 1] = float(i) * 0.37f - float(d);
+			tile[i * 5 + 2] = float((i + d) % 17) / 16.0f;
+			tile[i * 5 + 3] = float(i * 1000 + d);
+			tile[i * 5 + 4] = float((i * 7 + d) % 101) / 100.0f;
+		}
+
+		CHECK(dif.writeTile(V2i(0, 0), size, float(d), &tile[0]));
+	}
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_storage.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		dif.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_storage.dif")) {
+		std::cout << "Error opening input file" << std::endl;
 		return -1;
 	}
 
-	DifImage<float> dif(V2i(128, 128));
-	printf("adding channels\n");
-	unsigned int r, g, b, a;
-	dif.addChannel("r", r);
-	dif.addChannel("g", g);
-	dif.addChannel("b", b);
-	dif.addChannel("a", a);
+	// Converted channels load into any value type, native ones only into float
+	CHECK(storagecheck<float>(dif, ifp, size, 5) == 0);
+	CHECK(storagecheck<half>(dif, ifp, size, 4) == 0);
+
+	DifImage<double> wide(V2i(0, 0));
+	std::vector<std::string> ids(1, "id");
+	CHECK(wide.load(ifp, ids));
+	CHECK(wide.numberOfChannels() == 1);
+
+	double v = 0.0;
+	CHECK(wide.readChannelData(0, V2i(3, 2), 2.0f, v, DifImage<double>::eNone));
+	CHECK(v == double((2 * size.x + 3) * 1000 + 2));
+
+	std::vector<std::string> native(1, "z");
+	DifImage<double> none(V2i(0, 0));
+	CHECK(!none.load(ifp, native));
+
+	// Packed only on request, reads convert like the values loaded from the file
+	DifImage<float> loaded(V2i(0, 0));
+	CHECK(loaded.load(ifp) && !loaded.isPacked());
+
+	DifImage<float> packed(dif);
+	CHECK(packed.packChannels() == 4 && !packed.isPacked(0) && packed.isPacked(1) && packed.isPacked(4));
+
+	for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			float a[5], b[5];
+			CHECK(packed.readData(V2i(x, y), 1.5f, a) && loaded.readData(V2i(x, y), 1.5f, b));
+
+			for(int c = 0; c < 5; c++) {
+				float p = 0.0f, l = 0.0f;
+				CHECK(packed.readChannelData(c, V2i(x, y), 2.0f, p, DifImage<float>::eNone));
+				CHECK(loaded.readChannelData(names[c], V2i(x, y), 2.0f, l, DifImage<float>::eNone));
+				CHECK(p == l && a[c] == b[loaded.channelIndex(names[c])]);
+			}
+		}
+	}
 
-	float data[4];
+	// Read only until unpackChannels(), saving keeps the channels packed
+	float wdata[5] = {1.0f, 2.0f, 0.25f, 7.0f, 0.5f};
+	CHECK(!packed.writeTile(V2i(3, 2), V2i(1, 1), 2.0f, wdata) && !packed.reserveDepths(2));
 
-	for(int i = 0; i < 128; i++) {
+	{
+		Field3DOutputFile ofp;
 
-		for(int j = 0; j < 4; j++) {
-			data[0] = j + i;
-			data[1] = j + i + 1;
-			data[2] = j + i + 2;
-			data[3] = j + i + 3;
+		if(!ofp.create("test_packed.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
 
-			printf("%dx%d -> %d data=%f\n", i,i,j, data[0]);
-			dif.writeData(V2i(i,i), float(j), data);
+		packed.save(ofp);
+		ofp.close();
+	}
+
+	CHECK(packed.isPacked(1) && packed.isPacked(4));
+
+	packed.unpackChannels();
+	CHECK(!packed.isPacked() && packed.writeTile(V2i(3, 2), V2i(1, 1), 2.0f, wdata));
+
+	float f = 0.0f;
+	CHECK(packed.readChannelData(3, V2i(3, 2), 2.0f, f, DifImage<float>::eNone) && f == 7.0f);
+	CHECK(packed.readChannelData(3, V2i(4, 2), 2.0f, f, DifImage<float>::eNone) && f == float((2 * size.x + 4) * 1000 + 2));
+
+	Field3DInputFile pfp;
+
+	if(!pfp.open("test_packed.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<float> resaved(V2i(0, 0));
+	CHECK(resaved.load(pfp));
+
+	for(int c = 0; c < 5; c++) {
+		float r = 0.0f, l = 0.0f;
+		CHECK(resaved.readChannelData(names[c], V2i(5, 7), 3.0f, r, DifImage<float>::eNone));
+		CHECK(loaded.readChannelData(names[c], V2i(5, 7), 3.0f, l, DifImage<float>::eNone) && r == l);
+	}
+
+	pfp.close();
+
+	// Whole blocks of the id 2^31 compact to uniform blocks, whose packed bits are those of -0.0f
+	const V2i blocksize(32, 32);
+	std::vector<float> words(blocksize.x * blocksize.y, 2147483648.0f);
+
+	DifImage<float> uniform(blocksize);
+	uniform.addChannel("id", id);
+
+	for(int d = 0; d < 16; d++) {
+		CHECK(uniform.writeTile(V2i(0, 0), blocksize, float(d), &words[0]));
+	}
+
+	CHECK(uniform.setChannelStorage(0, eDifStorageUInt32) && uniform.setChannelCodec(0, eDifCodecLZ));
+
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_storage_uniform.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
 		}
 
+		uniform.save(ofp);
+		ofp.close();
 	}
 
-	printf("done\n");
-		
-	dif.save(ofp);
-	ofp.close();
+	Field3DInputFile uniformfp;
+
+	if(!uniformfp.open("test_storage_uniform.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	DifImage<double> ids32(V2i(0, 0));
+	CHECK(ids32.load(uniformfp));
+
+	for(int y = 0; y < blocksize.y; y++) {
+		for(int x = 0; x < blocksize.x; x++) {
+			CHECK(ids32.readChannelData(0, V2i(x, y), 15.0f, v, DifImage<double>::eNone) && v == 2147483648.0);
+		}
+	}
+
+	return 0;
+}
+
+int movetest() {
+	const V2i size(37, 29);
+
+	DifImage<float> dif(size);
+
+	for(int d = 0; d < 20; d++) {
+		dif.addDepth(float(d));
+	}
+
+	// A plain SparseField hands its blocks over and is left empty
+	SparseField<float>::Ptr sparse(new SparseField<float>);
+	sparse->setSize(V3i(size.x, size.y, 20));
+	sparse->clear(0.0f);
+
+	for(int i = 0; i < 100; i++) {
+		sparse->lvalue(i % size.x, (i * 3) % size.y, i % 20) = float(i + 1);
+	}
+
+	unsigned int id;
+	CHECK(dif.addChannel("s", sparse, id));
+
+	for(int i = 0; i < 100; i++) {
+		float v = 0.0f;
+		CHECK(dif.readChannelData(id, V2i(i % size.x, (i * 3) % size.y), float(i % 20), v, DifImage<float>::eNone));
+		CHECK(v == float(i + 1));
+	}
+
+	const V3i blocks = sparse->blockRes();
+
+	for(int k = 0; k < blocks.z; k++) {
+		for(int j = 0; j < blocks.y; j++) {
+			for(int i = 0; i < blocks.x; i++) {
+				CHECK(!sparse->blockIsAllocated(i, j, k));
+			}
+		}
+	}
+
+	// A DifField is shared, it may have fewer depths than the image
+	DifField<float>::Ptr shared(new DifField<float>(size));
+	shared->updateDepth(9);
+	shared->writePixel(V2i(3, 4), 2, 5.0f);
+
+	CHECK(dif.addChannel("d", shared, id));
+	shared->writePixel(V2i(5, 6), 9, 7.0f);
+
+	float v = 0.0f;
+	CHECK(dif.readChannelData(id, V2i(3, 4), 2.0f, v, DifImage<float>::eNone) && v == 5.0f);
+	CHECK(dif.readChannelData(id, V2i(5, 6), 9.0f, v, DifImage<float>::eNone) && v == 7.0f);
+	CHECK(dif.readChannelData(id, V2i(5, 6), 19.0f, v, DifImage<float>::eNone) && v == 0.0f);
+
+	// Copies keep their values
+	CHECK(dif.addChannel("c", *shared, id));
+	shared->writePixel(V2i(3, 4), 2, 6.0f);
+	CHECK(dif.readChannelData(id, V2i(3, 4), 2.0f, v, DifImage<float>::eNone) && v == 5.0f);
+
+	DifField<float>::Ptr small(new DifField<float>(V2i(8, 8)));
+	DifField<float>::Ptr deep(new DifField<float>(size));
+	deep->updateDepth(20);
+
+	CHECK(!dif.addChannel("x", small, id));
+	CHECK(!dif.addChannel("x", deep, id));
+	CHECK(!dif.addChannel("d", shared, id));
+	CHECK(!dif.addChannel("x", SparseField<float>::Ptr(), id));
+
+	// Swapping with an empty image moves everything over
+	DifImage<float> moved(V2i(0, 0));
+	CHECK(moved.swap(dif));
+	CHECK(dif.numberOfChannels() == 0 && dif.depthLevels() == 0);
+	CHECK(moved.numberOfChannels() == 3 && moved.depthLevels() == 20);
+	CHECK(moved.readChannelData("d", V2i(5, 6), 9.0f, v, DifImage<float>::eNone) && v == 7.0f);
+	CHECK(dif.addChannel("d", id));
+
+	// Loading holds no more than the final channels at any time
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_move.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
+
+		DifImage<float> dense(V2i(128, 128));
+		const char *names[4] = {"r", "g", "b", "a"};
+
+		for(int c = 0; c < 4; c++) {
+			dense.addChannel(names[c], id);
+		}
+
+		std::vector<float> data(128 * 128 * 4);
+
+		for(int d = 0; d < 16; d++) {
+			for(size_t i = 0; i < data.size(); i++) {
+				data[i] = float(i % 1021 + d);
+			}
+
+			dense.writeTile(V2i(0, 0), V2i(128, 128), float(d), &data[0]);
+		}
+
+		dense.save(ofp);
+		ofp.close();
+	}
 
 	Field3DInputFile ifp;
 
-	if(!ifp.open("test_hardcore.dif")) {
+	if(!ifp.open("test_move.dif")) {
 		std::cout << "Error opening input file" << std::endl;
 		return -1;
 	}
 
-	DifImage<float> difi(V2i(0,0));
-	if(!difi.load(ifp)) {
-		std::cout << "Error loading deep image file" << std::endl;
-		return -1;		
+	DifImage<float> back(V2i(0, 0));
+	back.setThreads(1);
+
+	g_heapBytes = g_heapPeak = 0;
+	g_trackHeap = true;
+
+	CHECK(back.load(ifp));
+
+	g_trackHeap = false;
+
+	// 4 channels * 128*128 * 16 depths of floats
+	const long final = 4L * 128 * 128 * 16 * sizeof(float);
+
+	CHECK(back.readChannelData("a", V2i(5, 0), 3.0f, v, DifImage<float>::eNone) && v == float(5 * 4 + 3 + 3));
+	CHECK(g_heapBytes >= final && g_heapPeak < final + final / 4);
+
+	// Copies are deep, writing to one leaves the other alone
+	DifImage<float> copy(back);
+	float values[4] = {-1.0f, -2.0f, -3.0f, -4.0f};
+	copy.writeData(V2i(5, 0), 3.0f, values);
+
+	bool ok = back.readChannelData("a", V2i(5, 0), 3.0f, v, DifImage<float>::eNone);
+	CHECK(ok && v == float(5 * 4 + 3 + 3));
+
+	ok = copy.readChannelData("a", V2i(5, 0), 3.0f, v, DifImage<float>::eNone);
+	CHECK(ok && v == -4.0f);
+
+	// Sample lists are copied with their staged samples
+	DifImage<float> samples(V2i(4, 4), DifImage<float>::eSamples);
+	samples.addChannel("z", id);
+	samples.writeData(V2i(1, 1), 2.0f, values);
+
+	DifImage<float> samplecopy(V2i(1, 1));
+	samplecopy = samples;
+	samplecopy.writeData(V2i(2, 1), 2.0f, values + 1);
+
+	CHECK(samples.numberOfSamples() == 1 && samplecopy.numberOfSamples() == 2);
+
+	ok = samplecopy.readChannelData("z", V2i(1, 1), 2.0f, v, DifImage<float>::eNone);
+	CHECK(ok && v == -1.0f);
+
+	return 0;
+}
+
+// Resident set size of the process in MB
+static float residentMemory() {
+	// Hand freed heap pages back first so they don't hide new allocations
+	malloc_trim(0);
+
+	std::ifstream statm("/proc/self/statm");
+	long pages = 0, resident = 0;
+
+	statm >> pages >> resident;
+
+	return resident * (sysconf(_SC_PAGESIZE) / (1024.0f * 1024.0f));
+}
+
+// Loads a file over and over, eager loads check that their image is writable
+struct RepeatedLoader {
+	enum DifImage<float>::DifImageLoadMode mode;
+	int* failures;
+
+	void operator()() {
+		Field3DInputFile ifp;
+
+		if(!ifp.open("test_outofcore.dif")) {
+			++(*failures);
+			return;
+		}
+
+		for(int i = 0; i < 8; i++) {
+			DifImage<float> dif(V2i(0, 0));
+			float data[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+
+			if(!dif.load(ifp, std::vector<std::string>(), mode) || (mode == DifImage<float>::eEager && !dif.writeTile(V2i(0, 0), V2i(1, 1), 0.0f, data))) {
+				++(*failures);
+			}
+		}
 	}
+};
 
-	float rdata[4];
+int outofcoretest() {
+	const int res = 256;
 
-	for(int i = 0; i < 128; i++) {
-		for(int j = 0; j < 4; j++) {
-			difi.readData(V2i(i,i), float(j), rdata);
+	{
+		Field3DOutputFile ofp;
+
+		if(!ofp.create("test_outofcore.dif")) {
+			std::cout << "Error opening output file" << std::endl;
+			return -1;
+		}
 
-			assert(rdata[0] == j + i);
-			assert(rdata[1] == j + i + 1);
-			assert(rdata[2] == j + i + 2);
-			assert(rdata[3] == j + i + 3);
+		// 4 channels * 256*256 * 16 depths of floats, 16 MB of blocks
+		DifImage<float> dif(V2i(res, res));
+
+		unsigned int r, g, b, a;
+		dif.addChannel("r", r);
+		dif.addChannel("g", g);
+		dif.addChannel("b", b);
+		dif.addChannel("a", a);
+
+		std::vector<float> data(res * res * 4);
+
+		for(int d = 0; d < 16; d++) {
+			for(size_t i = 0; i < data.size(); i++) {
+				data[i] = float(i % 1021 + d);
+			}
+
+			dif.writeTile(V2i(0, 0), V2i(res, res), float(d), &data[0]);
 		}
 
+		dif.save(ofp);
+		ofp.close();
+	}
+
+	Field3DInputFile ifp;
+
+	if(!ifp.open("test_outofcore.dif")) {
+		std::cout << "Error opening input file" << std::endl;
+		return -1;
+	}
+
+	difSetMemoryBudget(4.0f);
+
+	float before = residentMemory();
+
+	DifImage<float> difi(V2i(0, 0));
+	CHECK(difi.load(ifp, std::vector<std::string>(), DifImage<float>::eOutOfCore));
+	CHECK(difi.isOutOfCore());
+
+	std::vector<float> tile(res * res * 4);
+
+	for(int d = 0; d < 16; d++) {
+		CHECK(difi.readTile(V2i(0, 0), V2i(res, res), float(d), &tile[0], DifImage<float>::eNone));
+		CHECK(tile[5] == float(5 % 1021 + d));
+		CHECK(tile[res * res * 4 - 1] == float((res * res * 4 - 1) % 1021 + d));
 	}
 
+	// Everything has been read once but only the budget (plus slack) stays resident
+	CHECK(residentMemory() - before < 4.0f + 2.0f);
+
+	float data[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	CHECK(!difi.writeTile(V2i(0, 0), V2i(1, 1), 0.0f, data));
+
+	ifp.close();
+
+	// Out of core loads page only their own layers, eager loads next to them stay in memory
+	int failures[2] = {0, 0};
+	boost::thread_group group;
+
+	for(int t = 0; t < 2; t++) {
+		RepeatedLoader loader;
+		loader.mode     = t ? DifImage<float>::eEager : DifImage<float>::eOutOfCore;
+		loader.failures = &failures[t];
+
+		group.create_thread(loader);
+	}
+
+	group.join_all();
+
+	CHECK(failures[0] == 0 && failures[1] == 0);
+	CHECK(!SparseFileManager::singleton().doLimitMemUse());
+
 	return 0;
 }
 
@@ -159,12 +2652,59 @@ int fieldtest() {
 	ofp.close();
 	ifp.close();
 
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
 	initIO();
 
-	fieldtest();
+	int result = 0;
+
+	result |= fieldtest();
+
+	result |= depthordertest();
+
+	result |= depthreservetest();
+	result |= summarytest();
+	result |= pyramidtest();
+	result |= holdouttest();
+
+	result |= allocationtest();
+
+	result |= tiletest();
+
+	result |= regiontest();
+
+	result |= selectiveloadtest();
+
+	result |= outofcoretest();
+
+	result |= sampletest();
+
+	result |= lerptest<float>();
+	result |= lerptest<double>();
+	result |= lerptest<half>();
+
+	result |= resampletest();
+
+	result |= flattentest();
+
+	result |= mergetest();
+
+	result |= concurrentwritetest();
+
+	result |= concurrentreadtest();
+
+	result |= streamtest();
+
+	result |= mappedtest();
+
+	result |= codectest<float>();
+	result |= codectest<half>();
+
+	result |= storagetest();
+
+	result |= movetest();
 
 	DifImage<float> dif(V2i(12,12));
 
@@ -236,10 +2776,10 @@ int main(int argc, char *argv[]) {
 
 	std::cout << cret << std::endl; 
 
-	hardtest();
+	result |= hardtest();
 	
 	printf("Starting HiRes Test\n");
 	highrestest();
 
-	return 0;
+	return result;
 }